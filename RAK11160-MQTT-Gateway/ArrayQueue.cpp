@@ -16,8 +16,8 @@
  */
 ArrayQueue::ArrayQueue()
 {
-	Front = -1;
-	Rear = -1;
+	Front = 0;
+	Rear = 0;
 }
 
 /**
@@ -26,10 +26,14 @@ ArrayQueue::ArrayQueue()
  * @param payload pointer to uint8_t array to add to the FiFo
  * @param payload_size size of the uint8_t array
  * @return true Success
- * @return false Failed, FiFo is full
+ * @return false Failed, FiFo is full or payload is too large
  */
 bool ArrayQueue::enQueue(uint8_t *payload, uint16_t payload_size)
 {
+	if (payload_size > MAX_QUEUE_PAYLOAD)
+	{
+		return false;
+	}
 	noInterrupts();
 	if (this->getSize() == MAX_QUEUE_SIZE - 1)
 	{
@@ -96,13 +100,39 @@ uint8_t *ArrayQueue::getPayload(void)
 	return &Queue_Payload[Front][0];
 }
 
+/**
+ * @brief Get pointer to a payload entry behind the first entry in FiFo
+ *
+ * @param offset number of the entry, 0 is the first entry
+ * @return uint8_t* pointer to uint8_t array, NULL if the FiFo has less entries
+ */
+uint8_t *ArrayQueue::peekPayload(int offset)
+{
+	if (offset >= this->getSize())
+		return NULL;
+	return &Queue_Payload[(Front + offset) % MAX_QUEUE_SIZE][0];
+}
+
+/**
+ * @brief Get payload size of an entry behind the first entry in FiFo
+ *
+ * @param offset number of the entry, 0 is the first entry
+ * @return uint16_t payload size, 0 if the FiFo has less entries
+ */
+uint16_t ArrayQueue::peekPayloadSize(int offset)
+{
+	if (offset >= this->getSize())
+		return 0;
+	return Queue_Payload_Size[(Front + offset) % MAX_QUEUE_SIZE];
+}
+
 /**
  * @brief Return number of entries in the queue
  * @return int number of entries
  */
 int ArrayQueue::getSize()
 {
-	return abs(Rear - Front);
+	return (Rear - Front + MAX_QUEUE_SIZE) % MAX_QUEUE_SIZE;
 }
 
 /**
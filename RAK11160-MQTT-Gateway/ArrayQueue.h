@@ -13,7 +13,10 @@
 
 #include <Arduino.h>
 
+/** Number of entries + 1, one entry of the FiFo is always free */
 #define MAX_QUEUE_SIZE 20
+/** Max size of one entry, a LoRa packet with up to 255 bytes and the header of a mesh sink entry */
+#define MAX_QUEUE_PAYLOAD 268
 
 class ArrayQueue
 {
@@ -25,9 +28,11 @@ public:
 	bool isEmpty();
 	uint8_t *getPayload(void);
 	uint16_t getPayloadSize();
+	uint8_t *peekPayload(int offset);
+	uint16_t peekPayloadSize(int offset);
 
 private:
-	uint8_t Queue_Payload[MAX_QUEUE_SIZE][128];
+	uint8_t Queue_Payload[MAX_QUEUE_SIZE][MAX_QUEUE_PAYLOAD];
 	uint16_t Queue_Payload_Size[MAX_QUEUE_SIZE];
 	int Front;
 	int Rear;
@@ -17,10 +17,34 @@ bool has_mqtt_conn = false;
 
 /** WiFi active flag */
 volatile bool wifi_sending = false;
+/** The send handler is started after batch_delay to wait for more packets of a batch */
+volatile bool batch_waiting = false;
 
-/** Queue with received data packets (max 20, each 128 bytes long) */
+/** Queue with received data packets (max 20, each up to 268 bytes long) */
 ArrayQueue Fifo;
 
+/** Publish in the AT command queue */
+struct pub_slot_s
+{
+	/** JSON message, must be valid until the publish is finished */
+	char payload[JSON_BUFF_SIZE];
+	/** Number of FiFo entries in the message */
+	uint8_t num_entries;
+};
+
+/** Publishes in the AT command queue, they are finished in the order they were queued */
+pub_slot_s pub_slots[PUB_PIPELINE];
+/** Oldest publish in the AT command queue */
+uint8_t pub_head = 0;
+/** Number of publishes in the AT command queue */
+uint8_t pub_count = 0;
+/** Number of FiFo entries in the queued publishes, they are at the start of the FiFo */
+int pub_entries = 0;
+/** A publish failed, the entries of the publishes in the AT command queue stay in the FiFo */
+bool pub_retry = false;
+/** Failed publishes of the first FiFo entries */
+uint8_t pub_fails = 0;
+
 /**
  * @brief Arduino setup function, called once
  *
@@ -74,6 +98,18 @@ void setup(void)
 	{
 		MYLOG("SETUP", "Failed to init ATC");
 	}
+	if (!init_sink_at())
+	{
+		MYLOG("SETUP", "Failed to init ATC+SINK");
+	}
+	if (!init_batch_at())
+	{
+		MYLOG("SETUP", "Failed to init ATC+WIFIBATCH");
+	}
+	if (!init_store_at())
+	{
+		MYLOG("SETUP", "Failed to init ATC+WIFISTORE");
+	}
 
 	// Get WiFi and MQTT settings
 	if (!get_at_setting())
@@ -81,21 +117,32 @@ void setup(void)
 		MYLOG("SETUP", "Failed to read settings");
 	}
 
-	// Initialize ESP8684 connection
+	// Find the packets that were stored before the restart
+	flash_log_init(custom_parameters.store_kb);
+
+	// Start the AT command client for the ESP8684
+	at_client_init(esp_urc_cb);
+
+	// Initialize ESP8684 connection, the connection is done in the background
 	if (!init_connection())
 	{
 		MYLOG("SETUP", "Connection failed");
 	}
-	else
-	{
-		digitalWrite(LED_WIFI, LOW);
-		digitalWrite(LED_MQTT, LOW);
-	}
 
 	// Initialize timer for sending received LoRa P2P packet to MQTT broker
 	api.system.timer.create(RAK_TIMER_0, send_handler, RAK_TIMER_ONESHOT);
 
-	api.lora.precv(65534);
+	if (custom_parameters.mesh_sink == 1)
+	{
+		// Gateway is the master node of a RUI3-Mesh network
+		init_mesh_sink();
+		// Enable RX mode (always with TX allowed)
+		api.lora.precv(65533);
+	}
+	else
+	{
+		api.lora.precv(65534);
+	}
 }
 
 /**
@@ -116,63 +163,195 @@ void send_handler(void *)
 {
 	digitalWrite(LED_WIFI, HIGH);
 	api.system.timer.stop(RAK_TIMER_0);
+	// Cleared before queue_publish(), it can restart the timer to wait for a batch
+	wifi_sending = false;
+	batch_waiting = false;
 	if (!has_wifi_conn || !has_mqtt_conn)
 	{
 		// No connection to WiFi or Broker, retry to connect
 		if (!init_connection(true))
 		{
 			MYLOG("SEND", "Reconnect failed");
-			digitalWrite(LED_WIFI, HIGH);
 		}
 	}
+	else
+	{
+		queue_publish();
+	}
+}
+
+/**
+ * @brief Parse the FiFo entries and add them to the AT command queue
+ * 		until PUB_PIPELINE publishes are queued.
+ * 		Packets from the flash log are moved into the FiFo first.
+ * 		The entries stay in the FiFo until their publish is finished.
+ * 		In batch mode the entries wait until batch_count entries are received,
+ * 		the oldest entry is batch_delay ms old or the FiFo is full.
+ *
+ */
+void queue_publish(void)
+{
+	// Packets stored while the broker was not reachable, they are older than the packets received later
+	while (has_wifi_conn && has_mqtt_conn && !flash_log_empty() && (Fifo.getSize() < MAX_QUEUE_SIZE - 1))
+	{
+		uint8_t fifo_entry[MAX_QUEUE_PAYLOAD];
+		uint16_t entry_size = flash_log_read(fifo_entry);
+		if (entry_size == 0)
+		{
+			break;
+		}
+		Fifo.enQueue(fifo_entry, entry_size);
+	}
 
-	if (has_wifi_conn && has_mqtt_conn)
+	while ((pub_count < PUB_PIPELINE) && (Fifo.getSize() > pub_entries) && has_wifi_conn && has_mqtt_conn)
 	{
-		digitalWrite(LED_MQTT, HIGH);
-		while (!Fifo.isEmpty())
+		MYLOG("SEND", "%d FiFo entries, %d queued", Fifo.getSize(), pub_entries);
+		if (custom_parameters.batch_count > 1)
 		{
-			MYLOG("SEND", "on entry %d FiFo entries ", Fifo.getSize());
-			// Get last entry from the Fifo queue
-			uint16_t buffer_size = Fifo.getPayloadSize();
-			MYLOG("SEND", "Payload size %d", buffer_size);
-			uint8_t *buffer = Fifo.getPayload();
-#if MY_DEBUG > 0
-			for (int i = 0; i < buffer_size; i++)
+			uint32_t age = millis() - ((rx_entry_s *)Fifo.peekPayload(pub_entries))->rx_time;
+			if (((Fifo.getSize() - pub_entries) < custom_parameters.batch_count) && (age < custom_parameters.batch_delay) && (Fifo.getSize() < MAX_QUEUE_SIZE - 1))
 			{
-				Serial.printf("%02X", buffer[i]);
+				// Wait for more packets, rx_enqueue() starts the send handler earlier when the batch is complete
+				if (!wifi_sending)
+				{
+					wifi_sending = true;
+					batch_waiting = true;
+					api.system.timer.start(RAK_TIMER_0, custom_parameters.batch_delay - age, NULL);
+				}
+				break;
 			}
-			Serial.print("\r\n");
+		}
+		// Get the first entry that is not queued yet
+		uint16_t buffer_size = Fifo.peekPayloadSize(pub_entries);
+		MYLOG("SEND", "Payload size %d", buffer_size);
+		uint8_t *buffer = Fifo.peekPayload(pub_entries);
+		rx_entry_s *entry = (rx_entry_s *)buffer;
+#if MY_DEBUG > 0
+		for (int i = RX_ENTRY_HEADER_SIZE; i < buffer_size; i++)
+		{
+			Serial.printf("%02X", buffer[i]);
+		}
+		Serial.print("\r\n");
 #endif
-			// Parse the data
-			MYLOG("SEND", "Publish packet to MQTT Broker");
-			// Send as JSON
-			size_t buff_len = parse(buffer, buffer_size);
+		// Parse the data
+		MYLOG("SEND", "Publish packet to MQTT Broker");
+		// Send as JSON
+		size_t buff_len = 0;
+		uint8_t num_entries = 1;
+		char sub_topic[12] = "Test";
+		if (custom_parameters.batch_count > 1)
+		{
+			// LoRa P2P and mesh packets are sent together with their metadata
+			snprintf(sub_topic, sizeof(sub_topic), BATCH_TOPIC);
+			buff_len = parse_batch(num_entries, pub_entries, custom_parameters.batch_count, custom_parameters.batch_size);
+		}
+		else if (entry->type == RX_P2P)
+		{
+			buff_len = parse(&buffer[RX_ENTRY_HEADER_SIZE], buffer_size - RX_ENTRY_HEADER_SIZE);
+		}
+		else
+		{
+			// Mesh data, packets from the same origin are sent together to the topic of the origin
+			buff_len = parse_mesh(sub_topic, num_entries, pub_entries);
+		}
 
-			if (buff_len != 0)
+		if (buff_len == 0)
+		{
+			// MYLOG("SEND", "Parse to JSON failed");
+			if (pub_count != 0)
 			{
-				if (!publish_raw_msg((char *)"Test", (uint8_t *)json_buffer, buff_len))
-				{
-					MYLOG("SEND", "Publish failed");
-					digitalWrite(LED_MQTT, HIGH);
-					has_wifi_conn = false;
-					has_mqtt_conn = false;
-				}
-				else
-				{
-					digitalWrite(LED_MQTT, LOW);
-					MYLOG("SEND", "Publish success");
-				}
+				// Entry is removed after the queued publishes are finished
+				break;
 			}
-			else
+			Fifo.deQueue();
+			flash_log_dequeued();
+			continue;
+		}
+
+		pub_slot_s *slot = &pub_slots[(pub_head + pub_count) % PUB_PIPELINE];
+		memcpy(slot->payload, json_buffer, buff_len);
+		slot->num_entries = num_entries;
+		if (!publish_raw_msg(sub_topic, (uint8_t *)slot->payload, buff_len, publish_done, slot))
+		{
+			MYLOG("SEND", "AT command queue full");
+			break;
+		}
+		pub_count++;
+		pub_entries += num_entries;
+	}
+	if (Fifo.isEmpty())
+	{
+		digitalWrite(LED_WIFI, LOW);
+	}
+}
+
+/**
+ * @brief Callback when a publish is finished
+ * 		Removes the entries of the message from the FiFo and queues the next entries.
+ * 		After a failed publish the entries of it and of the following publishes stay in the FiFo
+ * 		and are sent again after the reconnect, entries that failed PUB_RETRY_MAX times are dropped.
+ *
+ * @param result result of the AT command
+ * @param context publish slot
+ */
+void publish_done(uint8_t result, void *context)
+{
+	pub_slot_s *slot = (pub_slot_s *)context;
+	// After a failed publish the entries of the following publishes are not at the start of the FiFo
+	bool keep = pub_retry;
+	if (result != AT_CMD_OK)
+	{
+		MYLOG("SEND", "Publish failed");
+		digitalWrite(LED_MQTT, HIGH);
+		has_wifi_conn = false;
+		has_mqtt_conn = false;
+		if (!pub_retry)
+		{
+			pub_retry = true;
+			pub_fails++;
+			keep = pub_fails < PUB_RETRY_MAX;
+			if (!keep)
 			{
-				// MYLOG("SEND", "Parse to JSON failed");
+				MYLOG("SEND", "Publish failed %d times, entries dropped", pub_fails);
+				pub_fails = 0;
 			}
+		}
+	}
+	else
+	{
+		MYLOG("SEND", "Publish success");
+		if (!pub_retry)
+		{
+			pub_fails = 0;
+		}
+	}
 
-			// Remove entry from queue
+	if (!keep)
+	{
+		// Remove entries from queue, they are the first ones in the FiFo
+		for (int idx = 0; idx < slot->num_entries; idx++)
+		{
 			Fifo.deQueue();
-			MYLOG("SEND", "On exit %d FiFo entries left", Fifo.getSize());
+			flash_log_dequeued();
 		}
-		digitalWrite(LED_WIFI, LOW);
 	}
-	wifi_sending = false;
-}
\ No newline at end of file
+	pub_entries -= slot->num_entries;
+	pub_head = (pub_head + 1) % PUB_PIPELINE;
+	pub_count--;
+	if (pub_count == 0)
+	{
+		pub_retry = false;
+	}
+	MYLOG("SEND", "%d FiFo entries left", Fifo.getSize());
+
+	if (has_wifi_conn && has_mqtt_conn)
+	{
+		queue_publish();
+	}
+	else if (!wifi_sending)
+	{
+		// Reconnect from the send handler
+		wifi_sending = true;
+		api.system.timer.start(RAK_TIMER_0, 250, NULL);
+	}
+}
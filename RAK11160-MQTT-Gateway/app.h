@@ -9,7 +9,11 @@
  *
  */
 #include <Arduino.h>
+#include <ArduinoJson.h>
 #include "ArrayQueue.h"
+#include "mesh_sink.h"
+#include "at_client.h"
+#include "flash_log.h"
 
 // Redefine LED1 pin (Only needed until RAK11160 is officially supported by RUI3)
 #ifdef WB_LED1
@@ -46,6 +50,31 @@
 #define MYLOG(...)
 #endif
 
+#ifndef JSON_BUFF_SIZE
+/** Default JSON buffer size */
+#define JSON_BUFF_SIZE 2048
+#endif
+
+#ifndef PUB_PIPELINE
+/** Number of publishes in the AT command queue at the same time */
+#define PUB_PIPELINE 2
+#endif
+
+#ifndef PUB_RETRY_MAX
+/** Number of failed publishes of the same FiFo entries before they are dropped */
+#define PUB_RETRY_MAX 3
+#endif
+
+#ifndef BATCH_TOPIC
+/** Sub topic of the batched messages */
+#define BATCH_TOPIC "batch"
+#endif
+
+#ifndef BATCH_DELAY_MAX
+/** Max time in ms a packet waits for more packets of a batch */
+#define BATCH_DELAY_MAX 60000
+#endif
+
 // Forward declarations
 void recv_cb(rui_lora_p2p_recv_t data);
 void send_cb(void);
@@ -53,22 +82,37 @@ bool init_connection(bool restart = false);
 bool init_wifi(bool restart);
 bool connect_wifi(void);
 bool connect_mqtt(bool restart = false);
-bool publish_msg(char *sub_topic, char *message);
-bool publish_raw_msg(char *sub_topic, uint8_t *message, size_t msg_len);
-bool wait_ok_response(time_t timeout, uint8_t pin, char *wait_for = "OK");
+void esp_urc_cb(uint16_t tokens);
+bool publish_msg(char *sub_topic, char *message, at_cmd_cb_t callback, void *context = NULL);
+bool publish_raw_msg(char *sub_topic, uint8_t *message, size_t msg_len, at_cmd_cb_t callback, void *context = NULL);
 void send_handler(void *);
+void queue_publish(void);
+void publish_done(uint8_t result, void *context);
 size_t parse(uint8_t *data, uint16_t data_len);
+bool parse_lpp(JsonObject values, uint8_t *data, uint16_t data_len);
+size_t parse_mesh(char *topic, uint8_t &num_entries, int start = 0);
+size_t parse_batch(uint8_t &num_entries, int start, uint8_t max_entries, uint16_t max_size);
+bool rx_enqueue(rx_entry_s *entry, uint8_t *payload, uint16_t payload_size);
 extern uint8_t rcvd_buffer[];
 extern uint16_t rcvd_buffer_size;
 extern bool has_wifi_conn;
 extern bool has_mqtt_conn;
 extern volatile bool wifi_sending;
+extern volatile bool batch_waiting;
+extern int pub_entries;
 extern char json_buffer[];
+extern StaticJsonDocument<JSON_BUFF_SIZE> note_json;
 extern ArrayQueue Fifo;
 
 // Custom AT commands
 bool init_wifi_at(void);
 int wifi_setup_handler(SERIAL_PORT port, char *cmd, stParam *param);
+bool init_sink_at(void);
+int sink_handler(SERIAL_PORT port, char *cmd, stParam *param);
+bool init_batch_at(void);
+int batch_handler(SERIAL_PORT port, char *cmd, stParam *param);
+bool init_store_at(void);
+int store_handler(SERIAL_PORT port, char *cmd, stParam *param);
 bool get_at_setting(void);
 bool save_at_setting(void);
 /** Custom flash parameters structure */
@@ -83,6 +127,15 @@ struct custom_param_s
 	char MQTT_URL[32] = "127.0.0.1";
 	char MQTT_PORT[32] = "1883";
 	char MQTT_PUB[32] = "RAKwireless/";
+	uint8_t mesh_sink = 0;
+	/** Max number of packets in one MQTT message, 1 = one message per packet */
+	uint8_t batch_count = 1;
+	/** Max size of a batched MQTT message in bytes */
+	uint16_t batch_size = JSON_BUFF_SIZE;
+	/** Max time in ms the oldest packet waits for more packets */
+	uint16_t batch_delay = 0;
+	/** Max size of the flash log in kByte, 0 = packets are dropped while the broker is not reachable */
+	uint8_t store_kb = FLASH_LOG_SIZE / 1024;
 };
 
 // Custom flash parameters
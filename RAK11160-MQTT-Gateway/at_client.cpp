@@ -0,0 +1,498 @@
+/**
+ * @file at_client.cpp
+ * @author Bernd Giesecke (bernd@giesecke.tk)
+ * @brief Non-blocking AT command client for the ESP8684
+ * 		Commands are queued with the response that finishes them, a timeout and a callback.
+ * 		A periodic timer reads the UART and feeds the received bytes into the response state machine,
+ * 		the CPU is free for the LoRa callbacks while the ESP8684 is working.
+ * 		The responses are recognized by a streaming matcher (Aho-Corasick automaton) with one table lookup per byte.
+ * @version 0.1
+ * @date 2026-10-17
+ *
+ * @copyright Copyright (c) 2026
+ *
+ */
+#include "app.h"
+
+/** States of the AT client */
+#define AT_IDLE 0
+#define AT_WAIT_PROMPT 1
+#define AT_SEND_PAYLOAD 2
+#define AT_WAIT_RESPONSE 3
+
+/** Size of the response buffer */
+#define AT_RESP_LEN 1024
+
+/** Size of the matcher table, the states and the character classes of the tokens */
+#define AT_DFA_STATES 96
+#define AT_DFA_CLASSES 40
+
+/** Tokens of the matcher, each token is a complete line or the start of a line */
+static const struct
+{
+	const char *text;
+	uint16_t token;
+} at_tokens[] = {
+	{"\nOK\r", AT_TOK_OK},
+	{"\nERROR\r", AT_TOK_ERROR},
+	{"\n>", AT_TOK_PROMPT},
+	{"\n+MQTTPUB:OK\r", AT_TOK_PUB_OK},
+	{"\n+MQTTPUB:FAIL\r", AT_TOK_PUB_FAIL},
+	{"\nbusy p", AT_TOK_BUSY},
+	{"\n+MQTTCONNECTED:", AT_TOK_MQTT_CONNECTED},
+	{"\n+MQTTDISCONNECTED:", AT_TOK_MQTT_DISCONNECTED},
+	{"\nWIFI GOT IP\r", AT_TOK_WIFI_CONNECTED},
+	{"\nWIFI DISCONNECT\r", AT_TOK_WIFI_DISCONNECT},
+	{"\nready\r", AT_TOK_READY},
+};
+
+/** Character class of each ASCII character, 0 for characters that are not in a token */
+static uint8_t at_class[128];
+/** Transition table of the matcher */
+static uint8_t at_dfa[AT_DFA_STATES][AT_DFA_CLASSES];
+/** Tokens that are finished in each state */
+static uint16_t at_out[AT_DFA_STATES];
+/** State of the matcher */
+static uint8_t at_match_state = 0;
+/** State of the matcher at the start of a line */
+static uint8_t at_line_start = 0;
+
+/** Queued AT command */
+struct at_cmd_s
+{
+	/** Command including \r\n, empty if the command only waits */
+	char cmd[AT_CMD_LEN];
+	/** Tokens that finish the command, 0 if the command is finished after the timeout */
+	uint16_t expect;
+	/** Payload that is sent after the '>' prompt, NULL if the command has no payload */
+	uint8_t *payload;
+	size_t payload_len;
+	/** Timeout for the response in ms */
+	time_t timeout;
+	/** LED that blinks while the command is active */
+	uint8_t pin;
+	/** Callback when the command is finished */
+	at_cmd_cb_t callback;
+	void *context;
+};
+
+/** AT command queue */
+static at_cmd_s at_queue[AT_QUEUE_SIZE];
+/** First command in the queue, this is the active command */
+static uint8_t at_head = 0;
+/** Number of commands in the queue */
+static uint8_t at_count = 0;
+/** State of the active command */
+static uint8_t at_state = AT_IDLE;
+/** Start time of the current state of the active command */
+static time_t at_start = 0;
+/** Payload bytes sent of the active command */
+static size_t at_sent = 0;
+/** Time the last payload block was sent */
+static time_t at_chunk_time = 0;
+/** Flag if the queue is cleared, no new commands are accepted */
+static bool at_clearing = false;
+/** Callback for unsolicited result codes */
+static at_urc_cb_t at_urc_callback = NULL;
+
+/** Response of the active or the last finished command */
+char esp_com_buff[AT_RESP_LEN];
+/** Write index into the response buffer */
+static int buff_idx = 0;
+/** The poll timer is running, it runs only while commands are queued */
+static bool at_polling = false;
+
+/**
+ * @brief Clear the response buffer
+ *
+ */
+static void at_clear_response(void)
+{
+	buff_idx = 0;
+	esp_com_buff[0] = 0;
+}
+
+/**
+ * @brief Start the poll timer if it is not running
+ *
+ */
+static void at_poll_start(void)
+{
+	if (!at_polling)
+	{
+		at_polling = true;
+		api.system.timer.start(RAK_TIMER_3, AT_POLL_INTERVAL, NULL);
+	}
+}
+
+/**
+ * @brief Stop the poll timer, the device can sleep until the next command is queued
+ *
+ */
+static void at_poll_stop(void)
+{
+	if (at_polling)
+	{
+		at_polling = false;
+		api.system.timer.stop(RAK_TIMER_3);
+	}
+}
+
+/**
+ * @brief Send the first command of the queue to the ESP8684
+ *
+ */
+static void at_start_next(void)
+{
+	if ((at_count == 0) || at_clearing)
+	{
+		return;
+	}
+	at_cmd_s *cmd = &at_queue[at_head];
+	at_clear_response();
+	if (cmd->cmd[0] != 0)
+	{
+		Serial1.print(cmd->cmd);
+		Serial1.flush();
+	}
+	at_state = cmd->payload != NULL ? AT_WAIT_PROMPT : AT_WAIT_RESPONSE;
+	at_start = millis();
+}
+
+/**
+ * @brief Finish the active command, call its callback and start the next command
+ *
+ * @param result AT_CMD_OK, AT_CMD_ERROR or AT_CMD_TIMEOUT
+ */
+static void at_finish(uint8_t result)
+{
+	at_cmd_s *cmd = &at_queue[at_head];
+	at_cmd_cb_t callback = cmd->callback;
+	void *context = cmd->context;
+	digitalWrite(cmd->pin, LOW);
+
+	at_head = (at_head + 1) % AT_QUEUE_SIZE;
+	at_count--;
+	at_state = AT_IDLE;
+
+	if (callback != NULL)
+	{
+		callback(result, context);
+	}
+	// The callback might have started a new command already
+	if (at_state == AT_IDLE)
+	{
+		at_start_next();
+	}
+	if (at_count == 0)
+	{
+		at_poll_stop();
+	}
+}
+
+/**
+ * @brief Send the next block of the payload of the active command
+ * 		The blocks have the size of the UART RX FIFO of the ESP8684.
+ * 		The next block is sent after the ESP8684 had the wire time of the block to empty its FIFO.
+ *
+ */
+static void at_send_chunk(void)
+{
+	at_cmd_s *cmd = &at_queue[at_head];
+	size_t chunk = cmd->payload_len - at_sent;
+	if (chunk > ESP_UART_CHUNK)
+	{
+		chunk = ESP_UART_CHUNK;
+	}
+	Serial1.write(&cmd->payload[at_sent], chunk);
+	Serial1.flush();
+	at_sent += chunk;
+	at_chunk_time = millis();
+
+	if (at_sent == cmd->payload_len)
+	{
+		// Wait for the publish result
+		at_clear_response();
+		at_state = AT_WAIT_RESPONSE;
+		at_start = millis();
+	}
+}
+
+/**
+ * @brief Build the matcher table from the tokens
+ * 		The tokens are added to a trie, then the missing transitions are filled
+ * 		with the transitions of the longest suffix that is in the trie (Aho-Corasick).
+ * 		The matcher starts as if a line end was received.
+ *
+ */
+void at_match_init(void)
+{
+	uint8_t num_classes = 1;
+	uint8_t num_states = 1;
+	memset(at_class, 0, sizeof(at_class));
+	memset(at_dfa, 0, sizeof(at_dfa));
+	memset(at_out, 0, sizeof(at_out));
+
+	// Trie of the tokens, transition 0 is "no transition", the root is never a target
+	for (size_t idx = 0; idx < sizeof(at_tokens) / sizeof(at_tokens[0]); idx++)
+	{
+		uint8_t state = 0;
+		for (const char *text = at_tokens[idx].text; *text != 0; text++)
+		{
+			uint8_t *char_class = &at_class[(uint8_t)*text];
+			if ((*char_class == 0) && (num_classes < AT_DFA_CLASSES))
+			{
+				*char_class = num_classes++;
+			}
+			if (at_dfa[state][*char_class] == 0)
+			{
+				if (num_states == AT_DFA_STATES)
+				{
+					MYLOG("AT", "Matcher table too small");
+					return;
+				}
+				at_dfa[state][*char_class] = num_states++;
+			}
+			state = at_dfa[state][*char_class];
+		}
+		at_out[state] |= at_tokens[idx].token;
+	}
+
+	// Breadth first through the trie, the fallback state of a state is always handled before the state
+	uint8_t fallback[AT_DFA_STATES] = {0};
+	uint8_t queue[AT_DFA_STATES];
+	uint8_t queue_head = 0;
+	uint8_t queue_tail = 0;
+	for (uint8_t char_class = 0; char_class < num_classes; char_class++)
+	{
+		if (at_dfa[0][char_class] != 0)
+		{
+			queue[queue_tail++] = at_dfa[0][char_class];
+		}
+	}
+	while (queue_head != queue_tail)
+	{
+		uint8_t state = queue[queue_head++];
+		at_out[state] |= at_out[fallback[state]];
+		for (uint8_t char_class = 0; char_class < num_classes; char_class++)
+		{
+			uint8_t next = at_dfa[state][char_class];
+			if (next != 0)
+			{
+				fallback[next] = at_dfa[fallback[state]][char_class];
+				queue[queue_tail++] = next;
+			}
+			else
+			{
+				at_dfa[state][char_class] = at_dfa[fallback[state]][char_class];
+			}
+		}
+	}
+	at_line_start = at_dfa[0][at_class['\n']];
+	at_match_state = at_line_start;
+}
+
+/**
+ * @brief Feed one byte into the matcher
+ *
+ * @param rcvd received byte
+ * @return uint16_t tokens that are finished with this byte, 0 if none
+ */
+uint16_t at_match(uint8_t rcvd)
+{
+	at_match_state = at_dfa[at_match_state][rcvd < 128 ? at_class[rcvd] : 0];
+	uint16_t tokens = at_out[at_match_state];
+	if ((tokens & AT_TOK_PROMPT) != 0)
+	{
+		// The prompt is not followed by a line end, the next output starts a new line
+		at_match_state = at_line_start;
+	}
+	return tokens;
+}
+
+/**
+ * @brief Handle one byte received from the ESP8684
+ *
+ * @param rcvd received byte
+ */
+static void at_rx_byte(char rcvd)
+{
+	// Keep the response for the callbacks, the matcher does not need it
+	if (buff_idx < AT_RESP_LEN - 1)
+	{
+		esp_com_buff[buff_idx] = rcvd;
+		buff_idx++;
+		esp_com_buff[buff_idx] = 0;
+	}
+
+	uint16_t tokens = at_match(rcvd);
+	if (tokens == 0)
+	{
+		return;
+	}
+
+	switch (at_state)
+	{
+	case AT_WAIT_PROMPT:
+		/** Expected response ********************
+		OK
+		>
+		*****************************************/
+		if ((tokens & AT_TOK_PROMPT) != 0)
+		{
+			at_state = AT_SEND_PAYLOAD;
+			at_sent = 0;
+			at_send_chunk();
+		}
+		else if ((tokens & AT_TOK_FAIL) != 0)
+		{
+			at_finish(AT_CMD_ERROR);
+		}
+		break;
+	case AT_WAIT_RESPONSE:
+		if ((tokens & at_queue[at_head].expect) != 0)
+		{
+			at_finish(AT_CMD_OK);
+		}
+		else if ((tokens & AT_TOK_FAIL) != 0)
+		{
+			at_finish(AT_CMD_ERROR);
+		}
+		break;
+	default:
+		// Payload phase or no active command
+		break;
+	}
+
+	// Unsolicited result codes, e.g. the MQTT broker disconnected
+	if (((tokens & AT_TOK_URC) != 0) && (at_urc_callback != NULL))
+	{
+		at_urc_callback(tokens & AT_TOK_URC);
+	}
+}
+
+/**
+ * @brief Start the AT client, the UART is polled every AT_POLL_INTERVAL ms while commands are queued.
+ * 		URCs that arrive while the queue is empty stay in the UART buffer and are handled when the next command is queued
+ *
+ * @param urc_callback called when an unsolicited result code is received, can be NULL
+ */
+void at_client_init(at_urc_cb_t urc_callback)
+{
+	at_urc_callback = urc_callback;
+	at_match_init();
+	api.system.timer.create(RAK_TIMER_3, at_client_poll, RAK_TIMER_PERIODIC);
+	at_polling = false;
+	api.system.timer.stop(RAK_TIMER_3);
+}
+
+/**
+ * @brief Add a command to the AT command queue
+ *
+ * @param cmd command including \r\n, NULL to only wait
+ * @param expect tokens that finish the command, 0 if the command is finished after the timeout
+ * @param timeout time to wait for the response in ms
+ * @param pin LED that blinks while the command is active
+ * @param callback called when the command is finished
+ * @param context given to the callback
+ * @param payload sent after the '>' prompt, must be valid until the callback is called
+ * @param payload_len size of the payload
+ * @return true command is queued
+ * @return false queue is full or command too long
+ */
+bool at_client_queue(const char *cmd, uint16_t expect, time_t timeout, uint8_t pin, at_cmd_cb_t callback,
+					 void *context, uint8_t *payload, size_t payload_len)
+{
+	if ((at_count == AT_QUEUE_SIZE) || at_clearing)
+	{
+		return false;
+	}
+	if ((cmd != NULL) && (strlen(cmd) >= AT_CMD_LEN))
+	{
+		return false;
+	}
+	at_cmd_s *new_cmd = &at_queue[(at_head + at_count) % AT_QUEUE_SIZE];
+	if (cmd != NULL)
+	{
+		strcpy(new_cmd->cmd, cmd);
+	}
+	else
+	{
+		new_cmd->cmd[0] = 0;
+	}
+	new_cmd->expect = expect;
+	new_cmd->payload = payload_len != 0 ? payload : NULL;
+	new_cmd->payload_len = payload_len;
+	new_cmd->timeout = timeout;
+	new_cmd->pin = pin;
+	new_cmd->callback = callback;
+	new_cmd->context = context;
+	at_count++;
+	at_poll_start();
+
+	if (at_state == AT_IDLE)
+	{
+		at_start_next();
+	}
+	return true;
+}
+
+/**
+ * @brief Timer callback, reads the UART and checks the timeout of the active command
+ *
+ */
+void at_client_poll(void *)
+{
+	while (Serial1.available() != 0)
+	{
+		at_rx_byte(Serial1.read());
+	}
+
+	if (at_state == AT_IDLE)
+	{
+		return;
+	}
+	at_cmd_s *cmd = &at_queue[at_head];
+	if (at_state == AT_SEND_PAYLOAD)
+	{
+		// Wire time of one block, 10 bits per byte
+		if ((millis() - at_chunk_time) >= (ESP_UART_CHUNK * 10 * 1000 + ESP_BAUD - 1) / ESP_BAUD)
+		{
+			at_send_chunk();
+		}
+		return;
+	}
+
+	digitalWrite(cmd->pin, !digitalRead(cmd->pin));
+	time_t timeout = at_state == AT_WAIT_PROMPT ? AT_PROMPT_TIMEOUT : cmd->timeout;
+	if ((long)(millis() - at_start) >= timeout)
+	{
+		// A command without expected response is finished after the timeout
+		at_finish(cmd->expect == 0 ? AT_CMD_OK : AT_CMD_TIMEOUT);
+	}
+}
+
+/**
+ * @brief Remove all commands from the AT command queue, the callbacks are called with AT_CMD_ERROR
+ *
+ */
+void at_client_clear(void)
+{
+	at_clearing = true;
+	while (at_count != 0)
+	{
+		at_finish(AT_CMD_ERROR);
+	}
+	at_clearing = false;
+	at_clear_response();
+}
+
+/**
+ * @brief Get the number of commands in the AT command queue
+ *
+ * @return uint8_t number of commands, including the active command
+ */
+uint8_t at_client_pending(void)
+{
+	return at_count;
+}
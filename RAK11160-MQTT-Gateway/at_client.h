@@ -0,0 +1,94 @@
+/**
+ * @file at_client.h
+ * @author Bernd Giesecke (bernd@giesecke.tk)
+ * @brief Non-blocking AT command client for the ESP8684
+ * @version 0.1
+ * @date 2026-10-17
+ *
+ * @copyright Copyright (c) 2026
+ *
+ */
+#ifndef AT_CLIENT_H
+#define AT_CLIENT_H
+
+#include <Arduino.h>
+
+/** Baud rate of the UART to the ESP8684 */
+#ifndef ESP_BAUD
+#define ESP_BAUD 115200
+#endif
+
+/** Size of the UART RX FIFO of the ESP8684, payloads are written in blocks of this size */
+#ifndef ESP_UART_CHUNK
+#define ESP_UART_CHUNK 128
+#endif
+
+/** Number of commands in the AT command queue */
+#ifndef AT_QUEUE_SIZE
+#define AT_QUEUE_SIZE 8
+#endif
+
+/** Maximum length of an AT command */
+#ifndef AT_CMD_LEN
+#define AT_CMD_LEN 160
+#endif
+
+/** Interval of the UART polling in ms */
+#ifndef AT_POLL_INTERVAL
+#define AT_POLL_INTERVAL 5
+#endif
+
+/** Time to wait for the '>' prompt of a command with payload in ms */
+#ifndef AT_PROMPT_TIMEOUT
+#define AT_PROMPT_TIMEOUT 10000
+#endif
+
+/** Tokens of the response matcher, one received byte can finish several tokens */
+#define AT_TOK_OK 0x0001
+#define AT_TOK_ERROR 0x0002
+#define AT_TOK_PROMPT 0x0004
+#define AT_TOK_PUB_OK 0x0008
+#define AT_TOK_PUB_FAIL 0x0010
+#define AT_TOK_BUSY 0x0020
+#define AT_TOK_MQTT_CONNECTED 0x0040
+#define AT_TOK_MQTT_DISCONNECTED 0x0080
+#define AT_TOK_WIFI_CONNECTED 0x0100
+#define AT_TOK_WIFI_DISCONNECT 0x0200
+#define AT_TOK_READY 0x0400
+/** Tokens that fail the active command */
+#define AT_TOK_FAIL (AT_TOK_ERROR | AT_TOK_PUB_FAIL | AT_TOK_BUSY)
+/** Unsolicited result codes, they can arrive at any time */
+#define AT_TOK_URC (AT_TOK_MQTT_CONNECTED | AT_TOK_MQTT_DISCONNECTED | AT_TOK_WIFI_CONNECTED | AT_TOK_WIFI_DISCONNECT | AT_TOK_READY)
+
+/** Results of an AT command */
+#define AT_CMD_OK 0
+#define AT_CMD_ERROR 1
+#define AT_CMD_TIMEOUT 2
+
+/**
+ * @brief Callback when an AT command is finished
+ *
+ * @param result AT_CMD_OK, AT_CMD_ERROR or AT_CMD_TIMEOUT
+ * @param context context given with the command
+ */
+typedef void (*at_cmd_cb_t)(uint8_t result, void *context);
+
+/**
+ * @brief Callback when an unsolicited result code is received
+ *
+ * @param tokens AT_TOK_URC tokens that were received
+ */
+typedef void (*at_urc_cb_t)(uint16_t tokens);
+
+// AT client functions & variables
+void at_client_init(at_urc_cb_t urc_callback);
+bool at_client_queue(const char *cmd, uint16_t expect, time_t timeout, uint8_t pin, at_cmd_cb_t callback,
+					 void *context = NULL, uint8_t *payload = NULL, size_t payload_len = 0);
+void at_client_poll(void *);
+void at_client_clear(void);
+uint8_t at_client_pending(void);
+void at_match_init(void);
+uint16_t at_match(uint8_t rcvd);
+extern char esp_com_buff[];
+
+#endif // AT_CLIENT_H
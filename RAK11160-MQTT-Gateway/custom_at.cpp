@@ -92,6 +92,184 @@ int wifi_setup_handler(SERIAL_PORT port, char *cmd, stParam *param)
 	return AT_OK;
 }
 
+/**
+ * @brief Add mesh sink AT command
+ *
+ * @return true if success
+ * @return false if failed
+ */
+bool init_sink_at(void)
+{
+	return api.system.atMode.add((char *)"SINK",
+								 (char *)"Set/Get mesh sink mode, 0 = LoRa P2P gateway, 1 = master node of a RUI3-Mesh",
+								 (char *)"SINK", sink_handler,
+								 RAK_ATCMD_PERM_WRITE | RAK_ATCMD_PERM_READ);
+}
+
+/**
+ * @brief Handler for mesh sink AT command
+ *
+ * @param port Serial port used
+ * @param cmd char array with the received AT command
+ * @param param char array with the received AT command parameters
+ * @return int result of command parsing
+ * 			AT_OK AT command & parameters valid
+ * 			AT_PARAM_ERROR command or parameters invalid
+ */
+int sink_handler(SERIAL_PORT port, char *cmd, stParam *param)
+{
+	if (param->argc == 1 && !strcmp(param->argv[0], "?"))
+	{
+		if (custom_parameters.mesh_sink == 1)
+		{
+			AT_PRINTF("%s=1:%08lX", cmd, g_sink_addr);
+		}
+		else
+		{
+			AT_PRINTF("%s=0", cmd);
+		}
+	}
+	else if ((param->argc == 1) && ((param->argv[0][0] == '0') || (param->argv[0][0] == '1')) && (param->argv[0][1] == 0))
+	{
+		uint8_t new_mode = param->argv[0][0] - '0';
+		if (new_mode != custom_parameters.mesh_sink)
+		{
+			custom_parameters.mesh_sink = new_mode;
+			save_at_setting();
+			// Timers and RX mode are set up at startup
+			AT_PRINTF("Restart the device to switch the mode");
+		}
+	}
+	else
+	{
+		return AT_PARAM_ERROR;
+	}
+
+	return AT_OK;
+}
+
+/**
+ * @brief Add MQTT batch AT command
+ *
+ * @return true if success
+ * @return false if failed
+ */
+bool init_batch_at(void)
+{
+	return api.system.atMode.add((char *)"WIFIBATCH",
+								 (char *)"Set/Get MQTT batch settings, max packets:max bytes:max delay ms",
+								 (char *)"WIFIBATCH", batch_handler,
+								 RAK_ATCMD_PERM_WRITE | RAK_ATCMD_PERM_READ);
+}
+
+/**
+ * @brief Handler for MQTT batch AT command
+ *
+ * @param port Serial port used
+ * @param cmd char array with the received AT command
+ * @param param char array with the received AT command parameters
+ * @return int result of command parsing
+ * 			AT_OK AT command & parameters valid
+ * 			AT_PARAM_ERROR command or parameters invalid
+ */
+int batch_handler(SERIAL_PORT port, char *cmd, stParam *param)
+{
+	if (param->argc == 1 && !strcmp(param->argv[0], "?"))
+	{
+		AT_PRINTF("%s=%d:%d:%d", cmd, custom_parameters.batch_count, custom_parameters.batch_size, custom_parameters.batch_delay);
+	}
+	else if (param->argc == 3)
+	{
+		for (int idx = 0; idx < 3; idx++)
+		{
+			for (int chr = 0; param->argv[idx][chr] != 0; chr++)
+			{
+				if (!isdigit(param->argv[idx][chr]))
+				{
+					return AT_PARAM_ERROR;
+				}
+			}
+		}
+		long new_count = strtol(param->argv[0], NULL, 10);
+		long new_size = strtol(param->argv[1], NULL, 10);
+		long new_delay = strtol(param->argv[2], NULL, 10);
+		if ((new_count < 1) || (new_count > MAX_QUEUE_SIZE - 1) || (new_size < 256) || (new_size > JSON_BUFF_SIZE) || (new_delay > BATCH_DELAY_MAX))
+		{
+			return AT_PARAM_ERROR;
+		}
+		custom_parameters.batch_count = new_count;
+		custom_parameters.batch_size = new_size;
+		custom_parameters.batch_delay = new_delay;
+		save_at_setting();
+	}
+	else
+	{
+		return AT_PARAM_ERROR;
+	}
+
+	return AT_OK;
+}
+
+/**
+ * @brief Add flash log AT command
+ *
+ * @return true if success
+ * @return false if failed
+ */
+bool init_store_at(void)
+{
+	return api.system.atMode.add((char *)"WIFISTORE",
+								 (char *)"Set/Get max size of the flash log in kByte for packets received while the MQTT broker is not reachable, 0 = off",
+								 (char *)"WIFISTORE", store_handler,
+								 RAK_ATCMD_PERM_WRITE | RAK_ATCMD_PERM_READ);
+}
+
+/**
+ * @brief Handler for flash log AT command
+ *
+ * @param port Serial port used
+ * @param cmd char array with the received AT command
+ * @param param char array with the received AT command parameters
+ * @return int result of command parsing
+ * 			AT_OK AT command & parameters valid
+ * 			AT_PARAM_ERROR command or parameters invalid
+ */
+int store_handler(SERIAL_PORT port, char *cmd, stParam *param)
+{
+	if (param->argc == 1 && !strcmp(param->argv[0], "?"))
+	{
+		AT_PRINTF("%s=%d:%ld:%ld", cmd, custom_parameters.store_kb, flash_log_stored(), flash_log_dropped());
+	}
+	else if (param->argc == 1)
+	{
+		for (int chr = 0; param->argv[0][chr] != 0; chr++)
+		{
+			if (!isdigit(param->argv[0][chr]))
+			{
+				return AT_PARAM_ERROR;
+			}
+		}
+		long new_size = strtol(param->argv[0], NULL, 10);
+		if (new_size > FLASH_LOG_SIZE / 1024)
+		{
+			return AT_PARAM_ERROR;
+		}
+		if (new_size != custom_parameters.store_kb)
+		{
+			custom_parameters.store_kb = new_size;
+			save_at_setting();
+			// The log is set up at startup
+			AT_PRINTF("Restart the device to change the flash log");
+		}
+	}
+	else
+	{
+		return AT_PARAM_ERROR;
+	}
+
+	return AT_OK;
+}
+
 /**
  * @brief Get setting from flash
  *
@@ -119,10 +297,32 @@ bool get_at_setting(void)
 		snprintf(custom_parameters.MQTT_URL, 32, "URL");
 		snprintf(custom_parameters.MQTT_PORT, 32, "1883");
 		snprintf(custom_parameters.MQTT_PUB, 32, "test/");
+		custom_parameters.mesh_sink = 0;
+		custom_parameters.batch_count = 1;
+		custom_parameters.batch_size = JSON_BUFF_SIZE;
+		custom_parameters.batch_delay = 0;
+		custom_parameters.store_kb = FLASH_LOG_SIZE / 1024;
 		save_at_setting();
 		return false;
 	}
 	memcpy((uint8_t *)&custom_parameters.valid_flag, (uint8_t *)&temp_params.valid_flag, sizeof(custom_param_s));
+	if (custom_parameters.mesh_sink > 1)
+	{
+		// Settings saved before the mesh sink mode was added
+		custom_parameters.mesh_sink = 0;
+	}
+	if ((custom_parameters.batch_count < 1) || (custom_parameters.batch_count > MAX_QUEUE_SIZE - 1) || (custom_parameters.batch_size < 256) || (custom_parameters.batch_size > JSON_BUFF_SIZE) || (custom_parameters.batch_delay > BATCH_DELAY_MAX))
+	{
+		// Settings saved before the batch mode was added
+		custom_parameters.batch_count = 1;
+		custom_parameters.batch_size = JSON_BUFF_SIZE;
+		custom_parameters.batch_delay = 0;
+	}
+	if (custom_parameters.store_kb > FLASH_LOG_SIZE / 1024)
+	{
+		// Settings saved before the flash log was added
+		custom_parameters.store_kb = FLASH_LOG_SIZE / 1024;
+	}
 	return true;
 }
 
@@ -0,0 +1,452 @@
+/**
+ * @file flash_log.cpp
+ * @author Bernd Giesecke (bernd@giesecke.tk)
+ * @brief Flash ring log for received packets while the MQTT broker is not reachable
+ * 		Packets are appended as records with a CRC to a page buffer in RAM. A page is written to the flash
+ * 		when it is full or FLASH_LOG_FLUSH_DELAY after the first record, the pages are used as a ring.
+ * 		Pages are only written complete and are cleared after all their records are published,
+ * 		each page is erased twice per round through the ring.
+ * 		If the log is full, the oldest page is overwritten.
+ * @version 0.1
+ * @date 2026-10-17
+ *
+ * @copyright Copyright (c) 2026
+ *
+ */
+#include "app.h"
+
+/** Number of pages in the log, 0 if the log is off */
+static uint8_t log_pages = 0;
+/** Sequence number of each page, 0 if the page is free */
+static uint32_t page_seq[FLASH_LOG_PAGES];
+/** Number of records in each page */
+static uint16_t page_records[FLASH_LOG_PAGES];
+/** Oldest page with records that are not published */
+static uint8_t tail_page = 0;
+
+/** Page that is written, its content is in page_buf */
+static uint8_t wr_page = 0;
+/** Write position in page_buf */
+static uint16_t wr_pos = sizeof(log_page_s);
+/** Content of the page that is written */
+static uint8_t page_buf[FLASH_LOG_PAGE];
+/** page_buf has records that are not written to the flash */
+static bool page_dirty = false;
+/** The page that is written is already in the flash */
+static bool page_in_flash = false;
+/** Flush timer is running */
+static bool flush_pending = false;
+
+/** Page, position and number of records that are read */
+static uint8_t rd_page = 0;
+static uint16_t rd_pos = sizeof(log_page_s);
+static uint16_t rd_count = 0;
+
+/** Sequence number of the next page */
+static uint32_t next_seq = 1;
+/** Pages with a lower sequence number were written before the restart */
+static uint32_t boot_seq = 1;
+
+/** FiFo entries in front of the records that were read from the log */
+static int fifo_ahead = 0;
+/** Records read from the log that are still in the FiFo, including FiFo entries between them */
+static int in_fifo = 0;
+
+/** Records in the log that are not read */
+static uint32_t log_stored = 0;
+/** Records lost because the log was full or the record was damaged */
+static uint32_t log_dropped = 0;
+
+/**
+ * @brief CRC16 CCITT
+ *
+ * @param crc start value
+ * @param data data
+ * @param len size of the data
+ * @return uint16_t CRC
+ */
+static uint16_t log_crc(uint16_t crc, uint8_t *data, uint16_t len)
+{
+	for (int idx = 0; idx < len; idx++)
+	{
+		crc ^= (uint16_t)data[idx] << 8;
+		for (int bit = 0; bit < 8; bit++)
+		{
+			crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+		}
+	}
+	return crc;
+}
+
+/**
+ * @brief Position of a page in the user flash
+ *
+ * @param page page number
+ * @return uint32_t flash offset
+ */
+static uint32_t page_offset(uint8_t page)
+{
+	return FLASH_LOG_OFFSET + (uint32_t)page * FLASH_LOG_PAGE;
+}
+
+/**
+ * @brief Mark a page in the flash as free
+ *
+ * @param page page number
+ */
+static void log_clear_page(uint8_t page)
+{
+	log_page_s header = {0, 0, 0};
+	if (!api.system.flash.set(page_offset(page), (uint8_t *)&header, sizeof(log_page_s)))
+	{
+		// Retry
+		api.system.flash.set(page_offset(page), (uint8_t *)&header, sizeof(log_page_s));
+	}
+	page_seq[page] = 0;
+	page_records[page] = 0;
+}
+
+/**
+ * @brief Remove the oldest page from the log, its records that are not read are lost
+ *
+ */
+static void log_drop_page(void)
+{
+	uint16_t lost = 0;
+	if (rd_page == tail_page)
+	{
+		lost = page_records[tail_page] - rd_count;
+		rd_page = (tail_page + 1) % log_pages;
+		rd_pos = sizeof(log_page_s);
+		rd_count = 0;
+	}
+	MYLOG("FLOG", "Log full, %d records dropped", lost);
+	log_stored -= lost;
+	log_dropped += lost;
+	page_seq[tail_page] = 0;
+	page_records[tail_page] = 0;
+	tail_page = (tail_page + 1) % log_pages;
+}
+
+/**
+ * @brief Start writing the next page of the ring
+ *
+ */
+static void log_next_page(void)
+{
+	wr_page = (wr_page + 1) % log_pages;
+	if (page_seq[wr_page] != 0)
+	{
+		// The ring is full, the next page is the oldest one
+		log_drop_page();
+	}
+	page_seq[wr_page] = next_seq++;
+	page_records[wr_page] = 0;
+	memset(page_buf, 0xFF, FLASH_LOG_PAGE);
+	wr_pos = sizeof(log_page_s);
+	page_dirty = false;
+	page_in_flash = false;
+}
+
+/**
+ * @brief Clear the pages after all records that were read from them are published
+ *
+ */
+static void log_commit(void)
+{
+	while (tail_page != rd_page)
+	{
+		log_clear_page(tail_page);
+		tail_page = (tail_page + 1) % log_pages;
+	}
+	if (flash_log_empty() && (wr_pos != sizeof(log_page_s)))
+	{
+		// All records are published, the page that is written starts again
+		if (page_in_flash)
+		{
+			log_page_s header = {0, 0, 0};
+			api.system.flash.set(page_offset(wr_page), (uint8_t *)&header, sizeof(log_page_s));
+		}
+		memset(page_buf, 0xFF, FLASH_LOG_PAGE);
+		page_records[wr_page] = 0;
+		wr_pos = rd_pos = sizeof(log_page_s);
+		rd_count = 0;
+		page_dirty = false;
+		page_in_flash = false;
+	}
+}
+
+/**
+ * @brief Find the pages of the log in the flash
+ *
+ * @param size_kb max size of the log in kByte, 0 = log off
+ * @return true log is ready
+ * @return false log is off or the flash is too small
+ */
+bool flash_log_init(uint8_t size_kb)
+{
+	log_pages = 0;
+	log_stored = log_dropped = 0;
+	fifo_ahead = in_fifo = 0;
+
+	uint32_t max_pages = ((uint32_t)size_kb * 1024) / FLASH_LOG_PAGE;
+	if (max_pages > FLASH_LOG_PAGES)
+	{
+		max_pages = FLASH_LOG_PAGES;
+	}
+
+	uint32_t min_seq = 0xFFFFFFFF;
+	uint32_t max_seq = 0;
+	uint8_t head_page = 0;
+	for (uint8_t page = 0; page < max_pages; page++)
+	{
+		log_page_s header;
+		if (!api.system.flash.get(page_offset(page) + FLASH_LOG_PAGE - sizeof(log_page_s), (uint8_t *)&header, sizeof(log_page_s)) ||
+			!api.system.flash.get(page_offset(page), (uint8_t *)&header, sizeof(log_page_s)))
+		{
+			// End of the user flash
+			break;
+		}
+		log_pages++;
+		page_seq[page] = 0;
+		page_records[page] = 0;
+		if ((header.magic != FLASH_LOG_MAGIC) || (header.seq == 0) || (header.seq == 0xFFFFFFFF) || (header.records > FLASH_LOG_PAGE / sizeof(log_record_s)))
+		{
+			continue;
+		}
+		page_seq[page] = header.seq;
+		page_records[page] = header.records;
+		log_stored += header.records;
+		if (header.seq < min_seq)
+		{
+			min_seq = header.seq;
+			tail_page = page;
+		}
+		if (header.seq > max_seq)
+		{
+			max_seq = header.seq;
+			head_page = page;
+		}
+	}
+	if (log_pages < 2)
+	{
+		MYLOG("FLOG", "Flash log off");
+		log_pages = 0;
+		return false;
+	}
+
+	if (max_seq != 0)
+	{
+		// Records from before the restart are sent first, new records are written to the next page
+		next_seq = max_seq + 1;
+		wr_page = head_page;
+		rd_page = tail_page;
+	}
+	else
+	{
+		next_seq = 1;
+		wr_page = log_pages - 1;
+		tail_page = rd_page = 0;
+	}
+	rd_pos = sizeof(log_page_s);
+	rd_count = 0;
+	boot_seq = next_seq;
+	log_next_page();
+
+	api.system.timer.create(RAK_TIMER_4, flash_log_flush, RAK_TIMER_ONESHOT);
+
+	MYLOG("FLOG", "%d pages, %ld records stored", log_pages, log_stored);
+	return true;
+}
+
+/**
+ * @brief Append a received packet to the log
+ *
+ * @param entry header of the FiFo entry
+ * @param payload received data
+ * @param payload_size size of the received data
+ * @return true packet is stored
+ * @return false log is off
+ */
+bool flash_log_append(rx_entry_s *entry, uint8_t *payload, uint16_t payload_size)
+{
+	if (log_pages == 0)
+	{
+		return false;
+	}
+	if ((payload_size + RX_ENTRY_HEADER_SIZE) > MAX_QUEUE_PAYLOAD)
+	{
+		payload_size = MAX_QUEUE_PAYLOAD - RX_ENTRY_HEADER_SIZE;
+	}
+	log_record_s record;
+	record.len = RX_ENTRY_HEADER_SIZE + payload_size;
+	if ((wr_pos + sizeof(log_record_s) + record.len) > FLASH_LOG_PAGE)
+	{
+		// Page is full
+		flash_log_flush(NULL);
+		log_next_page();
+	}
+
+	uint8_t *data = &page_buf[wr_pos + sizeof(log_record_s)];
+	memcpy(data, entry, RX_ENTRY_HEADER_SIZE);
+	memcpy(&data[RX_ENTRY_HEADER_SIZE], payload, payload_size);
+	record.crc = log_crc(log_crc(0xFFFF, (uint8_t *)&record.len, sizeof(record.len)), data, record.len);
+	memcpy(&page_buf[wr_pos], &record, sizeof(log_record_s));
+	wr_pos += sizeof(log_record_s) + record.len;
+	page_records[wr_page]++;
+	log_stored++;
+	page_dirty = true;
+
+	if (!flush_pending)
+	{
+		flush_pending = true;
+		api.system.timer.start(RAK_TIMER_4, FLASH_LOG_FLUSH_DELAY, NULL);
+	}
+	MYLOG("FLOG", "%ld records stored", log_stored);
+	return true;
+}
+
+/**
+ * @brief Read the oldest record that is not read yet.
+ * 		The record stays in the flash until it is removed from the FiFo with flash_log_dequeued().
+ * 		Must only be called if the FiFo has space for the record.
+ *
+ * @param fifo_entry buffer for the FiFo entry, MAX_QUEUE_PAYLOAD bytes
+ * @return uint16_t size of the FiFo entry, 0 if no record is left
+ */
+uint16_t flash_log_read(uint8_t *fifo_entry)
+{
+	while (log_pages != 0)
+	{
+		log_record_s record;
+		if (rd_page == wr_page)
+		{
+			if (rd_pos >= wr_pos)
+			{
+				return 0;
+			}
+			memcpy(&record, &page_buf[rd_pos], sizeof(log_record_s));
+			memcpy(fifo_entry, &page_buf[rd_pos + sizeof(log_record_s)], record.len);
+		}
+		else
+		{
+			if (rd_count >= page_records[rd_page])
+			{
+				rd_page = (rd_page + 1) % log_pages;
+				rd_pos = sizeof(log_page_s);
+				rd_count = 0;
+				continue;
+			}
+			uint32_t offset = page_offset(rd_page) + rd_pos;
+			bool valid = api.system.flash.get(offset, (uint8_t *)&record, sizeof(log_record_s)) &&
+						 (record.len >= RX_ENTRY_HEADER_SIZE) && (record.len <= MAX_QUEUE_PAYLOAD) &&
+						 ((rd_pos + sizeof(log_record_s) + record.len) <= FLASH_LOG_PAGE) &&
+						 api.system.flash.get(offset + sizeof(log_record_s), fifo_entry, record.len) &&
+						 (record.crc == log_crc(log_crc(0xFFFF, (uint8_t *)&record.len, sizeof(record.len)), fifo_entry, record.len));
+			if (!valid)
+			{
+				// The size of the following records is not known, the rest of the page is lost
+				uint16_t lost = page_records[rd_page] - rd_count;
+				MYLOG("FLOG", "Damaged record in page %d, %d records lost", rd_page, lost);
+				log_stored -= lost;
+				log_dropped += lost;
+				rd_count = page_records[rd_page];
+				continue;
+			}
+		}
+		rd_pos += sizeof(log_record_s) + record.len;
+		rd_count++;
+		log_stored--;
+		if (page_seq[rd_page] < boot_seq)
+		{
+			// Received before the restart, the time of the reception is not known
+			((rx_entry_s *)fifo_entry)->rx_time = millis();
+		}
+		if (in_fifo == 0)
+		{
+			fifo_ahead = Fifo.getSize();
+		}
+		in_fifo = Fifo.getSize() - fifo_ahead + 1;
+		return record.len;
+	}
+	return 0;
+}
+
+/**
+ * @brief Check if all records are read
+ *
+ * @return true no records to read or log is off
+ * @return false records are waiting
+ */
+bool flash_log_empty(void)
+{
+	return (log_pages == 0) || ((rd_page == wr_page) && (rd_pos >= wr_pos));
+}
+
+/**
+ * @brief Called for each entry that is removed from the FiFo.
+ * 		After all records read from the log are removed, their pages are cleared.
+ *
+ */
+void flash_log_dequeued(void)
+{
+	if (fifo_ahead > 0)
+	{
+		fifo_ahead--;
+		return;
+	}
+	if (in_fifo == 0)
+	{
+		return;
+	}
+	in_fifo--;
+	if (in_fifo == 0)
+	{
+		log_commit();
+	}
+}
+
+/**
+ * @brief Write the page buffer to the flash, timer callback and called when the page is full
+ *
+ */
+void flash_log_flush(void *)
+{
+	flush_pending = false;
+	api.system.timer.stop(RAK_TIMER_4);
+	if (!page_dirty)
+	{
+		return;
+	}
+	log_page_s *header = (log_page_s *)page_buf;
+	header->magic = FLASH_LOG_MAGIC;
+	header->records = page_records[wr_page];
+	header->seq = page_seq[wr_page];
+	if (!api.system.flash.set(page_offset(wr_page), page_buf, FLASH_LOG_PAGE))
+	{
+		// Retry
+		api.system.flash.set(page_offset(wr_page), page_buf, FLASH_LOG_PAGE);
+	}
+	page_dirty = false;
+	page_in_flash = true;
+}
+
+/**
+ * @brief Number of records in the log that are not sent
+ *
+ * @return uint32_t number of records
+ */
+uint32_t flash_log_stored(void)
+{
+	return log_stored;
+}
+
+/**
+ * @brief Number of records lost because the log was full or damaged
+ *
+ * @return uint32_t number of records
+ */
+uint32_t flash_log_dropped(void)
+{
+	return log_dropped;
+}
@@ -0,0 +1,74 @@
+/**
+ * @file flash_log.h
+ * @author Bernd Giesecke (bernd@giesecke.tk)
+ * @brief Flash ring log for received packets while the MQTT broker is not reachable
+ * @version 0.1
+ * @date 2026-10-17
+ *
+ * @copyright Copyright (c) 2026
+ *
+ */
+#ifndef FLASH_LOG_H
+#define FLASH_LOG_H
+
+#include <Arduino.h>
+#include "mesh_sink.h"
+
+/** Start of the log in the user flash, the first page has the settings */
+#ifndef FLASH_LOG_OFFSET
+#define FLASH_LOG_OFFSET 2048
+#endif
+
+/** Size of the log in the user flash, pages that can not be read are not used */
+#ifndef FLASH_LOG_SIZE
+#define FLASH_LOG_SIZE 16384
+#endif
+
+/** Size of a flash page, the log is written in complete pages */
+#ifndef FLASH_LOG_PAGE
+#define FLASH_LOG_PAGE 2048
+#endif
+
+/** Time in ms until a partly filled page is written to the flash */
+#ifndef FLASH_LOG_FLUSH_DELAY
+#define FLASH_LOG_FLUSH_DELAY 60000
+#endif
+
+/** Max number of pages in the log */
+#define FLASH_LOG_PAGES (FLASH_LOG_SIZE / FLASH_LOG_PAGE)
+
+/** Marker of a page with records */
+#define FLASH_LOG_MAGIC 0x4C47
+
+#pragma pack(push, 1)
+/** Header of a page in the log */
+struct log_page_s
+{
+	/** FLASH_LOG_MAGIC if the page has records that are not published, 0 after they are published */
+	uint16_t magic;
+	/** Number of records in the page */
+	uint16_t records;
+	/** Sequence number of the page, increases with each new page */
+	uint32_t seq;
+};
+
+/** Header of a record in the log, followed by the FiFo entry */
+struct log_record_s
+{
+	/** Size of the FiFo entry */
+	uint16_t len;
+	/** CRC16 over the size and the FiFo entry */
+	uint16_t crc;
+};
+#pragma pack(pop)
+
+bool flash_log_init(uint8_t size_kb);
+bool flash_log_append(rx_entry_s *entry, uint8_t *payload, uint16_t payload_size);
+uint16_t flash_log_read(uint8_t *fifo_entry);
+bool flash_log_empty(void);
+void flash_log_dequeued(void);
+void flash_log_flush(void *);
+uint32_t flash_log_stored(void);
+uint32_t flash_log_dropped(void);
+
+#endif // FLASH_LOG_H
@@ -0,0 +1,319 @@
+/**
+ * @file esp_at_emu.cpp
+ * @author Bernd Giesecke (bernd@giesecke.tk)
+ * @brief ESP8684 AT firmware emulator for the host tools
+ * 		Emulates the UART to the ESP8684 on a virtual time base:
+ * 		- bytes are on the wire for 10 bit times (8N1) in both directions
+ * 		- the RX buffer of the ESP8684 has a fixed size and is emptied by the AT task every tick
+ * 		- the AT task can be blocked periodically to emulate WiFi activity
+ * 		- commands are echoed and answered like the ESP-AT firmware does
+ * 		- the MQTT broker can close the connection
+ * @version 0.1
+ * @date 2026-10-17
+ *
+ * @copyright Copyright (c) 2026
+ *
+ */
+#include <Arduino.h>
+#include <deque>
+#include <string>
+#include "esp_at_emu.h"
+
+/** Settings of the emulated ESP8684 */
+static esp_emu_cfg_s emu_cfg;
+/** Counters of the emulated ESP8684 */
+static esp_emu_stats_s emu_stats;
+/** Virtual time in ns */
+static uint64_t now_ns = 0;
+/** Time of one byte on the wire in ns */
+static uint64_t byte_ns = 0;
+/** Time of the next run of the AT task */
+static uint64_t next_tick_ns = 0;
+
+/** RX buffer of the ESP8684 */
+static std::deque<uint8_t> esp_rx;
+/** Byte sent by the ESP8684 with the time it arrives at the gateway */
+struct esp_out_s
+{
+	uint64_t time;
+	uint8_t value;
+};
+/** Bytes on the way from the ESP8684 to the gateway */
+static std::deque<esp_out_s> esp_tx;
+/** Time the TX of the ESP8684 is free again */
+static uint64_t esp_tx_free_ns = 0;
+
+/** Command line collected by the AT task */
+static std::string at_line;
+/** Payload bytes the ESP8684 still expects after AT+MQTTPUBRAW */
+static uint32_t raw_left = 0;
+/** Flag if the MQTT broker closed the connection */
+static bool broker_down = false;
+
+/**
+ * @brief Send a response from the ESP8684 to the gateway
+ *
+ * @param response text to send
+ * @param start_ns time the ESP8684 starts sending
+ */
+static void esp_send(const char *response, uint64_t start_ns)
+{
+	uint64_t time = start_ns > esp_tx_free_ns ? start_ns : esp_tx_free_ns;
+	for (size_t idx = 0; idx < strlen(response); idx++)
+	{
+		time += byte_ns;
+		esp_tx.push_back({time, (uint8_t)response[idx]});
+	}
+	esp_tx_free_ns = time;
+}
+
+/**
+ * @brief Handle a complete command line
+ *
+ */
+static void esp_command(void)
+{
+	if (at_line.empty())
+	{
+		return;
+	}
+	if (emu_cfg.echo)
+	{
+		esp_send((at_line + "\r\n").c_str(), now_ns);
+	}
+	uint64_t broker_ns = now_ns + (uint64_t)emu_cfg.broker_ms * 1000000;
+
+	if ((at_line == "AT") || (at_line == "ATE0") || (at_line == "ATE1"))
+	{
+		emu_cfg.echo = at_line != "ATE0";
+		esp_send("\r\nOK\r\n", now_ns);
+	}
+	else if (broker_down && (at_line.rfind("AT+MQTTPUB", 0) == 0))
+	{
+		esp_send("\r\nERROR\r\n", now_ns);
+	}
+	else if (at_line.rfind("AT+MQTTPUBRAW=", 0) == 0)
+	{
+		// AT+MQTTPUBRAW=<LinkID>,"<topic>",<length>,<qos>,<retain>
+		size_t topic_end = at_line.find('"', at_line.find('"') + 1);
+		if (topic_end == std::string::npos)
+		{
+			esp_send("\r\nERROR\r\n", now_ns);
+			return;
+		}
+		raw_left = atoi(at_line.c_str() + topic_end + 2);
+		esp_send("\r\nOK\r\n\r\n>", now_ns);
+	}
+	else if (at_line.rfind("AT+MQTTPUB=", 0) == 0)
+	{
+		emu_stats.published++;
+		esp_send("\r\nOK\r\n", broker_ns);
+	}
+	else if (at_line.rfind("AT+MQTTCONN=", 0) == 0)
+	{
+		broker_down = false;
+		esp_send("+MQTTCONNECTED:0,1,\"127.0.0.1\",\"1883\",\"\",0\r\n\r\nOK\r\n", broker_ns);
+	}
+	else if (at_line.rfind("AT+CWJAP=", 0) == 0)
+	{
+		esp_send("WIFI CONNECTED\r\nWIFI GOT IP\r\n\r\nOK\r\n", now_ns + (uint64_t)emu_cfg.wifi_ms * 1000000);
+	}
+	else if (at_line.rfind("AT+", 0) == 0)
+	{
+		esp_send("\r\nOK\r\n", now_ns);
+	}
+	else
+	{
+		esp_send("\r\nERROR\r\n", now_ns);
+	}
+}
+
+/**
+ * @brief AT task of the ESP8684, empties the RX buffer
+ *
+ */
+static void esp_at_task(void)
+{
+	if (emu_cfg.stall_ms != 0)
+	{
+		uint64_t now_ms = now_ns / 1000000;
+		if ((now_ms % emu_cfg.stall_every_ms) < emu_cfg.stall_ms)
+		{
+			// Blocked by WiFi activity
+			return;
+		}
+	}
+	while (!esp_rx.empty())
+	{
+		uint8_t value = esp_rx.front();
+		esp_rx.pop_front();
+		if (raw_left != 0)
+		{
+			if (emu_stats.raw_bytes == 0)
+			{
+				emu_stats.raw_first_ns = now_ns;
+			}
+			emu_stats.raw_bytes++;
+			emu_stats.raw_last_ns = now_ns;
+			raw_left--;
+			if ((raw_left == 0) && !broker_down)
+			{
+				emu_stats.published++;
+				esp_send("\r\n+MQTTPUB:OK\r\n", now_ns + (uint64_t)emu_cfg.broker_ms * 1000000);
+			}
+			continue;
+		}
+		if (value == '\n')
+		{
+			esp_command();
+			at_line.clear();
+		}
+		else if (value != '\r')
+		{
+			at_line += (char)value;
+		}
+	}
+}
+
+/**
+ * @brief Reset the emulator and the virtual time
+ *
+ * @param cfg settings of the emulated ESP8684
+ */
+void esp_emu_reset(esp_emu_cfg_s &cfg)
+{
+	emu_cfg = cfg;
+	memset(&emu_stats, 0, sizeof(emu_stats));
+	now_ns = 0;
+	byte_ns = 10ULL * 1000000000ULL / cfg.baud;
+	next_tick_ns = (uint64_t)cfg.tick_ms * 1000000;
+	esp_rx.clear();
+	esp_tx.clear();
+	esp_tx_free_ns = 0;
+	at_line.clear();
+	raw_left = 0;
+	broker_down = false;
+}
+
+/**
+ * @brief The MQTT broker closes the connection
+ * 		The ESP8684 sends +MQTTDISCONNECTED, a running publish is not confirmed anymore
+ *
+ */
+void esp_emu_disconnect(void)
+{
+	broker_down = true;
+	esp_send("+MQTTDISCONNECTED:0\r\n", now_ns);
+}
+
+/**
+ * @brief Advance the virtual time and run the AT task when it is due
+ *
+ * @param ns time to advance in ns
+ */
+void esp_emu_advance(uint64_t ns)
+{
+	uint64_t target = now_ns + ns;
+	while (next_tick_ns <= target)
+	{
+		now_ns = next_tick_ns;
+		esp_at_task();
+		next_tick_ns += (uint64_t)emu_cfg.tick_ms * 1000000;
+	}
+	now_ns = target;
+}
+
+/**
+ * @brief Get the virtual time
+ *
+ * @return uint64_t time in ns
+ */
+uint64_t esp_emu_now_ns(void)
+{
+	return now_ns;
+}
+
+/**
+ * @brief Get the counters of the emulated ESP8684
+ *
+ * @return esp_emu_stats_s& counters
+ */
+esp_emu_stats_s &esp_emu_stats(void)
+{
+	return emu_stats;
+}
+
+// UART of the gateway, writes block until the byte is on the wire
+void HostUart::begin(unsigned long baud) {}
+
+size_t HostUart::write(uint8_t value)
+{
+	esp_emu_advance(byte_ns);
+	if (esp_rx.size() >= emu_cfg.rx_buffer)
+	{
+		emu_stats.lost++;
+		return 1;
+	}
+	esp_rx.push_back(value);
+	if (esp_rx.size() > emu_stats.max_fill)
+	{
+		emu_stats.max_fill = esp_rx.size();
+	}
+	return 1;
+}
+
+size_t HostUart::write(const uint8_t *buffer, size_t size)
+{
+	for (size_t idx = 0; idx < size; idx++)
+	{
+		write(buffer[idx]);
+	}
+	return size;
+}
+
+int HostUart::printf(const char *format, ...)
+{
+	char buffer[1024];
+	va_list args;
+	va_start(args, format);
+	vsnprintf(buffer, sizeof(buffer), format, args);
+	va_end(args);
+	return print(buffer);
+}
+
+size_t HostUart::print(const char *str)
+{
+	return write((const uint8_t *)str, strlen(str));
+}
+
+size_t HostUart::println(const char *str)
+{
+	return print(str) + print("\r\n");
+}
+
+int HostUart::available(void)
+{
+	int count = 0;
+	for (esp_out_s &out : esp_tx)
+	{
+		if (out.time > now_ns)
+		{
+			break;
+		}
+		count++;
+	}
+	return count;
+}
+
+int HostUart::read(void)
+{
+	if (esp_tx.empty() || (esp_tx.front().time > now_ns))
+	{
+		return -1;
+	}
+	uint8_t value = esp_tx.front().value;
+	esp_tx.pop_front();
+	return value;
+}
+
+void HostUart::flush(void) {}
@@ -0,0 +1,58 @@
+/**
+ * @file esp_at_emu.h
+ * @author Bernd Giesecke (bernd@giesecke.tk)
+ * @brief ESP8684 AT firmware emulator for the host tools
+ * @version 0.1
+ * @date 2026-10-17
+ *
+ * @copyright Copyright (c) 2026
+ *
+ */
+#ifndef ESP_AT_EMU_H
+#define ESP_AT_EMU_H
+
+#include <stdint.h>
+
+/** Settings of the emulated ESP8684 */
+struct esp_emu_cfg_s
+{
+	/** Baud rate of the UART, 8N1 */
+	uint32_t baud = 115200;
+	/** Size of the UART RX buffer of the ESP8684, bytes that arrive while it is full are lost */
+	uint32_t rx_buffer = 128;
+	/** The AT task empties the RX buffer every tick_ms */
+	uint32_t tick_ms = 10;
+	/** Every stall_every_ms the AT task is blocked for stall_ms (WiFi activity) */
+	uint32_t stall_ms = 0;
+	uint32_t stall_every_ms = 1000;
+	/** Time until the MQTT broker confirms a publish or a connection */
+	uint32_t broker_ms = 30;
+	/** Time until the ESP8684 is connected to the WiFi AP */
+	uint32_t wifi_ms = 2000;
+	/** ESP8684 echoes the commands (ATE1) */
+	bool echo = true;
+};
+
+/** Counters of the emulated ESP8684 */
+struct esp_emu_stats_s
+{
+	/** Bytes lost because the RX buffer was full */
+	uint32_t lost;
+	/** Highest fill level of the RX buffer */
+	uint32_t max_fill;
+	/** Payload bytes received after AT+MQTTPUBRAW */
+	uint32_t raw_bytes;
+	/** Time the first and the last payload byte arrived in ns */
+	uint64_t raw_first_ns;
+	uint64_t raw_last_ns;
+	/** Published messages */
+	uint32_t published;
+};
+
+void esp_emu_reset(esp_emu_cfg_s &cfg);
+void esp_emu_advance(uint64_t ns);
+void esp_emu_disconnect(void);
+uint64_t esp_emu_now_ns(void);
+esp_emu_stats_s &esp_emu_stats(void);
+
+#endif // ESP_AT_EMU_H
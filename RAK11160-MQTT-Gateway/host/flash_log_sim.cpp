@@ -0,0 +1,296 @@
+/**
+ * @file flash_log_sim.cpp
+ * @author Bernd Giesecke (bernd@giesecke.tk)
+ * @brief Host simulation of the flash log in flash_log.cpp during a broker outage
+ * @version 0.1
+ * @date 2026-10-17
+ *
+ * @copyright Copyright (c) 2026
+ *
+ */
+#include "app.h"
+
+// Globals that are normally provided by the application
+bool has_wifi_conn = false;
+bool has_mqtt_conn = false;
+volatile bool wifi_sending = false;
+volatile bool batch_waiting = false;
+int pub_entries = 0;
+custom_param_s custom_parameters;
+ArrayQueue Fifo;
+bool mesh_sink_rx(rui_lora_p2p_recv_t *data) { return false; }
+void mesh_sink_tx_done(void) {}
+
+/** Virtual time in ms */
+static uint32_t now_ms = 0;
+
+// Host versions of the Arduino and RUI3 functions
+HostApi api;
+HostSerial Serial;
+unsigned long millis(void) { return now_ms; }
+void delay(unsigned long ms) { now_ms += ms; }
+void pinMode(uint8_t pin, uint8_t mode) {}
+void digitalWrite(uint8_t pin, uint8_t val) {}
+int digitalRead(uint8_t pin) { return 0; }
+int analogRead(uint8_t pin) { return 0; }
+long random(long min, long max) { return min + (rand() % (max - min)); }
+void randomSeed(unsigned long seed) { srand(seed); }
+int HostSerial::printf(const char *format, ...) { return 0; }
+size_t HostSerial::print(const char *str) { return 0; }
+size_t HostSerial::println(const char *str) { return 0; }
+size_t HostSerial::write(uint8_t value) { return 0; }
+
+/** RUI3 timers, only the flush timer of the log is used */
+static RAK_TIMER_HANDLER timer_handler[RAK_TIMER_ID_MAX];
+static uint32_t timer_due[RAK_TIMER_ID_MAX];
+static bool timer_running[RAK_TIMER_ID_MAX];
+
+bool HostApi::system::timer::create(RAK_TIMER_ID id, RAK_TIMER_HANDLER handler, RAK_TIMER_MODE mode)
+{
+	timer_handler[id] = handler;
+	return true;
+}
+bool HostApi::system::timer::start(RAK_TIMER_ID id, uint32_t ms, void *data)
+{
+	timer_due[id] = now_ms + ms;
+	timer_running[id] = true;
+	return true;
+}
+bool HostApi::system::timer::stop(RAK_TIMER_ID id)
+{
+	timer_running[id] = false;
+	return true;
+}
+
+/** Size of the user flash */
+static uint32_t flash_size = FLASH_LOG_OFFSET + FLASH_LOG_SIZE;
+/** Content of the user flash */
+static uint8_t flash_mem[0x40000];
+/** Erase count of each flash page, RUI3 erases each page that is written */
+static uint32_t flash_erases[0x40000 / FLASH_LOG_PAGE];
+/** Write calls */
+static uint32_t flash_writes = 0;
+
+bool HostApi::system::flash::get(uint32_t offset, uint8_t *buf, uint32_t len)
+{
+	if ((offset + len) > flash_size)
+	{
+		return false;
+	}
+	memcpy(buf, &flash_mem[offset], len);
+	return true;
+}
+bool HostApi::system::flash::set(uint32_t offset, uint8_t *buf, uint32_t len)
+{
+	if ((offset + len) > flash_size)
+	{
+		return false;
+	}
+	memcpy(&flash_mem[offset], buf, len);
+	for (uint32_t page = offset / FLASH_LOG_PAGE; page <= (offset + len - 1) / FLASH_LOG_PAGE; page++)
+	{
+		flash_erases[page]++;
+	}
+	flash_writes++;
+	return true;
+}
+
+/**
+ * @brief Advance the virtual time and call the timers that are due
+ *
+ * @param ms time to advance
+ */
+static void advance(uint32_t ms)
+{
+	now_ms += ms;
+	for (int id = 0; id < RAK_TIMER_ID_MAX; id++)
+	{
+		if (timer_running[id] && (timer_due[id] <= now_ms))
+		{
+			timer_running[id] = false;
+			if ((id == RAK_TIMER_4) && (timer_handler[id] != NULL))
+			{
+				timer_handler[id](NULL);
+			}
+		}
+	}
+}
+
+/** Sequence number of the next received packet */
+static uint32_t rx_seq = 0;
+/** Sequence number expected next at the broker */
+static uint32_t expected_seq = 0;
+/** Packets received by the broker, missing and in the wrong order or twice */
+static uint32_t published = 0;
+static uint32_t missing = 0;
+static uint32_t out_of_order = 0;
+/** Payload size of the packets */
+static uint16_t payload_size = 40;
+
+/**
+ * @brief Receive a LoRa P2P packet with the next sequence number
+ *
+ */
+static void receive(void)
+{
+	uint8_t payload[255];
+	memset(payload, 0x55, sizeof(payload));
+	memcpy(payload, &rx_seq, sizeof(rx_seq));
+	rx_seq++;
+	rui_lora_p2p_recv_t data;
+	data.Buffer = payload;
+	data.BufferSize = payload_size;
+	data.Rssi = -80;
+	data.Snr = 8;
+	recv_cb(data);
+}
+
+/**
+ * @brief Publish up to max_entries FiFo entries like queue_publish() and publish_done() and check their order
+ *
+ * @param max_entries entries per message
+ */
+static void publish(int max_entries)
+{
+	while (!flash_log_empty() && (Fifo.getSize() < MAX_QUEUE_SIZE - 1))
+	{
+		uint8_t fifo_entry[MAX_QUEUE_PAYLOAD];
+		uint16_t entry_size = flash_log_read(fifo_entry);
+		if (entry_size == 0)
+		{
+			break;
+		}
+		Fifo.enQueue(fifo_entry, entry_size);
+	}
+	for (int idx = 0; (idx < max_entries) && !Fifo.isEmpty(); idx++)
+	{
+		uint32_t seq;
+		memcpy(&seq, &Fifo.peekPayload(0)[RX_ENTRY_HEADER_SIZE], sizeof(seq));
+		if (seq < expected_seq)
+		{
+			out_of_order++;
+		}
+		else
+		{
+			missing += seq - expected_seq;
+			expected_seq = seq + 1;
+		}
+		published++;
+		Fifo.deQueue();
+		flash_log_dequeued();
+	}
+}
+
+/**
+ * @brief Print the command line options
+ *
+ */
+static void usage(void)
+{
+	printf("flash_log_sim [--packets N] [--interval MS] [--size B] [--kb KB] [--flash B] [--batch N] [--restart]\n");
+}
+
+int main(int argc, char **argv)
+{
+	uint32_t packets = 300;
+	uint32_t interval = 10000;
+	int batch = 10;
+	bool restart = false;
+	custom_parameters.store_kb = FLASH_LOG_SIZE / 1024;
+	for (int idx = 1; idx < argc; idx++)
+	{
+		bool has_value = idx + 1 < argc;
+		if ((strcmp(argv[idx], "--packets") == 0) && has_value)
+		{
+			packets = atoi(argv[++idx]);
+		}
+		else if ((strcmp(argv[idx], "--interval") == 0) && has_value)
+		{
+			interval = atoi(argv[++idx]);
+		}
+		else if ((strcmp(argv[idx], "--size") == 0) && has_value)
+		{
+			payload_size = atoi(argv[++idx]);
+		}
+		else if ((strcmp(argv[idx], "--kb") == 0) && has_value)
+		{
+			custom_parameters.store_kb = atoi(argv[++idx]);
+		}
+		else if ((strcmp(argv[idx], "--flash") == 0) && has_value)
+		{
+			flash_size = atoi(argv[++idx]);
+		}
+		else if ((strcmp(argv[idx], "--batch") == 0) && has_value)
+		{
+			batch = atoi(argv[++idx]);
+		}
+		else if (strcmp(argv[idx], "--restart") == 0)
+		{
+			restart = true;
+		}
+		else
+		{
+			usage();
+			return 1;
+		}
+	}
+	if ((flash_size > sizeof(flash_mem)) || (payload_size < sizeof(uint32_t)) || (payload_size > 255) || (batch < 1))
+	{
+		usage();
+		return 1;
+	}
+	memset(flash_mem, 0xFF, sizeof(flash_mem));
+
+	bool log_on = flash_log_init(custom_parameters.store_kb);
+	printf("Flash log %s, %u kByte, %u bytes user flash, %u packets of %u bytes every %u ms during the outage%s\n\n",
+		   log_on ? "on" : "off", custom_parameters.store_kb, flash_size, packets, payload_size, interval,
+		   restart ? ", restart in the middle of the outage" : "");
+
+	// Outage, all packets go to the log
+	for (uint32_t idx = 0; idx < packets; idx++)
+	{
+		receive();
+		advance(interval);
+		if (restart && (idx == packets / 2))
+		{
+			// Records in the page buffer that are not flushed are lost
+			memset(timer_running, 0, sizeof(timer_running));
+			flash_log_init(custom_parameters.store_kb);
+		}
+	}
+	uint32_t stored = flash_log_stored();
+
+	// Connection is back, new packets arrive during the replay
+	has_wifi_conn = has_mqtt_conn = true;
+	uint32_t replay_rounds = 0;
+	while (!flash_log_empty() || !Fifo.isEmpty())
+	{
+		publish(batch);
+		replay_rounds++;
+		if ((replay_rounds % 4) == 0)
+		{
+			receive();
+		}
+		advance(100);
+	}
+	// Live traffic after the log is empty goes through the FiFo
+	for (int idx = 0; idx < 5; idx++)
+	{
+		receive();
+		publish(batch);
+	}
+
+	uint32_t max_erases = 0;
+	uint32_t total_erases = 0;
+	for (uint32_t page = FLASH_LOG_OFFSET / FLASH_LOG_PAGE; page < flash_size / FLASH_LOG_PAGE; page++)
+	{
+		total_erases += flash_erases[page];
+		max_erases = flash_erases[page] > max_erases ? flash_erases[page] : max_erases;
+	}
+	printf("Received %u, stored at the reconnect %u, dropped by the log %u\n", rx_seq, stored, flash_log_dropped());
+	printf("Published %u, missing %u, wrong order or twice %u, in %u rounds of %d\n", published, missing, out_of_order, replay_rounds, batch);
+	printf("Flash writes %u, page erases %u, max erases of one page %u, %.2f erases per received packet\n",
+		   flash_writes, total_erases, max_erases, (double)total_erases / rx_seq);
+	printf("Log pages cleared: %s\n", flash_log_stored() == 0 && flash_log_empty() ? "yes" : "no");
+	return 0;
+}
@@ -0,0 +1,422 @@
+/**
+ * @file publish_bench.cpp
+ * @author Bernd Giesecke (bernd@giesecke.tk)
+ * @brief Host benchmark for the connection, publish_raw_msg() in wifi.cpp and the batch mode of queue_publish()
+ * 		against the ESP8684 AT emulator
+ * @version 0.1
+ * @date 2026-10-17
+ *
+ * @copyright Copyright (c) 2026
+ *
+ */
+#include "app.h"
+#include "esp_at_emu.h"
+#include <chrono>
+
+// Settings and functions that are normally provided by custom_at.cpp and mesh_sink.cpp
+custom_param_s custom_parameters;
+bool init_wifi_at(void) { return true; }
+bool init_sink_at(void) { return true; }
+bool init_batch_at(void) { return true; }
+bool init_store_at(void) { return true; }
+bool get_at_setting(void) { return true; }
+void init_mesh_sink(void) {}
+bool mesh_sink_rx(rui_lora_p2p_recv_t *data) { return false; }
+void mesh_sink_tx_done(void) {}
+
+// Host versions of the Arduino and RUI3 functions, the time base is the virtual time of the emulator
+HostApi api;
+HostSerial Serial;
+HostUart Serial1;
+unsigned long millis(void) { return esp_emu_now_ns() / 1000000; }
+void delay(unsigned long ms) { esp_emu_advance((uint64_t)ms * 1000000); }
+void pinMode(uint8_t pin, uint8_t mode) {}
+/** Pin states, only for the LED toggling */
+static uint8_t pins[32];
+void digitalWrite(uint8_t pin, uint8_t val) { pins[pin & 31] = val; }
+int digitalRead(uint8_t pin) { return pins[pin & 31]; }
+int analogRead(uint8_t pin) { return 0; }
+long random(long min, long max) { return min + (rand() % (max - min)); }
+void randomSeed(unsigned long seed) { srand(seed); }
+int HostSerial::printf(const char *format, ...) { return 0; }
+size_t HostSerial::print(const char *str) { return 0; }
+size_t HostSerial::println(const char *str) { return 0; }
+size_t HostSerial::write(uint8_t value) { return 0; }
+/** The flash log is not used, the broker is always reachable */
+bool HostApi::system::flash::get(uint32_t offset, uint8_t *buf, uint32_t len) { return false; }
+bool HostApi::system::flash::set(uint32_t offset, uint8_t *buf, uint32_t len) { return false; }
+
+/** RUI3 timer */
+struct host_timer_s
+{
+	RAK_TIMER_HANDLER handler;
+	RAK_TIMER_MODE mode;
+	uint64_t period_ns;
+	uint64_t due_ns;
+	bool running;
+};
+static host_timer_s timers[RAK_TIMER_ID_MAX];
+/** Longest time the code spent in one timer callback in ns */
+static uint64_t max_blocked_ns = 0;
+
+bool HostApi::system::timer::create(RAK_TIMER_ID id, RAK_TIMER_HANDLER handler, RAK_TIMER_MODE mode)
+{
+	timers[id].handler = handler;
+	timers[id].mode = mode;
+	timers[id].running = false;
+	return true;
+}
+bool HostApi::system::timer::start(RAK_TIMER_ID id, uint32_t ms, void *data)
+{
+	timers[id].period_ns = (uint64_t)ms * 1000000;
+	timers[id].due_ns = esp_emu_now_ns() + timers[id].period_ns;
+	timers[id].running = true;
+	return true;
+}
+bool HostApi::system::timer::stop(RAK_TIMER_ID id)
+{
+	timers[id].running = false;
+	return true;
+}
+
+/**
+ * @brief Call the timers that are due and measure the time spent in them
+ *
+ */
+static void run_timers(void)
+{
+	for (int id = 0; id < RAK_TIMER_ID_MAX; id++)
+	{
+		host_timer_s *timer = &timers[id];
+		if (!timer->running || (timer->handler == NULL) || (timer->due_ns > esp_emu_now_ns()))
+		{
+			continue;
+		}
+		if (timer->mode == RAK_TIMER_ONESHOT)
+		{
+			timer->running = false;
+		}
+		else
+		{
+			timer->due_ns += timer->period_ns;
+		}
+		uint64_t start = esp_emu_now_ns();
+		timer->handler(NULL);
+		uint64_t blocked = esp_emu_now_ns() - start;
+		if (blocked > max_blocked_ns)
+		{
+			max_blocked_ns = blocked;
+		}
+		if (timer->due_ns < esp_emu_now_ns())
+		{
+			// Callback took longer than the timer period
+			timer->due_ns = esp_emu_now_ns();
+		}
+	}
+}
+
+/**
+ * @brief Run the virtual time until a flag is set
+ *
+ * @param done flag to wait for
+ * @param timeout_ms maximum time
+ * @return true flag is set
+ * @return false timeout
+ */
+static bool run_until(bool &done, uint32_t timeout_ms)
+{
+	uint64_t end = esp_emu_now_ns() + (uint64_t)timeout_ms * 1000000;
+	while (!done && (esp_emu_now_ns() < end))
+	{
+		esp_emu_advance(100000);
+		run_timers();
+	}
+	return done;
+}
+
+/**
+ * @brief Reset the emulator, the timers and the AT client
+ *
+ * @param cfg settings of the emulated ESP8684
+ */
+static void reset(esp_emu_cfg_s &cfg)
+{
+	esp_emu_reset(cfg);
+	memset(timers, 0, sizeof(timers));
+	max_blocked_ns = 0;
+	wifi_sending = false;
+	batch_waiting = false;
+	at_client_init(esp_urc_cb);
+}
+
+/** Flag and result of the finished publishes */
+static bool pub_finished = false;
+static int pub_done_count = 0;
+static int pub_ok_count = 0;
+static int pub_wait_count = 0;
+
+/**
+ * @brief Callback of the publishes
+ *
+ */
+static void bench_publish_done(uint8_t result, void *context)
+{
+	pub_done_count++;
+	if (result == AT_CMD_OK)
+	{
+		pub_ok_count++;
+	}
+	pub_finished = pub_done_count == pub_wait_count;
+}
+
+/** Payload sizes to measure */
+static const size_t sizes[] = {64, 256, 512, 1024, 2048};
+/** Payload buffer */
+static uint8_t payload[2048];
+
+/** Max time in ms a packet waits for more packets in the batch mode benchmark */
+#define BENCH_BATCH_DELAY 5000
+/** Packets per message in the batch mode benchmark, 1 is one message per packet, up to MAX_QUEUE_SIZE - 1 */
+static const uint8_t batch_counts[] = {1, 5, 10, MAX_QUEUE_SIZE - 1};
+
+/** Arrival of the packets in the batch mode benchmark */
+struct arrival_s
+{
+	const char *name;
+	int packets;
+	uint32_t interval_ms;
+};
+/** Burst of 20 sensors that send on the same schedule, and a steady flow of packets */
+static const arrival_s arrivals[] = {{"burst", 20, 100}, {"steady", 60, 1000}};
+
+/** Time each packet in the FiFo was received in ms, the packets are published in this order */
+static uint32_t rx_ms[256];
+
+/**
+ * @brief Receive packets over time through recv_cb(), publish them with the send handler of the gateway
+ * 		and measure the time from the reception until the publish is finished.
+ * 		The flash log is off, packets that find the FiFo full are dropped
+ *
+ * @param cfg settings of the emulated ESP8684
+ * @param arrival packets and their interval
+ * @param batch_count max packets in one message
+ */
+static void run_batch(esp_emu_cfg_s &cfg, const arrival_s &arrival, uint8_t batch_count)
+{
+	reset(cfg);
+	has_wifi_conn = has_mqtt_conn = true;
+	custom_parameters.mesh_sink = 0;
+	custom_parameters.batch_count = batch_count;
+	custom_parameters.batch_size = JSON_BUFF_SIZE;
+	custom_parameters.batch_delay = batch_count > 1 ? BENCH_BATCH_DELAY : 0;
+	api.system.timer.create(RAK_TIMER_0, send_handler, RAK_TIMER_ONESHOT);
+
+	// Cayenne LPP with temperature, humidity and voltage
+	uint8_t lpp[] = {0x01, 103, 0x00, 0xEB, 0x02, 104, 0x64, 0x03, 116, 0x01, 0x5E};
+	int received = 0;
+	int queued = 0;
+	int published = 0;
+	uint64_t total_ms = 0;
+	uint32_t max_ms = 0;
+	uint64_t start = esp_emu_now_ns();
+	uint64_t end = start + (uint64_t)(arrival.packets * arrival.interval_ms + 60000) * 1000000;
+	while (((received < arrival.packets) || (published < queued)) && (esp_emu_now_ns() < end))
+	{
+		if ((received < arrival.packets) && (esp_emu_now_ns() >= start + (uint64_t)received * arrival.interval_ms * 1000000))
+		{
+			lpp[3] = 0xEB + received;
+			rui_lora_p2p_recv_t data;
+			data.Buffer = lpp;
+			data.BufferSize = sizeof(lpp);
+			data.Rssi = -87;
+			data.Snr = 9;
+			received++;
+			int fifo_size = Fifo.getSize();
+			recv_cb(data);
+			if (Fifo.getSize() > fifo_size)
+			{
+				rx_ms[queued++] = millis();
+			}
+		}
+		esp_emu_advance(100000);
+		run_timers();
+		// Entries are removed from the FiFo after their publish is finished
+		for (; published < queued - Fifo.getSize(); published++)
+		{
+			uint32_t latency = millis() - rx_ms[published];
+			total_ms += latency;
+			max_ms = latency > max_ms ? latency : max_ms;
+		}
+	}
+	printf("| %s | %d | %u | %u | %d | %d | %.0f | %u | %.1f | %s |\n", arrival.name, arrival.packets, arrival.interval_ms, batch_count,
+		   esp_emu_stats().published, received - queued, published != 0 ? (double)total_ms / published : 0.0, max_ms,
+		   max_blocked_ns / 1e6, published == queued ? "ok" : "failed");
+}
+
+/**
+ * @brief Print the command line options
+ *
+ */
+static void usage(void)
+{
+	printf("publish_bench [--baud B] [--rxbuf B] [--tick MS] [--stall MS] [--stall-every MS] [--broker MS] [--no-echo]\n");
+}
+
+int main(int argc, char **argv)
+{
+	esp_emu_cfg_s cfg;
+	for (int idx = 1; idx < argc; idx++)
+	{
+		bool has_value = idx + 1 < argc;
+		if ((strcmp(argv[idx], "--baud") == 0) && has_value)
+		{
+			cfg.baud = atoi(argv[++idx]);
+		}
+		else if ((strcmp(argv[idx], "--rxbuf") == 0) && has_value)
+		{
+			cfg.rx_buffer = atoi(argv[++idx]);
+		}
+		else if ((strcmp(argv[idx], "--tick") == 0) && has_value)
+		{
+			cfg.tick_ms = atoi(argv[++idx]);
+		}
+		else if ((strcmp(argv[idx], "--stall") == 0) && has_value)
+		{
+			cfg.stall_ms = atoi(argv[++idx]);
+		}
+		else if ((strcmp(argv[idx], "--stall-every") == 0) && has_value)
+		{
+			cfg.stall_every_ms = atoi(argv[++idx]);
+		}
+		else if ((strcmp(argv[idx], "--broker") == 0) && has_value)
+		{
+			cfg.broker_ms = atoi(argv[++idx]);
+		}
+		else if (strcmp(argv[idx], "--no-echo") == 0)
+		{
+			cfg.echo = false;
+		}
+		else
+		{
+			usage();
+			return 1;
+		}
+	}
+
+	// JSON like payload
+	const char *pattern = "{\"node\":\"4C7A1D0E\",\"rssi\":-87,\"snr\":9,\"temperature\":23.5},";
+	for (size_t idx = 0; idx < sizeof(payload); idx++)
+	{
+		payload[idx] = pattern[idx % strlen(pattern)];
+	}
+
+	printf("ESP8684 emulator: %u baud, RX buffer %u bytes, AT task every %u ms, stall %u ms every %u ms, broker %u ms, echo %s\n\n",
+		   cfg.baud, cfg.rx_buffer, cfg.tick_ms, cfg.stall_ms, cfg.stall_every_ms, cfg.broker_ms, cfg.echo ? "on" : "off");
+
+	// Connection sequence without restart of the ESP8684
+	reset(cfg);
+	bool connected = init_connection(false) && run_until(has_mqtt_conn, 60000);
+	printf("Connection %s after %.1f ms (WiFi join %u ms), longest blocking %.1f ms\n\n", connected ? "done" : "failed",
+		   esp_emu_now_ns() / 1e6, cfg.wifi_ms, max_blocked_ns / 1e6);
+
+	printf("| bytes | publish ms | payload ms | longest blocking ms | max RX fill | lost | result |\n");
+	printf("| ---: | ---: | ---: | ---: | ---: | ---: | --- |\n");
+	for (size_t size : sizes)
+	{
+		reset(cfg);
+		pub_finished = false;
+		pub_done_count = pub_ok_count = 0;
+		pub_wait_count = 1;
+		uint64_t start = esp_emu_now_ns();
+		publish_raw_msg((char *)"Test", payload, size, bench_publish_done);
+		run_until(pub_finished, 120000);
+		uint64_t duration = esp_emu_now_ns() - start;
+		esp_emu_stats_s &stats = esp_emu_stats();
+		printf("| %zu | %.1f | %.1f | %.1f | %u | %u | %s |\n", size, duration / 1e6,
+			   (stats.raw_last_ns - stats.raw_first_ns) / 1e6, max_blocked_ns / 1e6, stats.max_fill, stats.lost,
+			   pub_ok_count == 1 ? "ok" : "failed");
+	}
+
+	// Several publishes queued at once
+	reset(cfg);
+	pub_finished = false;
+	pub_done_count = pub_ok_count = 0;
+	pub_wait_count = AT_QUEUE_SIZE;
+	uint64_t start = esp_emu_now_ns();
+	for (int idx = 0; idx < AT_QUEUE_SIZE; idx++)
+	{
+		publish_raw_msg((char *)"Test", payload, 256, bench_publish_done);
+	}
+	run_until(pub_finished, 600000);
+	uint64_t duration = esp_emu_now_ns() - start;
+	printf("\n%d queued publishes of 256 bytes: %d ok, %.1f ms, %.1f ms per publish, longest blocking %.1f ms\n",
+		   AT_QUEUE_SIZE, pub_ok_count, duration / 1e6, duration / 1e6 / AT_QUEUE_SIZE, max_blocked_ns / 1e6);
+
+	// Packets that arrive over time, one message per packet and batched messages like ATC+WIFIBATCH
+	printf("\nPackets received over time, published by queue_publish(), batch delay %d ms\n\n", BENCH_BATCH_DELAY);
+	printf("| arrival | packets | interval ms | packets per message | messages | dropped | avg latency ms | max latency ms | longest blocking ms | result |\n");
+	printf("| --- | ---: | ---: | ---: | ---: | ---: | ---: | ---: | ---: | --- |\n");
+	for (const arrival_s &arrival : arrivals)
+	{
+		for (uint8_t batch_count : batch_counts)
+		{
+			run_batch(cfg, arrival, batch_count);
+		}
+	}
+
+	// Broker closes the connection during a publish
+	reset(cfg);
+	init_connection(false);
+	run_until(has_mqtt_conn, 60000);
+	pub_finished = false;
+	pub_done_count = pub_ok_count = 0;
+	pub_wait_count = 1;
+	publish_raw_msg((char *)"Test", payload, 1024, bench_publish_done);
+	bool never = false;
+	run_until(never, 100);
+	esp_emu_disconnect();
+	start = esp_emu_now_ns();
+	run_until(pub_finished, 120000);
+	printf("\nBroker disconnect during a publish: publish %s after %.1f ms, MQTT connection %s\n",
+		   pub_ok_count == 1 ? "ok" : "failed", (esp_emu_now_ns() - start) / 1e6, has_mqtt_conn ? "still set" : "lost");
+
+	// Response matching, 1 kByte response with the strstr() of the old wait_ok_response() and with at_match()
+	char response[1024];
+	for (size_t idx = 0; idx < sizeof(response) - 8; idx++)
+	{
+		response[idx] = payload[idx];
+	}
+	strcpy(&response[sizeof(response) - 8], "\r\nOK\r\n");
+	char buffer[1024 + 1];
+	volatile size_t found = 0;
+	auto t_start = std::chrono::steady_clock::now();
+	for (int run = 0; run < 100; run++)
+	{
+		for (size_t idx = 0; idx < sizeof(response); idx++)
+		{
+			buffer[idx] = response[idx];
+			buffer[idx + 1] = 0;
+			if (strstr(buffer, "OK") != NULL)
+			{
+				found++;
+				break;
+			}
+		}
+	}
+	double strstr_ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - t_start).count() / 100 / sizeof(response);
+	t_start = std::chrono::steady_clock::now();
+	for (int run = 0; run < 100; run++)
+	{
+		for (size_t idx = 0; idx < sizeof(response); idx++)
+		{
+			if ((at_match(response[idx]) & AT_TOK_OK) != 0)
+			{
+				found++;
+				break;
+			}
+		}
+	}
+	double match_ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - t_start).count() / 100 / sizeof(response);
+	printf("Matching a 1 kByte response: strstr() %.1f ns/byte, at_match() %.1f ns/byte\n", strstr_ns, match_ns);
+	return 0;
+}
@@ -0,0 +1,199 @@
+/**
+ * @file Arduino.h
+ * @author Bernd Giesecke (bernd@giesecke.tk)
+ * @brief Minimal Arduino/RUI3 definitions to build the gateway sources on a Linux host
+ * @version 0.1
+ * @date 2026-10-17
+ *
+ * @copyright Copyright (c) 2026
+ *
+ */
+#ifndef HOST_ARDUINO_H
+#define HOST_ARDUINO_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <ctype.h>
+#include <stdarg.h>
+
+typedef bool boolean;
+typedef uint8_t byte;
+
+/** Flash strings and interrupt locks are not needed on the host */
+#define F(str) str
+inline void noInterrupts(void) {}
+inline void interrupts(void) {}
+
+/** Minimal Arduino String, for the debug output of the FiFo and the sensor names in parse.cpp */
+class String
+{
+public:
+	String(const char *str = "") { snprintf(text, sizeof(text), "%s", str); }
+	String(int value) { snprintf(text, sizeof(text), "%d", value); }
+	const char *c_str(void) const { return text; }
+	String operator+(const char *right) const
+	{
+		String result(text);
+		strncat(result.text, right, sizeof(result.text) - strlen(result.text) - 1);
+		return result;
+	}
+	String operator+(const String &right) const { return *this + right.text; }
+	friend String operator+(const char *left, const String &right)
+	{
+		String result(left);
+		strncat(result.text, right.text, sizeof(result.text) - strlen(result.text) - 1);
+		return result;
+	}
+
+private:
+	char text[64];
+};
+
+#define HIGH 1
+#define LOW 0
+#define OUTPUT 1
+#define INPUT 0
+
+/** Pins used by the gateway */
+#define PA0 0
+#define PA1 1
+#define PA10 10
+#define WB_A1 20
+
+/** Time base, provided by the host program */
+unsigned long millis(void);
+void delay(unsigned long ms);
+
+// GPIO and random functions, provided by the host program
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t val);
+int digitalRead(uint8_t pin);
+int analogRead(uint8_t pin);
+long random(long min, long max);
+void randomSeed(unsigned long seed);
+
+/** Serial port, output is only shown if the host program enables it */
+class HostSerial
+{
+public:
+	void begin(unsigned long baud) {}
+	int printf(const char *format, ...);
+	size_t print(const char *str);
+	size_t println(const char *str = "");
+	size_t println(const String &str) { return println(str.c_str()); }
+	size_t write(uint8_t value);
+	int available(void) { return 0; }
+	int read(void) { return -1; }
+	void flush(void) {}
+};
+extern HostSerial Serial;
+
+/** UART to the ESP8684, implemented by the host program */
+class HostUart
+{
+public:
+	void begin(unsigned long baud);
+	int printf(const char *format, ...);
+	size_t print(const char *str);
+	size_t println(const char *str = "");
+	size_t write(uint8_t value);
+	size_t write(const uint8_t *buffer, size_t size);
+	int available(void);
+	int read(void);
+	void flush(void);
+};
+extern HostUart Serial1;
+
+/** RUI3 AT command types */
+typedef int SERIAL_PORT;
+typedef struct
+{
+	int argc;
+	char *argv[16];
+} stParam;
+#define AT_OK 0
+#define AT_ERROR 1
+#define AT_PARAM_ERROR 2
+
+/** RUI3 timers */
+typedef enum
+{
+	RAK_TIMER_0 = 0,
+	RAK_TIMER_1,
+	RAK_TIMER_2,
+	RAK_TIMER_3,
+	RAK_TIMER_4,
+	RAK_TIMER_ID_MAX
+} RAK_TIMER_ID;
+typedef enum
+{
+	RAK_TIMER_ONESHOT = 0,
+	RAK_TIMER_PERIODIC = 1
+} RAK_TIMER_MODE;
+typedef void (*RAK_TIMER_HANDLER)(void *);
+
+/** RUI3 LoRa P2P receive structure */
+typedef struct
+{
+	uint8_t *Buffer;
+	uint8_t BufferSize;
+	int16_t Rssi;
+	int8_t Snr;
+} rui_lora_p2p_recv_t;
+
+/** Reduced RUI3 API, the timers and the flash are implemented by the host program */
+class HostApi
+{
+public:
+	/** LoRaWAN and LoRa P2P functions of setup(), the host programs feed the packets directly into recv_cb() */
+	class lorawan
+	{
+	public:
+		class nwm
+		{
+		public:
+			int get(void) { return 0; }
+			bool set(void) { return true; }
+		} nwm;
+	} lorawan;
+	class lora
+	{
+	public:
+		bool registerPRecvCallback(void (*callback)(rui_lora_p2p_recv_t)) { return true; }
+		bool registerPSendCallback(void (*callback)(void)) { return true; }
+		bool precv(uint32_t timeout) { return true; }
+	} lora;
+	class system
+	{
+	public:
+		class firmwareVersion
+		{
+		public:
+			bool set(const char *version) { return true; }
+		} firmwareVersion;
+		class sleep
+		{
+		public:
+			void all(void) {}
+		} sleep;
+		class timer
+		{
+		public:
+			bool create(RAK_TIMER_ID id, RAK_TIMER_HANDLER handler, RAK_TIMER_MODE mode);
+			bool start(RAK_TIMER_ID id, uint32_t ms, void *data);
+			bool stop(RAK_TIMER_ID id);
+		} timer;
+		class flash
+		{
+		public:
+			bool get(uint32_t offset, uint8_t *buf, uint32_t len);
+			bool set(uint32_t offset, uint8_t *buf, uint32_t len);
+		} flash;
+	} system;
+};
+extern HostApi api;
+
+#endif /* HOST_ARDUINO_H */
@@ -0,0 +1,343 @@
+/**
+ * @file ArduinoJson.h
+ * @author Bernd Giesecke (bernd@giesecke.tk)
+ * @brief Small ArduinoJson replacement with the functions used by parse.cpp, to build the gateway sources on a Linux host.
+ * 		The document has no memory pool, overflowed() is always false, the size of a message is limited with measureJson()
+ * @version 0.1
+ * @date 2026-10-17
+ *
+ * @copyright Copyright (c) 2026
+ *
+ */
+#ifndef HOST_ARDUINOJSON_H
+#define HOST_ARDUINOJSON_H
+
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <memory>
+#include <utility>
+#include <type_traits>
+
+/** Value in the JSON tree */
+struct HostJsonNode
+{
+	enum
+	{
+		JSON_NULL,
+		JSON_BOOL,
+		JSON_INT,
+		JSON_UINT,
+		JSON_FLOAT,
+		JSON_STRING,
+		JSON_OBJECT,
+		JSON_ARRAY
+	} kind = JSON_NULL;
+	bool boolean = false;
+	long long integer = 0;
+	unsigned long long uinteger = 0;
+	double real = 0.0;
+	std::string text;
+	std::vector<std::pair<std::string, std::unique_ptr<HostJsonNode>>> members;
+	std::vector<std::unique_ptr<HostJsonNode>> items;
+
+	/**
+	 * @brief Remove the value, the node is null afterwards
+	 *
+	 */
+	void clear(void)
+	{
+		kind = JSON_NULL;
+		text.clear();
+		members.clear();
+		items.clear();
+	}
+
+	/**
+	 * @brief Find a member of an object, the member is added if it does not exist
+	 *
+	 * @param key name of the member
+	 * @return HostJsonNode* value of the member
+	 */
+	HostJsonNode *member(const char *key)
+	{
+		if (kind != JSON_OBJECT)
+		{
+			clear();
+			kind = JSON_OBJECT;
+		}
+		for (auto &entry : members)
+		{
+			if (entry.first == key)
+			{
+				return entry.second.get();
+			}
+		}
+		members.emplace_back(key, std::unique_ptr<HostJsonNode>(new HostJsonNode));
+		return members.back().second.get();
+	}
+
+	/**
+	 * @brief Add an element to an array
+	 *
+	 * @return HostJsonNode* new element
+	 */
+	HostJsonNode *add(void)
+	{
+		if (kind != JSON_ARRAY)
+		{
+			clear();
+			kind = JSON_ARRAY;
+		}
+		items.emplace_back(new HostJsonNode);
+		return items.back().get();
+	}
+
+	/**
+	 * @brief Write the value as JSON string
+	 *
+	 * @param out string the JSON is appended to
+	 */
+	void serialize(std::string &out) const
+	{
+		char number[32];
+		switch (kind)
+		{
+		case JSON_NULL:
+			out += "null";
+			break;
+		case JSON_BOOL:
+			out += boolean ? "true" : "false";
+			break;
+		case JSON_INT:
+			snprintf(number, sizeof(number), "%lld", integer);
+			out += number;
+			break;
+		case JSON_UINT:
+			snprintf(number, sizeof(number), "%llu", uinteger);
+			out += number;
+			break;
+		case JSON_FLOAT:
+			snprintf(number, sizeof(number), "%.9g", real);
+			out += number;
+			break;
+		case JSON_STRING:
+			serialize_string(out, text);
+			break;
+		case JSON_OBJECT:
+			out += '{';
+			for (size_t idx = 0; idx < members.size(); idx++)
+			{
+				out += (idx == 0) ? "" : ",";
+				serialize_string(out, members[idx].first);
+				out += ':';
+				members[idx].second->serialize(out);
+			}
+			out += '}';
+			break;
+		case JSON_ARRAY:
+			out += '[';
+			for (size_t idx = 0; idx < items.size(); idx++)
+			{
+				out += (idx == 0) ? "" : ",";
+				items[idx]->serialize(out);
+			}
+			out += ']';
+			break;
+		}
+	}
+
+	/**
+	 * @brief Write a string with quotes and escaped characters
+	 *
+	 * @param out string the JSON is appended to
+	 * @param value string to write
+	 */
+	static void serialize_string(std::string &out, const std::string &value)
+	{
+		out += '"';
+		for (char c : value)
+		{
+			if ((c == '"') || (c == '\\'))
+			{
+				out += '\\';
+			}
+			out += c;
+		}
+		out += '"';
+	}
+};
+
+/** Reference to a value in the JSON tree, values are set by assignment */
+class JsonVariant
+{
+public:
+	JsonVariant(HostJsonNode *node = NULL) : node(node) {}
+
+	JsonVariant operator[](const char *key) { return JsonVariant(node->member(key)); }
+
+	JsonVariant &operator=(const char *value)
+	{
+		node->clear();
+		node->kind = HostJsonNode::JSON_STRING;
+		node->text = value;
+		return *this;
+	}
+
+	template <typename T>
+	typename std::enable_if<std::is_arithmetic<T>::value, JsonVariant &>::type operator=(T value)
+	{
+		node->clear();
+		if (std::is_same<T, bool>::value)
+		{
+			node->kind = HostJsonNode::JSON_BOOL;
+			node->boolean = value;
+		}
+		else if (std::is_floating_point<T>::value)
+		{
+			node->kind = HostJsonNode::JSON_FLOAT;
+			node->real = value;
+		}
+		else if (std::is_signed<T>::value)
+		{
+			node->kind = HostJsonNode::JSON_INT;
+			node->integer = (long long)value;
+		}
+		else
+		{
+			node->kind = HostJsonNode::JSON_UINT;
+			node->uinteger = (unsigned long long)value;
+		}
+		return *this;
+	}
+
+protected:
+	HostJsonNode *node;
+};
+
+/** Reference to an object in the JSON tree */
+class JsonObject : public JsonVariant
+{
+public:
+	JsonObject(HostJsonNode *node = NULL) : JsonVariant(node) {}
+
+	JsonObject createNestedObject(const char *key)
+	{
+		HostJsonNode *child = node->member(key);
+		child->clear();
+		child->kind = HostJsonNode::JSON_OBJECT;
+		return JsonObject(child);
+	}
+
+	void remove(const char *key)
+	{
+		for (auto entry = node->members.begin(); entry != node->members.end(); entry++)
+		{
+			if (entry->first == key)
+			{
+				node->members.erase(entry);
+				return;
+			}
+		}
+	}
+};
+
+/** Reference to an array in the JSON tree */
+class JsonArray
+{
+public:
+	JsonArray(HostJsonNode *node = NULL) : node(node) {}
+
+	JsonObject createNestedObject(void)
+	{
+		HostJsonNode *child = node->add();
+		child->kind = HostJsonNode::JSON_OBJECT;
+		return JsonObject(child);
+	}
+
+	size_t size(void) const { return node->items.size(); }
+
+	void remove(size_t index)
+	{
+		if (index < node->items.size())
+		{
+			node->items.erase(node->items.begin() + index);
+		}
+	}
+
+private:
+	HostJsonNode *node;
+};
+
+/** JSON document, the capacity N is not used */
+template <size_t N>
+class StaticJsonDocument
+{
+public:
+	void clear(void) { root.clear(); }
+
+	template <typename T>
+	T to(void)
+	{
+		root.clear();
+		root.kind = HostJsonNode::JSON_OBJECT;
+		return T(&root);
+	}
+
+	JsonVariant operator[](const char *key) { return JsonVariant(root.member(key)); }
+
+	JsonArray createNestedArray(const char *key)
+	{
+		HostJsonNode *child = root.member(key);
+		child->clear();
+		child->kind = HostJsonNode::JSON_ARRAY;
+		return JsonArray(child);
+	}
+
+	bool overflowed(void) const { return false; }
+
+	/** Root of the JSON tree */
+	HostJsonNode root;
+};
+
+/**
+ * @brief Size of the JSON string of a document, without the terminating 0
+ *
+ */
+template <size_t N>
+size_t measureJson(const StaticJsonDocument<N> &doc)
+{
+	std::string out;
+	doc.root.serialize(out);
+	return out.size();
+}
+
+/**
+ * @brief Write the JSON string of a document into a buffer, the string is cut at the size of the buffer
+ *
+ * @return size_t bytes written, without the terminating 0
+ */
+template <size_t N>
+size_t serializeJson(const StaticJsonDocument<N> &doc, char *buffer, size_t size)
+{
+	std::string out;
+	doc.root.serialize(out);
+	if (size == 0)
+	{
+		return 0;
+	}
+	size_t len = (out.size() < size) ? out.size() : size - 1;
+	memcpy(buffer, out.c_str(), len);
+	buffer[len] = 0;
+	return len;
+}
+
+template <size_t N, size_t S>
+size_t serializeJson(const StaticJsonDocument<N> &doc, char (&buffer)[S])
+{
+	return serializeJson(doc, buffer, S);
+}
+
+#endif /* HOST_ARDUINOJSON_H */
@@ -17,15 +17,58 @@
  */
 void recv_cb(rui_lora_p2p_recv_t data)
 {
+	// Mesh frames are handled by the sink, the data for the sink is added to the FiFo queue
+	if ((custom_parameters.mesh_sink == 1) && mesh_sink_rx(&data))
+	{
+		return;
+	}
+
+	rx_entry_s entry;
+	entry.type = RX_P2P;
+	entry.hops = 1;
+	entry.rssi = data.Rssi;
+	entry.snr = data.Snr;
+	entry.origin = 0;
+	rx_enqueue(&entry, data.Buffer, data.BufferSize);
+}
+
+/**
+ * @brief Add received data into the FiFo queue and start the send handler.
+ * 		Without connection to the MQTT broker, with a full FiFo or while older data
+ * 		is in the flash log, the data is added to the flash log
+ *
+ * @param entry header of the FiFo entry
+ * @param payload received data
+ * @param payload_size size of the received data
+ * @return true data is queued
+ * @return false FiFo full or flash log off
+ */
+bool rx_enqueue(rx_entry_s *entry, uint8_t *payload, uint16_t payload_size)
+{
+	bool queued = false;
+	entry->rx_time = millis();
 	// Add received data into FiFo Queue
-	if (has_wifi_conn && has_mqtt_conn)
+	if (has_wifi_conn && has_mqtt_conn && flash_log_empty() && (Fifo.getSize() < MAX_QUEUE_SIZE - 1))
 	{
 		MYLOG("RX-P2P-CB", "%d FiFo entries ", Fifo.getSize());
-		if (!Fifo.enQueue(data.Buffer, data.BufferSize))
+		uint8_t fifo_entry[MAX_QUEUE_PAYLOAD];
+		if ((payload_size + RX_ENTRY_HEADER_SIZE) > MAX_QUEUE_PAYLOAD)
+		{
+			payload_size = MAX_QUEUE_PAYLOAD - RX_ENTRY_HEADER_SIZE;
+		}
+		memcpy(fifo_entry, entry, RX_ENTRY_HEADER_SIZE);
+		memcpy(&fifo_entry[RX_ENTRY_HEADER_SIZE], payload, payload_size);
+		if (!Fifo.enQueue(fifo_entry, payload_size + RX_ENTRY_HEADER_SIZE))
 		{
 			MYLOG("RX-P2P-CB", "FiFo full");
-			return;
+			return false;
 		}
+		queued = true;
+	}
+	else
+	{
+		// Sent after the connection is back, in the order the data was received
+		queued = flash_log_append(entry, payload, payload_size);
 	}
 	// MYLOG("RX-P2P-CB", "%d FiFo entries ", Fifo.getSize());
 	if (!wifi_sending)
@@ -35,6 +78,15 @@ void recv_cb(rui_lora_p2p_recv_t data)
 		// Activate send to WiFi function
 		api.system.timer.start(RAK_TIMER_0, 250, NULL);
 	}
+	else if (batch_waiting && (((Fifo.getSize() - pub_entries) >= custom_parameters.batch_count) || (Fifo.getSize() >= MAX_QUEUE_SIZE - 1)))
+	{
+		// Batch is complete or the FiFo is full, do not wait until the batch delay is over
+		MYLOG("RX-P2P-CB", "Batch complete");
+		batch_waiting = false;
+		api.system.timer.stop(RAK_TIMER_0);
+		api.system.timer.start(RAK_TIMER_0, 250, NULL);
+	}
+	return queued;
 }
 
 /**
@@ -45,4 +97,9 @@ void send_cb(void)
 {
 	// MYLOG("TX-P2P-CB", "P2P TX finished");
 	digitalWrite(LED_WIFI, LOW);
+	if (custom_parameters.mesh_sink == 1)
+	{
+		// Next ACK or map message of the sink
+		mesh_sink_tx_done();
+	}
 }
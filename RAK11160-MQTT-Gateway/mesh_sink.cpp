@@ -0,0 +1,633 @@
+/**
+ * @file mesh_sink.cpp
+ * @author Bernd Giesecke (bernd@giesecke.tk)
+ * @brief Mesh sink, the gateway is the master node of a RUI3-Mesh network
+ * @version 0.1
+ * @date 2026-10-17
+ *
+ * @copyright Copyright (c) 2026
+ *
+ */
+#include "app.h"
+
+/** Interval of the map messages of the sink, the nodes keep the sink as neighbour */
+#ifndef SINK_MAP_INTERVAL
+#define SINK_MAP_INTERVAL 300000
+#endif
+/** Max random delay of the map message after a map request, all nodes that got the request answer it */
+#define SINK_MAP_JITTER 1500
+/** Delay of an ACK, the node that sent the packet waits for it */
+#define SINK_ACK_DELAY 10
+/** Delay before a TX is tried again after a busy channel or a busy radio */
+#define SINK_TX_RETRY 100
+/** Number of ACKs that can wait to be sent */
+#define SINK_ACK_NUM 4
+/** Number of packets that are remembered to drop duplicates */
+#define SINK_OLD_PACKETS 16
+/** Number of nodes the sink knows the path metric of */
+#define SINK_ROUTE_NUM 48
+/** Time after which a path metric is not used anymore */
+#define SINK_ROUTE_TIMEOUT 3600000
+
+/** Node address of the sink, the nodes have to use it as master address */
+uint32_t g_sink_addr = 0;
+
+/** Sequence number of the map messages, the nodes use it to estimate the link quality */
+uint8_t sink_map_seq = 0;
+/** Time the next map message is sent, 0 if no map message is pending */
+time_t sink_map_time = 0;
+/** TX of the radio is active */
+volatile bool sink_tx_active = false;
+/** Buffer for the outgoing frame, an ACK or a map message without nodes */
+uint8_t sink_tx_buffer[MAP_HEADER_SIZE + 5];
+
+/** ACK waiting to be sent, the origin and the sequence number identify the packet */
+struct sink_ack_s
+{
+	uint32_t orig;
+	uint8_t seq;
+};
+/** ACKs waiting to be sent */
+sink_ack_s sink_acks[SINK_ACK_NUM];
+/** Number of ACKs waiting to be sent */
+uint8_t sink_ack_count = 0;
+
+/** Origin and sequence number of the last received packets */
+struct sink_old_packet_s
+{
+	uint32_t origin;
+	uint8_t seq;
+};
+/** Last received packets */
+sink_old_packet_s sink_old_packets[SINK_OLD_PACKETS];
+/** Next entry in sink_old_packets to be replaced */
+uint8_t sink_old_idx = 0;
+
+/** Path metric of a node, learned from the maps of the neighbours of the sink */
+struct sink_route_s
+{
+	/** Node address, 0 if the entry is not used */
+	uint32_t node;
+	/** Neighbour that announced the node, 0 if the node is a neighbour */
+	uint32_t via;
+	/** Path metric from the neighbour to the node */
+	uint8_t metric;
+	/** Time the node was announced */
+	time_t seen;
+};
+/** Path metrics of the nodes */
+sink_route_s sink_routes[SINK_ROUTE_NUM];
+
+// Forward declarations
+void sink_tx_handler(void *);
+void sink_map_handler(void *);
+void sink_cad_cb(bool busy);
+
+/**
+ * @brief Initialize the mesh sink
+ * 		Node address from the DevEUI, same as on the mesh nodes
+ *
+ */
+void init_mesh_sink(void)
+{
+	uint8_t deviceMac[8];
+	api.lorawan.deui.get(deviceMac, 8);
+
+	g_sink_addr = (uint32_t)deviceMac[4] << 24;
+	g_sink_addr += (uint32_t)deviceMac[5] << 16;
+	g_sink_addr += (uint32_t)deviceMac[6] << 8;
+	g_sink_addr += (uint32_t)deviceMac[7];
+
+	Serial.printf("Mesh sink address %08lX, set it on the nodes with ATC+MASTER\r\n", g_sink_addr);
+
+	memset(sink_old_packets, 0, sizeof(sink_old_packets));
+	memset(sink_routes, 0, sizeof(sink_routes));
+
+	api.lora.registerPSendCADCallback(sink_cad_cb);
+	api.system.timer.create(RAK_TIMER_1, sink_tx_handler, RAK_TIMER_ONESHOT);
+	api.system.timer.create(RAK_TIMER_2, sink_map_handler, RAK_TIMER_PERIODIC);
+	api.system.timer.start(RAK_TIMER_2, SINK_MAP_INTERVAL, NULL);
+
+	// First map after a random delay, gateways that start together do not collide
+	sink_map_time = millis() + random(0, SINK_MAP_JITTER);
+	api.system.timer.start(RAK_TIMER_1, sink_map_time - millis() + 1, NULL);
+}
+
+/**
+ * @brief Schedule the map message of the sink
+ *
+ * @param delay_ms max delay of the map message
+ */
+static void sink_map_schedule(uint32_t delay_ms)
+{
+	time_t map_time = millis() + random(0, delay_ms + 1);
+	if ((sink_map_time == 0) || ((long)(map_time - sink_map_time) < 0))
+	{
+		sink_map_time = map_time;
+	}
+	if (!sink_tx_active)
+	{
+		api.system.timer.start(RAK_TIMER_1, sink_map_time - millis() + 1, NULL);
+	}
+}
+
+/**
+ * @brief Timer handler for the periodic map message
+ *
+ */
+void sink_map_handler(void *)
+{
+	sink_map_schedule(SINK_MAP_JITTER);
+}
+
+/**
+ * @brief Queue an ACK for a received packet
+ *
+ * @param orig origin of the packet
+ * @param seq sequence number of the packet
+ */
+static void sink_ack(uint32_t orig, uint8_t seq)
+{
+	if (sink_ack_count == SINK_ACK_NUM)
+	{
+		// The node sends the packet again
+		MYLOG("SINK", "ACK queue full");
+		return;
+	}
+	sink_acks[sink_ack_count].orig = orig;
+	sink_acks[sink_ack_count].seq = seq;
+	sink_ack_count++;
+	if (!sink_tx_active)
+	{
+		api.system.timer.start(RAK_TIMER_1, SINK_ACK_DELAY, NULL);
+	}
+}
+
+/**
+ * @brief Send the next ACK or the map message
+ *
+ */
+void sink_tx_handler(void *)
+{
+	api.system.timer.stop(RAK_TIMER_1);
+	if (sink_tx_active)
+	{
+		return;
+	}
+
+	uint8_t size = 0;
+	if (sink_ack_count != 0)
+	{
+		data_msg_s *ack_msg = (data_msg_s *)sink_tx_buffer;
+		ack_msg->mark1 = 'L';
+		ack_msg->mark2 = 'o';
+		ack_msg->mark3 = 'R';
+		ack_msg->type = LORA_ACK;
+		ack_msg->dest = 0;
+		ack_msg->from = g_sink_addr;
+		ack_msg->orig = sink_acks[0].orig;
+		ack_msg->seq = sink_acks[0].seq;
+		size = DATA_HEADER_SIZE;
+	}
+	else if (sink_map_time != 0)
+	{
+		if ((long)(sink_map_time - millis()) > 0)
+		{
+			api.system.timer.start(RAK_TIMER_1, sink_map_time - millis() + 1, NULL);
+			return;
+		}
+		// Full map without nodes, the sink does not forward packets
+		map_msg_s *map_msg = (map_msg_s *)sink_tx_buffer;
+		map_msg->mark1 = 'L';
+		map_msg->mark2 = 'o';
+		map_msg->mark3 = 'R';
+		map_msg->type = LORA_NODEMAP;
+		// Map version 1, the map of the sink never changes
+		map_msg->dest = 1;
+		map_msg->from = g_sink_addr;
+		map_msg->seq = sink_map_seq + 1;
+		map_msg->nodes[0][0] = 0xAA;
+		map_msg->nodes[0][1] = 0x55;
+		map_msg->nodes[0][2] = 0x00;
+		map_msg->nodes[0][3] = 0xFF;
+		map_msg->nodes[0][4] = 0xAA;
+		size = MAP_HEADER_SIZE + 5;
+	}
+	else
+	{
+		return;
+	}
+
+	sink_tx_active = true;
+	if (!api.lora.psend(size, sink_tx_buffer, true))
+	{
+		sink_tx_active = false;
+		api.system.timer.start(RAK_TIMER_1, SINK_TX_RETRY, NULL);
+	}
+}
+
+/**
+ * @brief TX finished, remove the sent frame and send the next one
+ *
+ */
+void mesh_sink_tx_done(void)
+{
+	if (!sink_tx_active)
+	{
+		return;
+	}
+	sink_tx_active = false;
+	if (sink_tx_buffer[3] == LORA_ACK)
+	{
+		sink_ack_count--;
+		memmove(&sink_acks[0], &sink_acks[1], sink_ack_count * sizeof(sink_ack_s));
+	}
+	else
+	{
+		sink_map_seq++;
+		sink_map_time = 0;
+	}
+	if ((sink_ack_count != 0) || (sink_map_time != 0))
+	{
+		api.system.timer.start(RAK_TIMER_1, SINK_ACK_DELAY, NULL);
+	}
+}
+
+/**
+ * @brief CAD before the TX finished
+ *
+ * @param busy true if the channel is busy, the frame was not sent
+ */
+void sink_cad_cb(bool busy)
+{
+	if (busy && sink_tx_active)
+	{
+		sink_tx_active = false;
+		api.system.timer.start(RAK_TIMER_1, random(SINK_TX_RETRY, 3 * SINK_TX_RETRY), NULL);
+	}
+}
+
+/**
+ * @brief Check if a packet was received already
+ *
+ * @param origin origin of the packet
+ * @param seq sequence number of the packet
+ * @return true if the packet is a duplicate
+ */
+static bool sink_old_packet(uint32_t origin, uint8_t seq)
+{
+	for (int idx = 0; idx < SINK_OLD_PACKETS; idx++)
+	{
+		if ((sink_old_packets[idx].origin == origin) && (sink_old_packets[idx].seq == seq))
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+/**
+ * @brief Remember a packet that was added to the Fifo, later copies of it are duplicates
+ *
+ * @param origin origin of the packet
+ * @param seq sequence number of the packet
+ */
+static void sink_remember_packet(uint32_t origin, uint8_t seq)
+{
+	sink_old_packets[sink_old_idx].origin = origin;
+	sink_old_packets[sink_old_idx].seq = seq;
+	sink_old_idx = (sink_old_idx + 1) % SINK_OLD_PACKETS;
+}
+
+/**
+ * @brief Find the path metric entry of a node
+ *
+ * @param node node address
+ * @return sink_route_s* entry or NULL if the node is not known
+ */
+static sink_route_s *sink_route(uint32_t node)
+{
+	for (int idx = 0; idx < SINK_ROUTE_NUM; idx++)
+	{
+		if (sink_routes[idx].node == node)
+		{
+			if ((millis() - sink_routes[idx].seen) > SINK_ROUTE_TIMEOUT)
+			{
+				sink_routes[idx].node = 0;
+				return NULL;
+			}
+			return &sink_routes[idx];
+		}
+	}
+	return NULL;
+}
+
+/**
+ * @brief Save the path metric of a node, the lowest metric over all neighbours is kept.
+ * 		If the table is full, the oldest entry is replaced
+ *
+ * @param node node address
+ * @param via neighbour that announced the node, 0 if the node is a neighbour
+ * @param metric path metric from the neighbour to the node
+ */
+static void sink_route_update(uint32_t node, uint32_t via, uint8_t metric)
+{
+	if ((node == 0) || (node == g_sink_addr))
+	{
+		return;
+	}
+	sink_route_s *route = sink_route(node);
+	if (route != NULL)
+	{
+		if ((via != 0) && (route->via != via) && ((route->via == 0) || (metric >= route->metric)))
+		{
+			// Known over a better path
+			return;
+		}
+	}
+	else
+	{
+		route = &sink_routes[0];
+		for (int idx = 0; idx < SINK_ROUTE_NUM; idx++)
+		{
+			if (sink_routes[idx].node == 0)
+			{
+				route = &sink_routes[idx];
+				break;
+			}
+			if ((long)(sink_routes[idx].seen - route->seen) < 0)
+			{
+				route = &sink_routes[idx];
+			}
+		}
+	}
+	route->node = node;
+	route->via = via;
+	route->metric = metric;
+	route->seen = millis();
+}
+
+/**
+ * @brief Estimate the hops from a node to the sink
+ * 		The mesh frames have no hop counter. A packet that was sent by its origin has one hop,
+ * 		for a relayed packet the hops are estimated from the path metric in the maps of the neighbours
+ *
+ * @param origin origin of the packet
+ * @param relayed true if the packet was relayed by other nodes
+ * @return uint8_t number of hops, 0 if not known
+ */
+static uint8_t sink_hops(uint32_t origin, bool relayed)
+{
+	if (!relayed)
+	{
+		return 1;
+	}
+	sink_route_s *route = sink_route(origin);
+	if ((route == NULL) || (route->via == 0))
+	{
+		// At least the origin and one relay
+		return 2;
+	}
+	// The path metric is the expected number of transmissions, over good links it is the number of hops
+	uint8_t hops = (route->metric + ROUTE_METRIC_UNIT / 2) / ROUTE_METRIC_UNIT;
+	return 1 + (hops < 1 ? 1 : hops);
+}
+
+/**
+ * @brief Handle the map message of a neighbour, the path metrics of its nodes are saved
+ *
+ * @param map_msg map message
+ * @param size size of the map message
+ */
+static void sink_map_rx(map_msg_s *map_msg, uint8_t size)
+{
+	uint8_t num_subs = (size - MAP_HEADER_SIZE) / 5;
+	if ((num_subs == 0) ||
+		(map_msg->nodes[num_subs - 1][0] != 0xAA) ||
+		(map_msg->nodes[num_subs - 1][1] != 0x55) ||
+		(map_msg->nodes[num_subs - 1][2] != 0x00) ||
+		(map_msg->nodes[num_subs - 1][3] != 0xFF) ||
+		(map_msg->nodes[num_subs - 1][4] != 0xAA))
+	{
+		MYLOG("SINK", "Invalid map from %08lX", map_msg->from);
+		return;
+	}
+	sink_route_update(map_msg->from, 0, 0);
+	if (map_msg->type == LORA_MAP_SUMMARY)
+	{
+		return;
+	}
+	for (int idx = 0; idx < num_subs - 1; idx++)
+	{
+		uint32_t node = (uint32_t)map_msg->nodes[idx][0];
+		node |= (uint32_t)map_msg->nodes[idx][1] << 8;
+		node |= (uint32_t)map_msg->nodes[idx][2] << 16;
+		node |= (uint32_t)map_msg->nodes[idx][3] << 24;
+		if (map_msg->nodes[idx][4] == MAP_ENTRY_REMOVED)
+		{
+			sink_route_s *route = sink_route(node);
+			if ((route != NULL) && (route->via == map_msg->from))
+			{
+				route->node = 0;
+			}
+			continue;
+		}
+		sink_route_update(node, map_msg->from, map_msg->nodes[idx][4]);
+	}
+}
+
+/**
+ * @brief Add data for the sink to the Fifo
+ *
+ * @param data_msg data message, from and orig as on a node that receives it
+ * @param data_size size of the data
+ * @param data received LoRa packet, for RSSI and SNR
+ * @param broadcast true if the data is a broadcast
+ * @return true if the data is queued or is a duplicate
+ * @return false if the data was dropped
+ */
+static bool sink_deliver(data_msg_s *data_msg, uint8_t data_size, rui_lora_p2p_recv_t *data, bool broadcast)
+{
+	uint32_t origin = (data_msg->orig == 0) ? data_msg->from : data_msg->orig;
+	if (sink_old_packet(origin, data_msg->seq))
+	{
+		MYLOG("SINK", "Got an old message from %08lX, dismissing it", origin);
+		return true;
+	}
+	if ((data_msg->type & LORA_FRAG) != 0)
+	{
+		// Payloads larger than one frame are not supported
+		MYLOG("SINK", "Fragment from %08lX dropped", origin);
+		return false;
+	}
+	rx_entry_s entry;
+	entry.type = broadcast ? RX_MESH_BROADCAST : RX_MESH;
+	entry.hops = broadcast ? 0 : sink_hops(origin, data_msg->orig != 0);
+	entry.rssi = data->Rssi;
+	entry.snr = data->Snr;
+	entry.origin = origin;
+	if (entry.hops == 1)
+	{
+		sink_route_update(origin, 0, 0);
+	}
+	MYLOG("SINK", "Data from %08lX, %d hops, %d bytes", origin, entry.hops, data_size);
+	if (!rx_enqueue(&entry, data_msg->data, data_size))
+	{
+		// Not remembered, the sender sends it again without an ACK
+		MYLOG("SINK", "Data from %08lX dropped", origin);
+		return false;
+	}
+	sink_remember_packet(origin, data_msg->seq);
+	return true;
+}
+
+/**
+ * @brief Split an aggregate message for the sink into its data messages
+ *
+ * @param agg_msg aggregate message
+ * @param size size of the aggregate message
+ * @param data received LoRa packet, for RSSI and SNR
+ * @return true if all data messages are queued or are duplicates
+ * @return false if a data message was dropped or the aggregate is invalid
+ */
+static bool sink_aggregate_rx(aggregate_msg_s *agg_msg, uint8_t size, rui_lora_p2p_recv_t *data)
+{
+	bool accepted = true;
+	data_msg_s data_msg;
+	uint16_t pos = AGGREGATE_HEADER_SIZE;
+	uint8_t *packet = (uint8_t *)agg_msg;
+
+	while ((pos + AGGREGATE_SUB_HEADER_SIZE) <= size)
+	{
+		uint8_t *sub = &packet[pos];
+		uint8_t data_size = sub[0];
+		uint8_t type = sub[1] & AGGREGATE_TYPE_MASK;
+		uint16_t sub_size = AGGREGATE_SUB_HEADER_SIZE + data_size;
+		if ((sub[1] & AGGREGATE_HAS_FROM) != 0)
+		{
+			sub_size += 4;
+		}
+		if ((sub[1] & AGGREGATE_HAS_ORIG) != 0)
+		{
+			sub_size += 4;
+		}
+		if (((pos + sub_size) > size) || (data_size > sizeof(data_msg.data)) || ((type != LORA_DIRECT) && (type != LORA_FORWARD)))
+		{
+			MYLOG("SINK", "Invalid aggregate from %08lX", agg_msg->from);
+			return false;
+		}
+		data_msg.type = type;
+		data_msg.from = agg_msg->from;
+		data_msg.orig = 0;
+		data_msg.seq = sub[2];
+		uint8_t sub_pos = AGGREGATE_SUB_HEADER_SIZE;
+		if ((sub[1] & AGGREGATE_HAS_FROM) != 0)
+		{
+			memcpy(&data_msg.from, &sub[sub_pos], 4);
+			sub_pos += 4;
+		}
+		if ((sub[1] & AGGREGATE_HAS_ORIG) != 0)
+		{
+			memcpy(&data_msg.orig, &sub[sub_pos], 4);
+			sub_pos += 4;
+		}
+		memcpy(data_msg.data, &sub[sub_pos], data_size);
+		// A forwarded message is for the sink if the sink is the final destination, the sink does not forward the others
+		if ((type == LORA_DIRECT) || (data_msg.from == g_sink_addr))
+		{
+			accepted = sink_deliver(&data_msg, data_size, data, false) && accepted;
+		}
+		else
+		{
+			accepted = false;
+		}
+		pos += sub_size;
+	}
+	return accepted;
+}
+
+/**
+ * @brief Handle a received mesh frame
+ * 		The sink delivers the data for it and acknowledges it after it is queued, answers map requests and learns the path metrics of the nodes.
+ * 		It does not forward packets for other nodes.
+ *
+ * @param data received LoRa packet
+ * @return true if the packet is a mesh frame
+ * @return false if the packet is not a mesh frame
+ */
+bool mesh_sink_rx(rui_lora_p2p_recv_t *data)
+{
+	if ((data->BufferSize < MAP_HEADER_SIZE) || (data->Buffer[0] != 'L') || (data->Buffer[1] != 'o') || (data->Buffer[2] != 'R'))
+	{
+		return false;
+	}
+	uint8_t size = data->BufferSize;
+	map_msg_s *map_msg = (map_msg_s *)data->Buffer;
+	data_msg_s *data_msg = (data_msg_s *)data->Buffer;
+	uint8_t type = data->Buffer[3] & ~(LORA_ACK_REQ | LORA_FRAG);
+	bool ack_req = (data->Buffer[3] & LORA_ACK_REQ) != 0;
+
+	switch (type)
+	{
+	case LORA_NODEMAP:
+	case LORA_MAP_SUMMARY:
+	case LORA_MAP_DELTA:
+		if (map_msg->from != g_sink_addr)
+		{
+			sink_map_rx(map_msg, size);
+		}
+		break;
+	case LORA_MAP_REQ:
+		// Broadcast of a node that found an unknown node, every node answers with its map
+		if ((size >= DATA_HEADER_SIZE) && (data_msg->from != g_sink_addr))
+		{
+			sink_map_schedule(SINK_MAP_JITTER);
+		}
+		break;
+	case LORA_MAP_SYNC_REQ:
+		if ((size >= DATA_HEADER_SIZE) && (data_msg->dest == g_sink_addr))
+		{
+			MYLOG("SINK", "Map sync request from %08lX", data_msg->from);
+			sink_map_schedule(SINK_MAP_JITTER);
+		}
+		break;
+	case LORA_DIRECT:
+	case LORA_FORWARD:
+		if ((size < DATA_HEADER_SIZE) || (data_msg->dest != g_sink_addr))
+		{
+			// Packet for another node
+			break;
+		}
+		if (((type == LORA_DIRECT) || (data_msg->from == g_sink_addr)) && sink_deliver(data_msg, size - DATA_HEADER_SIZE, data, false) && ack_req)
+		{
+			// Acknowledged after the data is queued, duplicates as well, the sender did not get the first ACK
+			sink_ack((data_msg->orig == 0) ? data_msg->from : data_msg->orig, data_msg->seq);
+		}
+		break;
+	case LORA_BROADCAST:
+		if ((size >= DATA_HEADER_SIZE) && (data_msg->from != g_sink_addr))
+		{
+			sink_deliver(data_msg, size - DATA_HEADER_SIZE, data, true);
+		}
+		break;
+	case LORA_AGGREGATE:
+	{
+		aggregate_msg_s *agg_msg = (aggregate_msg_s *)data->Buffer;
+		if ((size < AGGREGATE_HEADER_SIZE) || (agg_msg->dest != g_sink_addr))
+		{
+			break;
+		}
+		if (sink_aggregate_rx(agg_msg, size, data) && ack_req)
+		{
+			// Aggregates are acknowledged with the node that sent them and the sequence number of the aggregate header,
+			// the same as packet_origin() and packet_seq() of the nodes
+			sink_ack(agg_msg->from, agg_msg->seq);
+		}
+		break;
+	}
+	default:
+		// ACKs are not needed, the sink does not send packets that need an ACK
+		break;
+	}
+	return true;
+}
@@ -0,0 +1,132 @@
+/**
+ * @file mesh_sink.h
+ * @author Bernd Giesecke (bernd@giesecke.tk)
+ * @brief Frame formats of the RUI3-Mesh, used by the mesh sink
+ * @version 0.1
+ * @date 2026-10-17
+ *
+ * @copyright Copyright (c) 2026
+ *
+ */
+#ifndef MESH_SINK_H
+#define MESH_SINK_H
+
+#include <Arduino.h>
+
+// The frame formats must be the same as in RUI3-Mesh/mesh.h
+
+#pragma pack(push, 1)
+/** Map message, list of nodes with their path metric */
+struct map_msg_s
+{
+	uint8_t mark1 = 'L'; // 1
+	uint8_t mark2 = 'o'; // 2
+	uint8_t mark3 = 'R'; // 3
+	uint8_t type = 4;	 // 4
+	uint32_t dest = 0;	 // 5,6,7,8
+	uint32_t from = 0;	 // 9,10,11,12
+	uint8_t seq = 0;	 // 13
+	uint8_t nodes[48][5];
+};
+#pragma pack(pop)
+
+#pragma pack(push, 1)
+/** Data message */
+struct data_msg_s
+{
+	uint8_t mark1 = 'L'; // 1
+	uint8_t mark2 = 'o'; // 2
+	uint8_t mark3 = 'R'; // 3
+	uint8_t type = 0;	 // 4
+	uint32_t dest = 0;	 // 5,6,7,8
+	uint32_t from = 0;	 // 9,10,11,12
+	uint32_t orig = 0;	 // 13,14,15,16
+	uint8_t seq = 0;	 // 17
+	uint8_t data[238];	 // 18
+};
+#pragma pack(pop)
+
+#pragma pack(push, 1)
+/** Aggregate message, several data messages for the same next hop */
+struct aggregate_msg_s
+{
+	uint8_t mark1 = 'L'; // 1
+	uint8_t mark2 = 'o'; // 2
+	uint8_t mark3 = 'R'; // 3
+	uint8_t type = 9;	 // 4
+	uint32_t dest = 0;	 // 5,6,7,8
+	uint32_t from = 0;	 // 9,10,11,12
+	uint8_t seq = 0;	 // 13
+	uint8_t subs[242];	 // 14
+};
+#pragma pack(pop)
+
+/** Size of map message buffer without subnode */
+#define MAP_HEADER_SIZE 13
+/** Size of data message buffer without subnode */
+#define DATA_HEADER_SIZE 17
+/** Size of aggregate message buffer without sub-frames */
+#define AGGREGATE_HEADER_SIZE 13
+/** Size of a sub-frame header in an aggregate message, without the optional addresses */
+#define AGGREGATE_SUB_HEADER_SIZE 3
+/** Sub-frame header flags, the lower 4 bits are the message type */
+#define AGGREGATE_TYPE_MASK 0x0F
+#define AGGREGATE_HAS_FROM 0x10
+#define AGGREGATE_HAS_ORIG 0x20
+
+/** LoRa package types */
+#define LORA_INVALID 0
+#define LORA_DIRECT 1
+#define LORA_FORWARD 2
+#define LORA_BROADCAST 3
+#define LORA_NODEMAP 4
+#define LORA_MAP_REQ 5
+#define LORA_MAP_SUMMARY 6
+#define LORA_MAP_DELTA 7
+#define LORA_MAP_SYNC_REQ 8
+#define LORA_AGGREGATE 9
+#define LORA_ACK 10
+/** Flag in the type of LORA_DIRECT, LORA_FORWARD and LORA_AGGREGATE packets, the next hop has to acknowledge the packet */
+#define LORA_ACK_REQ 0x80
+/** Flag in the type of LORA_DIRECT and LORA_FORWARD packets, the data is a fragment of a large payload */
+#define LORA_FRAG 0x40
+
+/** Path metric of one transmission over a perfect link */
+#define ROUTE_METRIC_UNIT 8
+/** Path metric of a removed node in a map delta */
+#define MAP_ENTRY_REMOVED 0xFF
+
+/** Types of the entries in the Fifo */
+#define RX_P2P 0
+#define RX_MESH 1
+#define RX_MESH_BROADCAST 2
+
+#pragma pack(push, 1)
+/** Header of an entry in the Fifo, followed by the payload */
+struct rx_entry_s
+{
+	/** RX_P2P for a plain LoRa P2P packet, RX_MESH or RX_MESH_BROADCAST for data from the mesh */
+	uint8_t type;
+	/** Hops from the origin to the sink, 0 if not known */
+	uint8_t hops;
+	/** SNR of the frame */
+	int8_t snr;
+	/** RSSI of the frame */
+	int16_t rssi;
+	/** Node address of the origin of mesh data */
+	uint32_t origin;
+	/** millis() when the entry was added to the Fifo */
+	uint32_t rx_time;
+};
+#pragma pack(pop)
+
+/** Size of the Fifo entry header */
+#define RX_ENTRY_HEADER_SIZE sizeof(rx_entry_s)
+
+// Mesh sink functions & variables
+void init_mesh_sink(void);
+bool mesh_sink_rx(rui_lora_p2p_recv_t *data);
+void mesh_sink_tx_done(void);
+extern uint32_t g_sink_addr;
+
+#endif // MESH_SINK_H
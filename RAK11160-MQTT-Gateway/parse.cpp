@@ -11,17 +11,17 @@
 #include "app.h"
 #include <ArduinoJson.h>
 
-#ifndef JSON_BUFF_SIZE
-/** Default JSON buffer size */
-#define JSON_BUFF_SIZE 2048
-#endif
-
 /** JSON document for sending and response */
 StaticJsonDocument<JSON_BUFF_SIZE> note_json;
 
 /** Buffer for serialized JSON response */
 char json_buffer[JSON_BUFF_SIZE];
 
+/** Max number of mesh packets from one origin in one MQTT message */
+#ifndef SINK_BATCH_MAX
+#define SINK_BATCH_MAX 8
+#endif
+
 /** Number of defined sensor types */
 #define NUM_DEFINED_SENSOR_TYPES 38
 
@@ -68,6 +68,30 @@ size_t parse(uint8_t *data, uint16_t data_len)
 	// Clear Json object
 	note_json.clear();
 
+	if (!parse_lpp(note_json.to<JsonObject>(), data, data_len))
+	{
+		return 0;
+	}
+
+	// MYLOG("PARSE", "Finished parsing");
+	size_t packet_size = serializeJson(note_json, json_buffer);
+
+	MYLOG("PARSE", "%d bytes %s\n", packet_size, json_buffer);
+
+	return packet_size;
+}
+
+/**
+ * @brief Parse byte array for data in CayenneLPP format into a JSON object
+ *
+ * @param values JSON object the sensor values are added to
+ * @param data byte array
+ * @param data_len size of byte array
+ * @return true if all sensor values are known
+ * @return false if the data has an unknown sensor type
+ */
+bool parse_lpp(JsonObject values, uint8_t *data, uint16_t data_len)
+{
 	uint16_t byte_idx = 0;
 	uint8_t sens_num = 0;
 	float float_val1 = 0.0;
@@ -99,7 +123,7 @@ size_t parse(uint8_t *data, uint16_t data_len)
 		{
 			// Wrong sensor ID
 			MYLOG("PARSE", "Unknown Sensor %d", data[current_byte_idx]);
-			return 0;
+			return false;
 		}
 		// MYLOG("PARSE", "Found Sensor %d", data[current_byte_idx]);
 		current_byte_idx++;
@@ -113,13 +137,13 @@ size_t parse(uint8_t *data, uint16_t data_len)
 
 			float_val1 = (float)((int16_t)data[current_byte_idx + 1] << 8 | (int16_t)data[current_byte_idx]) / value_divider[sens_idx];
 			current_byte_idx += 2;
-			note_json[(char *)sens_full_name.c_str()]["X"] = float_val1;
+			values[(char *)sens_full_name.c_str()]["X"] = float_val1;
 			float_val2 = (float)((int16_t)data[current_byte_idx + 1] << 8 | (int16_t)data[current_byte_idx]) / value_divider[sens_idx];
 			current_byte_idx += 2;
-			note_json[(char *)sens_full_name.c_str()]["Y"] = float_val2;
+			values[(char *)sens_full_name.c_str()]["Y"] = float_val2;
 			float_val3 = (float)((int16_t)data[current_byte_idx + 1] << 8 | (int16_t)data[current_byte_idx]) / value_divider[sens_idx];
 			current_byte_idx += 2;
-			note_json[(char *)sens_full_name.c_str()]["Z"] = float_val3;
+			values[(char *)sens_full_name.c_str()]["Z"] = float_val3;
 			// MYLOG("PARSE", "x %.4f y %.4f z %.4f", float_val1, float_val2, float_val3);
 			break;
 		case 136:
@@ -128,13 +152,13 @@ size_t parse(uint8_t *data, uint16_t data_len)
 
 			float_val1 = (float)((int16_t)data[current_byte_idx + 2] << 16 | (int16_t)data[current_byte_idx + 1] << 8 | (int16_t)data[current_byte_idx]) / 10000.0;
 			current_byte_idx += 3;
-			note_json[(char *)sens_full_name.c_str()]["Lat"] = float_val1;
+			values[(char *)sens_full_name.c_str()]["Lat"] = float_val1;
 			float_val2 = (float)((int16_t)data[current_byte_idx + 2] << 16 | (int16_t)data[current_byte_idx + 1] << 8 | (int16_t)data[current_byte_idx]) / 10000.0;
 			current_byte_idx += 3;
-			note_json[(char *)sens_full_name.c_str()]["Lng"] = float_val2;
+			values[(char *)sens_full_name.c_str()]["Lng"] = float_val2;
 			float_val3 = (float)((int16_t)data[current_byte_idx + 2] << 16 | (int16_t)data[current_byte_idx + 1] << 8 | (int16_t)data[current_byte_idx]) / 100.0;
 			current_byte_idx += 3;
-			note_json[(char *)sens_full_name.c_str()]["Alt"] = float_val3;
+			values[(char *)sens_full_name.c_str()]["Alt"] = float_val3;
 			// MYLOG("PARSE", "lat %.4f lng %.4f alt %.4f", float_val1, float_val2, float_val3);
 			break;
 		case 137:
@@ -143,13 +167,13 @@ size_t parse(uint8_t *data, uint16_t data_len)
 
 			float_val1 = (float)((int16_t)data[current_byte_idx + 3] << 16 | (int16_t)data[current_byte_idx + 2] << 16 | (int16_t)data[current_byte_idx + 1] << 8 | (int16_t)data[current_byte_idx]) / 1000000.0;
 			current_byte_idx += 4;
-			note_json[(char *)sens_full_name.c_str()]["Lat"] = float_val1;
+			values[(char *)sens_full_name.c_str()]["Lat"] = float_val1;
 			float_val2 = (float)((int16_t)data[current_byte_idx + 3] << 16 | (int16_t)data[current_byte_idx + 2] << 16 | (int16_t)data[current_byte_idx + 1] << 8 | (int16_t)data[current_byte_idx]) / 1000000.0;
 			current_byte_idx += 4;
-			note_json[(char *)sens_full_name.c_str()]["Lng"] = float_val2;
+			values[(char *)sens_full_name.c_str()]["Lng"] = float_val2;
 			float_val3 = (float)((int16_t)data[current_byte_idx + 2] << 16 | (int16_t)data[current_byte_idx + 1] << 8 | (int16_t)data[current_byte_idx]) / 100.0;
 			current_byte_idx += 3;
-			note_json[(char *)sens_full_name.c_str()]["Alt"] = float_val3;
+			values[(char *)sens_full_name.c_str()]["Alt"] = float_val3;
 			// MYLOG("PARSE", "lat %.4f lng %.4f alt %.4f", float_val1, float_val2, float_val3);
 			break;
 		case 135:
@@ -158,13 +182,13 @@ size_t parse(uint8_t *data, uint16_t data_len)
 
 			unsigned_val1 = (int16_t)data[current_byte_idx];
 			current_byte_idx += 4;
-			note_json[(char *)sens_full_name.c_str()]["Red"] = unsigned_val1;
+			values[(char *)sens_full_name.c_str()]["Red"] = unsigned_val1;
 			unsigned_val2 = (int16_t)data[current_byte_idx];
 			current_byte_idx += 4;
-			note_json[(char *)sens_full_name.c_str()]["Green"] = unsigned_val2;
+			values[(char *)sens_full_name.c_str()]["Green"] = unsigned_val2;
 			unsigned_val3 = (int16_t)data[current_byte_idx];
 			current_byte_idx += 3;
-			note_json[(char *)sens_full_name.c_str()]["Blue"] = unsigned_val3;
+			values[(char *)sens_full_name.c_str()]["Blue"] = unsigned_val3;
 			// MYLOG("PARSE", "r %ld g %ld b %ld", unsigned_val1, unsigned_val2, unsigned_val3);
 			break;
 		case 255:
@@ -176,7 +200,7 @@ size_t parse(uint8_t *data, uint16_t data_len)
 				node_id_array[cnt] = data[current_byte_idx];
 				current_byte_idx++;
 			}
-			note_json["node_id"] = unsigned_val1;
+			values["node_id"] = unsigned_val1;
 
 			// MYLOG("PARSE", "Added %s %0X", sens_full_name.c_str(), unsigned_val1);
 
@@ -195,7 +219,7 @@ size_t parse(uint8_t *data, uint16_t data_len)
 			sscanf(rounding, "%f", &float_val1);
 
 			sens_full_name = value_name[sens_idx] + "_" + String(sens_num);
-			note_json[(char *)sens_full_name.c_str()] = float_val1;
+			values[(char *)sens_full_name.c_str()] = float_val1;
 			// MYLOG("PARSE", "Added %s %.2f", sens_full_name.c_str(), float_val1);
 
 			break;
@@ -205,10 +229,147 @@ size_t parse(uint8_t *data, uint16_t data_len)
 		// MYLOG("PARSE", ">>>>><<<<<");
 	}
 
-	// MYLOG("PARSE", "Finished parsing");
-	size_t packet_size = serializeJson(note_json, json_buffer);
+	return true;
+}
 
-	MYLOG("PARSE", "%d bytes %s\n", packet_size, json_buffer);
+/**
+ * @brief Add a FiFo entry with its metadata to a JSON array of packets
+ *
+ * @param packets JSON array the packet is added to
+ * @param idx position of the entry in the FiFo
+ * @param with_origin add the origin address of mesh data
+ */
+static void add_packet(JsonArray packets, int idx, bool with_origin)
+{
+	uint8_t *fifo_entry = Fifo.peekPayload(idx);
+	rx_entry_s *entry = (rx_entry_s *)fifo_entry;
+	uint16_t data_len = Fifo.peekPayloadSize(idx) - RX_ENTRY_HEADER_SIZE;
+	uint8_t *data = &fifo_entry[RX_ENTRY_HEADER_SIZE];
+
+	JsonObject packet = packets.createNestedObject();
+	if (with_origin && (entry->type != RX_P2P))
+	{
+		char orig[12];
+		sprintf(orig, "%08lX", entry->origin);
+		packet["orig"] = orig;
+	}
+	if (entry->hops != 0)
+	{
+		packet["hops"] = entry->hops;
+	}
+	packet["rssi"] = entry->rssi;
+	packet["snr"] = entry->snr;
+	// Time since the packet was received in ms, the gateway has no clock
+	packet["age"] = (uint32_t)(millis() - entry->rx_time);
+	if (entry->type == RX_MESH_BROADCAST)
+	{
+		packet["broadcast"] = true;
+	}
+	if (!parse_lpp(packet.createNestedObject("data"), data, data_len))
+	{
+		// Not Cayenne LPP, send the data as hex string
+		packet.remove("data");
+		char raw[2 * MAX_QUEUE_PAYLOAD + 1];
+		for (int byte_idx = 0; byte_idx < data_len; byte_idx++)
+		{
+			sprintf(&raw[byte_idx * 2], "%02X", data[byte_idx]);
+		}
+		raw[data_len * 2] = 0;
+		packet["raw"] = raw;
+	}
+}
+
+/**
+ * @brief Create one JSON message from the mesh data at a position in the FiFo.
+ * 		Consecutive entries from the same origin are put into one message, up to SINK_BATCH_MAX entries.
+ * 		Returns the JSON string in json_buffer, the entries are not removed from the FiFo
+ *
+ * @param topic char array for the sub topic of the message, the address of the origin
+ * @param num_entries number of FiFo entries in the message
+ * @param start position of the first entry in the FiFo
+ * @return size_t size of the JSON string
+ */
+size_t parse_mesh(char *topic, uint8_t &num_entries, int start)
+{
+	note_json.clear();
+	num_entries = 0;
+
+	rx_entry_s *first = (rx_entry_s *)Fifo.peekPayload(start);
+	if ((first == NULL) || (first->type == RX_P2P))
+	{
+		return 0;
+	}
+	sprintf(topic, "%08lX", first->origin);
+	note_json["orig"] = topic;
+	JsonArray packets = note_json.createNestedArray("packets");
+
+	int queued = Fifo.getSize();
+	for (int idx = start; (idx < queued) && (idx < start + SINK_BATCH_MAX); idx++)
+	{
+		rx_entry_s *entry = (rx_entry_s *)Fifo.peekPayload(idx);
+		if ((entry->type == RX_P2P) || (entry->origin != first->origin))
+		{
+			break;
+		}
+		add_packet(packets, idx, false);
+		if ((note_json.overflowed() || (measureJson(note_json) >= JSON_BUFF_SIZE)) && (num_entries != 0))
+		{
+			// Entry is sent with the next message
+			packets.remove(packets.size() - 1);
+			break;
+		}
+		num_entries++;
+	}
+
+	size_t packet_size = serializeJson(note_json, json_buffer, JSON_BUFF_SIZE);
+
+	MYLOG("PARSE", "%d mesh packets from %s, %d bytes %s\n", num_entries, topic, packet_size, json_buffer);
+
+	return packet_size;
+}
+
+/**
+ * @brief Create one JSON message from the LoRa P2P and mesh data at a position in the FiFo.
+ * 		Consecutive entries are put into one message until max_entries or max_size is reached.
+ * 		Returns the JSON string in json_buffer, the entries are not removed from the FiFo
+ *
+ * @param num_entries number of FiFo entries in the message
+ * @param start position of the first entry in the FiFo
+ * @param max_entries max number of entries in the message
+ * @param max_size max size of the JSON string, at least one entry is added
+ * @return size_t size of the JSON string
+ */
+size_t parse_batch(uint8_t &num_entries, int start, uint8_t max_entries, uint16_t max_size)
+{
+	note_json.clear();
+	num_entries = 0;
+
+	if (max_size > JSON_BUFF_SIZE)
+	{
+		max_size = JSON_BUFF_SIZE;
+	}
+	JsonArray packets = note_json.createNestedArray("packets");
+
+	int queued = Fifo.getSize();
+	for (int idx = start; (idx < queued) && (idx < start + max_entries); idx++)
+	{
+		add_packet(packets, idx, true);
+		if ((note_json.overflowed() || (measureJson(note_json) >= max_size)) && (num_entries != 0))
+		{
+			// Entry is sent with the next message
+			packets.remove(packets.size() - 1);
+			break;
+		}
+		num_entries++;
+	}
+	if (num_entries == 0)
+	{
+		return 0;
+	}
+
+	size_t packet_size = serializeJson(note_json, json_buffer, JSON_BUFF_SIZE);
+
+	MYLOG("PARSE", "%d packets in a batch, %d bytes %s\n", num_entries, packet_size, json_buffer);
 
 	return packet_size;
 }
@@ -10,444 +10,427 @@
  */
 #include "app.h"
 
-/** WiFi communication buffer */
-char esp_com_buff[1024];
+/** Time to wait for the ESP8684 boot in ms */
+#ifndef ESP_BOOT_TIMEOUT
+#define ESP_BOOT_TIMEOUT 30000
+#endif
+
+/** Steps of the connection sequence, each step is one AT command */
+#define CONN_IDLE 0
+#define CONN_RESET 1
+#define CONN_BOOT 2
+#define CONN_MODE 3
+#define CONN_JOIN 4
+#define CONN_RECONN 5
+#define CONN_PROTO 6
+#define CONN_POWER 7
+#define CONN_CLEAN 8
+#define CONN_USER 9
+#define CONN_BROKER 10
+
+/** Active step of the connection sequence */
+static uint8_t conn_step = CONN_IDLE;
+/** Flag if the connection sequence restarts the ESP8684 */
+static bool conn_restart = false;
+/** Start time of the ESP8684 boot */
+static time_t boot_start = 0;
+/** Command buffer */
+static char cmd_buff[AT_CMD_LEN];
 
 // Forward declaration
-void flush_RX(void);
+void connection_cb(uint8_t result, void *context);
+void connection_done(bool success);
 
 /**
- * @brief Initialize WiFi and MQTT connections
+ * @brief Queue the command of the next step of the connection sequence
  *
- * @return true connected
- * @return false no response from ESP8684 or no WiFi connection or no MQTT Broker connection
+ * @param step next step
+ * @param timeout time to wait for the response in ms
+ * @param pin LED that blinks while the command is active
+ * @return true command is queued
+ * @return false AT command queue is full
  */
-bool init_connection(bool restart)
+static bool conn_queue(uint8_t step, time_t timeout, uint8_t pin)
 {
-	if (!init_wifi(restart))
+	conn_step = step;
+	if (!at_client_queue(cmd_buff, AT_TOK_OK, timeout, pin, connection_cb))
 	{
-		MYLOG("WIFI", "Init ESP8684 failed");
+		connection_done(false);
 		return false;
 	}
-	else
+	return true;
+}
+
+/**
+ * @brief Start the WiFi and MQTT connection
+ * 		The connection is done in the background by the AT client,
+ * 		has_wifi_conn and has_mqtt_conn are set when the steps are finished
+ *
+ * @param restart restart the ESP8684 before connecting
+ * @return true connection sequence is started or is running already
+ * @return false connection sequence could not be started
+ */
+bool init_connection(bool restart)
+{
+	if (conn_step != CONN_IDLE)
 	{
-		MYLOG("WIFI", "Init ESP8684 ok");
-		// Initialize WiFi connection
-		has_wifi_conn = connect_wifi();
-		if (!has_wifi_conn)
-		{
-			MYLOG("WIFI", "WiFi connection failed");
-			return false;
-		}
-		else
-		{
-			MYLOG("WIFI", "WiFi connected");
-			// Initialize MQTT Broker connection
-			has_mqtt_conn = connect_mqtt(restart);
-			if (!has_mqtt_conn)
-			{
-				MYLOG("WIFI", "MQTT Broker connection failed");
-				return false;
-			}
-			else
-			{
-				MYLOG("WIFI", "MQTT Broker connected");
-			}
-		}
+		return true;
 	}
-	return true;
+	has_wifi_conn = false;
+	has_mqtt_conn = false;
+	conn_restart = restart;
+
+	// Remove the commands of the old connection
+	at_client_clear();
+	return init_wifi(restart);
 }
 
 /**
  * @brief Initialize ESP8684 connection
  *
- * @return true ESP8684 connected
- * @return false ESP8684 not found
+ * @param restart restart the ESP8684
+ * @return true first command is queued
+ * @return false AT command queue is full
  */
 bool init_wifi(bool restart)
 {
 	// Initialize Serial to ESP8684
-	Serial1.begin(115200);
+	Serial1.begin(ESP_BAUD);
 	pinMode(WB_ESP8684, OUTPUT);
 	if (restart)
 	{
 		digitalWrite(WB_ESP8684, LOW);
-		delay(1000);
+		// Keep the ESP8684 1 second in reset, the command only waits
+		conn_step = CONN_RESET;
+		if (!at_client_queue(NULL, 0, 1000, LED_WIFI, connection_cb))
+		{
+			connection_done(false);
+			return false;
+		}
+		return true;
 	}
 	// Enable ESP8684
 	digitalWrite(WB_ESP8684, HIGH);
 	// Wait for ESP8684 bootup
-	time_t start = millis();
-	while ((millis() - start) < 30000)
-	{
-		Serial1.println("AT");
-		Serial1.flush();
-		/** Expected response ********************
-		AT
-
-		OK
-		*****************************************/
-		if (wait_ok_response(10000, LED_WIFI))
-		{
-			// MYLOG("WIFI", "ESP8684 respond to AT: ==>\n%s\n<==\r\n", esp_com_buff);
-			// MYLOG("WIFI", "ESP8684 found");
-			return true;
-		}
-		delay(500);
-	}
-	digitalWrite(LED_WIFI, LOW);
-
-	// Try to flush the RX buffer in case there is some ESP8684 stuff in it
-	flush_RX();
+	boot_start = millis();
+	snprintf(cmd_buff, AT_CMD_LEN, "AT\r\n");
+	/** Expected response ********************
+	AT
 
-	// if analog input pin 1 is unconnected, random analog
-	// noise will cause the call to randomSeed() to generate
-	// different seed numbers each time the sketch runs.
-	// randomSeed() will then shuffle the random function.
-	randomSeed(analogRead(WB_A1));
-	return false;
+	OK
+	*****************************************/
+	return conn_queue(CONN_BOOT, 1000, LED_WIFI);
 }
 
 /**
  * @brief Connect to WiFi network
  *
- * @return true WiFi connected
- * @return false WiFi connection failed
+ * @return true first command is queued
+ * @return false AT command queue is full
  */
 bool connect_wifi(void)
 {
-	// Try to flush the RX buffer in case there is some ESP8684 stuff in it
-	flush_RX();
-
 	// Set connection mode to Station
-	// Clear send buffer
-	memset(esp_com_buff, 0, 1024);
-	snprintf(esp_com_buff, 511, "AT+CWMODE=1,1\r\n");
-	Serial1.printf("%s", esp_com_buff);
-	Serial1.flush();
+	snprintf(cmd_buff, AT_CMD_LEN, "AT+CWMODE=1,1\r\n");
 	/** Expected response ********************
 	AT+CWMODE=1,1
 
 	OK
 	*****************************************/
-	if (!wait_ok_response(10000, LED_WIFI))
-	{
-		MYLOG("WIFI", "WiFi station mode failed: %s", esp_com_buff);
-		return false;
-	}
-	digitalWrite(LED_WIFI, LOW);
-
-	// Try to flush the RX buffer in case there is some ESP8684 stuff in it
-	flush_RX();
-
-	// Set AP name and password
-	// Clear send buffer
-	memset(esp_com_buff, 0, 1024);
-	snprintf(esp_com_buff, 511, "AT+CWJAP=\"%s\",\"%s\"\r\n", custom_parameters.MQTT_WIFI_APN, custom_parameters.MQTT_WIFI_PW);
-	// MYLOG("WIFI", "Connect with ==>%s<==", esp_com_buff);
-	Serial1.printf("%s", esp_com_buff);
-	Serial1.flush();
-	/** Expected response ********************
-	AT+cwjap="<MQTT_WIFI_APN>","<MQTT_WIFI_PW>"
-	WIFI DISCONNECT
-	WIFI CONNECTED
-	WIFI GOT IP
-
-	OK
-	*****************************************/
-	if (!wait_ok_response(10000, LED_WIFI))
-	{
-		MYLOG("WIFI", "ESP8684 not connected: ==>%s<==\r\n", esp_com_buff);
-		return false;
-	}
-	digitalWrite(LED_WIFI, LOW);
-
-	// Try to flush the RX buffer in case there is some ESP8684 stuff in it
-	flush_RX();
-
-	// Set reconnection configuration (1 second interval, try forever)
-	// Clear send buffer
-	memset(esp_com_buff, 0, 1024);
-	snprintf(esp_com_buff, 511, "AT+CWRECONNCFG=1,0\r\n");
-	Serial1.printf("%s", esp_com_buff);
-	Serial1.flush();
-	/** Expected response ********************
-	+CWRECONNCFG:1,5000>
-
-	OK
-	*****************************************/
-	if (!wait_ok_response(10000, LED_WIFI))
-	{
-		MYLOG("WIFI", "ESP8684 not connected: ==>%s<==\r\n", esp_com_buff);
-		return false;
-	}
-
-	// Check protocol
-	// Clear send buffer
-	memset(esp_com_buff, 0, 1024);
-	snprintf(esp_com_buff, 511, "AT+CWSTAPROTO?\r\n");
-	Serial1.printf("%s", esp_com_buff);
-	Serial1.flush();
-	/** Expected response ********************
-	+RFPOWER:1,5000>
-
-	OK
-	*****************************************/
-	wait_ok_response(10000, LED_WIFI);
-	MYLOG("WIFI", "WiFi protocol: ==>%s<==\r\n", esp_com_buff);
-
-	// Set RF power
-	// Clear send buffer
-	memset(esp_com_buff, 0, 1024);
-	snprintf(esp_com_buff, 511, "AT+RFPOWER=84\r\n");
-	Serial1.printf("%s", esp_com_buff);
-	Serial1.flush();
-	/** Expected response ********************
-	+RFPOWER:1,5000>
-
-	OK
-	*****************************************/
-	if (wait_ok_response(10000, LED_WIFI))
-	{
-		MYLOG("WIFI", "WiFi station RF power set: ==>%s<==\r\n", esp_com_buff);
-		return true;
-	}
-	digitalWrite(LED_WIFI, LOW);
-
-	MYLOG("WIFI", "ESP8684 not connected: ==>%s<==\r\n", esp_com_buff);
-	return false;
+	return conn_queue(CONN_MODE, 10000, LED_WIFI);
 }
 
 /**
  * @brief Connect to MQTT Broker
  *
- * @return true Connection success
- * @return false Connection failed
+ * @param restart clean the MQTT connection first
+ * @return true first command is queued
+ * @return false AT command queue is full
  */
 bool connect_mqtt(bool restart)
 {
 	if (restart)
 	{
-		// Try to flush the RX buffer in case there is some ESP8684 stuff in it
-		flush_RX();
-
-		// Clear send buffer
-		memset(esp_com_buff, 0, 1024);
-		snprintf(esp_com_buff, 511, "AT+MQTTCLEAN=0\r\n");
-		// MYLOG("WIFI", "MQTT Clean with ==>%s<==", esp_com_buff);
-		Serial1.printf("%s", esp_com_buff);
-		Serial1.flush();
+		snprintf(cmd_buff, AT_CMD_LEN, "AT+MQTTCLEAN=0\r\n");
 		/** Expected response ********************
 		AT+MQTTCLEAN=0
 
 		OK
 		*****************************************/
-		if (wait_ok_response(10000, LED_MQTT) == false)
-		{
-			MYLOG("WIFI", "MQTT CLEAN failed: ==>\n%s\n<==\r\n", esp_com_buff);
-		}
-		digitalWrite(LED_MQTT, LOW);
+		return conn_queue(CONN_CLEAN, 10000, LED_MQTT);
 	}
 	// Create random user
 	uint16_t id = random(0, 65535);
 	char mqtt_user[64];
 	sprintf(mqtt_user, "%s%04X", custom_parameters.MQTT_USER, id);
 
-	// Try to flush the RX buffer in case there is some ESP8684 stuff in it
-	flush_RX();
-
-	// Clear send buffer
-	memset(esp_com_buff, 0, 1024);
-	snprintf(esp_com_buff, 511, "AT+MQTTUSERCFG=0,1,\"%s\",\"%s\",\"%s\",0,0,\"\"\r\n",
+	snprintf(cmd_buff, AT_CMD_LEN, "AT+MQTTUSERCFG=0,1,\"%s\",\"%s\",\"%s\",0,0,\"\"\r\n",
 			 mqtt_user, custom_parameters.MQTT_USERNAME, custom_parameters.MQTT_PASSWORD);
-	// MYLOG("WIFI", "MQTT USR setup with ==>%s<==", esp_com_buff);
-	Serial1.printf("%s", esp_com_buff);
-	Serial1.flush();
 	/** Expected response ********************
 	AT+MQTTUSERCFG=0,1,"<MQTT_USER>","<MQTT_USERNAME>","<MQTT_PASSWORD>",0,0,""
 
 	OK
 	*****************************************/
-	if (wait_ok_response(10000, LED_MQTT) == false)
+	return conn_queue(CONN_USER, 10000, LED_MQTT);
+}
+
+/**
+ * @brief Callback of the AT commands of the connection sequence, queues the next step
+ *
+ * @param result result of the finished command
+ * @param context not used
+ */
+void connection_cb(uint8_t result, void *context)
+{
+	switch (conn_step)
 	{
-		MYLOG("WIFI", "MQTT USR config failed: ==>\n%s\n<==\r\n", esp_com_buff);
-		return false;
-	}
-	digitalWrite(LED_MQTT, LOW);
-	// MYLOG("WIFI", "MQTT USR config ok: ==>%s<==\r\n", esp_com_buff);
+	case CONN_RESET:
+		// Enable ESP8684
+		digitalWrite(WB_ESP8684, HIGH);
+		boot_start = millis();
+		snprintf(cmd_buff, AT_CMD_LEN, "AT\r\n");
+		conn_queue(CONN_BOOT, 1000, LED_WIFI);
+		break;
+	case CONN_BOOT:
+		if (result == AT_CMD_OK)
+		{
+			MYLOG("WIFI", "Init ESP8684 ok");
+			connect_wifi();
+		}
+		else if ((millis() - boot_start) < ESP_BOOT_TIMEOUT)
+		{
+			// ESP8684 is still booting, try again
+			snprintf(cmd_buff, AT_CMD_LEN, "AT\r\n");
+			conn_queue(CONN_BOOT, 1000, LED_WIFI);
+		}
+		else
+		{
+			MYLOG("WIFI", "Init ESP8684 failed");
+			// if analog input pin 1 is unconnected, random analog
+			// noise will cause the call to randomSeed() to generate
+			// different seed numbers each time the sketch runs.
+			// randomSeed() will then shuffle the random function.
+			randomSeed(analogRead(WB_A1));
+			connection_done(false);
+		}
+		break;
+	case CONN_MODE:
+		if (result != AT_CMD_OK)
+		{
+			MYLOG("WIFI", "WiFi station mode failed: %s", esp_com_buff);
+			connection_done(false);
+			break;
+		}
+		// Set AP name and password
+		snprintf(cmd_buff, AT_CMD_LEN, "AT+CWJAP=\"%s\",\"%s\"\r\n", custom_parameters.MQTT_WIFI_APN, custom_parameters.MQTT_WIFI_PW);
+		/** Expected response ********************
+		AT+cwjap="<MQTT_WIFI_APN>","<MQTT_WIFI_PW>"
+		WIFI DISCONNECT
+		WIFI CONNECTED
+		WIFI GOT IP
 
-	// Try to flush the RX buffer in case there is some ESP8684 stuff in it
-	flush_RX();
+		OK
+		*****************************************/
+		conn_queue(CONN_JOIN, 10000, LED_WIFI);
+		break;
+	case CONN_JOIN:
+		if (result != AT_CMD_OK)
+		{
+			MYLOG("WIFI", "ESP8684 not connected: ==>%s<==\r\n", esp_com_buff);
+			connection_done(false);
+			break;
+		}
+		// Set reconnection configuration (1 second interval, try forever)
+		snprintf(cmd_buff, AT_CMD_LEN, "AT+CWRECONNCFG=1,0\r\n");
+		/** Expected response ********************
+		+CWRECONNCFG:1,5000>
 
-	// Clear send buffer
-	memset(esp_com_buff, 0, 1024);
-	snprintf(esp_com_buff, 511, "AT+MQTTCONN=0,\"%s\",%s,0\r\n",
-			 custom_parameters.MQTT_URL, custom_parameters.MQTT_PORT);
-	// MYLOG("WIFI", "MQTT Connect with ==>%s<==", esp_com_buff);
-	Serial1.printf("%s", esp_com_buff);
-	Serial1.flush();
-	/** Expected response ********************
-	AT+MQTTCONN=0,"<MQTT_URL>",<MQTT_PORT>,0
-	+MQTTCONNECTED:0,1,"<MQTT_URL>","<MQTT_PORT>","",0
+		OK
+		*****************************************/
+		conn_queue(CONN_RECONN, 10000, LED_WIFI);
+		break;
+	case CONN_RECONN:
+		if (result != AT_CMD_OK)
+		{
+			MYLOG("WIFI", "ESP8684 not connected: ==>%s<==\r\n", esp_com_buff);
+			connection_done(false);
+			break;
+		}
+		// Check protocol
+		snprintf(cmd_buff, AT_CMD_LEN, "AT+CWSTAPROTO?\r\n");
+		/** Expected response ********************
+		+CWSTAPROTO:<protocol>
 
-	OK
-	*****************************************/
-	if (wait_ok_response(10000, LED_MQTT) == false)
-	{
-		MYLOG("WIFI", "MQTT connect failed: ==>\n%s\n<==\r\n", esp_com_buff);
-		return false;
+		OK
+		*****************************************/
+		conn_queue(CONN_PROTO, 10000, LED_WIFI);
+		break;
+	case CONN_PROTO:
+		MYLOG("WIFI", "WiFi protocol: ==>%s<==\r\n", esp_com_buff);
+		// Set RF power
+		snprintf(cmd_buff, AT_CMD_LEN, "AT+RFPOWER=84\r\n");
+		/** Expected response ********************
+		+RFPOWER:1,5000>
+
+		OK
+		*****************************************/
+		conn_queue(CONN_POWER, 10000, LED_WIFI);
+		break;
+	case CONN_POWER:
+		if (result != AT_CMD_OK)
+		{
+			MYLOG("WIFI", "ESP8684 not connected: ==>%s<==\r\n", esp_com_buff);
+			connection_done(false);
+			break;
+		}
+		MYLOG("WIFI", "WiFi station RF power set: ==>%s<==\r\n", esp_com_buff);
+		has_wifi_conn = true;
+		// Initialize MQTT Broker connection
+		connect_mqtt(conn_restart);
+		break;
+	case CONN_CLEAN:
+		if (result != AT_CMD_OK)
+		{
+			MYLOG("WIFI", "MQTT CLEAN failed: ==>\n%s\n<==\r\n", esp_com_buff);
+		}
+		connect_mqtt(false);
+		break;
+	case CONN_USER:
+		if (result != AT_CMD_OK)
+		{
+			MYLOG("WIFI", "MQTT USR config failed: ==>\n%s\n<==\r\n", esp_com_buff);
+			connection_done(false);
+			break;
+		}
+		snprintf(cmd_buff, AT_CMD_LEN, "AT+MQTTCONN=0,\"%s\",%s,0\r\n",
+				 custom_parameters.MQTT_URL, custom_parameters.MQTT_PORT);
+		/** Expected response ********************
+		AT+MQTTCONN=0,"<MQTT_URL>",<MQTT_PORT>,0
+		+MQTTCONNECTED:0,1,"<MQTT_URL>","<MQTT_PORT>","",0
+
+		OK
+		*****************************************/
+		conn_queue(CONN_BROKER, 10000, LED_MQTT);
+		break;
+	case CONN_BROKER:
+		if (result != AT_CMD_OK)
+		{
+			MYLOG("WIFI", "MQTT connect failed: ==>\n%s\n<==\r\n", esp_com_buff);
+			connection_done(false);
+			break;
+		}
+		has_mqtt_conn = true;
+		connection_done(true);
+		break;
+	default:
+		break;
 	}
-	digitalWrite(LED_MQTT, LOW);
-	// MYLOG("WIFI", "MQTT connect ok: ==>%s<==\r\n", esp_com_buff);
-	return true;
 }
 
 /**
- * @brief Publish small topic to MQTT broker
- * 		Limited size for publish package
+ * @brief End of the connection sequence
  *
- * @param sub_topic sub topic maximum length: 128 bytes.
- * @param message to publish maximum length: 124 bytes
- * @return true topic published
- * @return false topic publishing failed
+ * @param success true if WiFi and MQTT Broker are connected
  */
-bool publish_msg(char *sub_topic, char *message)
+void connection_done(bool success)
 {
-	// Try to flush the RX buffer in case there is some ESP8684 stuff in it
-	flush_RX();
-
-	// Clear send buffer
-	memset(esp_com_buff, 0, 1024);
-	snprintf(esp_com_buff, 511, "AT+MQTTPUB=0,\"%s%s\",\'%s\',0,0\r\n",
-			 custom_parameters.MQTT_PUB, sub_topic, message);
-	// MYLOG("WIFI", "MQTT Publish ==>%s<==", esp_com_buff);
-	Serial1.printf("%s", esp_com_buff);
-	Serial1.flush();
-	/** Expected response ********************
-	AT+MQTTPUB=0,"<MQTT_PUB>","<data>",0,0
-
-	OK
-	*****************************************/
-	if (wait_ok_response(10000, LED_MQTT) == false)
+	conn_step = CONN_IDLE;
+	if (success)
 	{
-		MYLOG("WIFI", "MQTT PUB failed: ==>%s<==\r\n", esp_com_buff);
-		return false;
+		MYLOG("WIFI", "MQTT Broker connected");
+		digitalWrite(LED_WIFI, LOW);
+		digitalWrite(LED_MQTT, LOW);
+		// Publish the entries that are left in the FiFo
+		queue_publish();
+	}
+	else
+	{
+		MYLOG("WIFI", "Connection failed");
+		digitalWrite(LED_WIFI, HIGH);
 	}
-	digitalWrite(LED_MQTT, LOW);
-	// MYLOG("WIFI", "MQTT PUB ok: ==>%s<==\r\n", esp_com_buff);
-	MYLOG("WIFI", "MQTT PUB ok");
-	return true;
 }
 
 /**
- * @brief Publish to MQTT broker
+ * @brief Callback for unsolicited result codes of the ESP8684
+ * 		A lost WiFi or MQTT Broker connection is handled at once,
+ * 		the queued publishes fail and the connection is started again.
  *
- * @param sub_topic sub topic
- * @param message to publish
- * @return true topic published
- * @return false topic publishing failed
+ * @param tokens received AT_TOK_URC tokens
  */
-
-bool publish_raw_msg(char *sub_topic, uint8_t *message, size_t msg_len)
+void esp_urc_cb(uint16_t tokens)
 {
-	// Try to flush the RX buffer in case there is some ESP8684 stuff in it
-	flush_RX();
-
-	// Clear send buffer
-	memset(esp_com_buff, 0, 1024);
-	snprintf(esp_com_buff, 511, "AT+MQTTPUBRAW=0,\"%s%s\",%d,0,0\r\n",
-			 custom_parameters.MQTT_PUB, sub_topic, msg_len);
-	// MYLOG("WIFI", "MQTT Publish Raw ==>%s<==", esp_com_buff);
-	Serial1.printf("%s", esp_com_buff);
-	Serial1.flush();
-	/** Expected response ********************
-	OK
-	>
-	*****************************************/
-	if (wait_ok_response(10000, LED_MQTT, ">") == false)
+	// During the connection sequence WIFI DISCONNECT is a normal response
+	if (!has_wifi_conn || !has_mqtt_conn)
 	{
-		MYLOG("WIFI", "MQTT PUB RAW failed waiting for '>': ==>%s<==\r\n", esp_com_buff);
-		return false;
+		return;
 	}
-	digitalWrite(LED_MQTT, LOW);
-	// Start sending data
-	for (int idx = 0; idx < msg_len; idx++)
+	if ((tokens & (AT_TOK_MQTT_DISCONNECTED | AT_TOK_WIFI_DISCONNECT | AT_TOK_READY)) == 0)
 	{
-		Serial1.write(message[idx]);
-		delay(5);
+		return;
 	}
-	if (wait_ok_response(60000, LED_MQTT) == false)
+	MYLOG("WIFI", "Connection lost: ==>%s<==\r\n", esp_com_buff);
+	if ((tokens & AT_TOK_MQTT_DISCONNECTED) == 0)
 	{
-		MYLOG("WIFI", "MQTT PUB RAW failed waiting for 'OK': ==>\n%s\n<==\r\n", esp_com_buff);
-		return false;
+		has_wifi_conn = false;
+	}
+	has_mqtt_conn = false;
+	digitalWrite(LED_WIFI, HIGH);
+
+	// Queued publishes fail, their callbacks start the reconnection
+	at_client_clear();
+	if (!wifi_sending)
+	{
+		wifi_sending = true;
+		api.system.timer.start(RAK_TIMER_0, 250, NULL);
 	}
-	digitalWrite(LED_MQTT, LOW);
-	// MYLOG("WIFI", "MQTT PUB RAW ok: ==>%s<==\r\n", esp_com_buff);
-	MYLOG("WIFI", "MQTT PUB RAW ok");
-	return true;
 }
 
 /**
- * @brief Wait for response from ESP8684
+ * @brief Publish small topic to MQTT broker
+ * 		Limited size for publish package
  *
- * @param timeout time to wait in milliseconds
- * @param wait_for character array to wait for
- * @return true "wait_for" string received
- * @return false "wait_for" string not received, timeout
+ * @param sub_topic sub topic
+ * @param message to publish, the complete command is limited to AT_CMD_LEN bytes
+ * @param callback called when the publish is finished
+ * @param context given to the callback
+ * @return true publish is queued
+ * @return false AT command queue is full
  */
-bool wait_ok_response(time_t timeout, uint8_t pin, char *wait_for)
+bool publish_msg(char *sub_topic, char *message, at_cmd_cb_t callback, void *context)
 {
-	time_t start = millis();
-	int buff_idx = 0;
-	bool got_ok = false;
-
-	// Clear TX buffer
-	memset(esp_com_buff, 0, 1024);
+	char pub_cmd[AT_CMD_LEN];
+	snprintf(pub_cmd, AT_CMD_LEN, "AT+MQTTPUB=0,\"%s%s\",\'%s\',0,0\r\n",
+			 custom_parameters.MQTT_PUB, sub_topic, message);
+	/** Expected response ********************
+	AT+MQTTPUB=0,"<MQTT_PUB>","<data>",0,0
 
-	while ((millis() - start) < timeout)
-	{
-		if (Serial1.available() != 0)
-		{
-			char rcvd = Serial1.read();
-			// Serial.write(rcvd);
-			// Serial.flush();
-			esp_com_buff[buff_idx] = rcvd;
-			buff_idx++;
-			if (buff_idx == 1024)
-			{
-				esp_com_buff[1023] = 0;
-				digitalWrite(pin, LOW);
-				// Buffer overflow, return false
-				return false;
-			}
-			esp_com_buff[buff_idx] = 0;
-			if (strstr(esp_com_buff, wait_for) != NULL)
-			{
-				// Serial.println("RX OK");
-				digitalWrite(pin, LOW);
-				return true;
-			}
-		}
-		digitalWrite(pin, !digitalRead(pin));
-		delay(10);
-	}
-	digitalWrite(pin, LOW);
-	return false;
+	OK
+	*****************************************/
+	return at_client_queue(pub_cmd, AT_TOK_OK, 10000, LED_MQTT, callback, context);
 }
 
 /**
- * @brief Flush RX buffer from left-over ESP8684 data
- * 
+ * @brief Publish to MQTT broker
+ * 		The payload is sent after the '>' prompt of the ESP8684
+ *
+ * @param sub_topic sub topic
+ * @param message to publish, must be valid until the callback is called
+ * @param msg_len size of the message
+ * @param callback called when the publish is finished
+ * @param context given to the callback
+ * @return true publish is queued
+ * @return false AT command queue is full
  */
-void flush_RX(void)
+bool publish_raw_msg(char *sub_topic, uint8_t *message, size_t msg_len, at_cmd_cb_t callback, void *context)
 {
-	// Try to flush the RX buffer in case there is some ESP8684 stuff in it
-	if (Serial1.available())
-	{
-		while (Serial1.available())
-		{
-			Serial1.read();
-			delay(10);
-		}
-	}
-}
\ No newline at end of file
+	char pub_cmd[AT_CMD_LEN];
+	snprintf(pub_cmd, AT_CMD_LEN, "AT+MQTTPUBRAW=0,\"%s%s\",%u,0,0\r\n",
+			 custom_parameters.MQTT_PUB, sub_topic, (unsigned int)msg_len);
+	/** Expected response ********************
+	OK
+	>
+	<payload>
+	+MQTTPUB:OK
+	*****************************************/
+	return at_client_queue(pub_cmd, AT_TOK_PUB_OK, 60000, LED_MQTT, callback, context, message, msg_len);
+}
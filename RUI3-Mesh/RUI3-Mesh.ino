@@ -19,6 +19,11 @@ longlong_byte_u convert_value;
 /** Counter, only for testing */
 uint64_t msg_cnt = 0;
 
+/** Send the mesh counters to the master node after every n data packets, 0 = off */
+#ifndef STAT_REPORT_EVERY
+#define STAT_REPORT_EVERY 0
+#endif
+
 /** Buffer for BLE/Mesh data */
 char data_buffer[512] = {0};
 
@@ -67,6 +72,8 @@ void cad_cb(bool result)
 	{
 		MYLOG("CAD-P2P-CB", "Restart RX");
 	}
+	// Packet is not sent if the channel is busy
+	mesh_check_cad(result);
 }
 
 void setup(void)
@@ -143,6 +150,8 @@ void setup(void)
 	init_status_at();
 	init_map_at();
 	init_master_at();
+	init_airtime_at();
+	init_meshstat_at();
 
 	// Get saved custom parameters
 	get_at_setting();
@@ -298,6 +307,18 @@ void timed_loop(void *)
 			{
 				MYLOG("APP", "Error enqueue packet");
 			}
+
+#if STAT_REPORT_EVERY > 0
+			if ((g_custom_parameters.master_address != 0) && !use_broadcast && ((msg_cnt % STAT_REPORT_EVERY) == 0))
+			{
+				// Mesh counters for the master node
+				uint8_t report_size = mesh_stats_report((uint8_t *)data_buffer);
+				if (!send_to_mesh(false, g_custom_parameters.master_address, (uint8_t *)data_buffer, report_size))
+				{
+					MYLOG("APP", "Error enqueue statistics report");
+				}
+			}
+#endif
 		}
 	}
 
@@ -333,6 +354,13 @@ void on_mesh_data(uint32_t fromID, uint8_t *rxPayload, uint16_t rxSize, int16_t
 	Serial.println("-------------------------------------");
 	Serial.printf("Got %sdata from node %08lX\n", isBroadcast ? "broadcast " : "", fromID);
 
+	if ((rxSize >= 66) && (rxPayload[0] == MESH_STAT_REPORT_MARK1) && (rxPayload[1] == MESH_STAT_REPORT_MARK2) && (rxPayload[2] == MESH_STAT_REPORT_VERSION))
+	{
+		print_stats_report(rxPayload, rxSize);
+		Serial.println("-------------------------------------");
+		return;
+	}
+
 	longlong_byte_u new_counter;
 
 	// Demo output of the received data packet
@@ -345,6 +373,39 @@ void on_mesh_data(uint32_t fromID, uint8_t *rxPayload, uint16_t rxSize, int16_t
 	Serial.println("-------------------------------------");
 }
 
+/**
+ * @brief Print the summary of a statistics report of another node, see mesh_stats_report() for the format
+ *
+ * @param report received report
+ * @param size size of the report
+ */
+void print_stats_report(uint8_t *report, uint16_t size)
+{
+	uint16_t rx_total = 0;
+	uint16_t tx_total = 0;
+	for (int type = 0; type < MESH_STAT_TYPES; type++)
+	{
+		rx_total += report[8 + type * 2] | (report[9 + type * 2] << 8);
+		tx_total += report[30 + type * 2] | (report[31 + type * 2] << 8);
+	}
+	uint16_t counters[7];
+	for (int idx = 0; idx < 7; idx++)
+	{
+		counters[idx] = report[52 + idx * 2] | (report[53 + idx * 2] << 8);
+	}
+	Serial.printf("Statistics of the last %ld s\n", (uint32_t)(report[4] | (report[5] << 8) | (report[6] << 16) | ((uint32_t)report[7] << 24)));
+	Serial.printf("RX %d TX %d forwarded %d dropped %d failed %d retransmitted %d\n", rx_total, tx_total,
+				  counters[0], counters[1], counters[2], counters[3]);
+	Serial.printf("No route %d duplicates %d invalid %d\n", counters[4], counters[5], counters[6]);
+	uint16_t pos = 66 + MESH_TX_CLASSES * MESH_STAT_LATENCY_BUCKETS * 2;
+	for (int idx = 0; (idx < report[3]) && ((pos + 10) <= size); idx++, pos += 10)
+	{
+		Serial.printf("Neighbour %08lX rx %d tx %d retransmitted %d\n",
+					  (uint32_t)(report[pos] | (report[pos + 1] << 8) | (report[pos + 2] << 16) | ((uint32_t)report[pos + 3] << 24)),
+					  report[pos + 4] | (report[pos + 5] << 8), report[pos + 6] | (report[pos + 7] << 8), report[pos + 8] | (report[pos + 9] << 8));
+	}
+}
+
 /**
  * @brief Callback after the nodes list changed
  *
@@ -0,0 +1,1420 @@
+/**
+ * @file mesh_sim.cpp
+ * @author Bernd Giesecke (bernd@giesecke.tk)
+ * @brief Discrete event simulator for the RUI3 Mesh.
+ * 		Each node is a separate copy of the node library (sim_node.cpp + mesh.cpp + router.cpp),
+ * 		the simulator provides the RUI3 API, a virtual millis() and the radio medium.
+ * @version 0.1
+ * @date 2026-10-16
+ *
+ * @copyright Copyright (c) 2026
+ *
+ */
+#include <Arduino.h>
+#include "mesh.h"
+#include "sim.h"
+
+#include <dlfcn.h>
+#include <math.h>
+#include <unistd.h>
+#include <algorithm>
+#include <queue>
+#include <random>
+#include <string>
+#include <vector>
+
+/** Supply voltage of the radio in V */
+#define SIM_SUPPLY_V 3.3
+/** Current of the radio in mA in RX, in TX with +22 dBm and in sleep with warm start (SX1262) */
+#define SIM_RX_MA 4.6
+#define SIM_TX_MA 118.0
+#define SIM_SLEEP_MA 0.0012
+
+/** Simulation settings */
+struct sim_cfg_s
+{
+	int nodes = 30;
+	std::string topo = "grid";
+	double degree = 6.0;
+	double loss = 0.0;
+	bool snr_loss = false;
+	double drift = 20.0;
+	uint32_t sim_time = 3600;
+	uint32_t interval = 60;
+	/** Size of the test packets */
+	uint16_t payload = SIM_PAYLOAD_SIZE;
+	uint32_t warmup = 120;
+	uint32_t boot = 10;
+	bool master = true;
+	uint32_t seed = 1;
+	std::string lib = "./meshnode.so";
+	bool verbose = false;
+	bool per_node = false;
+	bool csv = false;
+	/** Node that fails, -1 if no node fails */
+	int fail_node = -1;
+	/** Time when the node fails */
+	uint32_t fail_time = 0;
+} cfg;
+
+/** Radio link between two nodes */
+struct sim_link_s
+{
+	bool ok;
+	int16_t rssi;
+	int8_t snr;
+};
+
+/** Timer of a node */
+struct sim_timer_s
+{
+	RAK_TIMER_HANDLER handler = NULL;
+	RAK_TIMER_MODE mode = RAK_TIMER_ONESHOT;
+	uint32_t period = 0;
+	uint64_t gen = 0;
+	bool active = false;
+};
+
+/** Simulated node */
+struct sim_node_s
+{
+	uint32_t addr = 0;
+	void *lib = NULL;
+	bool booted = false;
+	/** Node is switched off */
+	bool failed = false;
+	/** Clock rate of the node, 1.0 +/- drift */
+	double clock = 1.0;
+	service_lora_p2p_recv_cb_type recv_cb = NULL;
+	service_lora_p2p_send_cb_type send_cb = NULL;
+	service_lora_p2p_send_CAD_cb_type cad_cb = NULL;
+	sim_timer_s timers[RAK_TIMER_ID_MAX];
+	bool rx_enabled = false;
+	/** Time the receiver was switched on */
+	uint64_t rx_start = 0;
+	/** Time the receiver was on after the warm up in us */
+	uint64_t rx_on_us = 0;
+	/** Radio is in CAD or TX */
+	bool radio_busy = false;
+	/** Radio is transmitting */
+	bool transmitting = false;
+	/** Frames that are currently arriving at this node */
+	std::vector<int> rx_frames;
+	sim_node_setup_t setup = NULL;
+	sim_node_start_traffic_t start_traffic = NULL;
+	sim_node_map_size_t map_size = NULL;
+	sim_node_has_route_t has_route = NULL;
+	int *num_of_nodes = NULL;
+	mesh_tx_stats_s *tx_stats = NULL;
+	// Statistics
+	double airtime_ms = 0;
+	/** Time on air after the warm up */
+	double measured_airtime_ms = 0;
+	uint64_t tx_bytes = 0;
+	uint32_t tx_frames = 0;
+	uint32_t rx_frames_ok = 0;
+	uint32_t rx_lost = 0;
+	uint32_t cad_busy = 0;
+	uint32_t send_errors = 0;
+	int component = 0;
+};
+
+/** Frame on air */
+struct sim_frame_s
+{
+	int tx_node;
+	uint64_t end;
+	std::vector<uint8_t> data;
+	std::vector<int> receivers;
+	std::vector<bool> lost;
+};
+
+/** Application packet */
+struct sim_packet_s
+{
+	int origin;
+	int receiver;
+	uint64_t sent;
+	uint64_t delivered = 0;
+	std::vector<bool> got;
+};
+
+enum
+{
+	EV_BOOT,
+	EV_TIMER,
+	EV_CAD_END,
+	EV_TX_END,
+	EV_TRAFFIC,
+	EV_CHECK,
+	EV_FAIL,
+	EV_FAIL_CHECK
+};
+
+/** Simulator event */
+struct sim_event_s
+{
+	uint64_t time;
+	uint64_t seq;
+	int type;
+	int node;
+	int arg;
+	uint64_t gen;
+	bool operator>(const sim_event_s &other) const
+	{
+		return (time != other.time) ? (time > other.time) : (seq > other.seq);
+	}
+};
+
+std::priority_queue<sim_event_s, std::vector<sim_event_s>, std::greater<sim_event_s>> events;
+uint64_t event_seq = 0;
+/** Virtual time in microseconds */
+uint64_t now_us = 0;
+
+std::vector<sim_node_s> nodes;
+std::vector<sim_link_s> links;
+std::vector<sim_frame_s> frames;
+std::vector<std::vector<uint8_t>> frame_data;
+std::vector<sim_packet_s> packets;
+/** Hop distances between nodes, -1 if not reachable */
+std::vector<int16_t> hop_dist;
+std::vector<uint8_t> tx_pending;
+/** Node that is currently executing code */
+int current = -1;
+std::mt19937 rng;
+
+uint64_t converged_us = 0;
+/** Time from the failure of a node until no node has a route to it anymore */
+uint64_t removed_us = 0;
+uint32_t collisions = 0;
+uint32_t duplicates = 0;
+
+HostSerial Serial;
+HostSerial Serial6;
+HostApi api;
+
+/**
+ * @brief Add an event to the event queue
+ *
+ */
+static void schedule(uint64_t time, int type, int node, int arg = 0, uint64_t gen = 0)
+{
+	events.push({time, event_seq++, type, node, arg, gen});
+}
+
+static sim_link_s &link(int from, int to)
+{
+	return links[from * cfg.nodes + to];
+}
+
+/*****************************************************************************
+ * Arduino and RUI3 API for the nodes
+ *****************************************************************************/
+unsigned long millis(void)
+{
+	if (current < 0)
+	{
+		return (unsigned long)(now_us / 1000);
+	}
+	// Each node counts with its own clock rate
+	return (unsigned long)(now_us / nodes[current].clock / 1000);
+}
+
+void delay(unsigned long ms)
+{
+	// Code runs in zero time in the simulation
+}
+
+void pinMode(uint8_t pin, uint8_t mode) {}
+void digitalWrite(uint8_t pin, uint8_t val) {}
+int digitalRead(uint8_t pin) { return 0; }
+void noInterrupts(void) {}
+void interrupts(void) {}
+uint32_t HAL_GetDEVID(void) { return 0; }
+uint32_t HAL_GetREVID(void) { return 0; }
+
+long random(long max)
+{
+	return random(0, max);
+}
+
+long random(long min, long max)
+{
+	if (max <= min)
+	{
+		return min;
+	}
+	return min + (long)(rng() % (uint32_t)(max - min));
+}
+
+void randomSeed(unsigned long seed) {}
+
+int HostSerial::printf(const char *format, ...)
+{
+	// Serial6 only mirrors the debug output of the RAK4630
+	if (!cfg.verbose || (this == &Serial6))
+	{
+		return 0;
+	}
+	static bool line_start = true;
+	char line[512];
+	va_list args;
+	va_start(args, format);
+	int len = vsnprintf(line, sizeof(line), format, args);
+	va_end(args);
+	if (line_start && (current >= 0))
+	{
+		::printf("[%9.3f %08X] ", now_us / 1e6, nodes[current].addr);
+	}
+	for (char *ptr = line; *ptr != 0; ptr++)
+	{
+		if (*ptr != '\r')
+		{
+			putchar(*ptr);
+		}
+	}
+	line_start = (len > 0) && (line[strlen(line) - 1] == '\n');
+	return len;
+}
+
+size_t HostSerial::print(const char *str)
+{
+	return printf("%s", str);
+}
+
+size_t HostSerial::println(const char *str)
+{
+	return printf("%s\n", str);
+}
+
+size_t HostSerial::write(uint8_t value)
+{
+	return printf("%c", value);
+}
+
+bool HostApi::lorawan::deui::get(uint8_t *buf, uint32_t len)
+{
+	memset(buf, 0, len);
+	uint32_t addr = nodes[current].addr;
+	buf[4] = addr >> 24;
+	buf[5] = addr >> 16;
+	buf[6] = addr >> 8;
+	buf[7] = addr;
+	return true;
+}
+
+bool HostApi::system::timer::create(RAK_TIMER_ID id, RAK_TIMER_HANDLER handler, RAK_TIMER_MODE mode)
+{
+	sim_timer_s &timer = nodes[current].timers[id];
+	timer.handler = handler;
+	timer.mode = mode;
+	timer.active = false;
+	timer.gen++;
+	return true;
+}
+
+bool HostApi::system::timer::start(RAK_TIMER_ID id, uint32_t ms, void *data)
+{
+	sim_timer_s &timer = nodes[current].timers[id];
+	if (timer.handler == NULL)
+	{
+		return false;
+	}
+	timer.period = ms;
+	timer.active = true;
+	timer.gen++;
+	schedule(now_us + (uint64_t)(ms * 1000 * nodes[current].clock), EV_TIMER, current, id, timer.gen);
+	return true;
+}
+
+bool HostApi::system::timer::stop(RAK_TIMER_ID id)
+{
+	nodes[current].timers[id].active = false;
+	nodes[current].timers[id].gen++;
+	return true;
+}
+
+bool HostApi::lora::registerPRecvCallback(service_lora_p2p_recv_cb_type callback)
+{
+	nodes[current].recv_cb = callback;
+	return true;
+}
+
+bool HostApi::lora::registerPSendCallback(service_lora_p2p_send_cb_type callback)
+{
+	nodes[current].send_cb = callback;
+	return true;
+}
+
+bool HostApi::lora::registerPSendCADCallback(service_lora_p2p_send_CAD_cb_type callback)
+{
+	nodes[current].cad_cb = callback;
+	return true;
+}
+
+/**
+ * @brief Switch the receiver of a node on or off, the time in RX after the warm up is counted
+ *
+ * @param node node
+ * @param on receiver is on
+ */
+static void set_rx(sim_node_s &node, bool on)
+{
+	uint64_t warmup_us = (uint64_t)cfg.warmup * 1000000;
+	if (node.rx_enabled && !on && (now_us > warmup_us))
+	{
+		node.rx_on_us += now_us - std::max(node.rx_start, warmup_us);
+	}
+	if (!node.rx_enabled && on)
+	{
+		node.rx_start = now_us;
+	}
+	node.rx_enabled = on;
+}
+
+bool HostApi::lora::precv(uint32_t timeout)
+{
+	set_rx(nodes[current], timeout != 0);
+	return true;
+}
+
+/*****************************************************************************
+ * Radio medium
+ *****************************************************************************/
+
+/**
+ * @brief Get bandwidth in Hz from the RUI3 P2P setting
+ *
+ */
+static double bandwidth_hz(void)
+{
+	uint32_t bw = api.lora.pbw.get();
+	switch (bw)
+	{
+	case 0:
+		return 125000.0;
+	case 1:
+		return 250000.0;
+	case 2:
+		return 500000.0;
+	default:
+		return bw * 1000.0;
+	}
+}
+
+/**
+ * @brief Symbol time in milliseconds
+ *
+ */
+static double symbol_ms(void)
+{
+	return (double)(1 << api.lora.psf.get()) / bandwidth_hz() * 1000.0;
+}
+
+/**
+ * @brief LoRa time on air (Semtech AN1200.13), explicit header, CRC on
+ *
+ * @param len payload length
+ * @return double time on air in milliseconds
+ */
+static double time_on_air_ms(uint8_t len)
+{
+	int sf = api.lora.psf.get();
+	int cr = api.lora.pcr.get() + 1;
+	double t_sym = symbol_ms();
+	int de = t_sym > 16.0 ? 1 : 0;
+	double t_preamble = (api.lora.ppl.get() + 4.25) * t_sym;
+	double num = 8.0 * len - 4.0 * sf + 28 + 16;
+	double payload_symb = 8 + std::max(ceil(num / (4.0 * (sf - 2 * de))) * (cr + 4), 0.0);
+	return t_preamble + payload_symb * t_sym;
+}
+
+/**
+ * @brief Lowest SNR that can be demodulated for the current SF
+ *
+ */
+static double snr_floor(void)
+{
+	int sf = api.lora.psf.get();
+	if (sf <= 6)
+	{
+		return -5.0;
+	}
+	return -7.5 - 2.5 * (sf - 7);
+}
+
+/**
+ * @brief Packet reception ratio of a link, drops from 99 % at 6 dB above the SNR floor to 50 % at 2 dB
+ *
+ * @param snr SNR of the link
+ * @return double reception ratio
+ */
+static double snr_prr(int8_t snr)
+{
+	return 1.0 / (1.0 + exp(-1.2 * (snr - snr_floor() - 2.0)));
+}
+
+bool HostApi::lora::psend(uint8_t length, uint8_t *payload, bool cad)
+{
+	sim_node_s &node = nodes[current];
+	if (node.radio_busy)
+	{
+		node.send_errors++;
+		return false;
+	}
+	node.radio_busy = true;
+	tx_pending.assign(payload, payload + length);
+	frame_data.push_back(tx_pending);
+	int data_idx = frame_data.size() - 1;
+	if (cad)
+	{
+		// Channel activity detection takes about 2 symbols
+		schedule(now_us + (uint64_t)(2 * symbol_ms() * 1000), EV_CAD_END, current, data_idx, 1);
+	}
+	else
+	{
+		schedule(now_us, EV_CAD_END, current, data_idx, 0);
+	}
+	return true;
+}
+
+/**
+ * @brief Call into a node
+ *
+ */
+template <typename F>
+static void run_node(int node, F func)
+{
+	int last = current;
+	current = node;
+	func();
+	current = last;
+}
+
+/**
+ * @brief Start a transmission
+ *
+ * @param tx transmitting node
+ * @param data_idx index of the frame data
+ */
+static void start_tx(int tx, int data_idx)
+{
+	sim_node_s &node = nodes[tx];
+	sim_frame_s frame;
+	frame.tx_node = tx;
+	frame.data = frame_data[data_idx];
+	double toa = time_on_air_ms(frame.data.size());
+	frame.end = now_us + (uint64_t)(toa * 1000);
+	node.transmitting = true;
+	node.airtime_ms += toa;
+	if (now_us >= (uint64_t)cfg.warmup * 1000000)
+	{
+		node.measured_airtime_ms += toa;
+	}
+	node.tx_bytes += frame.data.size();
+	node.tx_frames++;
+
+	int frame_idx = frames.size();
+
+	// A node can not receive while it transmits
+	for (int rx_frame : node.rx_frames)
+	{
+		sim_frame_s &other = frames[rx_frame];
+		for (size_t idx = 0; idx < other.receivers.size(); idx++)
+		{
+			if (other.receivers[idx] == tx)
+			{
+				other.lost[idx] = true;
+			}
+		}
+	}
+
+	for (int rx = 0; rx < cfg.nodes; rx++)
+	{
+		if ((rx == tx) || !link(tx, rx).ok)
+		{
+			continue;
+		}
+		bool lost = nodes[rx].transmitting || !nodes[rx].booted || !nodes[rx].rx_enabled;
+		if (!nodes[rx].rx_frames.empty())
+		{
+			// Collision, all overlapping frames are lost at this receiver
+			lost = true;
+			for (int rx_frame : nodes[rx].rx_frames)
+			{
+				sim_frame_s &other = frames[rx_frame];
+				for (size_t idx = 0; idx < other.receivers.size(); idx++)
+				{
+					if ((other.receivers[idx] == rx) && !other.lost[idx])
+					{
+						other.lost[idx] = true;
+						collisions++;
+					}
+				}
+			}
+			collisions++;
+		}
+		frame.receivers.push_back(rx);
+		frame.lost.push_back(lost);
+		nodes[rx].rx_frames.push_back(frame_idx);
+	}
+	frames.push_back(frame);
+	schedule(frames[frame_idx].end, EV_TX_END, tx, frame_idx);
+}
+
+/**
+ * @brief End of a transmission, deliver the frame
+ *
+ * @param frame_idx frame index
+ */
+static void end_tx(int frame_idx)
+{
+	sim_frame_s &frame = frames[frame_idx];
+	sim_node_s &node = nodes[frame.tx_node];
+	node.transmitting = false;
+	node.radio_busy = false;
+
+	std::uniform_real_distribution<double> loss(0.0, 1.0);
+	for (size_t idx = 0; idx < frame.receivers.size(); idx++)
+	{
+		int rx = frame.receivers[idx];
+		std::vector<int> &rx_frames = nodes[rx].rx_frames;
+		rx_frames.erase(std::remove(rx_frames.begin(), rx_frames.end(), frame_idx), rx_frames.end());
+		if (frame.lost[idx] || !nodes[rx].rx_enabled || (loss(rng) < cfg.loss) || (nodes[rx].recv_cb == NULL) ||
+			(cfg.snr_loss && (loss(rng) > snr_prr(link(frame.tx_node, rx).snr))))
+		{
+			nodes[rx].rx_lost++;
+			continue;
+		}
+		nodes[rx].rx_frames_ok++;
+		rui_lora_p2p_recv_t data;
+		std::vector<uint8_t> buffer = frame.data;
+		data.Buffer = buffer.data();
+		data.BufferSize = buffer.size();
+		data.Rssi = link(frame.tx_node, rx).rssi;
+		data.Snr = link(frame.tx_node, rx).snr;
+		run_node(rx, [&]()
+				 { nodes[rx].recv_cb(data); });
+	}
+	frame.data.clear();
+	frame.data.shrink_to_fit();
+	if (node.send_cb != NULL)
+	{
+		run_node(frame.tx_node, [&]()
+				 { node.send_cb(); });
+	}
+}
+
+/*****************************************************************************
+ * Application packets
+ *****************************************************************************/
+extern "C" void sim_app_new_packet(uint32_t target, uint8_t *payload)
+{
+	sim_packet_s packet;
+	packet.origin = current;
+	packet.sent = now_us;
+	packet.receiver = -1;
+	if (cfg.master)
+	{
+		packet.receiver = 0;
+	}
+	else
+	{
+		for (int idx = 0; idx < cfg.nodes; idx++)
+		{
+			if (nodes[idx].addr == target)
+			{
+				packet.receiver = idx;
+			}
+		}
+		if (packet.receiver < 0)
+		{
+			packet.got.assign(cfg.nodes, false);
+		}
+	}
+	uint32_t id = packets.size() + 1;
+	memset(payload, 0, SIM_PAYLOAD_SIZE);
+	// Larger test packets get a pattern that is checked by the receiver
+	for (int idx = SIM_PAYLOAD_SIZE; idx < cfg.payload; idx++)
+	{
+		payload[idx] = (uint8_t)(id + idx);
+	}
+	memcpy(&payload[0], &id, 4);
+	memcpy(&payload[4], &nodes[current].addr, 4);
+	memcpy(&payload[8], &target, 4);
+	packets.push_back(packet);
+}
+
+extern "C" void sim_app_received(uint32_t from, uint8_t *payload, uint16_t size, bool is_broadcast)
+{
+	uint32_t id = 0;
+	if (size < SIM_PAYLOAD_SIZE)
+	{
+		return;
+	}
+	memcpy(&id, payload, 4);
+	if ((id == 0) || (id > packets.size()))
+	{
+		return;
+	}
+	for (int idx = SIM_PAYLOAD_SIZE; idx < size; idx++)
+	{
+		if (payload[idx] != (uint8_t)(id + idx))
+		{
+			fprintf(stderr, "Packet %u is corrupted at byte %d\n", id, idx);
+			return;
+		}
+	}
+	sim_packet_s &packet = packets[id - 1];
+	if (packet.receiver == current)
+	{
+		if (packet.delivered != 0)
+		{
+			duplicates++;
+			return;
+		}
+		packet.delivered = now_us;
+	}
+	else if (packet.receiver < 0)
+	{
+		if (packet.got[current])
+		{
+			duplicates++;
+		}
+		packet.got[current] = true;
+	}
+}
+
+extern "C" uint16_t sim_app_payload_size(void)
+{
+	return cfg.payload;
+}
+
+/*****************************************************************************
+ * Topology
+ *****************************************************************************/
+
+/**
+ * @brief Set a symmetric link between two nodes
+ *
+ */
+static void set_link(int node_a, int node_b, int16_t rssi)
+{
+	double noise = -174.0 + 10.0 * log10(bandwidth_hz()) + 6.0;
+	int snr = (int)lround(rssi - noise);
+	snr = std::min(12, std::max(-20, snr));
+	if (snr < snr_floor())
+	{
+		return;
+	}
+	link(node_a, node_b) = {true, rssi, (int8_t)snr};
+	link(node_b, node_a) = {true, rssi, (int8_t)snr};
+}
+
+/**
+ * @brief Create the link matrix
+ *
+ * @return true if topology is valid
+ */
+static bool create_topology(void)
+{
+	int num = cfg.nodes;
+	links.assign(num * num, {false, 0, 0});
+	double noise = -174.0 + 10.0 * log10(bandwidth_hz()) + 6.0;
+	// RSSI of a link at the edge of the range
+	double edge_rssi = noise + snr_floor() + 1.0;
+
+	if (cfg.topo == "full")
+	{
+		for (int node_a = 0; node_a < num; node_a++)
+		{
+			for (int node_b = node_a + 1; node_b < num; node_b++)
+			{
+				set_link(node_a, node_b, -90);
+			}
+		}
+	}
+	else if (cfg.topo == "line")
+	{
+		for (int node = 0; node < num - 1; node++)
+		{
+			set_link(node, node + 1, -110);
+		}
+	}
+	else if (cfg.topo == "grid")
+	{
+		int cols = (int)ceil(sqrt((double)num));
+		for (int node = 0; node < num; node++)
+		{
+			if (((node % cols) != (cols - 1)) && ((node + 1) < num))
+			{
+				set_link(node, node + 1, -110);
+			}
+			if ((node + cols) < num)
+			{
+				set_link(node, node + cols, -110);
+			}
+		}
+	}
+	else if (cfg.topo == "random")
+	{
+		// Nodes in a unit square, the radio range gives the requested average degree
+		std::uniform_real_distribution<double> pos(0.0, 1.0);
+		std::vector<double> pos_x(num), pos_y(num);
+		for (int node = 0; node < num; node++)
+		{
+			pos_x[node] = pos(rng);
+			pos_y[node] = pos(rng);
+		}
+		double range = sqrt(cfg.degree / (M_PI * num));
+		for (int node_a = 0; node_a < num; node_a++)
+		{
+			for (int node_b = node_a + 1; node_b < num; node_b++)
+			{
+				double dist = hypot(pos_x[node_a] - pos_x[node_b], pos_y[node_a] - pos_y[node_b]);
+				if (dist <= range)
+				{
+					// Log distance path loss with exponent 2.7
+					double rssi = edge_rssi + 27.0 * log10(range / std::max(dist, range / 100.0));
+					set_link(node_a, node_b, (int16_t)lround(std::min(rssi, -40.0)));
+				}
+			}
+		}
+	}
+	else if (cfg.topo.compare(0, 5, "file:") == 0)
+	{
+		// Lines with "node_a node_b [rssi]", node numbers start at 0
+		FILE *file = fopen(cfg.topo.c_str() + 5, "r");
+		if (file == NULL)
+		{
+			fprintf(stderr, "Cannot open %s\n", cfg.topo.c_str() + 5);
+			return false;
+		}
+		char line[128];
+		while (fgets(line, sizeof(line), file) != NULL)
+		{
+			int node_a, node_b, rssi = -100;
+			if ((line[0] == '#') || (sscanf(line, "%d %d %d", &node_a, &node_b, &rssi) < 2))
+			{
+				continue;
+			}
+			if ((node_a >= 0) && (node_a < num) && (node_b >= 0) && (node_b < num) && (node_a != node_b))
+			{
+				set_link(node_a, node_b, rssi);
+			}
+		}
+		fclose(file);
+	}
+	else
+	{
+		fprintf(stderr, "Unknown topology %s\n", cfg.topo.c_str());
+		return false;
+	}
+
+	// Hop distances and connected components
+	hop_dist.assign(num * num, -1);
+	for (int src = 0; src < num; src++)
+	{
+		std::vector<int> todo = {src};
+		hop_dist[src * num + src] = 0;
+		for (size_t head = 0; head < todo.size(); head++)
+		{
+			int node = todo[head];
+			for (int next = 0; next < num; next++)
+			{
+				if (link(node, next).ok && (hop_dist[src * num + next] < 0))
+				{
+					hop_dist[src * num + next] = hop_dist[src * num + node] + 1;
+					todo.push_back(next);
+				}
+			}
+		}
+	}
+	for (int node = 0; node < num; node++)
+	{
+		for (int other = 0; other < num; other++)
+		{
+			if (hop_dist[node * num + other] >= 0)
+			{
+				nodes[node].component++;
+			}
+		}
+	}
+	return true;
+}
+
+/*****************************************************************************
+ * Simulation
+ *****************************************************************************/
+
+/**
+ * @brief Load one copy of the node library per node
+ *
+ */
+static bool load_nodes(void)
+{
+	char tmp_dir[] = "/tmp/mesh_sim_XXXXXX";
+	if (mkdtemp(tmp_dir) == NULL)
+	{
+		return false;
+	}
+	FILE *src = fopen(cfg.lib.c_str(), "rb");
+	if (src == NULL)
+	{
+		fprintf(stderr, "Cannot open %s\n", cfg.lib.c_str());
+		return false;
+	}
+	std::vector<char> image;
+	char buf[65536];
+	size_t len;
+	while ((len = fread(buf, 1, sizeof(buf), src)) > 0)
+	{
+		image.insert(image.end(), buf, buf + len);
+	}
+	fclose(src);
+
+	for (int idx = 0; idx < cfg.nodes; idx++)
+	{
+		// dlopen() returns the same instance for the same file, each node needs its own copy
+		std::string path = std::string(tmp_dir) + "/node" + std::to_string(idx) + ".so";
+		FILE *dst = fopen(path.c_str(), "wb");
+		fwrite(image.data(), 1, image.size(), dst);
+		fclose(dst);
+		sim_node_s &node = nodes[idx];
+		node.lib = dlopen(path.c_str(), RTLD_NOW | RTLD_LOCAL);
+		unlink(path.c_str());
+		if (node.lib == NULL)
+		{
+			fprintf(stderr, "%s\n", dlerror());
+			return false;
+		}
+		node.setup = (sim_node_setup_t)dlsym(node.lib, "sim_node_setup");
+		node.start_traffic = (sim_node_start_traffic_t)dlsym(node.lib, "sim_node_start_traffic");
+		node.map_size = (sim_node_map_size_t)dlsym(node.lib, "sim_node_map_size");
+		node.has_route = (sim_node_has_route_t)dlsym(node.lib, "sim_node_has_route");
+		node.num_of_nodes = (int *)dlsym(node.lib, "g_num_of_nodes");
+		node.tx_stats = (mesh_tx_stats_s *)dlsym(node.lib, "g_mesh_tx_stats");
+		if ((node.setup == NULL) || (node.start_traffic == NULL) || (node.map_size == NULL) || (node.has_route == NULL))
+		{
+			fprintf(stderr, "Node library misses the sim_node_* functions\n");
+			return false;
+		}
+		// Unique upper 24 bits, the mesh uses them for the broadcast ID
+		node.addr = 0xAC000000 | ((uint32_t)(idx + 1) << 8) | (rng() & 0xFF);
+	}
+	rmdir(tmp_dir);
+	return true;
+}
+
+/**
+ * @brief Check if all nodes know all reachable nodes (or have a full map)
+ *
+ */
+static bool check_converged(void)
+{
+	for (int node = 0; node < cfg.nodes; node++)
+	{
+		int expected = std::min(nodes[node].component - 1, *nodes[node].num_of_nodes);
+		if (!nodes[node].booted || (nodes[node].map_size() < expected))
+		{
+			return false;
+		}
+	}
+	for (int node = 0; node < cfg.nodes; node++)
+	{
+		if ((nodes[node].component - 1) > *nodes[node].num_of_nodes)
+		{
+			// Map can not hold all nodes
+			continue;
+		}
+		for (int other = 0; other < cfg.nodes; other++)
+		{
+			if ((other != node) && (hop_dist[node * cfg.nodes + other] > 0) && !nodes[node].has_route(nodes[other].addr))
+			{
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+static void usage(void)
+{
+	printf("mesh_sim [options]\n"
+		   "  --nodes N         number of nodes (30)\n"
+		   "  --topo T          full, line, grid, random or file:<path> (grid)\n"
+		   "  --degree D        average number of neighbours for random (6)\n"
+		   "  --loss P          random packet loss 0.0 .. 1.0 (0)\n"
+		   "  --snr-loss        packet loss depends on the SNR of the link\n"
+		   "  --drift PPM       clock drift of the nodes (20)\n"
+		   "  --sf SF           spreading factor (7)\n"
+		   "  --bw BW           bandwidth, RUI3 P2P setting (0 = 125 kHz)\n"
+		   "  --cr CR           coding rate, RUI3 P2P setting (1 = 4/6)\n"
+		   "  --freq MHZ        frequency in MHz, sets the duty cycle limit (916)\n"
+		   "  --time S          simulated time in seconds (3600)\n"
+		   "  --interval S      send interval of test packets in seconds, 0 = off (60)\n"
+		   "  --payload B       size of the test packets in bytes (24)\n"
+		   "  --warmup S        start of test packets in seconds (120)\n"
+		   "  --boot S          nodes start randomly within S seconds (10)\n"
+		   "  --no-master       send to random nodes instead of node 0\n"
+		   "  --fail N:S        switch node N off after S seconds\n"
+		   "  --seed N          random seed (1)\n"
+		   "  --lib PATH        node library (./meshnode.so)\n"
+		   "  --per-node        print statistics of each node\n"
+		   "  --csv             print a single CSV line\n"
+		   "  --verbose         show Serial output of the nodes\n");
+}
+
+static bool parse_args(int argc, char **argv)
+{
+	for (int idx = 1; idx < argc; idx++)
+	{
+		std::string arg = argv[idx];
+		const char *val = (idx + 1 < argc) ? argv[idx + 1] : NULL;
+		bool has_val = true;
+		if (arg == "--nodes" && val)
+			cfg.nodes = atoi(val);
+		else if (arg == "--topo" && val)
+			cfg.topo = val;
+		else if (arg == "--degree" && val)
+			cfg.degree = atof(val);
+		else if (arg == "--loss" && val)
+			cfg.loss = atof(val);
+		else if (arg == "--drift" && val)
+			cfg.drift = atof(val);
+		else if (arg == "--sf" && val)
+			api.lora.psf.set(atoi(val));
+		else if (arg == "--bw" && val)
+			api.lora.pbw.set(atoi(val));
+		else if (arg == "--cr" && val)
+			api.lora.pcr.set(atoi(val));
+		else if (arg == "--freq" && val)
+			api.lora.pfreq.set((uint32_t)(atof(val) * 1000000.0));
+		else if (arg == "--time" && val)
+			cfg.sim_time = atoi(val);
+		else if (arg == "--interval" && val)
+			cfg.interval = atoi(val);
+		else if (arg == "--payload" && val)
+			cfg.payload = std::max(atoi(val), SIM_PAYLOAD_SIZE);
+		else if (arg == "--warmup" && val)
+			cfg.warmup = atoi(val);
+		else if (arg == "--boot" && val)
+			cfg.boot = atoi(val);
+		else if (arg == "--seed" && val)
+			cfg.seed = atoi(val);
+		else if (arg == "--lib" && val)
+			cfg.lib = val;
+		else if (arg == "--fail" && val)
+		{
+			if (sscanf(val, "%d:%u", &cfg.fail_node, &cfg.fail_time) != 2)
+			{
+				usage();
+				return false;
+			}
+		}
+		else
+		{
+			has_val = false;
+			if (arg == "--no-master")
+				cfg.master = false;
+			else if (arg == "--snr-loss")
+				cfg.snr_loss = true;
+			else if (arg == "--per-node")
+				cfg.per_node = true;
+			else if (arg == "--csv")
+				cfg.csv = true;
+			else if (arg == "--verbose")
+				cfg.verbose = true;
+			else
+			{
+				usage();
+				return false;
+			}
+		}
+		if (has_val)
+		{
+			idx++;
+		}
+	}
+	return (cfg.nodes >= 2) && (cfg.nodes <= 1000) && (cfg.fail_node < cfg.nodes);
+}
+
+/**
+ * @brief Energy the radio of a node used after the warm up
+ *
+ * @param node node
+ * @param rx_s set to the time the receiver was on in s
+ * @return double energy in mJ
+ */
+static double radio_energy(sim_node_s &node, double &rx_s)
+{
+	uint64_t warmup_us = (uint64_t)cfg.warmup * 1000000;
+	uint64_t end_us = (uint64_t)cfg.sim_time * 1000000;
+	if (end_us <= warmup_us)
+	{
+		rx_s = 0;
+		return 0;
+	}
+	uint64_t rx_us = node.rx_on_us;
+	if (node.rx_enabled)
+	{
+		rx_us += end_us - std::max(node.rx_start, warmup_us);
+	}
+	rx_s = rx_us / 1e6;
+	double tx_s = node.measured_airtime_ms / 1000.0;
+	// The receiver stays on during a TX
+	double listen_s = std::max(rx_s - tx_s, 0.0);
+	double sleep_s = std::max((end_us - warmup_us) / 1e6 - listen_s - tx_s, 0.0);
+	return SIM_SUPPLY_V * (SIM_TX_MA * tx_s + SIM_RX_MA * listen_s + SIM_SLEEP_MA * sleep_s);
+}
+
+/**
+ * @brief Print the results
+ *
+ */
+static void report(void)
+{
+	double hours = cfg.sim_time / 3600.0;
+	uint32_t sent = 0, delivered = 0, bcast_sent = 0;
+	double bcast_cover = 0;
+	std::vector<double> latency;
+	double per_hop_sum = 0;
+	for (sim_packet_s &packet : packets)
+	{
+		if (packet.receiver >= 0)
+		{
+			int hops = hop_dist[packet.origin * cfg.nodes + packet.receiver];
+			if (hops <= 0)
+			{
+				continue;
+			}
+			sent++;
+			if (packet.delivered != 0)
+			{
+				delivered++;
+				double lat = (packet.delivered - packet.sent) / 1000.0;
+				latency.push_back(lat);
+				per_hop_sum += lat / hops;
+			}
+		}
+		else
+		{
+			int reachable = nodes[packet.origin].component - 1;
+			if (reachable > 0)
+			{
+				bcast_sent++;
+				bcast_cover += (double)std::count(packet.got.begin(), packet.got.end(), true) / reachable;
+			}
+		}
+	}
+	std::sort(latency.begin(), latency.end());
+	double lat_avg = 0;
+	for (double lat : latency)
+	{
+		lat_avg += lat;
+	}
+	lat_avg = latency.empty() ? 0 : lat_avg / latency.size();
+	double lat_p50 = latency.empty() ? 0 : latency[latency.size() / 2];
+	double lat_p95 = latency.empty() ? 0 : latency[(latency.size() * 95) / 100];
+	double per_hop = latency.empty() ? 0 : per_hop_sum / latency.size();
+
+	double air_sum = 0, air_max = 0, bytes_sum = 0;
+	uint32_t tx_frames = 0, cad_busy = 0, send_errors = 0, rx_ok = 0;
+	int air_max_node = 0;
+	for (int node = 0; node < cfg.nodes; node++)
+	{
+		air_sum += nodes[node].airtime_ms;
+		bytes_sum += nodes[node].tx_bytes;
+		tx_frames += nodes[node].tx_frames;
+		cad_busy += nodes[node].cad_busy;
+		send_errors += nodes[node].send_errors;
+		rx_ok += nodes[node].rx_frames_ok;
+		if (nodes[node].airtime_ms > air_max)
+		{
+			air_max = nodes[node].airtime_ms;
+			air_max_node = node;
+		}
+	}
+	// TX scheduler counters, missing in node libraries before the TX classes
+	mesh_tx_stats_s tx_stats[MESH_TX_CLASSES] = {};
+	bool has_tx_stats = false;
+	for (int node = 0; node < cfg.nodes; node++)
+	{
+		if (nodes[node].tx_stats != NULL)
+		{
+			has_tx_stats = true;
+			for (int tx_class = 0; tx_class < MESH_TX_CLASSES; tx_class++)
+			{
+				tx_stats[tx_class].queued += nodes[node].tx_stats[tx_class].queued;
+				tx_stats[tx_class].dropped += nodes[node].tx_stats[tx_class].dropped;
+				tx_stats[tx_class].failed += nodes[node].tx_stats[tx_class].failed;
+				tx_stats[tx_class].retried += nodes[node].tx_stats[tx_class].retried;
+				tx_stats[tx_class].retransmitted += nodes[node].tx_stats[tx_class].retransmitted;
+				tx_stats[tx_class].aggregated += nodes[node].tx_stats[tx_class].aggregated;
+			}
+		}
+	}
+	// Radio energy after the warm up, the test packets are sent only after it
+	double energy_sum = 0, rx_on_sum = 0;
+	uint32_t forwarded = 0;
+	for (int node = 0; node < cfg.nodes; node++)
+	{
+		double rx_s;
+		energy_sum += radio_energy(nodes[node], rx_s);
+		rx_on_sum += rx_s;
+		if (nodes[node].tx_stats != NULL)
+		{
+			forwarded += nodes[node].tx_stats[MESH_TX_FORWARD].sent;
+		}
+	}
+	double measure_s = (cfg.sim_time > cfg.warmup) ? cfg.sim_time - cfg.warmup : 0;
+	double energy_node_hour = measure_s ? energy_sum / 1000.0 / cfg.nodes / (measure_s / 3600.0) : 0;
+	double rx_on_pct = measure_s ? 100.0 * rx_on_sum / cfg.nodes / measure_s : 0;
+	double energy_forward = forwarded ? energy_sum / forwarded : 0;
+	double energy_delivered = delivered ? energy_sum / delivered : 0;
+
+	double air_avg = air_sum / cfg.nodes / 1000.0;
+	double ratio = sent ? 100.0 * delivered / sent : 0;
+	double conv = converged_us ? converged_us / 1e6 : -1;
+	double removal = removed_us ? removed_us / 1e6 : -1;
+
+	if (cfg.csv)
+	{
+		printf("nodes,topo,sf,time_s,converged_s,sent,delivered,delivery_pct,duplicates,lat_avg_ms,lat_p50_ms,lat_p95_ms,per_hop_ms,"
+			   "airtime_avg_s,airtime_max_s,bytes_node_hour,tx_frames,collisions,cad_busy,send_errors,removal_s,"
+			   "rx_on_pct,energy_j_node_hour,energy_mj_forward,energy_mj_delivered\n");
+		printf("%d,%s,%u,%u,%.1f,%u,%u,%.2f,%u,%.1f,%.1f,%.1f,%.1f,%.2f,%.2f,%.0f,%u,%u,%u,%u,%.1f,%.2f,%.2f,%.1f,%.1f\n",
+			   cfg.nodes, cfg.topo.c_str(), api.lora.psf.get(), cfg.sim_time, conv, sent, delivered, ratio, duplicates,
+			   lat_avg, lat_p50, lat_p95, per_hop, air_avg, air_max / 1000.0, bytes_sum / cfg.nodes / hours,
+			   tx_frames, collisions, cad_busy, send_errors, removal,
+			   rx_on_pct, energy_node_hour, energy_forward, energy_delivered);
+		return;
+	}
+
+	printf("---------------------------------------------\n");
+	printf("Nodes %d, topology %s, SF%u, %u s simulated\n", cfg.nodes, cfg.topo.c_str(), api.lora.psf.get(), cfg.sim_time);
+	if (conv >= 0)
+	{
+		printf("Map convergence:    %.1f s\n", conv);
+	}
+	else
+	{
+		printf("Map convergence:    not converged\n");
+	}
+	if ((cfg.fail_node >= 0) && (removal >= 0))
+	{
+		printf("Route removal:      %.1f s after node %d failed\n", removal, cfg.fail_node);
+	}
+	else if (cfg.fail_node >= 0)
+	{
+		printf("Route removal:      node %d failed, routes not removed\n", cfg.fail_node);
+	}
+	printf("Delivery:           %u of %u (%.2f %%), %u duplicates\n", delivered, sent, ratio, duplicates);
+	if (bcast_sent)
+	{
+		printf("Broadcast coverage: %.2f %% of %u broadcasts\n", 100.0 * bcast_cover / bcast_sent, bcast_sent);
+	}
+	printf("Latency:            avg %.1f ms, p50 %.1f ms, p95 %.1f ms\n", lat_avg, lat_p50, lat_p95);
+	printf("Latency per hop:    %.1f ms\n", per_hop);
+	printf("Airtime per node:   avg %.2f s (%.3f %%), max %.2f s (node %d)\n",
+		   air_avg, 100.0 * air_avg / cfg.sim_time, air_max / 1000.0, air_max_node);
+	printf("Bytes on air:       %.0f per node per hour\n", bytes_sum / cfg.nodes / hours);
+	printf("Frames:             %u sent, %u received, %u collisions, %u CAD busy, %u send errors\n",
+		   tx_frames, rx_ok, collisions, cad_busy, send_errors);
+	printf("Radio energy:       %.2f J per node per hour, RX on %.2f %% of the time\n", energy_node_hour, rx_on_pct);
+	printf("Energy per packet:  %.1f mJ per forwarded frame, %.1f mJ per delivered packet\n", energy_forward, energy_delivered);
+	if (has_tx_stats)
+	{
+		const char *names[MESH_TX_CLASSES] = {"control", "forward", "local"};
+		for (int tx_class = 0; tx_class < MESH_TX_CLASSES; tx_class++)
+		{
+			printf("TX %-8s         %u queued, %u dropped, %u failed, %u retried, %u retransmitted, %u aggregated\n", names[tx_class],
+				   tx_stats[tx_class].queued, tx_stats[tx_class].dropped, tx_stats[tx_class].failed,
+				   tx_stats[tx_class].retried, tx_stats[tx_class].retransmitted, tx_stats[tx_class].aggregated);
+		}
+	}
+	printf("---------------------------------------------\n");
+
+	if (cfg.per_node)
+	{
+		printf("%4s %8s %5s %8s %9s %8s %8s %8s %6s %7s %9s\n", "#", "address", "map", "missing", "airtime", "tx", "rx", "rx lost", "cad",
+			   "rx on", "energy");
+		for (int node = 0; node < cfg.nodes; node++)
+		{
+			sim_node_s &sim_node = nodes[node];
+			int map = 0;
+			int missing = 0;
+			run_node(node, [&]()
+					 {
+						 map = sim_node.map_size();
+						 for (int other = 0; other < cfg.nodes; other++)
+						 {
+							 if ((hop_dist[node * cfg.nodes + other] > 0) && !sim_node.has_route(nodes[other].addr))
+							 {
+								 missing++;
+							 }
+						 } });
+			double rx_s;
+			double energy = radio_energy(sim_node, rx_s);
+			printf("%4d %08X %5d %8d %8.2fs %8u %8u %8u %6u %6.1f%% %7.0fmJ\n", node, sim_node.addr, map, missing, sim_node.airtime_ms / 1000.0,
+				   sim_node.tx_frames, sim_node.rx_frames_ok, sim_node.rx_lost, sim_node.cad_busy,
+				   measure_s ? 100.0 * rx_s / measure_s : 0, energy);
+		}
+	}
+}
+
+int main(int argc, char **argv)
+{
+	if (!parse_args(argc, argv))
+	{
+		return 1;
+	}
+	rng.seed(cfg.seed);
+	nodes.resize(cfg.nodes);
+	if (!load_nodes() || !create_topology())
+	{
+		return 1;
+	}
+
+	std::uniform_int_distribution<uint64_t> boot(0, (uint64_t)cfg.boot * 1000000);
+	std::uniform_real_distribution<double> drift(-cfg.drift, cfg.drift);
+	for (int node = 0; node < cfg.nodes; node++)
+	{
+		nodes[node].clock = 1.0 + drift(rng) / 1e6;
+		schedule(boot(rng), EV_BOOT, node);
+	}
+	schedule((uint64_t)cfg.warmup * 1000000, EV_TRAFFIC, 0);
+	schedule(1000000, EV_CHECK, 0);
+	if (cfg.fail_node >= 0)
+	{
+		schedule((uint64_t)cfg.fail_time * 1000000, EV_FAIL, cfg.fail_node);
+	}
+
+	uint64_t end_us = (uint64_t)cfg.sim_time * 1000000;
+	while (!events.empty() && (events.top().time <= end_us))
+	{
+		sim_event_s event = events.top();
+		events.pop();
+		now_us = event.time;
+		sim_node_s &node = nodes[event.node];
+		if (node.failed && ((event.type == EV_TIMER) || (event.type == EV_CAD_END) || (event.type == EV_TRAFFIC + 100)))
+		{
+			// Node is switched off
+			continue;
+		}
+
+		switch (event.type)
+		{
+		case EV_BOOT:
+			node.booted = true;
+			run_node(event.node, [&]()
+					 { node.setup(cfg.interval * 1000, (cfg.master && (event.node != 0)) ? nodes[0].addr : 0); });
+			break;
+		case EV_TIMER:
+		{
+			sim_timer_s &timer = node.timers[event.arg];
+			if (!timer.active || (timer.gen != event.gen))
+			{
+				break;
+			}
+			if (timer.mode == RAK_TIMER_PERIODIC)
+			{
+				schedule(now_us + (uint64_t)(timer.period * 1000 * node.clock), EV_TIMER, event.node, event.arg, timer.gen);
+			}
+			else
+			{
+				timer.active = false;
+			}
+			run_node(event.node, [&]()
+					 { timer.handler(NULL); });
+			break;
+		}
+		case EV_CAD_END:
+			if (event.gen != 0)
+			{
+				// Channel is busy if any frame is arriving at this node
+				bool busy = !node.rx_frames.empty();
+				if (busy)
+				{
+					node.radio_busy = false;
+					node.cad_busy++;
+				}
+				if (node.cad_cb != NULL)
+				{
+					run_node(event.node, [&]()
+							 { node.cad_cb(busy); });
+				}
+				if (busy)
+				{
+					break;
+				}
+			}
+			start_tx(event.node, event.arg);
+			frame_data[event.arg].clear();
+			break;
+		case EV_TX_END:
+			end_tx(event.arg);
+			break;
+		case EV_TRAFFIC:
+			for (int idx = 0; idx < cfg.nodes; idx++)
+			{
+				if (cfg.master && (idx == 0))
+				{
+					continue;
+				}
+				// Spread the start of the nodes over one send interval
+				std::uniform_int_distribution<uint64_t> offset(0, (uint64_t)cfg.interval * 1000000);
+				schedule(now_us + offset(rng), EV_TRAFFIC + 100, idx);
+			}
+			break;
+		case EV_TRAFFIC + 100:
+			if (node.booted)
+			{
+				run_node(event.node, [&]()
+						 { node.start_traffic(); });
+			}
+			break;
+		case EV_CHECK:
+			if (check_converged())
+			{
+				converged_us = now_us;
+			}
+			else
+			{
+				schedule(now_us + 1000000, EV_CHECK, 0);
+			}
+			break;
+		case EV_FAIL:
+			node.failed = true;
+			node.booted = false;
+			set_rx(node, false);
+			schedule(now_us + 1000000, EV_FAIL_CHECK, event.node);
+			break;
+		case EV_FAIL_CHECK:
+		{
+			// Wait until no node has a route to the failed node
+			bool has_route = false;
+			for (int other = 0; (other < cfg.nodes) && !has_route; other++)
+			{
+				if (!nodes[other].failed)
+				{
+					run_node(other, [&]()
+							 { has_route = nodes[other].has_route(node.addr); });
+				}
+			}
+			if (has_route)
+			{
+				schedule(now_us + 1000000, EV_FAIL_CHECK, event.node);
+			}
+			else
+			{
+				removed_us = now_us - (uint64_t)cfg.fail_time * 1000000;
+			}
+			break;
+		}
+		}
+	}
+	now_us = end_us;
+	report();
+	return 0;
+}
@@ -0,0 +1,188 @@
+/**
+ * @file packet_bench.cpp
+ * @author Bernd Giesecke (bernd@giesecke.tk)
+ * @brief Host benchmark for the packet path in mesh.cpp
+ * @version 0.1
+ * @date 2026-10-16
+ *
+ * @copyright Copyright (c) 2026
+ *
+ */
+#include "main.h"
+#include <chrono>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+// Globals that are normally provided by the application
+volatile uint16_t g_task_event_type = NO_EVENT;
+custom_param_s g_custom_parameters;
+bool has_rak1921 = false;
+char line_str[256];
+void rak1921_add_line(char *line) {}
+void rak1921_clear(void) {}
+void rak1921_write_header(char *header_line) {}
+void rak1921_write_line(int16_t line, int16_t y_pos, String text) {}
+void rak1921_display(void) {}
+
+// Host versions of the Arduino and RUI3 functions, the radio and the timers do nothing
+HostApi api;
+HostSerial Serial;
+HostSerial Serial6;
+unsigned long millis(void) { return 0; }
+void delay(unsigned long ms) {}
+void noInterrupts(void) {}
+void interrupts(void) {}
+long random(long min, long max) { return min + (rand() % (max - min)); }
+int HostSerial::printf(const char *format, ...) { return 0; }
+size_t HostSerial::println(const char *str) { return 0; }
+/** A packet was given to the radio */
+bool tx_started = false;
+bool HostApi::lora::psend(uint8_t length, uint8_t *payload, bool cad)
+{
+	tx_started = true;
+	return true;
+}
+bool HostApi::lora::precv(uint32_t timeout) { return true; }
+bool HostApi::lorawan::deui::get(uint8_t *buf, uint32_t len)
+{
+	memset(buf, 0, len);
+	buf[4] = 0x12;
+	buf[5] = 0x34;
+	buf[6] = 0x56;
+	buf[7] = 0x78;
+	return true;
+}
+bool HostApi::system::timer::create(RAK_TIMER_ID id, RAK_TIMER_HANDLER handler, RAK_TIMER_MODE mode) { return true; }
+bool HostApi::system::timer::start(RAK_TIMER_ID id, uint32_t ms, void *data) { return true; }
+bool HostApi::system::timer::stop(RAK_TIMER_ID id) { return true; }
+
+/** Node that forwards through this node */
+#define BENCH_NEIGHBOUR 0xAC000101
+/** Node the forwarded packets are sent to */
+#define BENCH_TARGET 0xAC000202
+/** Node a forwarded packet is addressed to, forwarding nodes handle packets for other nodes */
+#define BENCH_OTHER 0xAC000303
+
+/** Received data packets */
+volatile uint32_t sink;
+
+void on_data(uint32_t from, uint8_t *payload, uint16_t size, int16_t rssi, int8_t snr, bool is_broadcast)
+{
+	sink += size;
+}
+
+/**
+ * @brief Return cycles per operation, or ns if the CPU has no time stamp counter.
+ * 			Best of 5 runs to reduce the noise of the host
+ *
+ */
+template <typename F>
+static double time_cycles(long ops, F func)
+{
+	double best = 0;
+	for (int run = 0; run < 5; run++)
+	{
+#if defined(__x86_64__) || defined(__i386__)
+		uint64_t start = __rdtsc();
+		func();
+		double result = (double)(__rdtsc() - start) / ops;
+#else
+		auto start = std::chrono::steady_clock::now();
+		func();
+		auto stop = std::chrono::steady_clock::now();
+		double result = std::chrono::duration<double, std::nano>(stop - start).count() / ops;
+#endif
+		if ((run == 0) || (result < best))
+		{
+			best = result;
+		}
+	}
+	return best;
+}
+
+/**
+ * @brief Handle all pending mesh events, finish each TX immediately
+ *
+ */
+static void run_mesh(void)
+{
+	while (mesh_event != NO_EVENT)
+	{
+		mesh_task(NULL);
+		if (tx_started)
+		{
+			tx_started = false;
+			mesh_check_tx();
+		}
+	}
+}
+
+int main(int argc, char **argv)
+{
+	const long rounds = (argc > 1) ? atol(argv[1]) : 200000;
+
+	mesh_events_s events = {on_data, NULL};
+	init_mesh(&events);
+	run_mesh();
+
+	// Neighbour and a target that is direct for this node
+	add_node(BENCH_NEIGHBOUR, 0, 0);
+	add_node(BENCH_TARGET, 0, 0);
+
+	// Packet from the neighbour that has to be forwarded to the target
+	uint8_t forward[DATA_HEADER_SIZE + 24];
+	data_msg_s *forward_msg = (data_msg_s *)forward;
+	forward_msg->mark1 = 'L';
+	forward_msg->mark2 = 'o';
+	forward_msg->mark3 = 'R';
+	forward_msg->type = LORA_FORWARD;
+	forward_msg->dest = BENCH_OTHER;
+	forward_msg->from = BENCH_TARGET;
+	forward_msg->orig = BENCH_NEIGHBOUR;
+	memset(forward_msg->data, 0x55, 24);
+
+	// Direct packet for this node
+	uint8_t direct[DATA_HEADER_SIZE + 24];
+	memcpy(direct, forward, sizeof(direct));
+	data_msg_s *direct_msg = (data_msg_s *)direct;
+	direct_msg->type = LORA_DIRECT;
+	direct_msg->dest = g_this_device_addr;
+	direct_msg->from = BENCH_NEIGHBOUR;
+	direct_msg->orig = 0;
+
+	uint8_t payload[24] = {0};
+
+	printf("%14s %14s %14s\r\n", "rx direct", "rx+forward", "local tx");
+
+	double rx_direct = time_cycles(rounds, [&]()
+								   {
+		for (long round = 0; round < rounds; round++)
+		{
+			// New sequence number, otherwise the packet is dropped as a duplicate
+			direct_msg->seq++;
+			add_rx_packet(-80, 5, sizeof(direct), direct);
+			run_mesh();
+		} });
+
+	double rx_forward = time_cycles(rounds, [&]()
+									{
+		for (long round = 0; round < rounds; round++)
+		{
+			// New sequence number, otherwise the packet is dropped as a duplicate
+			forward_msg->seq++;
+			add_rx_packet(-80, 5, sizeof(forward), forward);
+			run_mesh();
+		} });
+
+	double tx_local = time_cycles(rounds, [&]()
+								  {
+		for (long round = 0; round < rounds; round++)
+		{
+			send_to_mesh(false, BENCH_TARGET, payload, sizeof(payload));
+			run_mesh();
+		} });
+
+	printf("%14.0f %14.0f %14.0f\r\n", rx_direct, rx_forward, tx_local);
+	return 0;
+}
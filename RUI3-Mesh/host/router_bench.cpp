@@ -0,0 +1,177 @@
+/**
+ * @file router_bench.cpp
+ * @author Bernd Giesecke (bernd@giesecke.tk)
+ * @brief Host benchmark for the mesh routing table in router.cpp
+ * @version 0.1
+ * @date 2026-10-16
+ *
+ * @copyright Copyright (c) 2026
+ *
+ */
+#include "main.h"
+#include <chrono>
+#include <vector>
+
+// Globals that are normally provided by mesh.cpp, user_at_cmd.cpp and RUI3
+HostApi api;
+int g_num_of_nodes = 0;
+uint32_t g_this_device_addr = 0x12345678;
+uint32_t g_broadcast_id = 0x12345600;
+custom_param_s g_custom_parameters;
+
+// Older router.cpp versions do not have the init function
+bool init_router(void) __attribute__((weak));
+
+/** Fake time base */
+unsigned long fake_time = 0;
+
+unsigned long millis(void)
+{
+	return fake_time;
+}
+
+void delay(unsigned long ms)
+{
+	fake_time += ms;
+}
+
+long random(long min, long max)
+{
+	return min + (rand() % (max - min));
+}
+
+/** Keeps the compiler from optimizing the lookups away */
+volatile uint32_t sink;
+
+/**
+ * @brief Prepare an empty nodes map
+ *
+ */
+static void reset_map(void)
+{
+	if (init_router)
+	{
+		init_router();
+	}
+	else
+	{
+		g_nodes_map = (g_nodes_list_s *)calloc(g_num_of_nodes, sizeof(g_nodes_list_s));
+		extern int nodes_mapindex;
+		nodes_mapindex = 0;
+	}
+}
+
+/**
+ * @brief Return ns per operation
+ *
+ */
+template <typename F>
+static double time_ns(long ops, F func)
+{
+	auto start = std::chrono::steady_clock::now();
+	func();
+	auto stop = std::chrono::steady_clock::now();
+	return std::chrono::duration<double, std::nano>(stop - start).count() / ops;
+}
+
+int main(int argc, char **argv)
+{
+	const int sizes[] = {15, 30, 48, 256};
+	const long rounds = (argc > 1) ? atol(argv[1]) : 20000;
+
+	srand(42);
+	printf("%6s %12s %12s %12s %14s %14s %12s\r\n", "nodes", "hit ns", "miss ns", "refresh ns", "evict+ins ns", "map sync ns", "clean ns");
+
+	for (int size : sizes)
+	{
+		g_num_of_nodes = size;
+		reset_map();
+
+		std::vector<uint32_t> ids(size);
+		std::vector<uint32_t> unknown(size);
+		for (int idx = 0; idx < size; idx++)
+		{
+			ids[idx] = ((uint32_t)rand() << 8) ^ (uint32_t)rand() ^ 0x80000000;
+			unknown[idx] = ids[idx] ^ 0x00010001;
+			add_node(ids[idx], (idx % 3) == 0 ? 0 : ids[0], (idx % 3) == 0 ? 0 : 1 + (idx % 4));
+		}
+
+		g_nodes_list_s route;
+		double hit = time_ns(rounds * size, [&]()
+							 {
+			for (long round = 0; round < rounds; round++)
+			{
+				for (int idx = 0; idx < size; idx++)
+				{
+					sink += get_route(ids[idx], &route);
+				}
+			} });
+
+		double miss = time_ns(rounds * size, [&]()
+							  {
+			for (long round = 0; round < rounds; round++)
+			{
+				for (int idx = 0; idx < size; idx++)
+				{
+					sink += check_node(unknown[idx]);
+				}
+			} });
+
+		double refresh = time_ns(rounds * size, [&]()
+								 {
+			for (long round = 0; round < rounds; round++)
+			{
+				for (int idx = 0; idx < size; idx++)
+				{
+					sink += add_node(ids[idx], ids[0], 10);
+				}
+			} });
+
+		// Insert into a full map, every insert has to evict a node.
+		// The nodes of the other half timed out, a full map keeps nodes that are alive and closer
+		extern time_t in_active_timeout;
+		double churn = time_ns(rounds * size * 2, [&]()
+							   {
+			for (long round = 0; round < rounds; round++)
+			{
+				fake_time += in_active_timeout;
+				for (int idx = 0; idx < size; idx++)
+				{
+					fake_time++;
+					sink += add_node(unknown[idx], ids[0], 2);
+				}
+				fake_time += in_active_timeout;
+				for (int idx = 0; idx < size; idx++)
+				{
+					fake_time++;
+					sink += add_node(ids[idx], ids[0], 2);
+				}
+			} });
+
+		// A map sync from a neighbour with up to 48 subs (or the map size)
+		int subs = size <= 48 ? size - 1 : 48;
+		long sync_rounds = rounds / 10 + 1;
+		double sync = time_ns(sync_rounds, [&]()
+							  {
+			for (long round = 0; round < sync_rounds; round++)
+			{
+				add_node(ids[0], 0, 0);
+				clear_subs(ids[0]);
+				for (int idx = 1; idx <= subs; idx++)
+				{
+					sink += add_node(ids[idx], ids[0], 2);
+				}
+			} });
+
+		// Regular check for timed out nodes, no node timed out
+		double clean = time_ns(rounds, [&]()
+							   {
+			for (long round = 0; round < rounds; round++)
+			{
+				sink += clean_map();
+			} });
+
+		printf("%6d %12.1f %12.1f %12.1f %14.1f %14.1f %12.1f\r\n", size, hit, miss, refresh, churn, sync, clean);
+	}
+	return 0;
+}
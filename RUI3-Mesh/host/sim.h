@@ -0,0 +1,59 @@
+/**
+ * @file sim.h
+ * @author Bernd Giesecke (bernd@giesecke.tk)
+ * @brief Interface between the simulator and the simulated mesh nodes
+ * @version 0.1
+ * @date 2026-10-16
+ *
+ * @copyright Copyright (c) 2026
+ *
+ */
+#ifndef HOST_SIM_H
+#define HOST_SIM_H
+
+#include <stdint.h>
+
+/** Size of the test payload, same as the STATUS packet of RUI3-Mesh.ino */
+#define SIM_PAYLOAD_SIZE 24
+
+extern "C"
+{
+	// Provided by the simulator, called by the node application
+
+	/**
+	 * @brief Register a new application packet
+	 *
+	 * @param target node address the packet is sent to, 0 for a broadcast
+	 * @param payload buffer for the test payload, SIM_PAYLOAD_SIZE bytes
+	 */
+	void sim_app_new_packet(uint32_t target, uint8_t *payload);
+
+	/**
+	 * @brief Report a received application packet
+	 *
+	 * @param from node address the mesh reported as sender
+	 * @param payload received payload
+	 * @param size size of the payload
+	 * @param is_broadcast true if received as broadcast
+	 */
+	void sim_app_received(uint32_t from, uint8_t *payload, uint16_t size, bool is_broadcast);
+
+	/**
+	 * @brief Size of the test packets, at least SIM_PAYLOAD_SIZE
+	 *
+	 */
+	uint16_t sim_app_payload_size(void);
+
+	// Provided by each node library, found with dlsym()
+
+	/** Configure and start the node, like setup() in RUI3-Mesh.ino */
+	typedef void (*sim_node_setup_t)(uint32_t send_interval, uint32_t master_address);
+	/** Start sending application packets */
+	typedef void (*sim_node_start_traffic_t)(void);
+	/** Number of nodes in the map of this node */
+	typedef uint8_t (*sim_node_map_size_t)(void);
+	/** Check if this node has a route to a node */
+	typedef bool (*sim_node_has_route_t)(uint32_t node_addr);
+}
+
+#endif /* HOST_SIM_H */
@@ -0,0 +1,210 @@
+/**
+ * @file sim_node.cpp
+ * @author Bernd Giesecke (bernd@giesecke.tk)
+ * @brief Application part of a simulated mesh node.
+ * 		Mirrors RUI3-Mesh.ino, but sends test packets that the simulator can track.
+ * 		Compiled together with mesh.cpp and router.cpp into one shared library per node.
+ * @version 0.1
+ * @date 2026-10-16
+ *
+ * @copyright Copyright (c) 2026
+ *
+ */
+#include "main.h"
+#include "sim.h"
+
+/** Flag for the event type */
+volatile uint16_t g_task_event_type = NO_EVENT;
+
+/** Buffer for BLE/Mesh data */
+char data_buffer[MESH_MAX_TRANSFER_SIZE] = {0};
+
+/** Custom flash parameters */
+custom_param_s g_custom_parameters;
+
+/** No OLED in the simulation */
+bool has_rak1921 = false;
+
+/** Buffer for OLED output */
+char line_str[256];
+
+// OLED functions are not used in the simulation
+void rak1921_add_line(char *line) {}
+void rak1921_clear(void) {}
+void rak1921_write_header(char *header_line) {}
+void rak1921_write_line(int16_t line, int16_t y_pos, String text) {}
+void rak1921_display(void) {}
+
+/**
+ * @brief LoRa P2P callback if a packet was received
+ *
+ * @param data received packet
+ */
+void recv_cb(rui_lora_p2p_recv_t data)
+{
+	// Save RX packet in queue to be processed by the mesh handler
+	add_rx_packet(data.Rssi, data.Snr, data.BufferSize, data.Buffer);
+}
+
+/**
+ * @brief LoRa P2P callback if a packet was sent
+ *
+ */
+void send_cb(void)
+{
+	// Check what to do after successful TX
+	mesh_check_tx();
+}
+
+/**
+ * @brief LoRa P2P callback after CAD
+ *
+ * @param result true if channel is busy
+ */
+void cad_cb(bool result)
+{
+	// Packet is not sent if the channel is busy
+	mesh_check_cad(result);
+}
+
+/**
+ * @brief Callback after a LoRa Mesh data package was received
+ *
+ */
+void on_mesh_data(uint32_t fromID, uint8_t *rxPayload, uint16_t rxSize, int16_t rxRssi, int8_t rxSnr, bool isBroadcast)
+{
+	sim_app_received(fromID, rxPayload, rxSize, isBroadcast);
+}
+
+/**
+ * @brief Callback after the nodes list changed
+ *
+ */
+void map_changed_cb(void)
+{
+	g_task_event_type |= MESH_MAP_CHANGED;
+}
+
+void status_timer(void *)
+{
+	g_task_event_type |= STATUS;
+}
+
+/**
+ * @brief Event handler, same flow as in RUI3-Mesh.ino
+ *
+ */
+void timed_loop(void *)
+{
+	while (g_task_event_type != NO_EVENT)
+	{
+		if ((g_task_event_type & MESH_MAP_CHANGED) == MESH_MAP_CHANGED)
+		{
+			g_task_event_type &= N_MESH_MAP_CHANGED;
+		}
+
+		if ((g_task_event_type & STATUS) == STATUS)
+		{
+			g_task_event_type &= N_STATUS;
+
+			// Select broadcast as default
+			bool use_broadcast = true;
+			// Target node address;
+			uint32_t node_addr = 0x00;
+
+			if (g_custom_parameters.master_address != 0)
+			{
+				node_addr = g_custom_parameters.master_address;
+				g_nodes_list_s route;
+				// Check if we have a route to the master
+				use_broadcast = !get_route(g_custom_parameters.master_address, &route);
+			}
+			else
+			{
+				// Select a random node from the map
+				uint8_t node_index = nodes_in_map();
+				if (node_index > 0)
+				{
+					node_addr = get_node_addr((uint8_t)random(0, (long)node_index));
+					use_broadcast = node_addr == 0x00;
+				}
+			}
+
+			sim_app_new_packet(use_broadcast ? 0 : node_addr, (uint8_t *)data_buffer);
+			send_to_mesh(use_broadcast, node_addr, (uint8_t *)data_buffer, sim_app_payload_size());
+		}
+	}
+
+	// Handle Mesh events
+	while (mesh_event != NO_EVENT)
+	{
+		mesh_task(NULL);
+	}
+
+	api.system.timer.start(RAK_TIMER_3, EVENT_HANDLER_TIME, NULL);
+}
+
+extern "C"
+{
+	/**
+	 * @brief Setup of the node, like setup() in RUI3-Mesh.ino
+	 *
+	 * @param send_interval interval for test packets in milliseconds
+	 * @param master_address address of the master node or 0
+	 */
+	void sim_node_setup(uint32_t send_interval, uint32_t master_address)
+	{
+		g_custom_parameters.send_interval = send_interval;
+		g_custom_parameters.master_address = master_address;
+
+		// Setup callbacks
+		g_mesh_events.data_avail_cb = on_mesh_data;
+		g_mesh_events.map_changed_cb = map_changed_cb;
+		api.lora.registerPRecvCallback(recv_cb);
+		api.lora.registerPSendCallback(send_cb);
+		api.lora.registerPSendCADCallback(cad_cb);
+
+		// Initialize the LoRa Mesh * events
+		init_mesh(&g_mesh_events);
+
+		// Enable RX mode (always with TX allowed)
+		api.lora.precv(65533);
+
+		// Timer to handle events
+		api.system.timer.create(RAK_TIMER_3, timed_loop, RAK_TIMER_ONESHOT);
+		api.system.timer.start(RAK_TIMER_3, EVENT_HANDLER_TIME, NULL);
+
+		// Timer for interval data sending
+		api.system.timer.create(RAK_TIMER_2, status_timer, RAK_TIMER_PERIODIC);
+	}
+
+	/**
+	 * @brief Start sending test packets
+	 *
+	 */
+	void sim_node_start_traffic(void)
+	{
+		if (g_custom_parameters.send_interval != 0)
+		{
+			api.system.timer.start(RAK_TIMER_2, g_custom_parameters.send_interval, NULL);
+		}
+	}
+
+	/**
+	 * @brief Number of nodes in the map
+	 *
+	 */
+	uint8_t sim_node_map_size(void)
+	{
+		return nodes_in_map();
+	}
+
+	/**
+	 * @brief Check for a route to a node
+	 *
+	 */
+	bool sim_node_has_route(uint32_t node_addr)
+	{
+		return check_node(node_addr);
+	}
+}
@@ -0,0 +1,191 @@
+/**
+ * @file Arduino.h
+ * @author Bernd Giesecke (bernd@giesecke.tk)
+ * @brief Minimal Arduino/RUI3 definitions to build the mesh sources on a Linux host
+ * @version 0.1
+ * @date 2026-10-16
+ *
+ * @copyright Copyright (c) 2026
+ *
+ */
+#ifndef HOST_ARDUINO_H
+#define HOST_ARDUINO_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <ctype.h>
+#include <stdarg.h>
+#include <string>
+
+typedef bool boolean;
+typedef uint8_t byte;
+
+#define HIGH 1
+#define LOW 0
+#define OUTPUT 1
+#define INPUT 0
+#define LED_BLUE 1
+#define LED_GREEN 2
+
+/** Reduced String class, only what the sketch sources need */
+class String : public std::string
+{
+public:
+	String(const char *str = "") : std::string(str) {}
+	String(const std::string &str) : std::string(str) {}
+};
+
+/** Time base, provided by the host program */
+unsigned long millis(void);
+void delay(unsigned long ms);
+
+// GPIO and random functions, provided by the host program
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t val);
+int digitalRead(uint8_t pin);
+long random(long max);
+long random(long min, long max);
+void randomSeed(unsigned long seed);
+void noInterrupts(void);
+void interrupts(void);
+uint32_t HAL_GetDEVID(void);
+uint32_t HAL_GetREVID(void);
+
+/** Serial port, output is only shown if the host program enables it */
+class HostSerial
+{
+public:
+	void begin(unsigned long baud) {}
+	operator bool() { return true; }
+	int printf(const char *format, ...);
+	size_t print(const char *str);
+	size_t println(const char *str = "");
+	size_t write(uint8_t value);
+	int available(void) { return 0; }
+	int read(void) { return -1; }
+	void flush(void) {}
+};
+extern HostSerial Serial;
+extern HostSerial Serial6;
+
+/** RUI3 AT command types */
+typedef int SERIAL_PORT;
+typedef struct
+{
+	int argc;
+	char *argv[16];
+} stParam;
+#define AT_OK 0
+#define AT_ERROR 1
+#define AT_PARAM_ERROR 2
+#define RAK_ATCMD_PERM_READ 1
+#define RAK_ATCMD_PERM_WRITE 2
+
+/** RUI3 timers */
+typedef enum
+{
+	RAK_TIMER_0 = 0,
+	RAK_TIMER_1,
+	RAK_TIMER_2,
+	RAK_TIMER_3,
+	RAK_TIMER_4,
+	RAK_TIMER_ID_MAX
+} RAK_TIMER_ID;
+typedef enum
+{
+	RAK_TIMER_ONESHOT = 0,
+	RAK_TIMER_PERIODIC = 1
+} RAK_TIMER_MODE;
+typedef void (*RAK_TIMER_HANDLER)(void *);
+
+/** RUI3 LoRa P2P receive structure */
+typedef struct
+{
+	uint8_t *Buffer;
+	uint8_t BufferSize;
+	int16_t Rssi;
+	int8_t Snr;
+} rui_lora_p2p_recv_t;
+
+typedef void (*service_lora_p2p_recv_cb_type)(rui_lora_p2p_recv_t data);
+typedef void (*service_lora_p2p_send_cb_type)(void);
+typedef void (*service_lora_p2p_send_CAD_cb_type)(bool result);
+
+/** Single LoRa P2P setting, shared by all simulated nodes */
+class HostParam
+{
+public:
+	HostParam(uint32_t value) : _value(value) {}
+	uint32_t get(void) { return _value; }
+	bool set(uint32_t value)
+	{
+		_value = value;
+		return true;
+	}
+
+private:
+	uint32_t _value;
+};
+
+/** Reduced RUI3 API, implemented by the host program */
+class HostApi
+{
+public:
+	class lora
+	{
+	public:
+		HostParam pfreq = HostParam(916000000);
+		HostParam psf = HostParam(7);
+		HostParam pbw = HostParam(0);
+		HostParam pcr = HostParam(1);
+		HostParam ppl = HostParam(8);
+		HostParam ptp = HostParam(5);
+		bool psend(uint8_t length, uint8_t *payload, bool cad = false);
+		bool precv(uint32_t timeout);
+		bool registerPRecvCallback(service_lora_p2p_recv_cb_type callback);
+		bool registerPSendCallback(service_lora_p2p_send_cb_type callback);
+		bool registerPSendCADCallback(service_lora_p2p_send_CAD_cb_type callback);
+		class nwm
+		{
+		public:
+			bool set(void) { return true; }
+		} nwm;
+	} lora;
+	class lorawan
+	{
+	public:
+		class deui
+		{
+		public:
+			bool get(uint8_t *buf, uint32_t len);
+		} deui;
+	} lorawan;
+	class system
+	{
+	public:
+		class timer
+		{
+		public:
+			bool create(RAK_TIMER_ID id, RAK_TIMER_HANDLER handler, RAK_TIMER_MODE mode);
+			bool start(RAK_TIMER_ID id, uint32_t ms, void *data);
+			bool stop(RAK_TIMER_ID id);
+		} timer;
+		class bat
+		{
+		public:
+			float get(void) { return 3.7; }
+		} bat;
+		class wdt
+		{
+		public:
+			void enable(uint32_t ms) {}
+			void reset(void) {}
+		} wdt;
+	} system;
+};
+extern HostApi api;
+
+#endif /* HOST_ARDUINO_H */
@@ -0,0 +1 @@
+// Host build stub, there is no OLED on the host
@@ -0,0 +1 @@
+// Host build stub, the watchdog is not used on the host
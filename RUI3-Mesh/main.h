@@ -74,6 +74,7 @@ union longlong_byte_u
 #include "mesh.h"
 void on_mesh_data(uint32_t fromID, uint8_t *rxPayload, uint16_t rxSize, int16_t rxRssi, int8_t rxSnr);
 void map_changed_cb(void);
+void print_stats_report(uint8_t *report, uint16_t size);
 void timed_loop(void *);
 void mesh_task(void *unused);
 void print_mesh_map_oled(void);
@@ -100,6 +101,10 @@ bool init_map_at(void);
 int mesh_map_handler(SERIAL_PORT port, char *cmd, stParam *param);
 bool init_master_at(void);
 int mesh_master_handler(SERIAL_PORT port, char *cmd, stParam *param);
+bool init_airtime_at(void);
+int airtime_handler(SERIAL_PORT port, char *cmd, stParam *param);
+bool init_meshstat_at(void);
+int meshstat_handler(SERIAL_PORT port, char *cmd, stParam *param);
 bool get_at_setting(void);
 bool save_at_setting(void);
 
@@ -13,25 +13,135 @@
 /*********************************************/
 
 #include "main.h"
-#include <cppQueue.h>
 
 /** Structure with Mesh event callbacks */
 mesh_events_s g_mesh_events;
 
 #define BROKEN_NET
 
-/** Max number of messages in the queue */
-#define TX_QUEUE_SIZE 2
-#define RX_QUEUE_SIZE 4
+/** Number of packet slots shared by the RX queue and the TX queues */
+#define MESH_SLOT_NUM 10
 
-data_msg_s tx_queue[TX_QUEUE_SIZE];
-rx_msg_s rx_queue[RX_QUEUE_SIZE];
+/** Max number of messages in the queues */
+#define TX_CONTROL_QUEUE_SIZE 2
+#define TX_FORWARD_QUEUE_SIZE 3
+#define TX_LOCAL_QUEUE_SIZE 2
+#define RX_QUEUE_SIZE 4
+/** Max number of sent packets that wait for an ACK */
+#define ACK_WAIT_QUEUE_SIZE 3
 
-/** Queue to handle outgoing packets */
-cppQueue mesh_tx_queue(sizeof(data_msg_s), TX_QUEUE_SIZE, FIFO, false, tx_queue, sizeof(tx_queue));
+/** Request ACKs from the next hop for direct and forwarded packets, 0 = packets are not acknowledged */
+#ifndef MESH_LINK_ACK
+#define MESH_LINK_ACK 1
+#endif
+/** Time to wait for an ACK in ms with SF7, doubles with each SF step */
+#define MESH_ACK_TIMEOUT 500
+/** Max number of retransmissions of a packet that was not acknowledged */
+#define MESH_ACK_RETRIES 3
+/** Time after a packet that needs an ACK in which no other packet is started in ms with SF7, the next hop sends its ACK in this time */
+#define MESH_ACK_TURNAROUND 100
+
+/** Size of the fragment header in the data of a packet, transfer ID, fragment index and number of fragments */
+#define FRAG_HEADER_SIZE 3
+/** Max data in one fragment */
+#define FRAG_DATA_SIZE (MESH_MAX_DATA_SIZE - FRAG_HEADER_SIZE)
+/** Max number of fragments of one payload, the fragment bitmaps have 32 bits */
+#define FRAG_MAX_COUNT ((MESH_MAX_TRANSFER_SIZE + FRAG_DATA_SIZE - 1) / FRAG_DATA_SIZE)
+/** Fragment index of a request for missing fragments */
+#define FRAG_NACK 0xFF
+/** Number of large payloads that can be reassembled at the same time */
+#define FRAG_RX_NUM 2
+/** Time without a new fragment until missing fragments are requested in ms with SF7, doubles with each SF step */
+#define FRAG_NACK_TIMEOUT 3000
+/** Number of requests for missing fragments before an incomplete payload is dropped */
+#define FRAG_NACK_RETRIES 3
+/** Time the sender keeps a large payload for requests of missing fragments in ms with SF7, doubles with each SF step */
+#define FRAG_TX_KEEP 30000
+
+/** Large payload that is reassembled from fragments */
+struct frag_rx_s
+{
+	/** Node that sent the payload, 0 if the buffer was never used */
+	uint32_t origin;
+	/** Transfer ID of the payload */
+	uint8_t id;
+	/** Number of fragments */
+	uint8_t count;
+	/** Received fragments, bit n is set if fragment n was received */
+	uint32_t received;
+	/** Size of the payload, known after the last fragment was received */
+	uint16_t size;
+	/** Number of requests for missing fragments */
+	uint8_t nacks;
+	/** Payload is complete and was given to the application */
+	bool complete;
+	/** Time when missing fragments are requested */
+	time_t nack_time;
+	/** Payload */
+	uint8_t data[MESH_MAX_TRANSFER_SIZE];
+};
+
+/** Large payload that is sent in fragments */
+struct frag_tx_s
+{
+	/** Node the payload is sent to */
+	uint32_t target;
+	/** Transfer ID of the payload */
+	uint8_t id;
+	/** Number of fragments */
+	uint8_t count;
+	/** Size of the payload */
+	uint16_t size;
+	/** Fragments that are not queued yet, bit n is set if fragment n has to be sent */
+	uint32_t pending;
+	/** Time until requests for missing fragments are answered */
+	time_t keep_time;
+	/** Payload */
+	uint8_t data[MESH_MAX_TRANSFER_SIZE];
+};
+
+/** Reassembly buffers for large payloads */
+frag_rx_s frag_rx[FRAG_RX_NUM];
+/** Large payload that is sent */
+frag_tx_s frag_tx;
+
+/** Queue of packet slots */
+struct mesh_slot_queue_s
+{
+	mesh_slot_s *head;
+	mesh_slot_s *tail;
+	uint8_t count;
+	uint8_t max_count;
+};
+
+/** Packet slots for received and outgoing packets */
+mesh_slot_s mesh_slots[MESH_SLOT_NUM];
+/** Unused packet slots */
+mesh_slot_s *mesh_free_slots = NULL;
+
+/** Queue for map syncs and map requests, if full the oldest packet is dropped */
+mesh_slot_queue_s mesh_tx_control = {NULL, NULL, 0, TX_CONTROL_QUEUE_SIZE};
+/** Queue for packets forwarded for other nodes, if full new packets are dropped */
+mesh_slot_queue_s mesh_tx_forward = {NULL, NULL, 0, TX_FORWARD_QUEUE_SIZE};
+/** Queue for packets of this node, if full new packets are dropped */
+mesh_slot_queue_s mesh_tx_local = {NULL, NULL, 0, TX_LOCAL_QUEUE_SIZE};
+
+/** Outgoing packet queues, in the order of their priority */
+mesh_slot_queue_s *mesh_tx_queues[MESH_TX_CLASSES] = {&mesh_tx_control, &mesh_tx_forward, &mesh_tx_local};
+/** Names of the TX classes for debug output */
+const char *mesh_tx_class_names[MESH_TX_CLASSES] = {"control", "forward", "local"};
+
+/** Counters of the TX classes */
+mesh_tx_stats_s g_mesh_tx_stats[MESH_TX_CLASSES];
+/** Counters per frame type and per neighbour */
+mesh_stats_s g_mesh_stats;
+/** Upper limits of the buckets of the queue residence time histogram in ms, the last bucket has no limit */
+const uint16_t mesh_stat_latency_limits[MESH_STAT_LATENCY_BUCKETS - 1] = {10, 50, 100, 500, 1000, 5000, 10000};
 
 /** Queue to handle incoming data packets*/
-cppQueue mesh_rx_queue(sizeof(rx_msg_s), RX_QUEUE_SIZE, FIFO, false, rx_queue, sizeof(rx_queue));
+mesh_slot_queue_s mesh_rx_queue = {NULL, NULL, 0, RX_QUEUE_SIZE};
+/** Sent packets that wait for an ACK of the next hop */
+mesh_slot_queue_s mesh_ack_wait = {NULL, NULL, 0, ACK_WAIT_QUEUE_SIZE};
 
 /** Event flag for Mesh Task */
 volatile uint16_t mesh_event;
@@ -41,30 +151,163 @@ uint32_t g_this_device_addr;
 /** The Mesh broadcast ID, created from node ID */
 uint32_t g_broadcast_id;
 
-/** Map message buffer */
-map_msg_s map_sync_msg;
-
-/** Structure for outgoing data */
-data_msg_s out_data_buffer;
-
-/** Max number of messages in the queue */
-#define TX_QUEUE_SIZE 4
-
-/** LoRa TX package */
-uint8_t tx_pckg[256];
-/** Size of data package */
-uint16_t tx_buff_len = 0;
-/** LoRa RX buffer */
-uint8_t rx_buffer[256];
-
-/** Sync time for routing at start, every 30 seconds */
-#define INIT_SYNCTIME 30000
-/** Sync time for routing after mesh has settled, every 10 minutes*/
-#define DEFAULT_SYNCTIME 600000
-/** Sync time */
-time_t sync_time = INIT_SYNCTIME;
-/** Counter to switch from initial sync time to default sync time*/
-uint8_t switch_sync_time_cnt = 10;
+/** Packet that is sent */
+mesh_slot_s *tx_slot = NULL;
+/** TX class of the packet that is sent */
+uint8_t tx_class_active = MESH_TX_LOCAL;
+/** Time the packet was given to the radio */
+time_t tx_start_time = 0;
+/** Max time for a TX, longer than the time on air of 255 bytes with SF12 and 125 kHz bandwidth */
+#define MESH_TX_TIMEOUT 15000
+/** Max random delay of a TX after a broadcast in ms, longer than the time on air of a full map with SF7, doubles with each SF step */
+#define MESH_TX_JITTER 500
+/** Max number of retries of a packet after a busy channel, the packet is dropped after that */
+#define MESH_CAD_RETRIES 6
+/** Backoff slot after a busy channel in ms with SF7, doubles with each SF step */
+#define MESH_CAD_BACKOFF_SLOT 100
+/** Time a data packet waits for other packets to the same next hop in ms, 0 = aggregate only packets that are queued already */
+#ifndef MESH_AGGREGATE_WAIT
+#define MESH_AGGREGATE_WAIT 0
+#endif
+/** No packet is sent before this time */
+time_t tx_holdoff_until = 0;
+/** Queues wait for the end of the TX delay */
+bool tx_holdoff_wait = false;
+
+/* MESH_DUTY_CYCLE can be defined as duty cycle limit in 1/1000 of the time, 0 = no limit.
+   If it is not defined, the limit of the frequency band is used */
+/** Duty cycle window in ms, the limits are defined per hour */
+#define AIRTIME_WINDOW 3600000
+/** Number of slots of the duty cycle window, the time on air leaves the window slot by slot */
+#define AIRTIME_SLOTS 60
+/** Length of one slot of the duty cycle window in ms */
+#define AIRTIME_SLOT (AIRTIME_WINDOW / AIRTIME_SLOTS)
+/** Share of the airtime budget in % that is kept for map syncs, map requests and ACKs */
+#ifndef AIRTIME_RESERVE_CONTROL
+#define AIRTIME_RESERVE_CONTROL 20
+#endif
+/** Share of the airtime budget in % that is kept for packets forwarded for other nodes */
+#ifndef AIRTIME_RESERVE_FORWARD
+#define AIRTIME_RESERVE_FORWARD 40
+#endif
+/** Share of the airtime budget in % that is kept for data of this node */
+#ifndef AIRTIME_RESERVE_LOCAL
+#define AIRTIME_RESERVE_LOCAL 20
+#endif
+/** Reserved shares of the TX classes, the rest of the budget is used by the class that needs it first */
+const uint8_t airtime_reserve[MESH_TX_CLASSES] = {AIRTIME_RESERVE_CONTROL, AIRTIME_RESERVE_FORWARD, AIRTIME_RESERVE_LOCAL};
+/** Time on air in ms of each TX class in each slot of the duty cycle window */
+uint16_t airtime_slots[AIRTIME_SLOTS][MESH_TX_CLASSES];
+/** Time on air in ms of each TX class in the duty cycle window */
+uint32_t airtime_used[MESH_TX_CLASSES];
+/** Slot of the duty cycle window that is filled now */
+uint8_t airtime_slot_idx = 0;
+/** Start time of the slot that is filled now */
+time_t airtime_slot_start = 0;
+/** Queues wait until time on air leaves the duty cycle window */
+bool airtime_wait = false;
+
+/** Shortest map sync interval (Trickle Imin), 30 seconds */
+#define TRICKLE_IMIN 30000
+/** Longest map sync interval (Trickle Imax), 10 minutes */
+#define TRICKLE_IMAX 600000
+/** Number of consistent maps heard in an interval that suppress the own map sync (Trickle k) */
+#define TRICKLE_K 2
+
+/** Trickle timer phases */
+typedef enum
+{
+	TRICKLE_SEND = 0, //!< Timer runs until the map sync point in the interval
+	TRICKLE_END		  //!< Timer runs until the end of the interval
+} trickle_phase_t;
+
+/** Current map sync interval */
+time_t trickle_interval = TRICKLE_IMIN;
+/** Map sync point within the current interval */
+time_t trickle_send_time = 0;
+/** Number of consistent maps heard in the current interval */
+uint8_t trickle_counter = 0;
+/** Phase of the Trickle timer */
+trickle_phase_t trickle_phase = TRICKLE_SEND;
+/** Time of the last own map sync */
+time_t trickle_last_sent = 0;
+
+/** Timeout to remove unresponsive nodes, from router.cpp */
+extern time_t in_active_timeout;
+
+/** Length of the wake window at the start of each wake period in ms */
+#ifndef MESH_WAKE_WINDOW
+#define MESH_WAKE_WINDOW 2000
+#endif
+/** RX starts this time before the wake window and ends this time after it in ms, covers the clock drift between two beacons */
+#ifndef MESH_WAKE_GUARD
+#define MESH_WAKE_GUARD 50
+#endif
+/** Time after the start in which the node stays in RX and takes over the schedule with the lowest root */
+#define MESH_WAKE_JOIN (2 * TRICKLE_IMAX)
+/** Without a beacon from the sync parent for this time the node looks for another parent, then it starts its own schedule */
+#define MESH_WAKE_LOST (4 * TRICKLE_IMAX)
+/** Every MESH_WAKE_SCAN periods the radio stays in RX for a full period to find neighbours with another schedule */
+#define MESH_WAKE_SCAN 60
+/** Highest sync level, a node without sync parent announces it and is not taken as parent */
+#define WAKE_LEVEL_MAX 15
+/** Flag in the time sync beacon, the schedule is used by sleeping nodes */
+#define WAKE_BEACON_SETTLED 0x08
+
+/** Root of the wake schedule, lower 16 bits of its node address */
+uint16_t wake_root = 0;
+/** Hops to the root of the wake schedule, 0 for the root */
+uint8_t wake_level = 0;
+/** Neighbour the wake schedule is taken from, 0 for the root */
+uint32_t wake_parent = 0;
+/** Time of the last beacon of the sync parent */
+time_t wake_parent_time = 0;
+/** Offset of the wake schedule, millis() + wake_offset is the time in the schedule */
+uint32_t wake_offset = 0;
+/** Start of the search for the schedule with the lowest root */
+time_t wake_join_start = 0;
+/** The schedule is used by sleeping nodes, the node sleeps outside of the wake windows as well */
+bool wake_settled = false;
+/** Radio is in RX */
+bool wake_rx_on = true;
+/** Queues wait for the next wake window */
+bool wake_wait = false;
+
+/** Time in which all packets from unknown nodes lead to one map request in ms with SF7, doubles with each SF step */
+#define MAP_REQ_WINDOW 2000
+/** Max number of map requests that can be sent in a burst (token bucket size) */
+#define MAP_REQ_TOKENS 2
+/** Time until one more map request can be sent in ms (token bucket refill) */
+#define MAP_REQ_REFILL 60000
+/** A map request waits until the end of the collection window */
+bool map_req_pending = false;
+/** End of the collection window of the pending map request */
+time_t map_req_time = 0;
+/** Unknown node that started the collection window */
+uint32_t map_req_node = 0;
+/** Map requests that can be sent now */
+uint8_t map_req_tokens = MAP_REQ_TOKENS;
+/** Time of the last refill of the map request tokens */
+time_t map_req_refill_time = 0;
+
+/** Next map announcement has to be the full map */
+bool map_full_pending = true;
+/** Map version that was announced last */
+uint16_t map_sent_version = 0;
+/** Oldest map version a neighbour requested a delta for */
+uint16_t map_reply_base = 0;
+/** A neighbour requested a delta */
+bool map_reply_pending = false;
+/** Neighbour a map sync was requested from and that did not answer yet */
+uint32_t map_sync_request_node = 0;
+/** Sequence number of the last map message, neighbours count lost map messages for their link estimate */
+uint8_t map_seq = 0;
+/** Next page of a full map that is sent in pages, 0 if no paged map is sent */
+uint8_t map_page_next = 0;
+/** Number of pages of the full map that is sent in pages */
+uint8_t map_page_count = 0;
+/** Map version of the full map that is sent in pages */
+uint16_t map_page_version = 0;
 
 /** Enum for network state */
 typedef enum
@@ -88,138 +331,2087 @@ int g_num_of_nodes = 0;
 boolean nodes_changed = false;
 
 /**
- * @brief Callback for Mesh Map Update Timer
+ * @brief Put all packet slots into the list of unused slots
  *
- * @param unused
  */
-void map_sync_handler(void *)
+void slot_pool_init(void)
 {
-	mesh_event |= SYNC_MAP;
+	noInterrupts();
+	mesh_free_slots = NULL;
+	for (int idx = MESH_SLOT_NUM - 1; idx >= 0; idx--)
+	{
+		mesh_slots[idx].next = mesh_free_slots;
+		mesh_free_slots = &mesh_slots[idx];
+	}
+	for (int tx_class = 0; tx_class < MESH_TX_CLASSES; tx_class++)
+	{
+		mesh_tx_queues[tx_class]->head = NULL;
+		mesh_tx_queues[tx_class]->tail = NULL;
+		mesh_tx_queues[tx_class]->count = 0;
+	}
+	mesh_rx_queue.head = NULL;
+	mesh_rx_queue.tail = NULL;
+	mesh_rx_queue.count = 0;
+	mesh_ack_wait.head = NULL;
+	mesh_ack_wait.tail = NULL;
+	mesh_ack_wait.count = 0;
+	tx_slot = NULL;
+	interrupts();
 }
 
 /**
- * @brief Initialize the Mesh network
+ * @brief Get an unused packet slot, can be called from the LoRa callbacks
  *
- * @param events Structure of event callbacks
+ * @return mesh_slot_s* slot or NULL if all slots are in use
  */
-void init_mesh(mesh_events_s *events)
+mesh_slot_s *slot_claim(void)
 {
-	_mesh_events = events;
+	noInterrupts();
+	mesh_slot_s *slot = mesh_free_slots;
+	if (slot != NULL)
+	{
+		mesh_free_slots = slot->next;
+		slot->next = NULL;
+		slot->retries = 0;
+		slot->ack_retries = 0;
+	}
+	interrupts();
+	return slot;
+}
 
-	// Adjust max number of nodes in the mesh depending on the RUI3 device
-#if defined(_VARIANT_RAK3172_) || defined(_VARIANT_RAK3172_SIP_)
-	g_num_of_nodes = 15;
-#else
-	g_num_of_nodes = 30;
-#endif
+/**
+ * @brief Return a packet slot to the list of unused slots
+ *
+ * @param slot packet slot
+ */
+void slot_release(mesh_slot_s *slot)
+{
+	noInterrupts();
+	slot->next = mesh_free_slots;
+	mesh_free_slots = slot;
+	interrupts();
+}
 
-	// Prepare empty nodes map
-	g_nodes_map = (g_nodes_list_s *)malloc(g_num_of_nodes * sizeof(g_nodes_list_s));
+/**
+ * @brief Add a packet slot at the end of a queue
+ *
+ * @param queue packet queue
+ * @param slot packet slot
+ * @return true if added
+ * @return false if the queue is full
+ */
+bool slot_push(mesh_slot_queue_s *queue, mesh_slot_s *slot)
+{
+	noInterrupts();
+	if (queue->count >= queue->max_count)
+	{
+		interrupts();
+		return false;
+	}
+	slot->next = NULL;
+	if (queue->tail == NULL)
+	{
+		queue->head = slot;
+	}
+	else
+	{
+		queue->tail->next = slot;
+	}
+	queue->tail = slot;
+	queue->count++;
+	interrupts();
+	return true;
+}
 
-	if (g_nodes_map == NULL)
+/**
+ * @brief Take the first packet slot from a queue
+ *
+ * @param queue packet queue
+ * @return mesh_slot_s* slot or NULL if the queue is empty
+ */
+mesh_slot_s *slot_pop(mesh_slot_queue_s *queue)
+{
+	noInterrupts();
+	mesh_slot_s *slot = queue->head;
+	if (slot != NULL)
 	{
-		MYLOG("MESH", "Could not allocate memory for nodes map");
+		queue->head = slot->next;
+		if (queue->head == NULL)
+		{
+			queue->tail = NULL;
+		}
+		queue->count--;
+		slot->next = NULL;
+	}
+	interrupts();
+	return slot;
+}
+
+/**
+ * @brief Put a packet slot back at the start of a queue it was taken from.
+ * 			The queue size is not checked, the slot was counted in the queue before
+ *
+ * @param queue packet queue
+ * @param slot packet slot
+ */
+void slot_push_front(mesh_slot_queue_s *queue, mesh_slot_s *slot)
+{
+	noInterrupts();
+	slot->next = queue->head;
+	queue->head = slot;
+	if (queue->tail == NULL)
+	{
+		queue->tail = slot;
+	}
+	queue->count++;
+	interrupts();
+}
+
+/**
+ * @brief Remove a packet slot from the middle of a queue
+ *
+ * @param queue packet queue
+ * @param prev slot before the slot in the queue, NULL if the slot is the first one
+ * @param slot packet slot
+ */
+void slot_unlink(mesh_slot_queue_s *queue, mesh_slot_s *prev, mesh_slot_s *slot)
+{
+	noInterrupts();
+	if (prev == NULL)
+	{
+		queue->head = slot->next;
 	}
 	else
 	{
-		MYLOG("MESH", "Memory for nodes map is allocated");
+		prev->next = slot->next;
+	}
+	if (queue->tail == slot)
+	{
+		queue->tail = prev;
+	}
+	queue->count--;
+	slot->next = NULL;
+	interrupts();
+}
+
+/**
+ * @brief Size of a data packet as sub-frame of an aggregate packet
+ *
+ * @param slot packet slot with a LORA_DIRECT or LORA_FORWARD packet
+ * @return uint8_t size of the sub-frame, 0 if the packet cannot be aggregated
+ */
+uint8_t aggregate_sub_size(mesh_slot_s *slot)
+{
+	data_msg_s *data_msg = (data_msg_s *)slot->packet;
+	if (((data_msg->type != LORA_DIRECT) && (data_msg->type != LORA_FORWARD)) || (slot->size < DATA_HEADER_SIZE))
+	{
+		return 0;
+	}
+	uint8_t sub_size = AGGREGATE_SUB_HEADER_SIZE + slot->size - DATA_HEADER_SIZE;
+	if (data_msg->from != g_this_device_addr)
+	{
+		sub_size += 4;
+	}
+	if (data_msg->orig != 0)
+	{
+		sub_size += 4;
+	}
+	return sub_size;
+}
+
+/**
+ * @brief Add a data packet as sub-frame to an aggregate packet.
+ * 			The sub-frame keeps type, sequence number and the addresses that differ from the aggregate header
+ *
+ * @param agg_slot slot of the aggregate packet
+ * @param slot slot of the data packet
+ */
+void aggregate_add(mesh_slot_s *agg_slot, mesh_slot_s *slot)
+{
+	data_msg_s *data_msg = (data_msg_s *)slot->packet;
+	uint8_t data_size = slot->size - DATA_HEADER_SIZE;
+	uint8_t *sub = &agg_slot->packet[agg_slot->size];
+	uint8_t pos = AGGREGATE_SUB_HEADER_SIZE;
+
+	sub[0] = data_size;
+	sub[1] = data_msg->type;
+	sub[2] = data_msg->seq;
+	if (data_msg->from != g_this_device_addr)
+	{
+		sub[1] |= AGGREGATE_HAS_FROM;
+		memcpy(&sub[pos], &data_msg->from, 4);
+		pos += 4;
+	}
+	if (data_msg->orig != 0)
+	{
+		sub[1] |= AGGREGATE_HAS_ORIG;
+		memcpy(&sub[pos], &data_msg->orig, 4);
+		pos += 4;
+	}
+	memcpy(&sub[pos], data_msg->data, data_size);
+	agg_slot->size += pos + data_size;
+}
+
+/**
+ * @brief Pack queued data packets for the same next hop into one aggregate packet.
+ * 			Each packet pays the LoRa preamble and the full header only once per hop
+ *
+ * @param first slot of the packet that is sent next
+ * @param tx_class TX class of the packet that is sent next
+ * @return mesh_slot_s* slot of the aggregate packet, or first if no other packet can be added
+ */
+mesh_slot_s *tx_aggregate(mesh_slot_s *first, uint8_t tx_class)
+{
+	uint8_t first_size = aggregate_sub_size(first);
+	if (first_size == 0)
+	{
+		return first;
+	}
+	uint32_t next_hop = ((data_msg_s *)first->packet)->dest;
+	uint16_t agg_size = AGGREGATE_HEADER_SIZE + first_size;
+
+	// Check if any other packet can be added before a slot is used for the aggregate packet
+	bool found = false;
+	for (uint8_t queue_class = MESH_TX_FORWARD; (queue_class < MESH_TX_CLASSES) && !found; queue_class++)
+	{
+		for (mesh_slot_s *slot = mesh_tx_queues[queue_class]->head; slot != NULL; slot = slot->next)
+		{
+			uint8_t sub_size = aggregate_sub_size(slot);
+			if ((sub_size != 0) && (((data_msg_s *)slot->packet)->dest == next_hop) && ((agg_size + sub_size) <= MESH_MAX_PACKET_SIZE))
+			{
+				found = true;
+				break;
+			}
+		}
+	}
+	if (!found)
+	{
+		return first;
+	}
+	mesh_slot_s *agg_slot = slot_claim();
+	if (agg_slot == NULL)
+	{
+		MYLOG("MESH", "No free packet slot for aggregation");
+		return first;
+	}
+
+	aggregate_msg_s *agg_msg = (aggregate_msg_s *)agg_slot->packet;
+	agg_msg->mark1 = 'L';
+	agg_msg->mark2 = 'o';
+	agg_msg->mark3 = 'R';
+	agg_msg->type = LORA_AGGREGATE;
+	agg_msg->dest = next_hop;
+	agg_msg->from = g_this_device_addr;
+	agg_msg->seq = get_next_packet_seq();
+	agg_slot->size = AGGREGATE_HEADER_SIZE;
+
+	aggregate_add(agg_slot, first);
+	slot_release(first);
+	g_mesh_tx_stats[tx_class].aggregated++;
+	uint8_t num_subs = 1;
+
+	// Forwarded packets first, then the packets of this node
+	for (uint8_t queue_class = MESH_TX_FORWARD; queue_class < MESH_TX_CLASSES; queue_class++)
+	{
+		mesh_slot_queue_s *queue = mesh_tx_queues[queue_class];
+		mesh_slot_s *prev = NULL;
+		mesh_slot_s *slot = queue->head;
+		while (slot != NULL)
+		{
+			mesh_slot_s *next = slot->next;
+			uint8_t sub_size = aggregate_sub_size(slot);
+			if ((sub_size != 0) && (((data_msg_s *)slot->packet)->dest == next_hop) && ((agg_slot->size + sub_size) <= MESH_MAX_PACKET_SIZE))
+			{
+				slot_unlink(queue, prev, slot);
+				aggregate_add(agg_slot, slot);
+				slot_release(slot);
+				g_mesh_tx_stats[queue_class].aggregated++;
+				num_subs++;
+			}
+			else
+			{
+				prev = slot;
+			}
+			slot = next;
+		}
+	}
+	MYLOG("MESH", "Aggregated %d packets for %08lX, %d bytes", num_subs, next_hop, agg_slot->size);
+	return agg_slot;
+}
+
+/**
+ * @brief Split an aggregate packet into its data packets and handle each of them like a received packet
+ *
+ * @param slot packet slot with the received aggregate packet
+ * @return true if all data packets were delivered, queued for forwarding or are duplicates
+ * @return false if a data packet was dropped
+ */
+bool aggregate_split(mesh_slot_s *slot)
+{
+	bool accepted = true;
+	aggregate_msg_s *agg_msg = (aggregate_msg_s *)slot->packet;
+	uint16_t pos = AGGREGATE_HEADER_SIZE;
+
+	while ((pos + AGGREGATE_SUB_HEADER_SIZE) <= slot->size)
+	{
+		uint8_t *sub = &slot->packet[pos];
+		uint8_t data_size = sub[0];
+		uint8_t type = sub[1] & AGGREGATE_TYPE_MASK;
+		uint16_t sub_size = AGGREGATE_SUB_HEADER_SIZE + data_size;
+		if ((sub[1] & AGGREGATE_HAS_FROM) != 0)
+		{
+			sub_size += 4;
+		}
+		if ((sub[1] & AGGREGATE_HAS_ORIG) != 0)
+		{
+			sub_size += 4;
+		}
+		if (((pos + sub_size) > slot->size) || (data_size > MESH_MAX_DATA_SIZE) || ((type != LORA_DIRECT) && (type != LORA_FORWARD)))
+		{
+			MYLOG("MESH", "Invalid aggregate from %08lX", agg_msg->from);
+			return false;
+		}
+
+		// Each sub-frame gets its own slot, it might be forwarded
+		mesh_slot_s *sub_slot = slot_claim();
+		if (sub_slot == NULL)
+		{
+			MYLOG("MESH", "No free packet slot, rest of aggregate dropped");
+			return false;
+		}
+		data_msg_s *data_msg = (data_msg_s *)sub_slot->packet;
+		data_msg->mark1 = 'L';
+		data_msg->mark2 = 'o';
+		data_msg->mark3 = 'R';
+		data_msg->type = type;
+		data_msg->dest = agg_msg->dest;
+		data_msg->from = agg_msg->from;
+		data_msg->orig = 0;
+		data_msg->seq = sub[2];
+		uint8_t sub_pos = AGGREGATE_SUB_HEADER_SIZE;
+		if ((sub[1] & AGGREGATE_HAS_FROM) != 0)
+		{
+			memcpy(&data_msg->from, &sub[sub_pos], 4);
+			sub_pos += 4;
+		}
+		if ((sub[1] & AGGREGATE_HAS_ORIG) != 0)
+		{
+			memcpy(&data_msg->orig, &sub[sub_pos], 4);
+			sub_pos += 4;
+		}
+		memcpy(data_msg->data, &sub[sub_pos], data_size);
+		sub_slot->size = DATA_HEADER_SIZE + data_size;
+		sub_slot->rssi = slot->rssi;
+		sub_slot->snr = slot->snr;
+
+		bool sub_accepted = false;
+		if (!mesh_handle_rx(sub_slot, &sub_accepted))
+		{
+			slot_release(sub_slot);
+		}
+		accepted = accepted && sub_accepted;
+		pos += sub_size;
+	}
+	return accepted;
+}
+
+/**
+ * @brief Get a packet slot to prepare an outgoing packet.
+ * 			For a control packet the oldest control packet is dropped if all slots are in use
+ *
+ * @param tx_class TX class of the packet
+ * @return mesh_slot_s* slot or NULL if all slots are in use
+ */
+mesh_slot_s *tx_slot_claim(mesh_tx_class_t tx_class)
+{
+	mesh_slot_s *slot = slot_claim();
+	if ((slot == NULL) && (tx_class == MESH_TX_CONTROL) && (mesh_tx_control.count != 0))
+	{
+		MYLOG("MESH", "No free packet slot, dropping oldest control packet");
+		g_mesh_tx_stats[MESH_TX_CONTROL].dropped++;
+		slot_release(slot_pop(&mesh_tx_control));
+		slot = slot_claim();
+	}
+	if (slot == NULL)
+	{
+		MYLOG("MESH", "No free packet slot for %s packet", mesh_tx_class_names[tx_class]);
+		g_mesh_tx_stats[tx_class].dropped++;
+	}
+	return slot;
+}
+
+/**
+ * @brief Add a packet slot to the queue of its TX class
+ *
+ * @param slot packet slot with the packet and its size
+ * @param tx_class TX class, MESH_TX_CONTROL packets are sent before MESH_TX_FORWARD packets
+ * 			and those are sent before MESH_TX_LOCAL packets
+ * @return true if queued
+ * @return false if the queue is full
+ */
+bool tx_slot_queue(mesh_slot_s *slot, mesh_tx_class_t tx_class)
+{
+	mesh_slot_queue_s *tx_queue = mesh_tx_queues[tx_class];
+
+	if (tx_queue->count >= tx_queue->max_count)
+	{
+		g_mesh_tx_stats[tx_class].dropped++;
+		if (tx_class != MESH_TX_CONTROL)
+		{
+			MYLOG("MESH", "Send queue %s is full", mesh_tx_class_names[tx_class]);
+			// Queue is already full!
+			return false;
+		}
+		// Control queue drops the oldest packet
+		MYLOG("MESH", "Send queue %s is full, dropping oldest packet", mesh_tx_class_names[tx_class]);
+		slot_release(slot_pop(tx_queue));
+	}
+
+	slot_push(tx_queue, slot);
+	g_mesh_tx_stats[tx_class].queued++;
+	slot->queue_time = millis();
+	if ((MESH_AGGREGATE_WAIT != 0) && (tx_class != MESH_TX_CONTROL) && (aggregate_sub_size(slot) != 0) && ((long)(tx_holdoff_until - millis()) <= 0))
+	{
+		// Give other packets for the same next hop time to arrive
+		tx_holdoff_until = millis() + MESH_AGGREGATE_WAIT;
+	}
+	mesh_post_event(CHECK_QUEUE);
+	return true;
+}
+
+/**
+ * @brief Release the slot of the packet that was sent
+ *
+ */
+void tx_slot_done(void)
+{
+	if (tx_slot != NULL)
+	{
+		slot_release(tx_slot);
+		tx_slot = NULL;
 	}
-	memset(g_nodes_map, 0, g_num_of_nodes * sizeof(g_nodes_list_s));
+	lora_state = MESH_IDLE;
+}
+
+/**
+ * @brief Callback for Mesh Map Update Timer
+ *
+ * @param unused
+ */
+void map_sync_handler(void *)
+{
+	mesh_post_event(SYNC_MAP);
+}
 
-	// Flush queue
-	mesh_tx_queue.flush();
-	mesh_rx_queue.flush();
+/** Mesh task is running */
+bool mesh_task_active = false;
+/** Mesh service timer is started */
+bool mesh_service_pending = false;
+/** Mesh service timer waits for the end of the TX delay or for an ACK timeout */
+bool mesh_service_wait = false;
 
-	data_msg_s temp;
-	rx_msg_s temp2;
+/**
+ * @brief Callback for the mesh service timer
+ *
+ * @param unused
+ */
+void mesh_service_handler(void *)
+{
+	mesh_service_pending = false;
+	if (mesh_service_wait)
+	{
+		mesh_service_wait = false;
+		if (tx_holdoff_wait)
+		{
+			// TX delay is over
+			tx_holdoff_wait = false;
+			mesh_event |= CHECK_QUEUE;
+		}
+		if (airtime_wait)
+		{
+			// Time on air left the duty cycle window
+			airtime_wait = false;
+			mesh_event |= CHECK_QUEUE;
+		}
+#if MESH_WAKE_PERIOD > 0
+		if (wake_wait && wake_tx_allowed(0))
+		{
+			// Wake window started, the nodes that waited for it do not all send at its start
+			wake_wait = false;
+			tx_holdoff_until = millis() + random(0, MESH_WAKE_WINDOW / 4);
+			mesh_event |= CHECK_QUEUE;
+		}
+#endif
+		if (mesh_ack_wait.count != 0)
+		{
+			mesh_event |= CHECK_ACK;
+		}
+		mesh_event |= CHECK_FRAG | CHECK_NODES;
+	}
+	mesh_task(NULL);
+}
 
-	// Push/pop to test queue
-	MYLOG("MESH", "TX Queue is %s", mesh_tx_queue.isInitialized() ? "initialized" : "not initialized");
-	MYLOG("MESH", "TX Queue is %s", mesh_tx_queue.isFull() ? "full" : "not full");
-	MYLOG("MESH", "TX Queue is %s", mesh_tx_queue.isEmpty() ? "empty" : "not empty");
-	// Push/pop to test queue
-	MYLOG("MESH", "RX Queue is %s", mesh_rx_queue.isInitialized() ? "initialized" : "not initialized");
-	MYLOG("MESH", "RX Queue is %s", mesh_rx_queue.isFull() ? "full" : "not full");
-	MYLOG("MESH", "RX Queue is %s", mesh_rx_queue.isEmpty() ? "empty" : "not empty");
+/**
+ * @brief Start the mesh service timer for the end of the TX delay, the next ACK timeout, the next request for missing fragments,
+ * 			the next node that times out, the end of the map request window, the next slot of the duty cycle window
+ * 			or the next change of the RX state of the wake schedule
+ *
+ */
+void mesh_service_schedule(void)
+{
+	if (mesh_service_pending && !mesh_service_wait)
+	{
+		// Mesh task runs soon, it schedules the timer again
+		return;
+	}
+	bool has_deadline = tx_holdoff_wait;
+	long wait = (long)(tx_holdoff_until - millis());
+	for (mesh_slot_s *slot = mesh_ack_wait.head; slot != NULL; slot = slot->next)
+	{
+		long ack_wait = (long)(slot->ack_time - millis());
+		if (!has_deadline || (ack_wait < wait))
+		{
+			wait = ack_wait;
+		}
+		has_deadline = true;
+	}
+	for (int idx = 0; idx < FRAG_RX_NUM; idx++)
+	{
+		if ((frag_rx[idx].origin == 0) || frag_rx[idx].complete)
+		{
+			continue;
+		}
+		long nack_wait = (long)(frag_rx[idx].nack_time - millis());
+		if (!has_deadline || (nack_wait < wait))
+		{
+			wait = nack_wait;
+		}
+		has_deadline = true;
+	}
+	if (map_req_pending)
+	{
+		long req_wait = (long)(map_req_time - millis());
+		if (!has_deadline || (req_wait < wait))
+		{
+			wait = req_wait;
+		}
+		has_deadline = true;
+	}
+	if (airtime_wait)
+	{
+		long slot_wait = (long)(airtime_slot_start + AIRTIME_SLOT - millis());
+		if (!has_deadline || (slot_wait < wait))
+		{
+			wait = slot_wait;
+		}
+		has_deadline = true;
+	}
+#if MESH_WAKE_PERIOD > 0
+	// RX is switched on or off, waiting queues are checked again when the wake window starts
+	long rx_wait;
+	wake_rx_needed(rx_wait);
+	if (wake_wait && ((long)(MESH_WAKE_PERIOD - wake_phase()) < rx_wait))
+	{
+		rx_wait = (long)(MESH_WAKE_PERIOD - wake_phase());
+	}
+	if (!has_deadline || (rx_wait < wait))
+	{
+		wait = rx_wait;
+	}
+	has_deadline = true;
+#endif
+	time_t node_timeout;
+	if (next_node_timeout(node_timeout))
+	{
+		// Nodes are removed when they time out, not only with the next map sync
+		long node_wait = (long)(node_timeout - millis()) + 1;
+		if (!has_deadline || (node_wait < wait))
+		{
+			wait = node_wait;
+		}
+		has_deadline = true;
+	}
+	if (!has_deadline)
+	{
+		return;
+	}
+	if (wait < MESH_SERVICE_DELAY)
+	{
+		wait = MESH_SERVICE_DELAY;
+	}
+	mesh_service_wait = true;
+	mesh_service_pending = api.system.timer.start(RAK_TIMER_4, wait, NULL);
+}
+
+/**
+ * @brief Set mesh events and wake up the mesh task to handle them.
+ * 			All events that are set until the mesh task runs are handled in one run.
+ * 			timed_loop() handles events that are left as well
+ *
+ * @param event event bits
+ */
+void mesh_post_event(uint16_t event)
+{
+	mesh_event |= event;
+	// A waiting TX delay or ACK timeout must not delay the new events
+	if (!mesh_task_active && (!mesh_service_pending || mesh_service_wait))
+	{
+		mesh_service_pending = api.system.timer.start(RAK_TIMER_4, MESH_SERVICE_DELAY, NULL);
+	}
+}
+
+/**
+ * @brief Scale a delay with the spreading factor, the time on air doubles with each SF step
+ *
+ * @param delay delay for SF7 in ms
+ * @return uint32_t delay for the current SF in ms
+ */
+uint32_t sf_scaled(uint32_t delay)
+{
+	uint8_t sf = api.lora.psf.get();
+	if (sf > 7)
+	{
+		delay = delay << (sf - 7);
+	}
+	return delay;
+}
+
+/**
+ * @brief Get the LoRa bandwidth in Hz from the RUI3 P2P setting
+ *
+ * @return uint32_t bandwidth in Hz
+ */
+uint32_t mesh_bandwidth(void)
+{
+	switch (api.lora.pbw.get())
+	{
+	case 0:
+	case 125:
+		return 125000;
+	case 1:
+	case 250:
+		return 250000;
+	case 2:
+	case 500:
+		return 500000;
+	case 3:
+		return 7810;
+	case 4:
+		return 10420;
+	case 5:
+		return 15630;
+	case 6:
+		return 20830;
+	case 7:
+		return 31250;
+	case 8:
+		return 41670;
+	case 9:
+		return 62500;
+	default:
+		return 125000;
+	}
+}
+
+/**
+ * @brief Calculate the time on air of a packet with the current LoRa P2P settings (Semtech AN1200.13).
+ * 			RUI3 sends P2P packets with explicit header and CRC
+ *
+ * @param size packet size
+ * @return uint32_t time on air in ms, rounded up
+ */
+uint32_t mesh_time_on_air(uint8_t size)
+{
+	int32_t sf = api.lora.psf.get();
+	int32_t cr = api.lora.pcr.get() + 1;
+	uint32_t symbol_us = (uint32_t)(((uint64_t)1000000 << sf) / mesh_bandwidth());
+	// Low data rate optimization is used if a symbol is longer than 16 ms
+	int32_t de = (symbol_us > 16000) ? 1 : 0;
+
+	int32_t payload_bits = 8 * size - 4 * sf + 28 + 16;
+	int32_t payload_symbols = 8;
+	if (payload_bits > 0)
+	{
+		int32_t bits_per_block = 4 * (sf - 2 * de);
+		payload_symbols += ((payload_bits + bits_per_block - 1) / bits_per_block) * (cr + 4);
+	}
+	// Preamble has 4.25 symbols more than the preamble length
+	uint32_t time_us = (api.lora.ppl.get() * 4 + 17) * symbol_us / 4 + payload_symbols * symbol_us;
+	return (time_us + 999) / 1000;
+}
+
+/**
+ * @brief Get the duty cycle limit, either MESH_DUTY_CYCLE or the limit of the ETSI sub-band of the frequency
+ *
+ * @return uint16_t duty cycle limit in 1/1000 of the time, 0 = no limit
+ */
+uint16_t mesh_duty_cycle(void)
+{
+#ifdef MESH_DUTY_CYCLE
+	return MESH_DUTY_CYCLE;
+#else
+	uint32_t freq = api.lora.pfreq.get();
+	if ((freq < 863000000) || (freq > 870000000))
+	{
+		// No duty cycle limit outside of the EU868 band
+		return 0;
+	}
+	if ((freq >= 868700000) && (freq <= 869200000))
+	{
+		return 1;
+	}
+	if ((freq >= 869400000) && (freq <= 869650000))
+	{
+		return 100;
+	}
+	return 10;
+#endif
+}
+
+/**
+ * @brief Move the duty cycle window to the current time, time on air of slots that left the window is removed
+ *
+ */
+void airtime_roll(void)
+{
+	if ((long)(millis() - airtime_slot_start) >= AIRTIME_WINDOW)
+	{
+		memset(airtime_slots, 0, sizeof(airtime_slots));
+		memset(airtime_used, 0, sizeof(airtime_used));
+		airtime_slot_start = millis();
+		return;
+	}
+	while ((long)(millis() - airtime_slot_start) >= AIRTIME_SLOT)
+	{
+		airtime_slot_start += AIRTIME_SLOT;
+		airtime_slot_idx = (airtime_slot_idx + 1) % AIRTIME_SLOTS;
+		for (int tx_class = 0; tx_class < MESH_TX_CLASSES; tx_class++)
+		{
+			airtime_used[tx_class] -= airtime_slots[airtime_slot_idx][tx_class];
+			airtime_slots[airtime_slot_idx][tx_class] = 0;
+		}
+	}
+}
+
+/**
+ * @brief Add the time on air of a sent packet to the duty cycle window
+ *
+ * @param tx_class TX class of the packet
+ * @param time_on_air time on air in ms
+ */
+void airtime_charge(uint8_t tx_class, uint32_t time_on_air)
+{
+	airtime_roll();
+	uint32_t slot_time = airtime_slots[airtime_slot_idx][tx_class] + time_on_air;
+	if (slot_time > UINT16_MAX)
+	{
+		time_on_air -= slot_time - UINT16_MAX;
+		slot_time = UINT16_MAX;
+	}
+	airtime_slots[airtime_slot_idx][tx_class] = slot_time;
+	airtime_used[tx_class] += time_on_air;
+	g_mesh_tx_stats[tx_class].airtime += time_on_air;
+}
+
+/**
+ * @brief Get the time on air a TX class used in the duty cycle window
+ *
+ * @param tx_class TX class
+ * @return uint32_t time on air in ms
+ */
+uint32_t mesh_airtime_used(mesh_tx_class_t tx_class)
+{
+	airtime_roll();
+	return airtime_used[tx_class];
+}
+
+/**
+ * @brief Get the time on air a TX class can use now.
+ * 			Each class can use its reserved share and the part of the budget that is not reserved.
+ * 			The unused reserved shares of the other classes are kept for them
+ *
+ * @param tx_class TX class
+ * @return uint32_t time on air in ms, UINT32_MAX if there is no duty cycle limit
+ */
+uint32_t mesh_airtime_left(mesh_tx_class_t tx_class)
+{
+	uint32_t budget = (AIRTIME_WINDOW / 1000) * mesh_duty_cycle();
+	if (budget == 0)
+	{
+		return UINT32_MAX;
+	}
+	airtime_roll();
+	uint32_t used = 0;
+	for (int queue_class = 0; queue_class < MESH_TX_CLASSES; queue_class++)
+	{
+		used += airtime_used[queue_class];
+		uint32_t reserved = budget * airtime_reserve[queue_class] / 100;
+		if ((queue_class != tx_class) && (airtime_used[queue_class] < reserved))
+		{
+			used += reserved - airtime_used[queue_class];
+		}
+	}
+	return (used < budget) ? (budget - used) : 0;
+}
+
+/**
+ * @brief Reset the counters of the TX classes and the mesh counters
+ *
+ */
+void mesh_stats_reset(void)
+{
+	memset(g_mesh_tx_stats, 0, sizeof(g_mesh_tx_stats));
+	memset(&g_mesh_stats, 0, sizeof(g_mesh_stats));
+	g_mesh_stats.start_time = millis();
+}
+
+/**
+ * @brief Get the counters of a neighbour.
+ * 			If the neighbour has no counters yet, the entry with the least traffic is used for it
+ *
+ * @param addr address of the neighbour
+ * @return mesh_neighbour_stats_s* counters of the neighbour
+ */
+mesh_neighbour_stats_s *neighbour_stats(uint32_t addr)
+{
+	mesh_neighbour_stats_s *least = &g_mesh_stats.neighbours[0];
+	for (int idx = 0; idx < MESH_STAT_NEIGHBOURS; idx++)
+	{
+		mesh_neighbour_stats_s *entry = &g_mesh_stats.neighbours[idx];
+		if (entry->addr == addr)
+		{
+			return entry;
+		}
+		if ((entry->rx + entry->tx) < (least->rx + least->tx))
+		{
+			least = entry;
+		}
+	}
+	least->addr = addr;
+	least->rx = 0;
+	least->tx = 0;
+	least->retransmitted = 0;
+	return least;
+}
+
+/**
+ * @brief Add the time a packet waited in its queue to the histogram of its TX class
+ *
+ * @param slot packet that is sent now
+ * @param tx_class TX class of the packet
+ */
+void stats_queue_time(mesh_slot_s *slot, uint8_t tx_class)
+{
+	if ((slot->retries != 0) || (slot->ack_retries != 0))
+	{
+		// Only the first TX of a packet is counted
+		return;
+	}
+	uint32_t wait = millis() - slot->queue_time;
+	uint8_t bucket = 0;
+	while ((bucket < (MESH_STAT_LATENCY_BUCKETS - 1)) && (wait >= mesh_stat_latency_limits[bucket]))
+	{
+		bucket++;
+	}
+	g_mesh_stats.queue_time[tx_class][bucket]++;
+}
+
+/**
+ * @brief Count a sent frame per frame type and per next hop
+ *
+ * @param slot packet that was sent
+ */
+void stats_tx(mesh_slot_s *slot)
+{
+	data_msg_s *data_msg = (data_msg_s *)slot->packet;
+	uint8_t type = data_msg->type & ~(LORA_ACK_REQ | LORA_FRAG);
+	if (type < MESH_STAT_TYPES)
+	{
+		g_mesh_stats.tx[type]++;
+	}
+	if ((type == LORA_DIRECT) || (type == LORA_FORWARD) || (type == LORA_AGGREGATE))
+	{
+		neighbour_stats(data_msg->dest)->tx++;
+	}
+}
+
+/**
+ * @brief Add a 16 bit counter to the statistics report, larger values are limited to 0xFFFF
+ *
+ * @param buffer report
+ * @param pos position in the report, moved behind the counter
+ * @param value counter
+ */
+void report_u16(uint8_t *buffer, uint8_t &pos, uint32_t value)
+{
+	if (value > 0xFFFF)
+	{
+		value = 0xFFFF;
+	}
+	buffer[pos++] = (uint8_t)value;
+	buffer[pos++] = (uint8_t)(value >> 8);
+}
+
+/**
+ * @brief Add a 32 bit value to the statistics report
+ *
+ * @param buffer report
+ * @param pos position in the report, moved behind the value
+ * @param value value
+ */
+void report_u32(uint8_t *buffer, uint8_t &pos, uint32_t value)
+{
+	report_u16(buffer, pos, value & 0xFFFF);
+	report_u16(buffer, pos, value >> 16);
+}
+
+/**
+ * @brief Create the binary statistics report that can be sent to the master node.
+ * 			All values are little endian, counters are 16 bit and limited to 0xFFFF:
+ * 			marker 'S' 'T', version, number of neighbours, seconds since the reset of the counters (32 bit),
+ * 			RX per frame type, TX per frame type, forwarded, dropped, failed, retransmitted, no route, duplicates, invalid,
+ * 			queue residence histogram of each TX class,
+ * 			per neighbour address (32 bit), RX, TX and retransmitted
+ *
+ * @param buffer buffer for the report, at least MESH_STAT_REPORT_SIZE bytes
+ * @return uint8_t size of the report
+ */
+uint8_t mesh_stats_report(uint8_t *buffer)
+{
+	uint8_t pos = 0;
+	buffer[pos++] = MESH_STAT_REPORT_MARK1;
+	buffer[pos++] = MESH_STAT_REPORT_MARK2;
+	buffer[pos++] = MESH_STAT_REPORT_VERSION;
+	uint8_t num_pos = pos++;
+	report_u32(buffer, pos, (millis() - g_mesh_stats.start_time) / 1000);
+	for (int type = 0; type < MESH_STAT_TYPES; type++)
+	{
+		report_u16(buffer, pos, g_mesh_stats.rx[type]);
+	}
+	for (int type = 0; type < MESH_STAT_TYPES; type++)
+	{
+		report_u16(buffer, pos, g_mesh_stats.tx[type]);
+	}
+	uint32_t dropped = 0;
+	uint32_t failed = 0;
+	uint32_t retransmitted = 0;
+	for (int tx_class = 0; tx_class < MESH_TX_CLASSES; tx_class++)
+	{
+		dropped += g_mesh_tx_stats[tx_class].dropped;
+		failed += g_mesh_tx_stats[tx_class].failed;
+		retransmitted += g_mesh_tx_stats[tx_class].retransmitted;
+	}
+	report_u16(buffer, pos, g_mesh_tx_stats[MESH_TX_FORWARD].queued);
+	report_u16(buffer, pos, dropped);
+	report_u16(buffer, pos, failed);
+	report_u16(buffer, pos, retransmitted);
+	report_u16(buffer, pos, g_mesh_stats.no_route);
+	report_u16(buffer, pos, g_mesh_stats.duplicate);
+	report_u16(buffer, pos, g_mesh_stats.rx_invalid);
+	for (int tx_class = 0; tx_class < MESH_TX_CLASSES; tx_class++)
+	{
+		for (int bucket = 0; bucket < MESH_STAT_LATENCY_BUCKETS; bucket++)
+		{
+			report_u16(buffer, pos, g_mesh_stats.queue_time[tx_class][bucket]);
+		}
+	}
+	uint8_t num_neighbours = 0;
+	for (int idx = 0; idx < MESH_STAT_NEIGHBOURS; idx++)
+	{
+		mesh_neighbour_stats_s *entry = &g_mesh_stats.neighbours[idx];
+		if (entry->addr == 0)
+		{
+			continue;
+		}
+		report_u32(buffer, pos, entry->addr);
+		report_u16(buffer, pos, entry->rx);
+		report_u16(buffer, pos, entry->tx);
+		report_u16(buffer, pos, entry->retransmitted);
+		num_neighbours++;
+	}
+	buffer[num_pos] = num_neighbours;
+	return pos;
+}
+
+/**
+ * @brief Delay the next TX by a random time.
+ * 			Neighbours that react to the same broadcast would send at the same time otherwise
+ *
+ */
+void tx_random_holdoff(void)
+{
+	if ((long)(tx_holdoff_until - millis()) <= 0)
+	{
+		tx_holdoff_until = millis() + random(0, sf_scaled(MESH_TX_JITTER));
+	}
+}
+
+/**
+ * @brief Put the packet that could not be sent back at the start of its queue.
+ * 			It is sent again after a random backoff, the backoff window doubles with each retry.
+ * 			After MESH_CAD_RETRIES retries the packet is dropped
+ *
+ */
+void tx_backoff(void)
+{
+	if (tx_slot->retries >= MESH_CAD_RETRIES)
+	{
+		MYLOG("MESH", "No free channel after %d retries, %s packet dropped", tx_slot->retries, mesh_tx_class_names[tx_class_active]);
+		g_mesh_tx_stats[tx_class_active].failed++;
+		tx_slot_done();
+		return;
+	}
+	tx_slot->retries++;
+	g_mesh_tx_stats[tx_class_active].retried++;
+
+	// Random number of backoff slots, the window doubles with each retry
+	uint32_t backoff_slot = sf_scaled(MESH_CAD_BACKOFF_SLOT);
+	time_t backoff_until = millis() + random(backoff_slot, (backoff_slot << tx_slot->retries) + 1);
+	if ((long)(backoff_until - tx_holdoff_until) > 0)
+	{
+		tx_holdoff_until = backoff_until;
+	}
+	MYLOG("MESH", "Retry %d of %s packet in %ld ms", tx_slot->retries, mesh_tx_class_names[tx_class_active], (long)(tx_holdoff_until - millis()));
+
+	slot_push_front(mesh_tx_queues[tx_class_active], tx_slot);
+	tx_slot = NULL;
+	lora_state = MESH_IDLE;
+}
+
+/**
+ * @brief Get the origin of a packet, together with the sequence number it identifies the packet
+ *
+ * @param data_msg LORA_DIRECT, LORA_FORWARD or LORA_AGGREGATE packet
+ * @return uint32_t address of the node that created the packet
+ */
+uint32_t packet_origin(data_msg_s *data_msg)
+{
+	if (((data_msg->type & ~LORA_ACK_REQ) == LORA_AGGREGATE) || (data_msg->orig == 0x00))
+	{
+		return data_msg->from;
+	}
+	return data_msg->orig;
+}
+
+/**
+ * @brief Get the sequence number of a packet, aggregates have it in the aggregate header
+ *
+ * @param data_msg LORA_DIRECT, LORA_FORWARD or LORA_AGGREGATE packet
+ * @return uint8_t sequence number that is acknowledged by the next hop
+ */
+uint8_t packet_seq(data_msg_s *data_msg)
+{
+	if ((data_msg->type & ~LORA_ACK_REQ) == LORA_AGGREGATE)
+	{
+		return ((aggregate_msg_s *)data_msg)->seq;
+	}
+	return data_msg->seq;
+}
+
+/**
+ * @brief Check if the next packet to send is an ACK that was not sent yet.
+ * 			ACKs are not delayed, the next hop waits for them
+ *
+ * @return true if the first packet of the control queue is a new ACK
+ */
+bool ack_first(void)
+{
+	mesh_slot_s *slot = mesh_tx_control.head;
+	return (slot != NULL) && (slot->packet[3] == LORA_ACK) && (slot->retries == 0);
+}
+
+/**
+ * @brief Acknowledge a received packet.
+ * 			Direct and forwarded packets do not have the address of the node that sent them,
+ * 			the ACK is identified by the address of this node, the origin and the sequence number of the packet
+ *
+ * @param orig origin of the received packet
+ * @param seq sequence number of the received packet
+ */
+void send_ack(uint32_t orig, uint8_t seq)
+{
+	mesh_slot_s *slot = prepare_data_packet(MESH_TX_CONTROL, LORA_ACK, 0, 0);
+	if (slot == NULL)
+	{
+		return;
+	}
+	data_msg_s *ack_msg = (data_msg_s *)slot->packet;
+	ack_msg->orig = orig;
+	ack_msg->seq = seq;
+	tx_slot_queue(slot, MESH_TX_CONTROL);
+}
+
+/**
+ * @brief Keep a sent packet until the next hop acknowledges it
+ *
+ * @return true if the packet waits for an ACK
+ * @return false if the packet does not need an ACK or too many packets wait for an ACK
+ */
+bool ack_wait_start(void)
+{
+	if ((tx_slot->packet[3] & LORA_ACK_REQ) == 0)
+	{
+		return false;
+	}
+	tx_slot->ack_time = millis() + sf_scaled(MESH_ACK_TIMEOUT);
+	// Keep the channel free for the ACK, a following packet would block the next hop
+	time_t turnaround_until = millis() + sf_scaled(MESH_ACK_TURNAROUND);
+	if ((long)(turnaround_until - tx_holdoff_until) > 0)
+	{
+		tx_holdoff_until = turnaround_until;
+	}
+	if (!slot_push(&mesh_ack_wait, tx_slot))
+	{
+		MYLOG("MESH", "Too many packets wait for an ACK");
+		return false;
+	}
+	tx_slot = NULL;
+	return true;
+}
+
+/**
+ * @brief Release the packet that is acknowledged by an ACK
+ *
+ * @param ack_msg received ACK
+ */
+void ack_received(data_msg_s *ack_msg)
+{
+	mesh_slot_s *prev = NULL;
+	for (mesh_slot_s *slot = mesh_ack_wait.head; slot != NULL; slot = slot->next)
+	{
+		data_msg_s *data_msg = (data_msg_s *)slot->packet;
+		if ((data_msg->dest == ack_msg->from) && (packet_seq(data_msg) == ack_msg->seq) && (packet_origin(data_msg) == ack_msg->orig))
+		{
+			MYLOG("MESH", "ACK from %08lX", ack_msg->from);
+			slot_unlink(&mesh_ack_wait, prev, slot);
+			slot_release(slot);
+			return;
+		}
+		prev = slot;
+	}
+}
+
+/**
+ * @brief Send packets again that were not acknowledged in time.
+ * 			Only the hop that lost the packet repeats it, after MESH_ACK_RETRIES retransmissions the packet is dropped
+ *
+ */
+void ack_check_timeouts(void)
+{
+	mesh_slot_s *prev = NULL;
+	mesh_slot_s *slot = mesh_ack_wait.head;
+	while (slot != NULL)
+	{
+		mesh_slot_s *next = slot->next;
+		if ((long)(slot->ack_time - millis()) > 0)
+		{
+			prev = slot;
+			slot = next;
+			continue;
+		}
+		slot_unlink(&mesh_ack_wait, prev, slot);
+		data_msg_s *data_msg = (data_msg_s *)slot->packet;
+		if (slot->ack_retries >= MESH_ACK_RETRIES)
+		{
+			MYLOG("MESH", "No ACK from %08lX after %d retransmissions, packet dropped", data_msg->dest, slot->ack_retries);
+			g_mesh_tx_stats[slot->tx_class].failed++;
+			slot_release(slot);
+		}
+		else
+		{
+			MYLOG("MESH", "No ACK from %08lX, send packet again", data_msg->dest);
+			slot->ack_retries++;
+			slot->retries = 0;
+			g_mesh_tx_stats[slot->tx_class].retransmitted++;
+			neighbour_stats(data_msg->dest)->retransmitted++;
+			// Retransmissions are sent before new packets of the same class
+			slot_push_front(mesh_tx_queues[slot->tx_class], slot);
+			mesh_post_event(CHECK_QUEUE);
+		}
+		slot = next;
+	}
+}
+
+/**
+ * @brief Get a packet slot and prepare the header of a packet to a node, direct or over the first hop of the route
+ *
+ * @param tx_class TX class of the packet
+ * @param target_addr address of the node
+ * @param data_size size of the data after the header
+ * @return mesh_slot_s* slot or NULL if all slots are in use
+ */
+mesh_slot_s *prepare_unicast_packet(mesh_tx_class_t tx_class, uint32_t target_addr, uint8_t data_size)
+{
+	mesh_slot_s *slot;
+	g_nodes_list_s route;
+	if (get_route(target_addr, &route) && (route.first_hop != 0))
+	{
+		// Node is not in range or its link is weak, send to the first hop for forwarding
+		slot = prepare_data_packet(tx_class, LORA_FORWARD, route.first_hop, data_size);
+		if (slot != NULL)
+		{
+			((data_msg_s *)slot->packet)->from = target_addr;
+			((data_msg_s *)slot->packet)->orig = g_this_device_addr;
+		}
+	}
+	else
+	{
+		// Prepare direct message
+		slot = prepare_data_packet(tx_class, LORA_DIRECT, target_addr, data_size);
+	}
+	return slot;
+}
+
+/**
+ * @brief Put the fragments of the large payload that are not sent yet into the local queue.
+ * 			Only as many fragments as the local queue can hold are queued, the rest follows after each TX
+ *
+ */
+void frag_tx_feed(void)
+{
+	while ((frag_tx.pending != 0) && (mesh_tx_local.count < mesh_tx_local.max_count))
+	{
+		uint8_t idx = 0;
+		while ((frag_tx.pending & (1UL << idx)) == 0)
+		{
+			idx++;
+		}
+		uint16_t offset = idx * FRAG_DATA_SIZE;
+		uint8_t len = ((frag_tx.size - offset) > FRAG_DATA_SIZE) ? FRAG_DATA_SIZE : (frag_tx.size - offset);
+
+		mesh_slot_s *slot = prepare_unicast_packet(MESH_TX_LOCAL, frag_tx.target, FRAG_HEADER_SIZE + len);
+		if (slot == NULL)
+		{
+			return;
+		}
+		data_msg_s *data_msg = (data_msg_s *)slot->packet;
+		data_msg->type |= LORA_FRAG;
+		data_msg->data[0] = frag_tx.id;
+		data_msg->data[1] = idx;
+		data_msg->data[2] = frag_tx.count;
+		memcpy(&data_msg->data[FRAG_HEADER_SIZE], &frag_tx.data[offset], len);
+		if (!tx_slot_queue(slot, MESH_TX_LOCAL))
+		{
+			slot_release(slot);
+			return;
+		}
+		frag_tx.pending &= ~(1UL << idx);
+		frag_tx.keep_time = millis() + sf_scaled(FRAG_TX_KEEP);
+	}
+}
+
+/**
+ * @brief Split a payload that is too large for one packet into fragments
+ *
+ * @param target_addr address of the node
+ * @param tx_data payload
+ * @param data_size size of the payload, up to MESH_MAX_TRANSFER_SIZE
+ * @return true if the payload is accepted
+ * @return false if it is too large or the fragments of the previous payload are not queued yet
+ */
+bool send_fragmented(uint32_t target_addr, uint8_t *tx_data, uint16_t data_size)
+{
+	if (data_size > MESH_MAX_TRANSFER_SIZE)
+	{
+		return false;
+	}
+	if (frag_tx.pending != 0)
+	{
+		MYLOG("MESH", "Previous large payload is still sent");
+		return false;
+	}
+	// The previous payload cannot be repaired anymore
+	frag_tx.target = target_addr;
+	frag_tx.id++;
+	frag_tx.count = (data_size + FRAG_DATA_SIZE - 1) / FRAG_DATA_SIZE;
+	frag_tx.size = data_size;
+	frag_tx.pending = (1UL << frag_tx.count) - 1;
+	memcpy(frag_tx.data, tx_data, data_size);
+	MYLOG("MESH", "Sending %d bytes in %d fragments to %08lX", data_size, frag_tx.count, target_addr);
+	frag_tx_feed();
+	return true;
+}
+
+/**
+ * @brief Request the missing fragments of a payload from its sender
+ *
+ * @param entry reassembly buffer of the payload
+ */
+void frag_send_nack(frag_rx_s *entry)
+{
+	uint32_t missing = ((1UL << entry->count) - 1) & ~entry->received;
+	entry->nacks++;
+	entry->nack_time = millis() + sf_scaled(FRAG_NACK_TIMEOUT);
+	MYLOG("MESH", "Request fragments %08lX of payload %d from %08lX", missing, entry->id, entry->origin);
+
+	mesh_slot_s *slot = prepare_unicast_packet(MESH_TX_CONTROL, entry->origin, FRAG_HEADER_SIZE + 4);
+	if (slot == NULL)
+	{
+		return;
+	}
+	data_msg_s *data_msg = (data_msg_s *)slot->packet;
+	data_msg->type |= LORA_FRAG;
+	data_msg->data[0] = entry->id;
+	data_msg->data[1] = FRAG_NACK;
+	data_msg->data[2] = entry->count;
+	memcpy(&data_msg->data[FRAG_HEADER_SIZE], &missing, 4);
+	tx_slot_queue(slot, MESH_TX_CONTROL);
+}
+
+/**
+ * @brief Handle a fragment for this node. Complete payloads are given to the application,
+ * 			requests for missing fragments are answered from the payload that was sent last
+ *
+ * @param data_msg received fragment
+ * @param data_size size of the data in the packet, including the fragment header
+ * @param rssi RSSI of the packet
+ * @param snr SNR of the packet
+ */
+void frag_received(data_msg_s *data_msg, uint8_t data_size, int16_t rssi, int8_t snr)
+{
+	uint32_t origin = (data_msg->orig == 0x00) ? data_msg->from : data_msg->orig;
+	if (data_size < FRAG_HEADER_SIZE)
+	{
+		MYLOG("MESH", "Invalid fragment from %08lX", origin);
+		return;
+	}
+	uint8_t id = data_msg->data[0];
+	uint8_t idx = data_msg->data[1];
+	uint8_t count = data_msg->data[2];
+	uint8_t len = data_size - FRAG_HEADER_SIZE;
+
+	if (idx == FRAG_NACK)
+	{
+		if (len < 4)
+		{
+			MYLOG("MESH", "Invalid fragment request from %08lX", origin);
+			return;
+		}
+		uint32_t missing;
+		memcpy(&missing, &data_msg->data[FRAG_HEADER_SIZE], 4);
+		if ((frag_tx.target == origin) && (frag_tx.id == id) && ((long)(frag_tx.keep_time - millis()) > 0))
+		{
+			MYLOG("MESH", "Send fragments %08lX of payload %d again", missing, id);
+			frag_tx.pending |= missing & ((1UL << frag_tx.count) - 1);
+			frag_tx_feed();
+		}
+		return;
+	}
+
+	if ((count == 0) || (count > FRAG_MAX_COUNT) || (idx >= count) || (((idx * FRAG_DATA_SIZE) + len) > MESH_MAX_TRANSFER_SIZE))
+	{
+		MYLOG("MESH", "Invalid fragment from %08lX", origin);
+		return;
+	}
+
+	// Find the payload, or a free buffer, or the buffer that waits longest for a fragment
+	frag_rx_s *entry = NULL;
+	frag_rx_s *free_entry = NULL;
+	frag_rx_s *oldest = NULL;
+	for (int idx_buf = 0; idx_buf < FRAG_RX_NUM; idx_buf++)
+	{
+		frag_rx_s *check = &frag_rx[idx_buf];
+		if ((check->origin == origin) && (check->id == id))
+		{
+			entry = check;
+			break;
+		}
+		if ((check->origin == 0) || check->complete)
+		{
+			free_entry = check;
+		}
+		else if ((oldest == NULL) || ((long)(check->nack_time - oldest->nack_time) < 0))
+		{
+			oldest = check;
+		}
+	}
+	if (entry == NULL)
+	{
+		entry = (free_entry != NULL) ? free_entry : oldest;
+		if ((entry->origin != 0) && !entry->complete)
+		{
+			MYLOG("MESH", "No free reassembly buffer, payload %d from %08lX dropped", entry->id, entry->origin);
+		}
+		entry->origin = origin;
+		entry->id = id;
+		entry->count = count;
+		entry->received = 0;
+		entry->size = 0;
+		entry->nacks = 0;
+		entry->complete = false;
+	}
+	else if (entry->count != count)
+	{
+		MYLOG("MESH", "Fragment count of payload %d from %08lX changed", id, origin);
+		return;
+	}
+	else if (entry->complete)
+	{
+		// Fragment that was sent again after the payload was complete
+		return;
+	}
+
+	memcpy(&entry->data[idx * FRAG_DATA_SIZE], &data_msg->data[FRAG_HEADER_SIZE], len);
+	entry->received |= 1UL << idx;
+	entry->nack_time = millis() + sf_scaled(FRAG_NACK_TIMEOUT);
+	if (idx == (count - 1))
+	{
+		entry->size = (idx * FRAG_DATA_SIZE) + len;
+	}
+
+	if (entry->received == ((1UL << count) - 1))
+	{
+		MYLOG("MESH", "Payload %d from %08lX complete, %d bytes", id, origin, entry->size);
+		// Buffer is kept to ignore fragments that are sent again, until it is needed for another payload
+		entry->complete = true;
+		if ((_mesh_events != NULL) && (_mesh_events->data_avail_cb != NULL))
+		{
+			_mesh_events->data_avail_cb(origin, entry->data, entry->size, rssi, snr, false);
+		}
+	}
+	else if (idx == (count - 1))
+	{
+		// Fragments arrive in order, after the last one the missing ones are known
+		frag_send_nack(entry);
+	}
+}
+
+/**
+ * @brief Request missing fragments of payloads that did not get a new fragment in time.
+ * 			After FRAG_NACK_RETRIES requests the payload is dropped
+ *
+ */
+void frag_check_timeouts(void)
+{
+	for (int idx = 0; idx < FRAG_RX_NUM; idx++)
+	{
+		frag_rx_s *entry = &frag_rx[idx];
+		if ((entry->origin == 0) || entry->complete || ((long)(entry->nack_time - millis()) > 0))
+		{
+			continue;
+		}
+		if (entry->nacks >= FRAG_NACK_RETRIES)
+		{
+			MYLOG("MESH", "Payload %d from %08lX incomplete, dropped", entry->id, entry->origin);
+			entry->origin = 0;
+		}
+		else
+		{
+			frag_send_nack(entry);
+		}
+	}
+}
+
+/**
+ * @brief Give the data of a packet for this node to the application, fragments are reassembled first
+ *
+ * @param data_msg received packet
+ * @param slot packet slot with size, RSSI and SNR of the packet
+ * @param is_fragment true if the packet is a fragment of a large payload
+ */
+void mesh_deliver(data_msg_s *data_msg, mesh_slot_s *slot, bool is_fragment)
+{
+	if (is_fragment)
+	{
+		frag_received(data_msg, slot->size - DATA_HEADER_SIZE, slot->rssi, slot->snr);
+		return;
+	}
+	if ((_mesh_events != NULL) && (_mesh_events->data_avail_cb != NULL))
+	{
+		if (data_msg->orig == 0x00)
+		{
+			_mesh_events->data_avail_cb(data_msg->from, data_msg->data, slot->size - DATA_HEADER_SIZE, slot->rssi, slot->snr, false);
+		}
+		else
+		{
+			_mesh_events->data_avail_cb(data_msg->orig, data_msg->data, slot->size - DATA_HEADER_SIZE, slot->rssi, slot->snr, false);
+		}
+	}
+}
+
+/**
+ * @brief Start a new Trickle interval, the map sync point is randomly in the second half of the interval
+ *
+ */
+void trickle_start_interval(void)
+{
+	trickle_counter = 0;
+	trickle_phase = TRICKLE_SEND;
+	trickle_send_time = (trickle_interval / 2) + random(0, trickle_interval / 2);
+	MYLOG("MESH", "Map sync interval %ld ms, sync after %ld ms", trickle_interval, trickle_send_time);
+	api.system.timer.stop(RAK_TIMER_1);
+	api.system.timer.start(RAK_TIMER_1, trickle_send_time, NULL);
+}
+
+/**
+ * @brief Inconsistent map information was heard, go back to the shortest map sync interval
+ *
+ */
+void trickle_reset(void)
+{
+	// If the map is full, old nodes are replaced all the time and the maps never get consistent.
+	// Syncing faster would only spread the replacements
+	if (nodes_in_map() >= g_num_of_nodes)
+	{
+		return;
+	}
+	if (trickle_interval > TRICKLE_IMIN)
+	{
+		MYLOG("MESH", "Map inconsistent, reset map sync interval");
+		trickle_interval = TRICKLE_IMIN;
+		trickle_start_interval();
+	}
+}
+
+#if MESH_WAKE_PERIOD > 0
+/**
+ * @brief Get the position in the wake period
+ *
+ * @return uint32_t time since the start of the last wake window in ms
+ */
+uint32_t wake_phase(void)
+{
+	return (uint32_t)(millis() + wake_offset) % MESH_WAKE_PERIOD;
+}
+
+/**
+ * @brief Time of the channel activity detection before a TX, 2 symbols
+ *
+ * @return uint32_t CAD time in ms, rounded up
+ */
+uint32_t wake_cad_time(void)
+{
+	return (uint32_t)((((uint64_t)2000000 << api.lora.psf.get()) / mesh_bandwidth() + 999) / 1000);
+}
+
+/**
+ * @brief Check if the radio has to be in RX and get the time until that changes.
+ * 			RX is on from MESH_WAKE_GUARD before the wake window until MESH_WAKE_GUARD after it,
+ * 			all the time until the schedule is settled and for a full period every MESH_WAKE_SCAN periods
+ *
+ * @param next_change set to the time until the RX state changes in ms
+ * @return true if the radio has to be in RX
+ */
+bool wake_rx_needed(long &next_change)
+{
+	if (!wake_settled)
+	{
+		next_change = (long)(wake_join_start + MESH_WAKE_JOIN - millis());
+		return true;
+	}
+	uint32_t phase = wake_phase();
+	uint32_t period = (uint32_t)(millis() + wake_offset) / MESH_WAKE_PERIOD;
+	if (((period % MESH_WAKE_SCAN) == (g_this_device_addr % MESH_WAKE_SCAN)) || (phase >= MESH_WAKE_PERIOD - MESH_WAKE_GUARD))
+	{
+		// Scan period or guard time before the wake window, RX stays on until the end of the next wake window
+		next_change = MESH_WAKE_PERIOD - phase + MESH_WAKE_WINDOW + MESH_WAKE_GUARD;
+		return true;
+	}
+	if (phase < MESH_WAKE_WINDOW + MESH_WAKE_GUARD)
+	{
+		next_change = MESH_WAKE_WINDOW + MESH_WAKE_GUARD - phase;
+		return true;
+	}
+	next_change = MESH_WAKE_PERIOD - MESH_WAKE_GUARD - phase;
+	return false;
+}
+
+/**
+ * @brief Check if a packet can be sent now, the neighbours receive only in the wake window
+ *
+ * @param time_on_air time on air of the packet in ms
+ * @return true if the packet ends in the wake window or the schedule is not settled yet
+ */
+bool wake_tx_allowed(uint32_t time_on_air)
+{
+	if (!wake_settled)
+	{
+		return true;
+	}
+	return (wake_phase() + wake_cad_time() + time_on_air) <= MESH_WAKE_WINDOW;
+}
+
+/**
+ * @brief Write the time sync beacon of a map message right before it is sent.
+ * 			Root in the first 2 bytes, then 11 bits position in the wake period when the TX starts after the CAD,
+ * 			the settled flag and 4 bits sync level
+ *
+ * @param slot packet slot that is sent
+ */
+void wake_beacon_stamp(mesh_slot_s *slot)
+{
+	uint8_t type = slot->packet[3];
+	if (((type != LORA_NODEMAP) && (type != LORA_MAP_SUMMARY) && (type != LORA_MAP_DELTA)) ||
+		(((slot->size - MAP_HEADER_SIZE) % 5) != MAP_BEACON_SIZE))
+	{
+		return;
+	}
+	uint8_t *beacon = &slot->packet[slot->size - MAP_BEACON_SIZE];
+	uint32_t phase = (uint32_t)(((uint64_t)((wake_phase() + wake_cad_time()) % MESH_WAKE_PERIOD) * 2048) / MESH_WAKE_PERIOD);
+	beacon[0] = (uint8_t)wake_root;
+	beacon[1] = (uint8_t)(wake_root >> 8);
+	beacon[2] = (uint8_t)phase;
+	beacon[3] = (uint8_t)((wake_level << 4) | (wake_settled ? WAKE_BEACON_SETTLED : 0) | (phase >> 8));
+}
+
+/**
+ * @brief Take over the wake schedule from the time sync beacon of a neighbour.
+ * 			A settled schedule wins over one that is not settled, then the lower root wins.
+ * 			In the same schedule the sync parent or a neighbour closer to the root is followed
+ *
+ * @param from neighbour that sent the map message
+ * @param slot packet slot with the received map message
+ */
+void wake_beacon_rx(uint32_t from, mesh_slot_s *slot)
+{
+	uint8_t *beacon = &slot->packet[slot->size - MAP_BEACON_SIZE];
+	uint16_t root = beacon[0] | (beacon[1] << 8);
+	uint8_t level = beacon[3] >> 4;
+	bool settled = (beacon[3] & WAKE_BEACON_SETTLED) == WAKE_BEACON_SETTLED;
+	if (level >= WAKE_LEVEL_MAX - 1)
+	{
+		// Neighbour has no sync parent or is too far from its root
+		return;
+	}
+	bool take_over;
+	if (root == wake_root)
+	{
+		take_over = (wake_level != 0) && ((from == wake_parent) || (level + 1 < wake_level));
+		settled = settled || wake_settled;
+	}
+	else
+	{
+		take_over = (settled && !wake_settled) || ((settled == wake_settled) && (root < wake_root));
+	}
+	if (!take_over)
+	{
+		return;
+	}
+
+	// The packet was received at the end of its time on air
+	time_t tx_start = slot->queue_time - mesh_time_on_air(slot->size);
+	uint32_t phase = (uint32_t)(((uint64_t)(((beacon[3] & 0x07) << 8) | beacon[2]) * MESH_WAKE_PERIOD + 1024) / 2048);
+	wake_offset = (phase + MESH_WAKE_PERIOD - ((uint32_t)tx_start % MESH_WAKE_PERIOD)) % MESH_WAKE_PERIOD;
+	wake_parent_time = millis();
+	if ((root != wake_root) || (from != wake_parent) || (level + 1 != wake_level) || (settled != wake_settled))
+	{
+		MYLOG("MESH", "Wake schedule of root %04X from %08lX, level %d%s", root, from, level + 1, settled ? ", settled" : "");
+		if (root != wake_root)
+		{
+			// Neighbours take over the new schedule faster
+			trickle_reset();
+		}
+		wake_root = root;
+		wake_level = level + 1;
+		wake_parent = from;
+		wake_settled = settled;
+	}
+}
+
+/**
+ * @brief Switch the RX on or off for the wake schedule.
+ * 			Settles the schedule at the end of the join time and looks for another sync parent if the parent is not heard anymore
+ *
+ */
+void wake_update(void)
+{
+	if (!wake_settled && ((long)(millis() - wake_join_start) >= MESH_WAKE_JOIN))
+	{
+		MYLOG("MESH", "Wake schedule of root %04X settled, level %d", wake_root, wake_level);
+		wake_settled = true;
+	}
+	if ((wake_level != 0) && ((long)(millis() - wake_parent_time) >= MESH_WAKE_LOST))
+	{
+		if (wake_parent != 0)
+		{
+			// Any neighbour in the same schedule can be the new sync parent
+			MYLOG("MESH", "Sync parent %08lX lost", wake_parent);
+			wake_parent = 0;
+			wake_level = WAKE_LEVEL_MAX;
+		}
+		else
+		{
+			MYLOG("MESH", "No sync parent, start own wake schedule");
+			wake_root = (uint16_t)g_this_device_addr;
+			wake_level = 0;
+		}
+		wake_parent_time = millis();
+	}
+
+	if (lora_state == MESH_TX)
+	{
+		// mesh_check_tx() checks the queues after the TX, the RX state is set then
+		return;
+	}
+	long next_change;
+	bool rx_on = wake_rx_needed(next_change);
+	if (rx_on != wake_rx_on)
+	{
+		wake_rx_on = rx_on;
+		api.lora.precv(rx_on ? 65533 : 0);
+	}
+}
+#endif
+
+/**
+ * @brief Initialize the Mesh network
+ *
+ * @param events Structure of event callbacks
+ */
+void init_mesh(mesh_events_s *events)
+{
+	_mesh_events = events;
+
+	// First map announcement is the full map
+	map_full_pending = true;
+	map_reply_pending = false;
+	map_req_pending = false;
+	map_req_tokens = MAP_REQ_TOKENS;
+	map_req_refill_time = millis();
+
+	// Max number of nodes in the mesh depends on the RUI3 device
+	g_num_of_nodes = MESH_MAX_NODES;
+
+	// Prepare empty nodes map and its hash index
+	if (!init_router())
+	{
+		MYLOG("MESH", "Could not allocate memory for nodes map");
+	}
+	else
+	{
+		MYLOG("MESH", "Memory for nodes map is allocated");
+	}
+
+	// Prepare the packet slots
+	slot_pool_init();
+	mesh_stats_reset();
+
+	// Start the duty cycle window
+	memset(airtime_slots, 0, sizeof(airtime_slots));
+	memset(airtime_used, 0, sizeof(airtime_used));
+	airtime_slot_idx = 0;
+	airtime_slot_start = millis();
+	airtime_wait = false;
+
+	MYLOG("MESH", "Send queue created with %d packet slots, %d bytes", MESH_SLOT_NUM, (int)sizeof(mesh_slots));
+
+	// Create node ID
+	/// \todo this doesn't work in LoRa P2P mode
+	uint8_t deviceMac[8];
+	api.lorawan.deui.get(deviceMac, 8);
+
+	g_this_device_addr = (uint32_t)deviceMac[4] << 24;
+	g_this_device_addr += (uint32_t)deviceMac[5] << 16;
+	g_this_device_addr += (uint32_t)deviceMac[6] << 8;
+	g_this_device_addr += (uint32_t)deviceMac[7];
+
+	MYLOG("MESH", "Got DevEUI %08X", g_this_device_addr);
+
+	if (g_this_device_addr == 0)
+	{
+#if defined _VARIANT_RAK3172_ || defined _VARIANT_RAK3172_SIP_
+		uint32_t unique_id = HAL_GetDEVID();
+		MYLOG("MESH", "DEVID %08X", HAL_GetDEVID());
+		MYLOG("MESH", "REVID %08X", HAL_GetREVID());
+		g_this_device_addr = (HAL_GetDEVID() << 16) + HAL_GetREVID();
+#endif
+#if defined _VARIANT_RAK4630_
+		uint32_t deviceID[2];
+		deviceID[0] = NRF_FICR->DEVICEID[0];
+		deviceID[1] = NRF_FICR->DEVICEID[1];
+		MYLOG("MESH", "DEVID[0] %04X", deviceID[0]);
+		MYLOG("MESH", "DEVID[1] %04X", deviceID[1]);
+
+		g_this_device_addr += (uint32_t)deviceMac[4] << 24;
+		g_this_device_addr += (uint32_t)deviceMac[5] << 16;
+		g_this_device_addr += (uint32_t)deviceMac[6] << 8;
+		g_this_device_addr += (uint32_t)deviceMac[7];
+#endif
+	}
+	MYLOG("MESH", "Mesh NodeId = %08lX", g_this_device_addr);
+
+	// Create broadcast ID
+	g_broadcast_id = g_this_device_addr & 0xFFFFFF00;
+	MYLOG("MESH", "Broadcast ID is %08lX", g_broadcast_id);
+	map_seq = (uint8_t)random(0, 0x100);
+
+	// Own wake schedule until a schedule with a lower root is heard, the application has the radio in RX
+	wake_root = (uint16_t)g_this_device_addr;
+	wake_level = 0;
+	wake_parent = 0;
+	wake_settled = false;
+	wake_join_start = millis();
+	wake_parent_time = millis();
+	wake_rx_on = true;
+	wake_wait = false;
+#if MESH_WAKE_PERIOD > 0
+	wake_offset = (uint32_t)random(0, MESH_WAKE_PERIOD);
+#endif
+
+	// if (!api.system.scheduler.task.create("MeshSync", (RAK_TASK_HANDLER)mesh_task)) //
+	// {
+	// 	MYLOG("MESH", "Starting Mesh Sync Task failed");
+	// }
+	// else
+	// {
+	// 	MYLOG("MESH", "Starting Mesh Sync Task success");
+	// }
+
+	api.system.timer.create(RAK_TIMER_1, map_sync_handler, RAK_TIMER_ONESHOT);
+	api.system.timer.create(RAK_TIMER_4, mesh_service_handler, RAK_TIMER_ONESHOT);
+	trickle_interval = TRICKLE_IMIN;
+	trickle_start_interval();
+
+	mesh_task(NULL);
+
+	// Wake up task to send the full map
+	mesh_post_event(MAP_REPLY);
+}
+
+/**
+ * @brief Get a packet slot and prepare the header of a map message
+ *
+ * @return mesh_slot_s* slot or NULL if all slots are in use
+ */
+static mesh_slot_s *prepare_map_packet(void)
+{
+	mesh_slot_s *slot = tx_slot_claim(MESH_TX_CONTROL);
+	if (slot == NULL)
+	{
+		MYLOG("MESH", "Cannot send map because send queue is full");
+		return NULL;
+	}
+	map_msg_s *map_sync_msg = (map_msg_s *)slot->packet;
+	map_sync_msg->mark1 = 'L';
+	map_sync_msg->mark2 = 'o';
+	map_sync_msg->mark3 = 'R';
+	map_sync_msg->from = g_this_device_addr;
+	map_seq++;
+	map_sync_msg->seq = map_seq;
+	return slot;
+}
+
+/**
+ * @brief Add the end marker to a map message and queue it
+ *
+ * @param slot packet slot with the map message
+ * @param subs_len number of map entries in the message
+ */
+static void queue_map_packet(mesh_slot_s *slot, uint8_t subs_len)
+{
+	map_msg_s *map_sync_msg = (map_msg_s *)slot->packet;
+	map_sync_msg->nodes[subs_len][0] = 0xAA;
+	map_sync_msg->nodes[subs_len][1] = 0x55;
+	map_sync_msg->nodes[subs_len][2] = 0x00;
+	map_sync_msg->nodes[subs_len][3] = 0xFF;
+	map_sync_msg->nodes[subs_len][4] = 0xAA;
+	subs_len++;
+
+	slot->size = MAP_HEADER_SIZE + (subs_len * 5);
+#if MESH_WAKE_PERIOD > 0
+	// Time sync beacon, written when the packet is sent
+	slot->size += MAP_BEACON_SIZE;
+#endif
+
+	// A full control queue drops its oldest packet
+	tx_slot_queue(slot, MESH_TX_CONTROL);
+}
+
+/**
+ * @brief Destination field of a full map message.
+ * 			Map version in the lower 16 bits, page number and number of pages in the upper bytes if the map is sent in pages
+ *
+ * @param page page number
+ * @param pages number of pages, 0 if the map fits into one message
+ * @param version map version
+ * @return uint32_t value for the destination field
+ */
+static uint32_t map_page_dest(uint8_t page, uint8_t pages, uint16_t version)
+{
+	return ((uint32_t)pages << 24) | ((uint32_t)page << 16) | version;
+}
+
+/**
+ * @brief Queue the next page of a full map that is sent in pages.
+ * 			A page is only queued after the control queue is empty, a full control queue drops its oldest packet.
+ * 			If the map changed since the first page, the full map is sent again with the next map sync
+ *
+ */
+void map_page_feed(void)
+{
+	if ((map_page_next == 0) || (mesh_tx_control.count != 0))
+	{
+		return;
+	}
+	if (map_page_version != g_map_version)
+	{
+		MYLOG("MESH", "Map changed while it was sent in pages");
+		map_page_next = 0;
+		map_full_pending = true;
+		return;
+	}
+	mesh_slot_s *slot = prepare_map_packet();
+	if (slot == NULL)
+	{
+		return;
+	}
+	map_msg_s *map_sync_msg = (map_msg_s *)slot->packet;
+	map_sync_msg->type = LORA_NODEMAP;
+	map_sync_msg->dest = map_page_dest(map_page_next, map_page_count, map_page_version);
+	uint8_t subs_len = node_map(map_sync_msg->nodes, map_page_next * MAP_PAGE_NODES, MAP_PAGE_NODES);
+	MYLOG("MESH", "Sending full map version %d, page %d of %d, size is %d", map_page_version, map_page_next + 1, map_page_count, subs_len);
+	map_page_next++;
+	if (map_page_next == map_page_count)
+	{
+		map_page_next = 0;
+	}
+	queue_map_packet(slot, subs_len);
+}
+
+/**
+ * @brief Send the map of this node.
+ * 			Sends the full map, the changes since a map version the neighbours know
+ * 			or only the map version if nothing changed
+ *
+ * @param full true to send the full map
+ * @param base map version the changes are calculated from
+ */
+void send_map(bool full, uint16_t base)
+{
+	mesh_slot_s *slot = prepare_map_packet();
+	if (slot == NULL)
+	{
+		return;
+	}
+	map_msg_s *map_sync_msg = (map_msg_s *)slot->packet;
+
+	// Get sub nodes
+	uint8_t subs_len = 0;
+	if (!full)
+	{
+		subs_len = node_map_delta(map_sync_msg->nodes, base, MAP_PAGE_NODES);
+		full = subs_len == MAP_DELTA_INVALID;
+	}
+	if (full)
+	{
+		map_sync_msg->type = LORA_NODEMAP;
+		uint8_t pages = (nodes_in_map() + MAP_PAGE_NODES - 1) / MAP_PAGE_NODES;
+		subs_len = node_map(map_sync_msg->nodes, 0, MAP_PAGE_NODES);
+		map_full_pending = false;
+		if (pages > 1)
+		{
+			// Map does not fit into one message, the next pages are queued after this one is sent
+			map_page_next = 1;
+			map_page_count = pages;
+			map_page_version = g_map_version;
+			map_sync_msg->dest = map_page_dest(0, pages, g_map_version);
+			MYLOG("MESH", "Sending full map version %d, page 1 of %d, size is %d", g_map_version, pages, subs_len);
+		}
+		else
+		{
+			map_page_next = 0;
+			map_sync_msg->dest = map_page_dest(0, 0, g_map_version);
+			MYLOG("MESH", "Sending full map version %d, size is %d", g_map_version, subs_len);
+		}
+	}
+	else if (base == g_map_version)
+	{
+		map_sync_msg->type = LORA_MAP_SUMMARY;
+		map_sync_msg->dest = g_map_version;
+		MYLOG("MESH", "Sending map version %d", g_map_version);
+	}
+	else
+	{
+		map_sync_msg->type = LORA_MAP_DELTA;
+		map_sync_msg->dest = ((uint32_t)base << 16) | g_map_version;
+		MYLOG("MESH", "Sending map delta %d to %d, size is %d", base, g_map_version, subs_len);
+	}
+	map_reply_pending = false;
+	map_sent_version = g_map_version;
+	trickle_last_sent = millis();
+
+	queue_map_packet(slot, subs_len);
+}
+
+/**
+ * @brief Remove the nodes that timed out or are unreachable, a changed map is synced faster
+ *
+ */
+static void check_node_timeouts(void)
+{
+	if (!clean_map())
+	{
+		trickle_reset();
+		if ((_mesh_events != NULL) && (_mesh_events->map_changed_cb != NULL))
+		{
+			_mesh_events->map_changed_cb();
+		}
+	}
+}
+
+/**
+ * @brief A packet from a node that is not in the map was received, request the maps of the other nodes.
+ * 			All packets from unknown nodes within MAP_REQ_WINDOW lead to one map request at the end of the window.
+ * 			The window has a random length, the neighbours that got the same packet do not all send a request
+ *
+ * @param node_addr address of the unknown node
+ */
+void map_request_trigger(uint32_t node_addr)
+{
+	if (map_req_pending)
+	{
+		MYLOG("MESH", "Unknown node %08lX, map request is pending", node_addr);
+		return;
+	}
+	uint32_t window = sf_scaled(MAP_REQ_WINDOW);
+	MYLOG("MESH", "Unknown node %08lX, map request within %ld ms", node_addr, window);
+	map_req_pending = true;
+	map_req_node = node_addr;
+	map_req_time = millis() + random(window / 2, window);
+}
 
-	if (!mesh_tx_queue.push((void *)&temp.mark1))
+/**
+ * @brief Send the pending map request at the end of its window.
+ * 			It is not sent if the unknown node is in the map now, if another node sent a map request
+ * 			or if this node waits for the map of a neighbour already.
+ * 			A token bucket limits the number of map requests
+ *
+ */
+void map_request_check(void)
+{
+	if (!map_req_pending || ((long)(map_req_time - millis()) > 0))
 	{
-		MYLOG("MESH", "Failed to add packet to TX queue");
+		return;
 	}
-	if (!mesh_tx_queue.pop((void *)&temp.mark1))
+	map_req_pending = false;
+	if (check_node(map_req_node))
 	{
-		MYLOG("MESH", "Failed to get packet from TX queue");
+		MYLOG("MESH", "Node %08lX is known now, no map request", map_req_node);
+		return;
 	}
-	if (!mesh_rx_queue.push((void *)&temp2.rx_size))
+	if (map_sync_request_node != 0)
 	{
-		MYLOG("MESH", "Failed to add packet to RX queue");
+		MYLOG("MESH", "Map of %08lX is requested already, no map request", map_sync_request_node);
+		return;
 	}
-	if (!mesh_rx_queue.pop((void *)&temp2.rx_size))
+
+	// Refill the token bucket
+	uint32_t refills = (millis() - map_req_refill_time) / MAP_REQ_REFILL;
+	if (refills != 0)
 	{
-		MYLOG("MESH", "Failed to get packet from RX queue");
+		map_req_refill_time += refills * MAP_REQ_REFILL;
+		map_req_tokens = (map_req_tokens + refills) > MAP_REQ_TOKENS ? MAP_REQ_TOKENS : map_req_tokens + refills;
 	}
-
-	MYLOG("MESH", "Send queue created!");
-
-	// Create node ID
-	/// \todo this doesn't work in LoRa P2P mode
-	uint8_t deviceMac[8];
-	api.lorawan.deui.get(deviceMac, 8);
-
-	g_this_device_addr = (uint32_t)deviceMac[4] << 24;
-	g_this_device_addr += (uint32_t)deviceMac[5] << 16;
-	g_this_device_addr += (uint32_t)deviceMac[6] << 8;
-	g_this_device_addr += (uint32_t)deviceMac[7];
-
-	MYLOG("MESH", "Got DevEUI %08X", g_this_device_addr);
-
-	if (g_this_device_addr == 0)
+	if (map_req_tokens == 0)
 	{
-#if defined _VARIANT_RAK3172_ || defined _VARIANT_RAK3172_SIP_
-		uint32_t unique_id = HAL_GetDEVID();
-		MYLOG("MESH", "DEVID %08X", HAL_GetDEVID());
-		MYLOG("MESH", "REVID %08X", HAL_GetREVID());
-		g_this_device_addr = (HAL_GetDEVID() << 16) + HAL_GetREVID();
-#endif
-#if defined _VARIANT_RAK4630_
-		uint32_t deviceID[2];
-		deviceID[0] = NRF_FICR->DEVICEID[0];
-		deviceID[1] = NRF_FICR->DEVICEID[1];
-		MYLOG("MESH", "DEVID[0] %04X", deviceID[0]);
-		MYLOG("MESH", "DEVID[1] %04X", deviceID[1]);
-
-		g_this_device_addr += (uint32_t)deviceMac[4] << 24;
-		g_this_device_addr += (uint32_t)deviceMac[5] << 16;
-		g_this_device_addr += (uint32_t)deviceMac[6] << 8;
-		g_this_device_addr += (uint32_t)deviceMac[7];
-#endif
+		MYLOG("MESH", "Too many map requests, no map request");
+		return;
 	}
-	MYLOG("MESH", "Mesh NodeId = %08lX", g_this_device_addr);
-
-	// Create broadcast ID
-	g_broadcast_id = g_this_device_addr & 0xFFFFFF00;
-	MYLOG("MESH", "Broadcast ID is %08lX", g_broadcast_id);
-
-	// if (!api.system.scheduler.task.create("MeshSync", (RAK_TASK_HANDLER)mesh_task)) //
-	// {
-	// 	MYLOG("MESH", "Starting Mesh Sync Task failed");
-	// }
-	// else
-	// {
-	// 	MYLOG("MESH", "Starting Mesh Sync Task success");
-	// }
-
-	api.system.timer.create(RAK_TIMER_1, map_sync_handler, RAK_TIMER_ONESHOT);
-	api.system.timer.start(RAK_TIMER_1, sync_time, NULL);
-
-	mesh_task(NULL);
-
-	// Wake up task to handle request for nodes map
-	mesh_event |= SYNC_MAP;
+	map_req_tokens--;
+	MYLOG("MESH", "Unknown node %08lX, send map request", map_req_node);
+	send_map_request();
 }
 
-bool mesh_task_active = false;
-
 /**
  * @brief Task to handle the mesh
  *
@@ -227,23 +2419,22 @@ bool mesh_task_active = false;
  */
 void mesh_task(void *unused)
 {
-	// if (mesh_task_active)
-	// {
-	// 	MYLOG("MESH", "Mesh task already running");
-	// 	return;
-	// }
-	// mesh_task_active = true;
-
-	lora_state = MESH_IDLE;
+	if (mesh_task_active)
+	{
+		// Events that are set while the task runs are handled in the same run
+		return;
+	}
+	mesh_task_active = true;
 
-	if (mesh_event != 0)
+	// Handle all pending events, the highest priority event is checked first after each event
+	while (mesh_event != 0)
 	{
 		if ((mesh_event & CHECK_RX) == CHECK_RX)
 		{
 			MYLOG("MESH", "Mesh task check RX");
 			mesh_event &= N_CHECK_RX;
 			mesh_check_rx();
-			return;
+			continue;
 		}
 
 		// MYLOG("MESH", "Mesh task wakeup");
@@ -257,7 +2448,7 @@ void mesh_task(void *unused)
 			{
 				_mesh_events->map_changed_cb();
 			}
-			return;
+			continue;
 		}
 
 		if ((mesh_event & CHECK_QUEUE) == CHECK_QUEUE)
@@ -266,48 +2457,135 @@ void mesh_task(void *unused)
 
 			MYLOG("MESH", "Mesh task check send queue");
 
-			// Check if we have something in the queue
-			if (mesh_tx_queue.getCount() != 0)
+			if ((lora_state == MESH_TX) && ((millis() - tx_start_time) > MESH_TX_TIMEOUT))
 			{
-				if (lora_state != MESH_TX)
-				{
-					memset(tx_pckg, 0, 256);
+				MYLOG("MESH", "TX timeout");
+				g_mesh_tx_stats[tx_class_active].failed++;
+				tx_slot_done();
+			}
 
-					if (mesh_tx_queue.pop((data_msg_s *)tx_pckg))
-					{
-						// Get message length
-						data_msg_s *tx_check = (data_msg_s *)tx_pckg;
-						tx_buff_len = tx_check->data[242];
+			if (lora_state == MESH_TX)
+			{
+				// mesh_check_tx() or mesh_check_cad() will check the queues again
+				MYLOG("MESH", "TX still active");
+				continue;
+			}
 
-						lora_state = MESH_TX;
+			long holdoff = (long)(tx_holdoff_until - millis());
+			if ((holdoff > 0) && !ack_first())
+			{
+				// The mesh service timer checks the queues again after the TX delay
+				MYLOG("MESH", "TX delayed for %ld ms", holdoff);
+				tx_holdoff_wait = true;
+				continue;
+			}
 
-						// api.lora.precv(0);
-						// Send packet over LoRa
-						if (api.lora.psend(tx_buff_len, (uint8_t *)&tx_pckg, true))
-						{
-							MYLOG("MESH", "Packet enqueued");
-						}
-						else
-						{
-							// api.lora.precv(65535);
-							MYLOG("MESH", "+EVT:SEND_ERROR");
-						}
-					}
-					else
-					{
-						MYLOG("MESH", "Queue is full");
-					}
+			// Send the next packet from the queue with the highest priority that has airtime left
+			uint8_t tx_class;
+			bool airtime_blocked = false;
+			bool wake_blocked = false;
+			for (tx_class = 0; tx_class < MESH_TX_CLASSES; tx_class++)
+			{
+				mesh_slot_s *next_slot = mesh_tx_queues[tx_class]->head;
+				if (next_slot == NULL)
+				{
+					continue;
+				}
+				if (mesh_airtime_left((mesh_tx_class_t)tx_class) < mesh_time_on_air(next_slot->size))
+				{
+					// Duty cycle limit reached, the packet stays in the queue
+					airtime_blocked = true;
+					continue;
+				}
+#if MESH_WAKE_PERIOD > 0
+				if (!wake_tx_allowed(mesh_time_on_air(next_slot->size)))
+				{
+					// Neighbours do not receive until the end of the packet, it waits for the next wake window
+					wake_blocked = true;
+					continue;
+				}
+#endif
+				tx_slot = slot_pop(mesh_tx_queues[tx_class]);
+				stats_queue_time(tx_slot, tx_class);
+				break;
+			}
+			if (tx_slot == NULL)
+			{
+				if (airtime_blocked)
+				{
+					// The mesh service timer checks the queues again when time on air leaves the duty cycle window
+					MYLOG("MESH", "Duty cycle limit, TX delayed");
+					airtime_wait = true;
+				}
+				else if (wake_blocked)
+				{
+					// The mesh service timer checks the queues again when the next wake window starts
+					MYLOG("MESH", "Outside of the wake window, TX delayed");
+					wake_wait = true;
 				}
 				else
 				{
-					MYLOG("MESH", "TX still active");
+					MYLOG("MESH", "Packet queue is empty");
+				}
+				continue;
+			}
+			if (tx_class != MESH_TX_CONTROL)
+			{
+				// Data packets for the same next hop are sent together
+				tx_slot = tx_aggregate(tx_slot, tx_class);
+#if MESH_LINK_ACK > 0
+				uint8_t type = tx_slot->packet[3] & ~LORA_FRAG;
+				if ((type == LORA_DIRECT) || (type == LORA_FORWARD) || (type == LORA_AGGREGATE))
+				{
+					// Next hop acknowledges the packet, it is kept until the ACK is received
+					tx_slot->packet[3] |= LORA_ACK_REQ;
 				}
+#endif
+			}
+			tx_slot->tx_class = tx_class;
+
+			lora_state = MESH_TX;
+			tx_class_active = tx_class;
+			tx_start_time = millis();
+#if MESH_WAKE_PERIOD > 0
+			wake_beacon_stamp(tx_slot);
+#endif
+
+			// api.lora.precv(0);
+			// Send packet over LoRa, the slot is kept until the TX is finished
+			if (api.lora.psend(tx_slot->size, tx_slot->packet, true))
+			{
+				MYLOG("MESH", "Packet enqueued from %s queue", mesh_tx_class_names[tx_class]);
 			}
 			else
 			{
-				MYLOG("MESH", "Packet queue is empty");
+				// api.lora.precv(65535);
+				MYLOG("MESH", "+EVT:SEND_ERROR");
+				// Radio is busy, try again later
+				tx_backoff();
+				mesh_post_event(CHECK_QUEUE);
 			}
-			return;
+			continue;
+		}
+
+		if ((mesh_event & MAP_REPLY) == MAP_REPLY)
+		{
+			mesh_event &= N_MAP_REPLY;
+			MYLOG("MESH", "Mesh task Map Reply");
+			// Nothing to do if a map sync answered the requests already
+			if (map_full_pending || map_reply_pending)
+			{
+				send_map(map_full_pending, map_reply_base);
+			}
+			continue;
+		}
+
+		if ((mesh_event & CHECK_NODES) == CHECK_NODES)
+		{
+			mesh_event &= N_CHECK_NODES;
+			check_node_timeouts();
+			map_request_check();
+			continue;
 		}
 
 		if ((mesh_event & SYNC_MAP) == SYNC_MAP)
@@ -315,77 +2593,90 @@ void mesh_task(void *unused)
 			MYLOG("MESH", "Mesh task Sync Map");
 			mesh_event &= N_SYNC_MAP;
 
+			if (trickle_phase == TRICKLE_END)
+			{
+				// Interval is over, double it
+				trickle_interval = trickle_interval * 2;
+				if (trickle_interval > TRICKLE_IMAX)
+				{
+					trickle_interval = TRICKLE_IMAX;
+				}
+				trickle_start_interval();
+				continue;
+			}
+
 			// Time to sync the Mesh
 
 			// MYLOG("MESH", "Checking mesh map");
-			if (!clean_map())
+			check_node_timeouts();
+
+			// Local changes are always sent, neighbours need a sign of life before they remove this node
+			bool local_changes = map_full_pending || (map_sent_version != g_map_version);
+			bool silent_too_long = (millis() - trickle_last_sent) > (unsigned long)(in_active_timeout / 2);
+#if MESH_WAKE_PERIOD > 0
+			// Neighbours that follow the wake schedule of this node need its beacon in each interval
+			silent_too_long = true;
+#endif
+			if ((trickle_counter < TRICKLE_K) || local_changes || silent_too_long)
 			{
-				sync_time = INIT_SYNCTIME;
-				if ((_mesh_events != NULL) && (_mesh_events->map_changed_cb != NULL))
+				if (map_full_pending)
 				{
-					_mesh_events->map_changed_cb();
+					send_map(true, 0);
 				}
-			}
-			MYLOG("MESH", "Sending mesh map");
-			map_sync_msg.from = g_this_device_addr;
-			map_sync_msg.type = LORA_NODEMAP;
-			memset(map_sync_msg.nodes, 0, 48 * 5);
-
-			// Get sub nodes
-			uint8_t subs_len = node_map(map_sync_msg.nodes);
-			MYLOG("MESH", "Map size is %d", subs_len);
-			if (subs_len != 0)
-			{
-				for (int idx = 0; idx < subs_len; idx++)
+				else
 				{
-					uint32_t checkNode = map_sync_msg.nodes[idx][0];
-					checkNode |= map_sync_msg.nodes[idx][1] << 8;
-					checkNode |= map_sync_msg.nodes[idx][2] << 16;
-					checkNode |= map_sync_msg.nodes[idx][3] << 24;
+					// Changes since the last announcement, or only the map version if nothing changed
+					send_map(false, map_sent_version);
 				}
 			}
-			map_sync_msg.nodes[subs_len][0] = 0xAA;
-			map_sync_msg.nodes[subs_len][1] = 0x55;
-			map_sync_msg.nodes[subs_len][2] = 0x00;
-			map_sync_msg.nodes[subs_len][3] = 0xFF;
-			map_sync_msg.nodes[subs_len][4] = 0xAA;
-			subs_len++;
-
-			// print_mesh_map();
-
-			// Serial.printf("Nodes %d\n", subs_len);
-			// Serial.printf("%c%c%c\n", map_sync_msg.mark1, map_sync_msg.mark2, map_sync_msg.mark3);
-			// Serial.printf("Type %d\n", map_sync_msg.type);
-			// Serial.printf("Dest %08X\n", map_sync_msg.dest);
-			// Serial.printf("From %08X\n", map_sync_msg.from);
-			// for (int idx = 0; idx < subs_len; idx++)
-			// {
-			// 	Serial.printf("Node %02X%02X%02X%02X\n", map_sync_msg.nodes[idx][0], map_sync_msg.nodes[idx][1], map_sync_msg.nodes[idx][2], map_sync_msg.nodes[idx][3]);
-			// }
-
-			subs_len = MAP_HEADER_SIZE + (subs_len * 5);
-
-			MYLOG("MESH", "Header Size %d", subs_len);
-
-			if (!add_send_request((data_msg_s *)&map_sync_msg, subs_len))
+			else
 			{
-				MYLOG("MESH", "Cannot send map because send queue is full");
+				MYLOG("MESH", "Map sync suppressed, heard %d consistent maps", trickle_counter);
 			}
 
-			// Time to relax the syncing ???
-			switch_sync_time_cnt--;
-
-			if (switch_sync_time_cnt == 0)
+			// Repeat an unanswered map sync request
+			g_nodes_list_s route;
+			if ((map_sync_request_node != 0) && get_route(map_sync_request_node, &route) && (route.first_hop == 0))
+			{
+				MYLOG("MESH", "Repeat map sync request to %08lX", map_sync_request_node);
+				send_map_sync_request(map_sync_request_node);
+			}
+			else
 			{
-				MYLOG("MESH", "Switching sync time to DEFAULT_SYNCTIME");
-				sync_time = DEFAULT_SYNCTIME;
+				map_sync_request_node = 0;
 			}
 
-			// Restart map sync timer
-			api.system.timer.start(RAK_TIMER_1, sync_time, NULL);
+			// Wait for the end of the interval
+			trickle_phase = TRICKLE_END;
+			api.system.timer.start(RAK_TIMER_1, trickle_interval - trickle_send_time, NULL);
+			continue;
 		}
+
+		if ((mesh_event & CHECK_ACK) == CHECK_ACK)
+		{
+			mesh_event &= N_CHECK_ACK;
+			ack_check_timeouts();
+			continue;
+		}
+
+		if ((mesh_event & CHECK_FRAG) == CHECK_FRAG)
+		{
+			mesh_event &= N_CHECK_FRAG;
+			frag_check_timeouts();
+			continue;
+		}
+
+		// Only unknown event bits are left
+		MYLOG("MESH", "Unknown mesh event %04X", mesh_event);
+		mesh_event = NO_EVENT;
 	}
-	// mesh_task_active = false;
+	mesh_task_active = false;
+
+#if MESH_WAKE_PERIOD > 0
+	wake_update();
+#endif
+	// Wake up for the end of a TX delay, an ACK timeout or missing fragments
+	mesh_service_schedule();
 }
 
 // To simulate a mesh where some nodes are out of range,
@@ -399,352 +2690,548 @@ void mesh_task(void *unused)
 #define BROKEN_NODE_3 0x2BD56908
 
 /**
- * Callback after a LoRa package was received
+ * @brief Handle a received packet
  *
+ * @param slot packet slot with the received packet
+ * @param accepted optional, set to true if the packet was delivered, queued for forwarding or is a duplicate
+ * @return true if the packet is forwarded from the same slot
+ * @return false if the slot can be released
  */
-void mesh_check_rx(void)
+bool mesh_handle_rx(mesh_slot_s *slot, bool *accepted)
 {
-	rx_msg_s rx_pckg;
+	/** Packet is forwarded from the same slot */
+	bool slot_queued = false;
+	/** Packet is taken over by this node, only then it is acknowledged */
+	bool rx_accepted = false;
+	/** The previous hop waits for an ACK */
+	bool ack_req = false;
+	uint32_t ack_orig = 0;
+	uint8_t ack_seq = 0;
+	if (accepted != NULL)
+	{
+		*accepted = false;
+	}
 
-	if (mesh_rx_queue.isInitialized())
+	// Check the received data
+	if ((slot->packet[0] == 'L') && (slot->packet[1] == 'o') && (slot->packet[2] == 'R'))
 	{
-		while (!mesh_rx_queue.isEmpty())
+		// Valid Mesh data received
+		map_msg_s *thisMsg = (map_msg_s *)slot->packet;
+		data_msg_s *thisDataMsg = (data_msg_s *)slot->packet;
+
+		if ((thisDataMsg->type & LORA_ACK_REQ) != 0)
+		{
+			thisDataMsg->type &= ~LORA_ACK_REQ;
+			if (thisDataMsg->dest == g_this_device_addr)
+			{
+				// The ACK is sent after the packet is delivered or queued, a forwarded packet is changed before
+				ack_req = true;
+				ack_orig = packet_origin(thisDataMsg);
+				ack_seq = packet_seq(thisDataMsg);
+			}
+		}
+		// Fragments are forwarded like other packets, only the receiver reassembles them
+		uint8_t frag_flag = thisDataMsg->type & LORA_FRAG;
+		thisDataMsg->type &= ~LORA_FRAG;
+		if (thisDataMsg->type < MESH_STAT_TYPES)
+		{
+			g_mesh_stats.rx[thisDataMsg->type]++;
+		}
+		else
+		{
+			g_mesh_stats.rx_invalid++;
+		}
+
+		if ((thisMsg->type == LORA_NODEMAP) || (thisMsg->type == LORA_MAP_SUMMARY) || (thisMsg->type == LORA_MAP_DELTA))
 		{
-			if (mesh_rx_queue.pop((rx_msg_s *)&rx_pckg.rx_size))
+			/// \todo for debug make some nodes unreachable
+#ifdef BROKEN_NET
+			switch (g_this_device_addr)
+			{
+			case BROKEN_NODE_1:
+				if (thisMsg->from == BROKEN_NODE_2)
+				{
+					return false;
+				}
+			case BROKEN_NODE_2:
+				if (thisMsg->from == BROKEN_NODE_1)
+				{
+					return false;
+				}
+			}
+#endif
+			MYLOG("MESH", "Got map message");
+			// Mapping received
+			uint8_t subsSize = slot->size - MAP_HEADER_SIZE;
+			uint8_t numSubs = subsSize / 5;
+
+			// Serial.println("********************************");
+			// for (int idx = 0; idx < tempSize; idx++)
+			// {
+			// 	Serial.printf("%02X ", rx_buffer[idx]);
+			// }
+			// Serial.println("");
+			// Serial.printf("subsSize %d -> # subs %d\n", subsSize, subsSize / 5);
+			// Serial.println("********************************");
+
+			// Serial.printf("%c%c%c\n", rx_buffer[0], rx_buffer[1], rx_buffer[2]);
+			// Serial.printf("Type %d\n", thisMsg->type);
+			// Serial.printf("Dest %08X\n", thisMsg->dest);
+			// Serial.printf("From %08X\n", thisMsg->from);
+
+			// for (int idx = 0; idx < numSubs; idx++)
+			// {
+			// 	Serial.printf("Node %02X%02X%02X%02X\n", map_sync_msg.nodes[idx][0], map_sync_msg.nodes[idx][1], map_sync_msg.nodes[idx][2], map_sync_msg.nodes[idx][3]);
+			// }
+
+#ifndef SHOW_MAP
+			sprintf(line_str, "Map from %08LX", thisMsg->from);
+			rak1921_add_line(line_str);
+#endif
+			// Check if end marker is in the message
+			if ((thisMsg->nodes[numSubs - 1][0] != 0xAA) ||
+				(thisMsg->nodes[numSubs - 1][1] != 0x55) ||
+				(thisMsg->nodes[numSubs - 1][2] != 0x00) ||
+				(thisMsg->nodes[numSubs - 1][3] != 0xFF) ||
+				(thisMsg->nodes[numSubs - 1][4] != 0xAA))
+			{
+				MYLOG("MESH", "Invalid map, end marker is missing from %08lX", thisMsg->from);
+				g_mesh_stats.rx_invalid++;
+				return false;
+			}
+#if MESH_WAKE_PERIOD > 0
+			if ((subsSize % 5) == MAP_BEACON_SIZE)
+			{
+				wake_beacon_rx(thisMsg->from, slot);
+			}
+#endif
+			neighbour_stats(thisMsg->from)->rx++;
+			nodes_changed = update_link(thisMsg->from, slot->snr, thisMsg->seq);
+			g_nodes_list_s route;
+			if (!get_route(thisMsg->from, &route) || (route.first_hop != 0))
+			{
+				// Link is weaker than the route over other nodes, its map is not used
+				if (nodes_changed)
+				{
+					g_task_event_type |= MESH_MAP_CHANGED;
+					trickle_reset();
+				}
+				return false;
+			}
+
+			// Entries of the map, without the end marker
+			uint8_t num_entries = numSubs - 1;
+			uint16_t known_version;
+			bool map_known = get_map_version(thisMsg->from, known_version);
+			if (map_known && (known_version == (uint16_t)thisMsg->dest))
 			{
-				lora_state = MESH_IDLE;
+				// Neighbour has the map we know, counts for the suppression of our map sync
+				trickle_counter++;
+			}
 
-				// Check the received data
-				if ((rx_pckg.rx_buffer[0] == 'L') && (rx_pckg.rx_buffer[1] == 'o') && (rx_pckg.rx_buffer[2] == 'R'))
+			if (thisMsg->type == LORA_NODEMAP)
+			{
+				// Full map, take it over and remove nodes that use sending node as hop but are not in the map anymore
+				uint8_t pages = (uint8_t)(thisMsg->dest >> 24);
+				bool complete = true;
+				if (pages > 1)
+				{
+					// Large map, the nodes are removed after the last page
+					nodes_changed |= sync_subs_page(thisMsg->from, thisMsg->nodes, num_entries, (uint8_t)(thisMsg->dest >> 16), pages, (uint16_t)thisMsg->dest, complete);
+				}
+				else
+				{
+					nodes_changed |= sync_subs(thisMsg->from, thisMsg->nodes, num_entries);
+				}
+				if (complete)
+				{
+					set_map_version(thisMsg->from, (uint16_t)thisMsg->dest);
+					if (map_sync_request_node == thisMsg->from)
+					{
+						map_sync_request_node = 0;
+					}
+				}
+			}
+			else if (thisMsg->type == LORA_MAP_SUMMARY)
+			{
+				// Map of the sender did not change, keep its subs alive
+				touch_subs(thisMsg->from);
+				if ((!map_known || (known_version != (uint16_t)thisMsg->dest)) && (map_sync_request_node != thisMsg->from))
+				{
+					MYLOG("MESH", "Map version gap, request sync from %08lX", thisMsg->from);
+					tx_random_holdoff();
+					send_map_sync_request(thisMsg->from);
+					trickle_reset();
+				}
+			}
+			else
+			{
+				// Delta covers the changes from base to version
+				uint16_t base = (uint16_t)(thisMsg->dest >> 16);
+				uint16_t version = (uint16_t)thisMsg->dest;
+				touch_subs(thisMsg->from);
+				if (map_known && ((uint16_t)(known_version - base) <= (uint16_t)(version - base)))
+				{
+					nodes_changed |= apply_delta(thisMsg->from, thisMsg->nodes, num_entries);
+					set_map_version(thisMsg->from, version);
+					if (map_sync_request_node == thisMsg->from)
+					{
+						map_sync_request_node = 0;
+					}
+				}
+				else if (map_sync_request_node != thisMsg->from)
 				{
-					// Valid Mesh data received
-					map_msg_s *thisMsg = (map_msg_s *)rx_pckg.rx_buffer;
-					data_msg_s *thisDataMsg = (data_msg_s *)rx_pckg.rx_buffer;
+					// A pending request is repeated with the next map sync, not for every delta the node sends to others
+					MYLOG("MESH", "Map delta does not match, request sync from %08lX", thisMsg->from);
+					tx_random_holdoff();
+					send_map_sync_request(thisMsg->from);
+					trickle_reset();
+				}
+			}
+
+			if (nodes_changed)
+			{
+				// Wake up task to handle change of nodes map
+				// mesh_event |= NODE_CHANGE;
+				g_task_event_type |= MESH_MAP_CHANGED;
+				// Own map changed, sync faster
+				trickle_reset();
+			}
+
+			// print_mesh_map_oled();
+		}
+		else if (thisDataMsg->type == LORA_DIRECT)
+		{
+			MYLOG("MESH", "Direct message from %08lX", thisMsg->from);
+			// MYLOG("MESH", "From %08lX", thisDataMsg->from);
+			// MYLOG("MESH", "Dest %08lX", thisDataMsg->dest);
+
+#ifndef SHOW_MAP
+			sprintf(line_str, "Dir %08LX R %d S %d", thisMsg->from, slot->rssi, slot->snr);
+			rak1921_add_line(line_str);
+#endif
 
-					if (thisMsg->type == LORA_NODEMAP)
+			if (thisDataMsg->dest == g_this_device_addr)
+			{
+				// Check if we got this message already
+				if (is_old_packet((thisDataMsg->orig == 0x00) ? thisDataMsg->from : thisDataMsg->orig, thisDataMsg->seq))
+				{
+					MYLOG("MESH", "Got an old message, dismissing it");
+					g_mesh_stats.duplicate++;
+					// Acknowledge duplicates as well, the sender did not get the first ACK
+					if (ack_req)
+					{
+						send_ack(ack_orig, ack_seq);
+					}
+					if (accepted != NULL)
+					{
+						*accepted = true;
+					}
+					return false;
+				}
+				// 							MYLOG("MESH", "LoRa Packet received size:%d, rssi:%d, snr:%d", slot->size, slot->rssi, slot->snr);
+				// #if MY_DEBUG > 0
+				// 							for (int idx = 0; idx < slot->size; idx++)
+				// 							{
+				// 								Serial.printf(" %02X", slot->packet[idx]);
+				// 							}
+				// 							Serial.println("");
+				// #endif
+				// Message is for us, call user callback to handle the data
+				// MYLOG("MESH", "Got data message type %c >%s<", thisDataMsg->data[0], (char *)&thisDataMsg->data[1]);
+				mesh_deliver(thisDataMsg, slot, frag_flag != 0);
+				rx_accepted = true;
+			}
+			else
+			{
+				// Message is not for us
+				MYLOG("MESH", "Msg for node %08lX", thisDataMsg->dest);
+				return false;
+			}
+			// Check if we know that node
+			if (!check_node(thisDataMsg->from))
+			{
+				// Unknown node, force a map update
+				map_request_trigger(thisDataMsg->from);
+			}
+		}
+		else if (thisDataMsg->type == LORA_FORWARD)
+		{
+			MYLOG("MESH", "Forward message from %08lX", thisMsg->from);
+#ifndef SHOW_MAP
+			sprintf(line_str, "Forw %08LX R %d S %d", thisMsg->from, slot->rssi, slot->snr);
+			rak1921_add_line(line_str);
+#endif
+			if (thisDataMsg->dest != g_this_device_addr)
+			{
+				// Message is forwarded by another node
+				MYLOG("MESH", "Msg for node %08lX", thisDataMsg->dest);
+				return false;
+			}
+			else if (thisDataMsg->from == g_this_device_addr)
+			{
+				// Check if we got this message already
+				if (is_old_packet((thisDataMsg->orig == 0x00) ? thisDataMsg->from : thisDataMsg->orig, thisDataMsg->seq))
+				{
+					MYLOG("MESH", "Got an old message, dismissing it");
+					g_mesh_stats.duplicate++;
+					// Acknowledge duplicates as well, the sender did not get the first ACK
+					if (ack_req)
+					{
+						send_ack(ack_orig, ack_seq);
+					}
+					if (accepted != NULL)
+					{
+						*accepted = true;
+					}
+					return false;
+				}
+				// 							MYLOG("MESH", "LoRa Packet received size:%d, rssi:%d, snr:%d", slot->size, slot->rssi, slot->snr);
+				// #if MY_DEBUG > 0
+				// 							for (int idx = 0; idx < slot->size; idx++)
+				// 							{
+				// 								Serial.printf(" %02X", slot->packet[idx]);
+				// 							}
+				// 							Serial.println("");
+				// #endif
+				// Message is for us, call user callback to handle the data
+				// MYLOG("MESH", "Got data message type %c >%s<", thisDataMsg->data[0], (char *)&thisDataMsg->data[1]);
+				mesh_deliver(thisDataMsg, slot, frag_flag != 0);
+				rx_accepted = true;
+			}
+			else
+			{
+				// We are the next hop, forward the message to the node in from
+				g_nodes_list_s route;
+				if (get_route(thisDataMsg->from, &route))
+				{
+					// Check if we forwarded this message already
+					uint32_t seq_origin = (thisDataMsg->orig == 0x00) ? thisDataMsg->from : thisDataMsg->orig;
+					uint8_t seq = thisDataMsg->seq;
+					if (is_old_packet(seq_origin, seq))
 					{
-						/// \todo for debug make some nodes unreachable
-#ifdef BROKEN_NET
-						switch (g_this_device_addr)
-						{
-						case BROKEN_NODE_1:
-							if (thisMsg->from == BROKEN_NODE_2)
-							{
-								return;
-							}
-						case BROKEN_NODE_2:
-							if (thisMsg->from == BROKEN_NODE_1)
-							{
-								return;
-							}
-						}
-#endif
-						MYLOG("MESH", "Got map message");
-						// Mapping received
-						uint8_t subsSize = rx_pckg.rx_size - MAP_HEADER_SIZE;
-						uint8_t numSubs = subsSize / 5;
-
-						// Serial.println("********************************");
-						// for (int idx = 0; idx < tempSize; idx++)
-						// {
-						// 	Serial.printf("%02X ", rx_buffer[idx]);
-						// }
-						// Serial.println("");
-						// Serial.printf("subsSize %d -> # subs %d\n", subsSize, subsSize / 5);
-						// Serial.println("********************************");
-
-						// Serial.printf("%c%c%c\n", rx_buffer[0], rx_buffer[1], rx_buffer[2]);
-						// Serial.printf("Type %d\n", thisMsg->type);
-						// Serial.printf("Dest %08X\n", thisMsg->dest);
-						// Serial.printf("From %08X\n", thisMsg->from);
-
-						// for (int idx = 0; idx < numSubs; idx++)
-						// {
-						// 	Serial.printf("Node %02X%02X%02X%02X\n", map_sync_msg.nodes[idx][0], map_sync_msg.nodes[idx][1], map_sync_msg.nodes[idx][2], map_sync_msg.nodes[idx][3]);
-						// }
-
-#ifndef SHOW_MAP
-						sprintf(line_str, "Map from %08LX", thisMsg->from);
-						rak1921_add_line(line_str);
-#endif
-						// Check if end marker is in the message
-						if ((thisMsg->nodes[numSubs - 1][0] != 0xAA) ||
-							(thisMsg->nodes[numSubs - 1][1] != 0x55) ||
-							(thisMsg->nodes[numSubs - 1][2] != 0x00) ||
-							(thisMsg->nodes[numSubs - 1][3] != 0xFF) ||
-							(thisMsg->nodes[numSubs - 1][4] != 0xAA))
-						{
-							MYLOG("MESH", "Invalid map, end marker is missing from %08lX", thisMsg->from);
-							return;
-						}
-						nodes_changed = add_node(thisMsg->from, 0, 0);
-
-						// Remove nodes that use sending node as hop
-						clear_subs(thisMsg->from);
-
-						// MYLOG("MESH", "From %08lX", thisMsg->from);
-						// MYLOG("MESH", "Dest %08lX", thisMsg->dest);
-
-						if (subsSize != 0)
+						MYLOG("MESH", "Got an old message, dismissing it");
+						g_mesh_stats.duplicate++;
+						// Acknowledge duplicates as well, the sender did not get the first ACK
+						if (ack_req)
 						{
-							// Mapping contains subs
-
-							// MYLOG("MESH", "Msg size %d", tempSize);
-							// MYLOG("MESH", "#subs %d", numSubs);
-
-							// Serial.println("++++++++++++++++++++++++++++");
-							// Serial.printf("From %08X Dest %08X #Subs %d\n", thisMsg->from, thisMsg->dest, numSubs);
-							// for (int idx = 0; idx < numSubs; idx++)
-							// {
-							// 	uint32_t subId = (uint32_t)thisMsg->nodes[idx][0];
-							// 	subId += (uint32_t)thisMsg->nodes[idx][1] << 8;
-							// 	subId += (uint32_t)thisMsg->nodes[idx][2] << 16;
-							// 	subId += (uint32_t)thisMsg->nodes[idx][3] << 24;
-							// 	uint8_t hops = thisMsg->nodes[idx][4];
-							// 	Serial.printf("ID: %08X numHops: %d\n", subId, hops);
-							// }
-							// Serial.println("++++++++++++++++++++++++++++");
-
-							for (int idx = 0; idx < numSubs - 1; idx++)
-							{
-								uint32_t subId = (uint32_t)thisMsg->nodes[idx][0];
-								subId += (uint32_t)thisMsg->nodes[idx][1] << 8;
-								subId += (uint32_t)thisMsg->nodes[idx][2] << 16;
-								subId += (uint32_t)thisMsg->nodes[idx][3] << 24;
-								uint8_t hops = thisMsg->nodes[idx][4];
-								if (subId != g_this_device_addr)
-								{
-									nodes_changed |= add_node(subId, thisMsg->from, hops + 1);
-									// MYLOG("MESH", "Subs %08lX", subId);
-								}
-							}
+							send_ack(ack_orig, ack_seq);
 						}
-
-						if (nodes_changed)
+						if (accepted != NULL)
 						{
-							// Wake up task to handle change of nodes map
-							// mesh_event |= NODE_CHANGE;
-							g_task_event_type |= MESH_MAP_CHANGED;
+							*accepted = true;
 						}
-
-						// print_mesh_map_oled();
+						return false;
 					}
-					else if (thisDataMsg->type == LORA_DIRECT)
+					// We found a route, send package to next hop
+					if (route.first_hop == 0)
 					{
-						MYLOG("MESH", "Direct message from %08lX", thisMsg->from);
-						// MYLOG("MESH", "From %08lX", thisDataMsg->from);
-						// MYLOG("MESH", "Dest %08lX", thisDataMsg->dest);
-
-#ifndef SHOW_MAP
-						sprintf(line_str, "Dir %08LX R %d S %d", thisMsg->from, rx_pckg.rx_rssi, rx_pckg.rx_snr);
-						rak1921_add_line(line_str);
-#endif
-
-						if (thisDataMsg->dest == g_this_device_addr)
-						{
-							// 							MYLOG("MESH", "LoRa Packet received size:%d, rssi:%d, snr:%d", rx_pckg.rx_size, rx_pckg.rx_rssi, rx_pckg.rx_snr);
-							// #if MY_DEBUG > 0
-							// 							for (int idx = 0; idx < rx_pckg.rx_size; idx++)
-							// 							{
-							// 								Serial.printf(" %02X", rx_pckg.rx_buffer[idx]);
-							// 							}
-							// 							Serial.println("");
-							// #endif
-							// Message is for us, call user callback to handle the data
-							// MYLOG("MESH", "Got data message type %c >%s<", thisDataMsg->data[0], (char *)&thisDataMsg->data[1]);
-							if ((_mesh_events != NULL) && (_mesh_events->data_avail_cb != NULL))
-							{
-								if (thisDataMsg->orig == 0x00)
-								{
-									_mesh_events->data_avail_cb(thisDataMsg->from, thisDataMsg->data, rx_pckg.rx_size - DATA_HEADER_SIZE, rx_pckg.rx_rssi, rx_pckg.rx_snr, false);
-								}
-								else
-								{
-									_mesh_events->data_avail_cb(thisDataMsg->orig, thisDataMsg->data, rx_pckg.rx_size - DATA_HEADER_SIZE, rx_pckg.rx_rssi, rx_pckg.rx_snr, false);
-								}
-							}
-						}
-						else
-						{
-							// Message is not for us forward the message
-							MYLOG("MESH", "Msg for node %08lX", thisDataMsg->dest);
-						}
-						// Check if we know that node
-						if (!check_node(thisDataMsg->from))
-						{
-							// Unknown node, force a map update
-							MYLOG("MESH", "Unknown node, force map update");
-							send_map_request();
-						}
+						// Node is in range, use direct message
+						// MYLOG("MESH", "Route for %lX is direct", route.node_id);
+						// Destination is a direct
+						thisDataMsg->dest = thisDataMsg->from;
+						thisDataMsg->from = thisDataMsg->orig;
+						thisDataMsg->type = LORA_DIRECT;
 					}
-					else if (thisDataMsg->type == LORA_FORWARD)
+					else
 					{
-						MYLOG("MESH", "Forward message from %08lX", thisMsg->from);
-#ifndef SHOW_MAP
-						sprintf(line_str, "Forw %08LX R %d S %d", thisMsg->from, rx_pckg.rx_rssi, rx_pckg.rx_snr);
-						rak1921_add_line(line_str);
-#endif
-						if (thisDataMsg->dest == g_this_device_addr)
-						{
-							// 							MYLOG("MESH", "LoRa Packet received size:%d, rssi:%d, snr:%d", rx_pckg.rx_size, rx_pckg.rx_rssi, rx_pckg.rx_snr);
-							// #if MY_DEBUG > 0
-							// 							for (int idx = 0; idx < rx_pckg.rx_size; idx++)
-							// 							{
-							// 								Serial.printf(" %02X", rx_pckg.rx_buffer[idx]);
-							// 							}
-							// 							Serial.println("");
-							// #endif
-							// Message is for us, call user callback to handle the data
-							// MYLOG("MESH", "Got data message type %c >%s<", thisDataMsg->data[0], (char *)&thisDataMsg->data[1]);
-							if ((_mesh_events != NULL) && (_mesh_events->data_avail_cb != NULL))
-							{
-								if (thisDataMsg->orig == 0x00)
-								{
-									_mesh_events->data_avail_cb(thisDataMsg->from, thisDataMsg->data, rx_pckg.rx_size - DATA_HEADER_SIZE, rx_pckg.rx_rssi, rx_pckg.rx_snr, false);
-								}
-								else
-								{
-									_mesh_events->data_avail_cb(thisDataMsg->orig, thisDataMsg->data, rx_pckg.rx_size - DATA_HEADER_SIZE, rx_pckg.rx_rssi, rx_pckg.rx_snr, false);
-								}
-							}
-						}
-						else
-						{
-							// Message is for sub node, forward the message
-							g_nodes_list_s route;
-							if (get_route(thisDataMsg->from, &route))
-							{
-								// We found a route, send package to next hop
-								if (route.first_hop == 0)
-								{
-									// Node is in range, use direct message
-									// MYLOG("MESH", "Route for %lX is direct", route.node_id);
-									// Destination is a direct
-									thisDataMsg->dest = thisDataMsg->from;
-									thisDataMsg->from = thisDataMsg->orig;
-									thisDataMsg->type = LORA_DIRECT;
-								}
-								else
-								{
-									// Node is not in range, use forwarding
-									// MYLOG("MESH", "Route for %lX is to %lX", route.node_id, route.first_hop);
-									// Destination is a sub
-									thisDataMsg->dest = route.first_hop;
-									thisDataMsg->type = LORA_FORWARD;
-								}
-
-								// Put message into send queue
-								if (!add_send_request(thisDataMsg, rx_pckg.rx_size))
-								{
-									MYLOG("MESH", "Cannot forward message because send queue is full");
-								}
-							}
-							else
-							{
-								MYLOG("MESH", "No route found for %lX", thisMsg->from);
-							}
-						}
-						// Check if we know that node
-						if (!check_node(thisDataMsg->from))
-						{
-							// Unknown node, force a map update
-							MYLOG("MESH", "Unknown node, force map update");
-							send_map_request();
-						}
+						// Node is not in range, use forwarding
+						// MYLOG("MESH", "Route for %lX is to %lX", route.node_id, route.first_hop);
+						// Destination is a sub
+						thisDataMsg->dest = route.first_hop;
+						thisDataMsg->type = LORA_FORWARD;
+					}
+					thisDataMsg->type |= frag_flag;
+
+					// Put message into send queue, it is sent from the same slot
+					slot_queued = tx_slot_queue(slot, MESH_TX_FORWARD);
+					if (slot_queued)
+					{
+						rx_accepted = true;
 					}
-					else if (thisDataMsg->type == LORA_BROADCAST)
+					else
 					{
-						MYLOG("MESH", "Broadcast message from %08lX", thisMsg->from);
+						MYLOG("MESH", "Cannot forward message because send queue is full");
+						// Not in the duplicate window, the previous hop sends it again
+						forget_packet(seq_origin, seq);
+					}
+				}
+				else
+				{
+					MYLOG("MESH", "No route found for %lX", thisMsg->from);
+					g_mesh_stats.no_route++;
+				}
+			}
+			// Check if we know that node
+			if (!check_node(thisDataMsg->from))
+			{
+				// Unknown node, force a map update
+				map_request_trigger(thisDataMsg->from);
+			}
+		}
+		else if (thisDataMsg->type == LORA_BROADCAST)
+		{
+			MYLOG("MESH", "Broadcast message from %08lX", thisMsg->from);
 #ifndef SHOW_MAP
-						sprintf(line_str, "BRDC %08LX R %d S %d", thisMsg->from, rx_pckg.rx_rssi, rx_pckg.rx_snr);
-						rak1921_add_line(line_str);
+			sprintf(line_str, "BRDC %08LX R %d S %d", thisMsg->from, slot->rssi, slot->snr);
+			rak1921_add_line(line_str);
 #endif
-						// This is a broadcast. Forward to all direct nodes, but not to the one who sent it
-						// MYLOG("MESH", "Handling broadcast with ID %08lX from %08lX", thisDataMsg->dest, thisDataMsg->from);
-						// Check if this broadcast is coming from ourself
-						if ((thisDataMsg->dest & 0xFFFFFF00) == (g_this_device_addr & 0xFFFFFF00))
-						{
-							// MYLOG("MESH", "We received our own broadcast, dismissing it");
-							return;
-						}
-						// Check if we handled this broadcast already
-						if (is_old_broadcast(thisDataMsg->dest))
-						{
-							// MYLOG("MESH", "Got an old broadcast, dismissing it");
-							return;
-						}
+			// This is a broadcast. Forward to all direct nodes, but not to the one who sent it
+			// MYLOG("MESH", "Handling broadcast with ID %08lX from %08lX", thisDataMsg->dest, thisDataMsg->from);
+			// Check if this broadcast is coming from ourself
+			if ((thisDataMsg->dest & 0xFFFFFF00) == (g_this_device_addr & 0xFFFFFF00))
+			{
+				// MYLOG("MESH", "We received our own broadcast, dismissing it");
+				return false;
+			}
+			// Check if we handled this broadcast already
+			if (is_old_packet(thisDataMsg->from, thisDataMsg->seq))
+			{
+				// MYLOG("MESH", "Got an old broadcast, dismissing it");
+				g_mesh_stats.duplicate++;
+				return false;
+			}
 
-						// Put broadcast into send queue
-						if (!add_send_request(thisDataMsg, rx_pckg.rx_size))
-						{
-							MYLOG("MESH", "Cannot forward broadcast because send queue is full");
-						}
+			// Put broadcast into send queue, it is sent from the same slot after a random delay
+			tx_random_holdoff();
+			slot_queued = tx_slot_queue(slot, MESH_TX_FORWARD);
+			if (!slot_queued)
+			{
+				MYLOG("MESH", "Cannot forward broadcast because send queue is full");
+			}
 
-						// This is a broadcast, call user callback to handle the data
-						// MYLOG("MESH", "Got data broadcast size %ld", tempSize);
-						if ((_mesh_events != NULL) && (_mesh_events->data_avail_cb != NULL))
-						{
-							_mesh_events->data_avail_cb(thisDataMsg->from, thisDataMsg->data, rx_pckg.rx_size - DATA_HEADER_SIZE, rx_pckg.rx_rssi, rx_pckg.rx_snr, true);
-						}
-						// Check if we know that node
-						if (!check_node(thisDataMsg->from))
-						{
-							// Unknown node, force a map update
-							MYLOG("MESH", "Unknown node, force map update");
-							send_map_request();
-						}
-					}
-					else if (thisDataMsg->type == LORA_MAP_REQ)
-					{
+			// This is a broadcast, call user callback to handle the data
+			// MYLOG("MESH", "Got data broadcast size %ld", tempSize);
+			if ((_mesh_events != NULL) && (_mesh_events->data_avail_cb != NULL))
+			{
+				_mesh_events->data_avail_cb(thisDataMsg->from, thisDataMsg->data, slot->size - DATA_HEADER_SIZE, slot->rssi, slot->snr, true);
+			}
+			// Check if we know that node
+			if (!check_node(thisDataMsg->from))
+			{
+				// Unknown node, force a map update
+				map_request_trigger(thisDataMsg->from);
+			}
+		}
+		else if (thisDataMsg->type == LORA_MAP_REQ)
+		{
 #ifndef SHOW_MAP
-						sprintf(line_str, "MREQ %08LX R %d S %d", thisMsg->from, rx_pckg.rx_rssi, rx_pckg.rx_snr);
-						rak1921_add_line(line_str);
+			sprintf(line_str, "MREQ %08LX R %d S %d", thisMsg->from, slot->rssi, slot->snr);
+			rak1921_add_line(line_str);
 #endif
 
-						// This is a broadcast. Forward to all direct nodes, but not to the one who sent it
-						MYLOG("MESH", "Handling Mesh map request with ID %08lX from %08lX", thisDataMsg->dest, thisDataMsg->from);
-						// Check if this broadcast is coming from ourself
-						if ((thisDataMsg->dest & 0xFFFFFF00) == (g_this_device_addr & 0xFFFFFF00))
-						{
-							MYLOG("MESH", "We received our own broadcast, dismissing it");
-							return;
-						}
-						// Check if we handled this broadcast already
-						if (is_old_broadcast(thisDataMsg->dest))
-						{
-							MYLOG("MESH", "Got an old broadcast, dismissing it");
-							return;
-						}
+			// This is a broadcast. Forward to all direct nodes, but not to the one who sent it
+			MYLOG("MESH", "Handling Mesh map request with ID %08lX from %08lX", thisDataMsg->dest, thisDataMsg->from);
+			// Check if this broadcast is coming from ourself
+			if ((thisDataMsg->dest & 0xFFFFFF00) == (g_this_device_addr & 0xFFFFFF00))
+			{
+				MYLOG("MESH", "We received our own broadcast, dismissing it");
+				return false;
+			}
+			// Check if we handled this broadcast already
+			if (is_old_packet(thisDataMsg->from, thisDataMsg->seq))
+			{
+				MYLOG("MESH", "Got an old broadcast, dismissing it");
+				g_mesh_stats.duplicate++;
+				return false;
+			}
 
-						// Put broadcast into send queue
-						if (!add_send_request(thisDataMsg, rx_pckg.rx_size))
-						{
-							MYLOG("MESH", "Cannot forward broadcast because send queue is full");
-						}
-						// Wake up task to handle request for nodes map
-						mesh_event |= SYNC_MAP;
-					}
-				}
-				else
-				{
-					MYLOG("MESH", "Invalid package");
-					for (int idx = 0; idx < rx_pckg.rx_size; idx++)
-					{
-						Serial.printf("%02X ", rx_pckg.rx_buffer[idx]);
-					}
-					Serial.println("");
-				}
+			// Another node requested the maps already, the answers bring the unknown node as well
+			if (map_req_pending)
+			{
+				MYLOG("MESH", "Map request from %08lX, own map request not needed", thisDataMsg->from);
+				map_req_pending = false;
 			}
-			else
+
+			// Put broadcast into send queue, it is sent from the same slot after a random delay
+			tx_random_holdoff();
+			slot_queued = tx_slot_queue(slot, MESH_TX_CONTROL);
+			if (!slot_queued)
 			{
-				MYLOG("MESH", "Error getting msg from RX buffer");
-				break;
+				MYLOG("MESH", "Cannot forward broadcast because send queue is full");
 			}
+			// Wake up task to handle request for nodes map, the map sync timer is not changed
+			map_full_pending = true;
+			mesh_post_event(MAP_REPLY);
+			trickle_reset();
+		}
+		else if (thisDataMsg->type == LORA_MAP_SYNC_REQ)
+		{
+			if (thisDataMsg->dest != g_this_device_addr)
+			{
+				// Request for another node
+				return false;
+			}
+			MYLOG("MESH", "Map sync request from %08lX", thisDataMsg->from);
+			uint16_t base = thisDataMsg->data[0] | (thisDataMsg->data[1] << 8);
+			if ((thisDataMsg->data[2] == 0) || (node_map_delta(NULL, base, MAP_PAGE_NODES) == MAP_DELTA_INVALID))
+			{
+				// Sender doesn't know our map or the changes are too old, send the full map
+				map_full_pending = true;
+			}
+			else if (!map_reply_pending || ((uint16_t)(g_map_version - base) > (uint16_t)(g_map_version - map_reply_base)))
+			{
+				// Delta from the oldest requested version covers all requests
+				map_reply_base = base;
+			}
+			map_reply_pending = true;
+			mesh_post_event(MAP_REPLY);
+		}
+		else if (thisDataMsg->type == LORA_AGGREGATE)
+		{
+			if (thisMsg->dest != g_this_device_addr)
+			{
+				// Aggregate for another node
+				return false;
+			}
+			MYLOG("MESH", "Aggregate message from %08lX", thisMsg->from);
+			neighbour_stats(thisMsg->from)->rx++;
+			rx_accepted = aggregate_split(slot);
+		}
+		else if (thisDataMsg->type == LORA_ACK)
+		{
+			neighbour_stats(thisDataMsg->from)->rx++;
+			ack_received(thisDataMsg);
 		}
 	}
 	else
 	{
-		MYLOG("MESH", "RX queue not initialized");
+		MYLOG("MESH", "Invalid package");
+		g_mesh_stats.rx_invalid++;
+		for (int idx = 0; idx < slot->size; idx++)
+		{
+			Serial.printf("%02X ", slot->packet[idx]);
+		}
+		Serial.println("");
+	}
+	if (rx_accepted)
+	{
+		if (ack_req)
+		{
+			send_ack(ack_orig, ack_seq);
+		}
+		if (accepted != NULL)
+		{
+			*accepted = true;
+		}
+	}
+	return slot_queued;
+}
+
+/**
+ * Callback after a LoRa package was received
+ *
+ */
+void mesh_check_rx(void)
+{
+	mesh_slot_s *slot;
+
+	while ((slot = slot_pop(&mesh_rx_queue)) != NULL)
+	{
+		if (!mesh_handle_rx(slot))
+		{
+			slot_release(slot);
+		}
 	}
 }
 
@@ -755,100 +3242,106 @@ void mesh_check_rx(void)
 void mesh_check_tx(void)
 {
 	// MYLOG("MESH", "LoRa send finished");
-	lora_state = MESH_IDLE;
+	if (lora_state == MESH_TX)
+	{
+		g_mesh_tx_stats[tx_class_active].sent++;
+		airtime_charge(tx_class_active, mesh_time_on_air(tx_slot->size));
+		stats_tx(tx_slot);
+		// Packets that need an ACK are kept until the ACK is received
+		ack_wait_start();
+	}
+	tx_slot_done();
+	// Next fragments of a large payload
+	frag_tx_feed();
+	// Next page of a large map
+	map_page_feed();
+
+	mesh_post_event(CHECK_QUEUE);
+}
+
+/**
+ * @brief Callback after the CAD before a TX.
+ * 			If the channel is busy, the packet is not sent and there is no TX finished callback.
+ * 			The packet is sent again after a random backoff
+ *
+ * @param busy true if the channel is busy
+ */
+void mesh_check_cad(bool busy)
+{
+	if (busy && (lora_state == MESH_TX))
+	{
+		MYLOG("MESH", "Channel busy, %s packet not sent", mesh_tx_class_names[tx_class_active]);
+		tx_backoff();
 
-	mesh_event |= CHECK_QUEUE;
+		mesh_post_event(CHECK_QUEUE);
+	}
 }
 
 /**
- * Add a data package to the queue
+ * Add a data package to the queue of its TX class
  * @param package
  * 			dataPckg * to the package data
  * @param msg_size
  * 			Size of the data package
+ * @param tx_class
+ * 			TX class, MESH_TX_CONTROL packets are sent before MESH_TX_FORWARD packets
+ * 			and those are sent before MESH_TX_LOCAL packets
  * @return result
  * 			TRUE if task could be added to queue
  * 			FALSE if queue is full or not initialized
  */
-bool add_send_request(data_msg_s *package, uint8_t msg_size)
+bool add_send_request(data_msg_s *package, uint8_t msg_size, mesh_tx_class_t tx_class)
 {
-	data_msg_s temp;
-
-	if (mesh_tx_queue.isInitialized())
+	mesh_slot_s *slot = tx_slot_claim(tx_class);
+	if (slot == NULL)
 	{
-		if (!mesh_tx_queue.isFull())
-		{
-			// Found an empty entry!
-			memcpy((void *)&temp.mark1, (void *)&package->mark1, msg_size);
-			temp.data[242] = msg_size;
-
-			// Try to add to cloudTaskQueue
-			if (!mesh_tx_queue.push((void *)&temp.mark1))
-			{
-				MYLOG("MESH", "Failed to add packet to TX queue");
-				return false;
-			}
-			else
-			{
-				// MYLOG("MESH", "Queued msg #%d with len %d", next, msg_size);
-				mesh_event |= CHECK_QUEUE;
-				return true;
-			}
-		}
-		else
-		{
-			MYLOG("MESH", "Send queue is full");
-			// Queue is already full!
-			return false;
-		}
+		return false;
 	}
-	else
+	memcpy(slot->packet, (void *)&package->mark1, msg_size);
+	slot->size = msg_size;
+	if (!tx_slot_queue(slot, tx_class))
 	{
-		MYLOG("MESH", "Send queue not yet initialized");
+		slot_release(slot);
 		return false;
 	}
+	return true;
 }
 
+/**
+ * @brief Add a received packet to the RX queue, called from the LoRa RX callback
+ *
+ * @param rssi RSSI of the packet
+ * @param snr SNR of the packet
+ * @param size size of the packet
+ * @param buffer received packet
+ * @return true if the packet was queued
+ * @return false if the RX queue is full
+ */
 bool add_rx_packet(int16_t rssi, int8_t snr, uint8_t size, uint8_t *buffer)
 {
-	rx_msg_s temp;
-
-	if (mesh_rx_queue.isInitialized())
+	mesh_slot_s *slot = slot_claim();
+	if (slot == NULL)
 	{
-		if (!mesh_rx_queue.isFull())
-		{
-			// Found an empty entry!
-			memcpy((void *)temp.rx_buffer, buffer, size);
+		MYLOG("MESH", "RX queue is full");
+		return false;
+	}
 
-			temp.rx_rssi = rssi;
-			temp.rx_snr = snr;
-			temp.rx_size = size;
+	memcpy(slot->packet, buffer, size);
+	slot->rssi = rssi;
+	slot->snr = snr;
+	slot->size = size;
+	// Receive time for the time sync beacon
+	slot->queue_time = millis();
 
-			// Try to add to cloudTaskQueue
-			if (!mesh_rx_queue.push((void *)&temp.rx_size))
-			{
-				MYLOG("MESH", "Failed to add packet to RX queue");
-				return false;
-			}
-			else
-			{
-				// MYLOG("MESH", "Queued msg #%d with len %d", next, msg_size);
-				mesh_event |= CHECK_RX;
-				return true;
-			}
-		}
-		else
-		{
-			MYLOG("MESH", "RX queue is full");
-			// Queue is already full!
-			return false;
-		}
-	}
-	else
+	if (!slot_push(&mesh_rx_queue, slot))
 	{
-		MYLOG("MESH", "RX queue not yet initialized");
+		MYLOG("MESH", "RX queue is full");
+		// Queue is already full!
+		slot_release(slot);
 		return false;
 	}
+	mesh_post_event(CHECK_RX);
+	return true;
 }
 
 /**
@@ -858,11 +3351,11 @@ bool add_rx_packet(int16_t rssi, int8_t snr, uint8_t size, uint8_t *buffer)
 void print_mesh_map(void)
 {
 	/** Node ID of the selected receiver node */
-	uint32_t node_id[48];
+	uint32_t node_id;
 	/** First hop ID of the selected receiver node */
-	uint32_t first_hop[48];
-	/** Number of hops to the selected receiver node */
-	uint8_t num_hops[48];
+	uint32_t first_hop;
+	/** Path metric to the selected receiver node */
+	uint8_t metric;
 	/** Number of nodes in the map */
 	uint8_t num_elements;
 
@@ -870,24 +3363,31 @@ void print_mesh_map(void)
 	/** Number of nodes in the map */
 	num_elements = nodes_in_map();
 
-	for (int idx = 0; idx < num_elements; idx++)
-	{
-		get_node(idx, node_id[idx], first_hop[idx], num_hops[idx]);
-	}
-	// Display the nodes
+	// Display the nodes, one by one, the map can be larger than a buffer on the stack
 	MYLOG("MESH", "%d nodes in the map", num_elements + 1);
 	MYLOG("MESH", "Node #01 id: %08lX this node", g_this_device_addr);
 	for (int idx = 0; idx < num_elements; idx++)
 	{
-		if (first_hop[idx] == 0)
+		get_node(idx, node_id, first_hop, metric);
+		if (first_hop == 0)
 		{
-			MYLOG("MESH", "Node #%02d id: %08lX direct", idx + 2, node_id[idx]);
+			MYLOG("MESH", "Node #%02d id: %08lX direct ETX %d.%02d", idx + 2, node_id,
+				  metric / ROUTE_METRIC_UNIT, (metric % ROUTE_METRIC_UNIT) * 100 / ROUTE_METRIC_UNIT);
 		}
 		else
 		{
-			MYLOG("MESH", "Node #%02d id: %08lX first hop %08lX #hops %d", idx + 2, node_id[idx], first_hop[idx], num_hops[idx]);
+			MYLOG("MESH", "Node #%02d id: %08lX first hop %08lX ETX %d.%02d", idx + 2, node_id, first_hop,
+				  metric / ROUTE_METRIC_UNIT, (metric % ROUTE_METRIC_UNIT) * 100 / ROUTE_METRIC_UNIT);
 		}
 	}
+	for (int tx_class = 0; tx_class < MESH_TX_CLASSES; tx_class++)
+	{
+		MYLOG("MESH", "TX %s: queued %ld sent %ld dropped %ld failed %ld retried %ld retransmitted %ld aggregated %ld airtime %ld ms", mesh_tx_class_names[tx_class],
+			  g_mesh_tx_stats[tx_class].queued, g_mesh_tx_stats[tx_class].sent,
+			  g_mesh_tx_stats[tx_class].dropped, g_mesh_tx_stats[tx_class].failed,
+			  g_mesh_tx_stats[tx_class].retried, g_mesh_tx_stats[tx_class].retransmitted,
+			  g_mesh_tx_stats[tx_class].aggregated, g_mesh_tx_stats[tx_class].airtime);
+	}
 	MYLOG("MESH", "---------------------------------------------");
 }
 
@@ -898,20 +3398,24 @@ void print_mesh_map_oled(void)
 	{
 		MYLOG("MESH", "Print map to OLED");
 		/** Node ID of the selected receiver node */
-		uint32_t node_id[48];
+		uint32_t node_id[10];
 		/** First hop ID of the selected receiver node */
-		uint32_t first_hop[48];
-		/** Number of hops to the selected receiver node */
-		uint8_t num_hops[48];
+		uint32_t first_hop[10];
+		/** Path metric to the selected receiver node */
+		uint8_t metric[10];
 		/** Number of nodes in the map */
 		uint8_t num_elements;
 
-		/** Number of nodes in the map */
+		/** Number of nodes in the map, the display shows the first 10 */
 		num_elements = nodes_in_map();
+		if (num_elements > 10)
+		{
+			num_elements = 10;
+		}
 
 		for (int idx = 0; idx < num_elements; idx++)
 		{
-			get_node(idx, node_id[idx], first_hop[idx], num_hops[idx]);
+			get_node(idx, node_id[idx], first_hop[idx], metric[idx]);
 		}
 
 		// Display the nodes
@@ -920,11 +3424,6 @@ void print_mesh_map_oled(void)
 		sprintf(line_str, "Node %08lX - B %.1fV", g_this_device_addr, api.system.bat.get());
 		rak1921_write_header(line_str);
 
-		if (num_elements > 10)
-		{
-			num_elements = 10;
-		}
-
 		int16_t line = 0;
 		for (int idx = 0; idx < num_elements; idx += 2)
 		{
@@ -951,76 +3450,91 @@ void print_mesh_map_oled(void)
 #endif
 }
 
+/**
+ * @brief Get a packet slot and prepare the header of a data packet
+ *
+ * @param tx_class TX class of the packet
+ * @param type packet type
+ * @param dest destination address or broadcast ID
+ * @param data_size size of the data after the header
+ * @return mesh_slot_s* slot or NULL if all slots are in use
+ */
+mesh_slot_s *prepare_data_packet(mesh_tx_class_t tx_class, uint8_t type, uint32_t dest, uint8_t data_size)
+{
+	mesh_slot_s *slot = tx_slot_claim(tx_class);
+	if (slot == NULL)
+	{
+		return NULL;
+	}
+	data_msg_s *data_msg = (data_msg_s *)slot->packet;
+	data_msg->mark1 = 'L';
+	data_msg->mark2 = 'o';
+	data_msg->mark3 = 'R';
+	data_msg->type = type;
+	data_msg->dest = dest;
+	data_msg->from = g_this_device_addr;
+	data_msg->orig = 0;
+	// Broadcasts use the sequence number from their broadcast ID
+	if ((type == LORA_BROADCAST) || (type == LORA_MAP_REQ))
+	{
+		data_msg->seq = dest & 0x000000FF;
+	}
+	else
+	{
+		data_msg->seq = get_next_packet_seq();
+	}
+	slot->size = DATA_HEADER_SIZE + data_size;
+	return slot;
+}
+
 /**
  * @brief Enqueue data to be send over the Mesh Network
  *
  * @param is_broadcast if true, send as broadcast
  * @param target_addr used for direct message
  * @param tx_data pointer to data packet
- * @param data_size size of data packet
+ * @param data_size size of data packet, payloads larger than MESH_MAX_DATA_SIZE are sent in fragments (not as broadcast)
  * @return true packet is enqueued for sending
  * @return false
  */
-bool send_to_mesh(bool is_broadcast, uint32_t target_addr, uint8_t *tx_data, uint8_t data_size)
+bool send_to_mesh(bool is_broadcast, uint32_t target_addr, uint8_t *tx_data, uint16_t data_size)
 {
-	char data_buffer[512];
 	// Check if data fits into buffer
-	if (data_size > 243)
+	if (data_size > MESH_MAX_DATA_SIZE)
 	{
-		return false;
+		if (is_broadcast)
+		{
+			return false;
+		}
+		// Large payload, send in fragments
+		return send_fragmented(target_addr, tx_data, data_size);
 	}
 
+	mesh_slot_s *slot;
 	// Check if it is a broadcast
 	if (is_broadcast)
 	{
-		// Send a broadcast
-		// Prepare data
-		out_data_buffer.mark1 = 'L';
-		out_data_buffer.mark2 = 'o';
-		out_data_buffer.mark3 = 'R';
-
 		// Setup broadcast
-		out_data_buffer.dest = get_next_broadcast_id();
-		out_data_buffer.from = g_this_device_addr;
-		out_data_buffer.type = LORA_BROADCAST;
-		// MYLOG("MESH", "Queuing broadcast with id %08lX", out_data_buffer.dest);
-
-		memcpy(out_data_buffer.data, tx_data, data_size);
-
-		int dataLen = DATA_HEADER_SIZE + data_size;
-
-		// Add package to send queue
-		if (!add_send_request(&out_data_buffer, dataLen))
-		{
-			MYLOG("MESH", "Sending package failed");
-		}
+		slot = prepare_data_packet(MESH_TX_LOCAL, LORA_BROADCAST, get_next_broadcast_id(), data_size);
 	}
 	else // direct message
 	{
-		// Prepare data
-		out_data_buffer.mark1 = 'L';
-		out_data_buffer.mark2 = 'o';
-		out_data_buffer.mark3 = 'R';
-
-		// Prepare direct message
-		out_data_buffer.dest = target_addr;
-		out_data_buffer.from = g_this_device_addr;
-		out_data_buffer.type = LORA_DIRECT;
-
-		memcpy(out_data_buffer.data, tx_data, data_size);
+		slot = prepare_unicast_packet(MESH_TX_LOCAL, target_addr, data_size);
+	}
+	if (slot == NULL)
+	{
+		MYLOG("MESH", "Sending package failed");
+		return false;
+	}
 
-		int dataLen = DATA_HEADER_SIZE + data_size;
+	memcpy(((data_msg_s *)slot->packet)->data, tx_data, data_size);
 
-		// Add package to send queue
-		if (!add_send_request(&out_data_buffer, dataLen))
-		{
-			MYLOG("MESH", "Sending package failed");
-			return false;
-		}
-		// else
-		// {
-		// 	MYLOG("MESH", "Queued msg direct to %08lX", out_data_buffer.dest);
-		// }
+	// Add package to send queue
+	if (!tx_slot_queue(slot, MESH_TX_LOCAL))
+	{
+		MYLOG("MESH", "Sending package failed");
+		slot_release(slot);
+		return false;
 	}
 	return true;
 }
@@ -1033,25 +3547,47 @@ bool send_to_mesh(bool is_broadcast, uint32_t target_addr, uint8_t *tx_data, uin
  */
 bool send_map_request()
 {
-	// Send a broadcast
-	// Prepare data
-	out_data_buffer.mark1 = 'L';
-	out_data_buffer.mark2 = 'o';
-	out_data_buffer.mark3 = 'R';
-
 	// Setup broadcast
-	out_data_buffer.dest = get_next_broadcast_id();
-	out_data_buffer.from = g_this_device_addr;
-	out_data_buffer.type = LORA_MAP_REQ;
-	// MYLOG("MESH", "Queuing map request with id %08lX", out_data_buffer.dest);
+	mesh_slot_s *slot = prepare_data_packet(MESH_TX_CONTROL, LORA_MAP_REQ, get_next_broadcast_id(), 0);
+	if (slot == NULL)
+	{
+		MYLOG("MESH", "Sending package failed");
+		return false;
+	}
 
-	int dataLen = DATA_HEADER_SIZE;
+	// Add package to send queue, a full control queue drops its oldest packet
+	tx_slot_queue(slot, MESH_TX_CONTROL);
+	return true;
+}
 
-	// Add package to send queue
-	if (!add_send_request(&out_data_buffer, dataLen))
+/**
+ * @brief Request the map changes from a direct node after a map version gap.
+ * 			The node answers with the changes since the version this node knows or with its full map
+ *
+ * @param node_addr address of the direct node
+ * @return true if enqueued
+ * @return false if queue is full
+ */
+bool send_map_sync_request(uint32_t node_addr)
+{
+	uint16_t known_version = 0;
+	bool map_known = get_map_version(node_addr, known_version);
+
+	// Repeated at the next map sync until the node answers
+	map_sync_request_node = node_addr;
+
+	mesh_slot_s *slot = prepare_data_packet(MESH_TX_CONTROL, LORA_MAP_SYNC_REQ, node_addr, 3);
+	if (slot == NULL)
 	{
 		MYLOG("MESH", "Sending package failed");
 		return false;
 	}
+	data_msg_s *data_msg = (data_msg_s *)slot->packet;
+	data_msg->data[0] = known_version & 0xFF;
+	data_msg->data[1] = known_version >> 8;
+	data_msg->data[2] = map_known ? 1 : 0;
+
+	// Add package to send queue, a full control queue drops its oldest packet
+	tx_slot_queue(slot, MESH_TX_CONTROL);
 	return true;
-}
\ No newline at end of file
+}
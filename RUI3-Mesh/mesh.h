@@ -21,6 +21,7 @@ struct map_msg_s
 	uint8_t type = 5;	 // 4
 	uint32_t dest = 0;	 // 5,6,7,8
 	uint32_t from = 0;	 // 9,10,11,12
+	uint8_t seq = 0;	 // 13
 	uint8_t nodes[48][5];
 };
 #pragma pack(pop)
@@ -34,19 +35,56 @@ struct data_msg_s
 	uint32_t dest = 0;	 // 5,6,7,8
 	uint32_t from = 0;	 // 9,10,11,12
 	uint32_t orig = 0;	 // 13,14,15,16
-	uint8_t data[243];	 // 17
+	uint8_t seq = 0;	 // 17
+	uint8_t data[238];	 // 18
 };
 #pragma pack(pop)
 #pragma pack(push, 1)
-struct rx_msg_s
+struct aggregate_msg_s
 {
-	uint8_t rx_size;
-	int8_t rx_snr;
-	int16_t rx_rssi;
-	uint8_t rx_buffer[256];
+	uint8_t mark1 = 'L'; // 1
+	uint8_t mark2 = 'o'; // 2
+	uint8_t mark3 = 'R'; // 3
+	uint8_t type = 9;	 // 4
+	uint32_t dest = 0;	 // 5,6,7,8
+	uint32_t from = 0;	 // 9,10,11,12
+	uint8_t seq = 0;	 // 13
+	uint8_t subs[242];	 // 14
 };
 #pragma pack(pop)
 
+/** Max size of a LoRa packet */
+#define MESH_MAX_PACKET_SIZE 255
+/** Max size of the data in a data message */
+#define MESH_MAX_DATA_SIZE (MESH_MAX_PACKET_SIZE - DATA_HEADER_SIZE)
+/** Max size of a payload for send_to_mesh(), larger than MESH_MAX_DATA_SIZE is sent in fragments */
+#define MESH_MAX_TRANSFER_SIZE 1024
+
+/** Slot for a received or outgoing packet, packets are handled and forwarded in their slot */
+struct mesh_slot_s
+{
+	/** Next slot in the same queue */
+	mesh_slot_s *next;
+	/** Size of the packet */
+	uint8_t size;
+	/** SNR of a received packet */
+	int8_t snr;
+	/** RSSI of a received packet */
+	int16_t rssi;
+	/** Number of retries of an outgoing packet after a busy channel */
+	uint8_t retries;
+	/** Number of retransmissions of an outgoing packet that was not acknowledged */
+	uint8_t ack_retries;
+	/** TX class of an outgoing packet that waits for an ACK */
+	uint8_t tx_class;
+	/** Time until an outgoing packet waits for an ACK */
+	time_t ack_time;
+	/** Time an outgoing packet was added to its TX queue */
+	time_t queue_time;
+	/** Packet, starts with the map_msg_s or data_msg_s header */
+	uint8_t packet[MESH_MAX_PACKET_SIZE];
+};
+
 /**
  * Mesh callback functions
  */
@@ -81,11 +119,21 @@ typedef struct
 
 /** Time interval for handling mesh events */
 #define EVENT_HANDLER_TIME 1000
+/** Delay of the mesh task after a mesh event in ms, the callback that set the event is finished before */
+#define MESH_SERVICE_DELAY 1
 
 /** Size of map message buffer without subnode */
-#define MAP_HEADER_SIZE 12
+#define MAP_HEADER_SIZE 13
 /** Size of data message buffer without subnode */
-#define DATA_HEADER_SIZE 16
+#define DATA_HEADER_SIZE 17
+/** Size of aggregate message buffer without sub-frames */
+#define AGGREGATE_HEADER_SIZE 13
+/** Size of a sub-frame header in an aggregate message, without the optional addresses */
+#define AGGREGATE_SUB_HEADER_SIZE 3
+/** Sub-frame header flags, the lower 4 bits are the message type */
+#define AGGREGATE_TYPE_MASK 0x0F
+#define AGGREGATE_HAS_FROM 0x10
+#define AGGREGATE_HAS_ORIG 0x20
 
 /** LoRa package types */
 #define LORA_INVALID 0
@@ -94,18 +142,156 @@ typedef struct
 #define LORA_BROADCAST 3
 #define LORA_NODEMAP 4
 #define LORA_MAP_REQ 5
+#define LORA_MAP_SUMMARY 6
+#define LORA_MAP_DELTA 7
+#define LORA_MAP_SYNC_REQ 8
+#define LORA_AGGREGATE 9
+#define LORA_ACK 10
+/** Flag in the type of LORA_DIRECT, LORA_FORWARD and LORA_AGGREGATE packets, the next hop has to acknowledge the packet */
+#define LORA_ACK_REQ 0x80
+/** Flag in the type of LORA_DIRECT and LORA_FORWARD packets, the data is a fragment of a large payload */
+#define LORA_FRAG 0x40
+
+/** TX scheduler classes, a lower class is always sent first */
+typedef enum
+{
+	MESH_TX_CONTROL = 0, //!< Map syncs, map requests and map sync requests
+	MESH_TX_FORWARD,	 //!< Frames forwarded for other nodes
+	MESH_TX_LOCAL,		 //!< Data of this node
+	MESH_TX_CLASSES		 //!< Number of TX classes
+} mesh_tx_class_t;
+
+/** Counters of a TX scheduler class */
+struct mesh_tx_stats_s
+{
+	/** Frames added to the queue of the class */
+	uint32_t queued;
+	/** Frames sent successful */
+	uint32_t sent;
+	/** Frames dropped because the queue of the class was full */
+	uint32_t dropped;
+	/** Frames dropped because the radio was busy or the channel was not free after all retries */
+	uint32_t failed;
+	/** Retries after a busy channel or a busy radio */
+	uint32_t retried;
+	/** Frames sent again because the next hop did not acknowledge them */
+	uint32_t retransmitted;
+	/** Frames packed together with other frames into one aggregate frame */
+	uint32_t aggregated;
+	/** Time on air of the sent frames in ms */
+	uint32_t airtime;
+};
+
+/** Number of frame types with their own counters, LORA_INVALID to LORA_ACK */
+#define MESH_STAT_TYPES 11
+/** Number of neighbours with their own counters */
+#define MESH_STAT_NEIGHBOURS 8
+/** Number of buckets of the queue residence time histogram */
+#define MESH_STAT_LATENCY_BUCKETS 8
+/** Marker and version of the binary statistics report */
+#define MESH_STAT_REPORT_MARK1 'S'
+#define MESH_STAT_REPORT_MARK2 'T'
+#define MESH_STAT_REPORT_VERSION 1
+/** Max size of the binary statistics report */
+#define MESH_STAT_REPORT_SIZE (66 + MESH_TX_CLASSES * MESH_STAT_LATENCY_BUCKETS * 2 + MESH_STAT_NEIGHBOURS * 10)
+
+/** Counters of a neighbour */
+struct mesh_neighbour_stats_s
+{
+	/** Address of the neighbour, 0 if the entry is not used */
+	uint32_t addr;
+	/** Map messages, aggregates and ACKs received from the neighbour */
+	uint32_t rx;
+	/** Frames sent to the neighbour as next hop */
+	uint32_t tx;
+	/** Frames sent again to the neighbour because it did not acknowledge them */
+	uint32_t retransmitted;
+};
+
+/** Counters of the mesh, in addition to the counters of the TX classes */
+struct mesh_stats_s
+{
+	/** Time the counters were reset */
+	time_t start_time;
+	/** Received frames per frame type, messages in an aggregate are counted with their own type as well */
+	uint32_t rx[MESH_STAT_TYPES];
+	/** Sent frames per frame type */
+	uint32_t tx[MESH_STAT_TYPES];
+	/** Received frames without mesh marker, with unknown type or invalid map */
+	uint32_t rx_invalid;
+	/** Messages that could not be forwarded because there is no route */
+	uint32_t no_route;
+	/** Messages and broadcasts that were received already */
+	uint32_t duplicate;
+	/** Time from queueing until the first TX per TX class, bucket limits in mesh_stat_latency_limits */
+	uint32_t queue_time[MESH_TX_CLASSES][MESH_STAT_LATENCY_BUCKETS];
+	/** Counters of the neighbours with the most traffic */
+	mesh_neighbour_stats_s neighbours[MESH_STAT_NEIGHBOURS];
+};
+
+/** Max number of nodes in the nodes map, can be set with -DMESH_MAX_NODES up to 250 */
+#ifndef MESH_MAX_NODES
+#if defined(_VARIANT_RAK3172_) || defined(_VARIANT_RAK3172_SIP_)
+#define MESH_MAX_NODES 15
+#else
+#define MESH_MAX_NODES 30
+#endif
+#endif
+#if MESH_MAX_NODES > 250
+#error "MESH_MAX_NODES must not be larger than 250"
+#endif
+/** Period of the wake schedule in ms, 0 = the radio is always in RX.
+	Otherwise the nodes keep the radio in RX only in a wake window at the start of each period and sleep in between */
+#ifndef MESH_WAKE_PERIOD
+#define MESH_WAKE_PERIOD 0
+#endif
+/** Max number of nodes in one map message, without the end marker. A larger full map is sent in pages */
+#if MESH_WAKE_PERIOD > 0
+// One node less, the time sync beacon follows the end marker
+#define MAP_PAGE_NODES 46
+#else
+#define MAP_PAGE_NODES 47
+#endif
+/** Size of the time sync beacon after the end marker of a map message, nodes without wake schedule ignore it */
+#define MAP_BEACON_SIZE 4
+
+/** Path metric of a removed node in a map delta */
+#define MAP_ENTRY_REMOVED 0xFF
+/** Result of node_map_delta() if the changes can only be sent as full map */
+#define MAP_DELTA_INVALID 0xFF
 
 // LoRa Mesh functions & variables
 void init_mesh(mesh_events_s *events);
 void mesh_task(void *pvParameters);
+void mesh_post_event(uint16_t event);
 void mesh_check_rx(void);
 void mesh_check_tx(void);
-bool add_send_request(data_msg_s *package, uint8_t msg_size);
+void mesh_check_cad(bool busy);
+bool mesh_handle_rx(mesh_slot_s *slot, bool *accepted = NULL);
+bool add_send_request(data_msg_s *package, uint8_t msg_size, mesh_tx_class_t tx_class = MESH_TX_LOCAL);
 bool add_rx_packet(int16_t rssi, int8_t snr, uint8_t size, uint8_t *buffer);
+mesh_slot_s *prepare_data_packet(mesh_tx_class_t tx_class, uint8_t type, uint32_t dest, uint8_t data_size);
 void print_mesh_map(void);
-bool send_to_mesh(bool is_broadcast, uint32_t target_addr, uint8_t *tx_data, uint8_t data_size);
+bool send_to_mesh(bool is_broadcast, uint32_t target_addr, uint8_t *tx_data, uint16_t data_size);
 bool send_map_request();
+bool send_map_sync_request(uint32_t node_addr);
 extern mesh_events_s g_mesh_events;
+extern mesh_tx_stats_s g_mesh_tx_stats[MESH_TX_CLASSES];
+extern const char *mesh_tx_class_names[MESH_TX_CLASSES];
+extern mesh_stats_s g_mesh_stats;
+extern const uint16_t mesh_stat_latency_limits[MESH_STAT_LATENCY_BUCKETS - 1];
+void mesh_stats_reset(void);
+uint8_t mesh_stats_report(uint8_t *buffer);
+uint32_t mesh_time_on_air(uint8_t size);
+uint16_t mesh_duty_cycle(void);
+uint32_t mesh_airtime_used(mesh_tx_class_t tx_class);
+uint32_t mesh_airtime_left(mesh_tx_class_t tx_class);
+uint32_t wake_phase(void);
+bool wake_rx_needed(long &next_change);
+bool wake_tx_allowed(uint32_t time_on_air);
+void wake_beacon_stamp(mesh_slot_s *slot);
+void wake_beacon_rx(uint32_t from, mesh_slot_s *slot);
+void wake_update(void);
 
 /** Wake up events for Mesh Task */
 #define NO_EVENT 0
@@ -117,29 +303,79 @@ extern mesh_events_s g_mesh_events;
 #define N_CHECK_QUEUE 0b11111011
 #define CHECK_RX      0b00001000
 #define N_CHECK_RX    0b11110111
+#define MAP_REPLY     0b00010000
+#define N_MAP_REPLY   0b11101111
+#define CHECK_ACK     0b00100000
+#define N_CHECK_ACK   0b11011111
+#define CHECK_FRAG    0b01000000
+#define N_CHECK_FRAG  0b10111111
+#define CHECK_NODES   0b10000000
+#define N_CHECK_NODES 0b01111111
+
+/** Path metric of one transmission over a perfect link, metrics are expected transmissions * ROUTE_METRIC_UNIT */
+#define ROUTE_METRIC_UNIT 8
+/** Path metric of an unreachable node */
+#define ROUTE_METRIC_MAX 0xFE
+/** A different route is only taken if its path metric is lower by at least this value */
+#define ROUTE_METRIC_HYSTERESIS 4
 
 struct g_nodes_list_s
 {
 	uint32_t node_id;
 	uint32_t first_hop;
 	time_t time_stamp;
-	uint8_t num_hops;
+	/** Path metric to the node, expected transmissions * ROUTE_METRIC_UNIT */
+	uint8_t metric;
+	/** Map version of this node when the entry was added or changed */
+	uint16_t changed_version;
+	/** Map version of a direct node that was applied */
+	uint16_t map_version;
+	/** Map of a direct node is known */
+	bool map_known;
+	/** Highest packet sequence number received from this node */
+	uint8_t seq_last;
+	/** Received packet sequence numbers, bit n is set if seq_last - n was received */
+	uint32_t seq_window;
+	/** Average SNR of the link to a direct node in 1/4 dB */
+	int16_t link_snr;
+	/** Average ratio of received map messages of a direct node, 255 = 100 %, 0 = no link estimate */
+	uint8_t link_prr;
+	/** Sequence number of the last map message received from a direct node */
+	uint8_t link_seq;
+	/** Next hop of a route that is better than the weak link to a direct node, 0 if none */
+	uint32_t alt_hop;
+	/** Path metric of the route over alt_hop */
+	uint8_t alt_metric;
 };
 
 // Mesh Router
+bool init_router(void);
 bool get_route(uint32_t id, g_nodes_list_s *route);
-boolean add_node(uint32_t id, uint32_t hop, uint8_t num_hops);
+boolean add_node(uint32_t id, uint32_t hop, uint8_t metric);
+bool update_link(uint32_t id, int8_t snr, uint8_t seq);
 void clear_subs(uint32_t id);
 bool clean_map(void);
-uint8_t node_map(uint32_t subs[], uint8_t hops[]);
-uint8_t node_map(uint8_t nodes[][5]);
+bool next_node_timeout(time_t &timeout);
+uint8_t node_map(uint32_t subs[], uint8_t metrics[]);
+uint8_t node_map(uint8_t nodes[][5], uint8_t first, uint8_t max_nodes);
 uint8_t nodes_in_map();
-bool get_node(uint8_t node_num, uint32_t &nodeId, uint32_t &firstHop, uint8_t &numHops);
+bool get_node(uint8_t node_num, uint32_t &nodeId, uint32_t &firstHop, uint8_t &metric);
 uint32_t get_node_addr(uint8_t node_num);
 uint32_t get_next_broadcast_id(void);
-bool is_old_broadcast(uint32_t g_broadcast_id);
+uint8_t get_next_packet_seq(void);
+bool is_old_packet(uint32_t origin, uint8_t seq);
+void forget_packet(uint32_t origin, uint8_t seq);
 bool check_node(uint32_t node_addr);
+void touch_subs(uint32_t id);
+bool sync_subs(uint32_t id, uint8_t nodes[][5], uint8_t num_nodes);
+bool sync_subs_page(uint32_t id, uint8_t nodes[][5], uint8_t num_nodes, uint8_t page, uint8_t pages, uint16_t version, bool &complete);
+bool apply_delta(uint32_t id, uint8_t nodes[][5], uint8_t num_nodes);
+bool get_map_version(uint32_t id, uint16_t &version);
+void set_map_version(uint32_t id, uint16_t version);
+void invalidate_map_versions(uint32_t except);
+uint8_t node_map_delta(uint8_t nodes[][5], uint16_t base, uint8_t max_nodes);
 
 extern g_nodes_list_s *g_nodes_map;
 extern int g_num_of_nodes;
 extern uint32_t g_this_device_addr;
+extern uint16_t g_map_version;
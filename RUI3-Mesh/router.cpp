@@ -14,204 +14,1270 @@
 
 #include "main.h"
 
-/** The list with all known nodes */
-g_nodes_list_s *g_nodes_map;
-/** Index to the first free node entry */
+/** The list with all known nodes, free entries have node_id 0 */
+g_nodes_list_s *g_nodes_map = NULL;
+/** Number of nodes in the list */
 int nodes_mapindex = 0;
 
+/** Stack of free entries in the nodes list */
+uint16_t *nodes_free_list = NULL;
+/** Number of entries on the free stack */
+int nodes_free_cnt = 0;
+
+/** Hash index node_id => entry in the nodes list (open addressing, linear probing) */
+int16_t *nodes_hash = NULL;
+/** Size of the hash index, always a power of 2 */
+int nodes_hash_size = 0;
+/** Number of deleted entries in the hash index */
+int nodes_hash_tombs = 0;
+
+/** Min-heap of the used entries in the nodes list ordered by time stamp, the first entry is the next node that times out */
+uint16_t *nodes_heap = NULL;
+/** Position of each entry of the nodes list in the timeout heap */
+uint16_t *nodes_heap_pos = NULL;
+/** Number of entries in the timeout heap */
+int nodes_heap_cnt = 0;
+/** A node got the path metric ROUTE_METRIC_MAX, it is removed with the next clean_map() */
+bool nodes_unreachable = false;
+
+/** Marker for an unused hash index entry */
+#define HASH_EMPTY -1
+/** Marker for a deleted hash index entry */
+#define HASH_TOMB -2
+
+/** Version of the map this node announces, changes with every added, changed or removed entry */
+uint16_t g_map_version = 0;
+
+/** Size of the log of removed nodes, removals older than the log can only be synced with a full map */
+#define REMOVED_LOG_SIZE 16
+
+/** Time after the removal of a node in which it is only added again as direct node, in ms */
+#ifndef ROUTE_HOLD_DOWN
+#define ROUTE_HOLD_DOWN 120000
+#endif
+
+/** Removed node and the map version of the removal */
+struct removed_node_s
+{
+	uint32_t node_id;
+	uint16_t version;
+	/** Time of the removal */
+	time_t time;
+	/** Node is only added again as direct node within ROUTE_HOLD_DOWN */
+	bool hold_down;
+};
+
+/** Log of the latest removed nodes */
+removed_node_s removed_log[REMOVED_LOG_SIZE];
+/** Next entry in the removed nodes log */
+uint8_t removed_log_index = 0;
+/** Oldest map version a delta can be created from */
+uint16_t removed_log_floor = 0;
+
+/** Neighbour whose paged full map is received */
+uint32_t page_sync_id = 0;
+/** Next expected page of the paged full map */
+uint8_t page_sync_next = 0;
+/** Map version of the paged full map */
+uint16_t page_sync_version = 0;
+/** Time when the first page was received, entries over the neighbour that are older were not in the map */
+time_t page_sync_start = 0;
+
 /** Timeout to remove unresponsive nodes */
 time_t in_active_timeout = 120000;
 
-/** ID of received broadcast */
-extern uint32_t g_broadcast_id;
+/** SNR above the demodulation floor in 1/4 dB that gives a loss free link */
+#define LINK_SNR_MARGIN 32
+/** Lowest delivery ratio of a link, limits the link metric to 16 transmissions */
+#define LINK_PRR_MIN 64
+/** Weight of a new SNR value in the link estimate, 1 / LINK_SNR_WEIGHT */
+#define LINK_SNR_WEIGHT 4
+/** Weight of a received or lost map message in the link estimate, 1 / LINK_PRR_WEIGHT */
+#define LINK_PRR_WEIGHT 8
+/** Larger gaps in the map message sequence are a restart of the node, not lost messages */
+#define LINK_MAX_GAP 16
+
+/** ID of received broadcast */
+extern uint32_t g_broadcast_id;
+
+/** Sequence number of the last packet sent by this node */
+uint8_t g_packet_seq = 0;
+
+/** Number of packet sequence numbers in the duplicate window */
+#define SEQ_WINDOW_SIZE 32
+/** Number of origins outside of the nodes map that have a duplicate window */
+#define NUM_OF_UNKNOWN_ORIGINS 8
+
+/** Duplicate window of an origin that is not in the nodes map */
+struct origin_window_s
+{
+	uint32_t node_id;
+	uint8_t seq_last;
+	uint32_t seq_window;
+};
+
+/** Duplicate windows of origins that are not in the nodes map */
+origin_window_s unknown_origins[NUM_OF_UNKNOWN_ORIGINS];
+/** Next entry that is replaced in the list of unknown origins */
+uint8_t unknown_origins_index = 0;
+
+/**
+ * @brief Get the start position of a node ID in the hash index
+ *
+ * @param id node ID
+ * @return int start position for probing
+ */
+static inline int hash_pos(uint32_t id)
+{
+	// Fibonacci hashing, node IDs are often sequential in the lower bytes
+	return (int)((uint32_t)(id * 2654435761UL) >> 16) & (nodes_hash_size - 1);
+}
+
+/**
+ * @brief Find the entry of a node in the nodes list
+ *
+ * @param id node ID to search for
+ * @return int index in g_nodes_map or -1 if the node is not in the list
+ */
+static int find_entry(uint32_t id)
+{
+	if ((id == 0) || (nodes_hash_size == 0))
+	{
+		return -1;
+	}
+	int pos = hash_pos(id);
+	for (int probe = 0; probe < nodes_hash_size; probe++)
+	{
+		int16_t entry = nodes_hash[pos];
+		if (entry == HASH_EMPTY)
+		{
+			return -1;
+		}
+		if ((entry >= 0) && (g_nodes_map[entry].node_id == id))
+		{
+			return entry;
+		}
+		pos = (pos + 1) & (nodes_hash_size - 1);
+	}
+	return -1;
+}
+
+/**
+ * @brief Rebuild the hash index from the nodes list to get rid of tombstones
+ *
+ */
+static void rebuild_hash(void)
+{
+	for (int idx = 0; idx < nodes_hash_size; idx++)
+	{
+		nodes_hash[idx] = HASH_EMPTY;
+	}
+	nodes_hash_tombs = 0;
+	for (int idx = 0; idx < g_num_of_nodes; idx++)
+	{
+		if (g_nodes_map[idx].node_id != 0)
+		{
+			int pos = hash_pos(g_nodes_map[idx].node_id);
+			while (nodes_hash[pos] != HASH_EMPTY)
+			{
+				pos = (pos + 1) & (nodes_hash_size - 1);
+			}
+			nodes_hash[pos] = idx;
+		}
+	}
+}
+
+/**
+ * @brief Add a node entry to the hash index
+ *
+ * @param id node ID
+ * @param index entry in g_nodes_map
+ */
+static void hash_insert(uint32_t id, int index)
+{
+	int pos = hash_pos(id);
+	while (nodes_hash[pos] >= 0)
+	{
+		pos = (pos + 1) & (nodes_hash_size - 1);
+	}
+	if (nodes_hash[pos] == HASH_TOMB)
+	{
+		nodes_hash_tombs--;
+	}
+	nodes_hash[pos] = index;
+}
+
+/**
+ * @brief Remove a node entry from the hash index, leaves a tombstone
+ *
+ * @param id node ID
+ */
+static void hash_remove(uint32_t id)
+{
+	int pos = hash_pos(id);
+	for (int probe = 0; probe < nodes_hash_size; probe++)
+	{
+		int16_t entry = nodes_hash[pos];
+		if (entry == HASH_EMPTY)
+		{
+			return;
+		}
+		if ((entry >= 0) && (g_nodes_map[entry].node_id == id))
+		{
+			nodes_hash[pos] = HASH_TOMB;
+			nodes_hash_tombs++;
+			break;
+		}
+		pos = (pos + 1) & (nodes_hash_size - 1);
+	}
+
+	// Too many tombstones make the probe chains long, clean up
+	if ((nodes_hash_tombs + nodes_mapindex) > ((nodes_hash_size * 3) / 4))
+	{
+		rebuild_hash();
+	}
+}
+
+/**
+ * @brief Check if an entry of the nodes list was refreshed before another one
+ *
+ * @param first entry in g_nodes_map
+ * @param second entry in g_nodes_map
+ * @return true if the time stamp of first is older
+ */
+static inline bool heap_older(int first, int second)
+{
+	// Time stamps wrap around, compare the difference
+	return (long)(g_nodes_map[first].time_stamp - g_nodes_map[second].time_stamp) < 0;
+}
+
+/**
+ * @brief Put an entry of the nodes list to a position in the timeout heap
+ *
+ * @param pos position in the heap
+ * @param idx entry in g_nodes_map
+ */
+static inline void heap_set(int pos, int idx)
+{
+	nodes_heap[pos] = idx;
+	nodes_heap_pos[idx] = pos;
+}
+
+/**
+ * @brief Move an entry of the timeout heap up or down until the heap order is restored
+ *
+ * @param pos position of the entry in the heap
+ */
+static void heap_fix(int pos)
+{
+	int idx = nodes_heap[pos];
+	// Older than the parent, move up
+	while ((pos > 0) && heap_older(idx, nodes_heap[(pos - 1) / 2]))
+	{
+		heap_set(pos, nodes_heap[(pos - 1) / 2]);
+		pos = (pos - 1) / 2;
+	}
+	// Newer than a child, move down
+	while (true)
+	{
+		int child = (pos * 2) + 1;
+		if (child >= nodes_heap_cnt)
+		{
+			break;
+		}
+		if (((child + 1) < nodes_heap_cnt) && heap_older(nodes_heap[child + 1], nodes_heap[child]))
+		{
+			child++;
+		}
+		if (!heap_older(nodes_heap[child], idx))
+		{
+			break;
+		}
+		heap_set(pos, nodes_heap[child]);
+		pos = child;
+	}
+	heap_set(pos, idx);
+}
+
+/**
+ * @brief Add an entry of the nodes list to the timeout heap
+ *
+ * @param idx new entry in g_nodes_map
+ */
+static void heap_insert(int idx)
+{
+	heap_set(nodes_heap_cnt, idx);
+	nodes_heap_cnt++;
+	heap_fix(nodes_heap_cnt - 1);
+}
+
+/**
+ * @brief Remove an entry of the nodes list from the timeout heap
+ *
+ * @param idx removed entry in g_nodes_map
+ */
+static void heap_remove(int idx)
+{
+	int pos = nodes_heap_pos[idx];
+	nodes_heap_cnt--;
+	if (pos == nodes_heap_cnt)
+	{
+		return;
+	}
+	// Last entry takes the free position
+	heap_set(pos, nodes_heap[nodes_heap_cnt]);
+	heap_fix(pos);
+}
+
+/**
+ * @brief Refresh the time stamp of an entry, it times out later
+ *
+ * @param idx entry in g_nodes_map
+ * @param now current time
+ */
+static void touch_entry(int idx, time_t now)
+{
+	g_nodes_map[idx].time_stamp = now;
+	heap_fix(nodes_heap_pos[idx]);
+}
+
+/**
+ * @brief Step the map version after a change of an entry
+ *
+ * @param idx changed entry in g_nodes_map
+ */
+static void map_changed(int idx)
+{
+	g_map_version++;
+	g_nodes_map[idx].changed_version = g_map_version;
+	if (g_nodes_map[idx].metric >= ROUTE_METRIC_MAX)
+	{
+		nodes_unreachable = true;
+	}
+}
+
+/**
+ * @brief Allocate the nodes list and its hash index
+ * 			g_num_of_nodes must be set before
+ *
+ * @return true if memory could be allocated
+ * @return false if memory allocation failed
+ */
+bool init_router(void)
+{
+	nodes_hash_size = 1;
+	while (nodes_hash_size < (g_num_of_nodes * 2))
+	{
+		nodes_hash_size <<= 1;
+	}
+
+	// Release a previous map in case the mesh is initialized again
+	free(g_nodes_map);
+	free(nodes_free_list);
+	free(nodes_hash);
+	free(nodes_heap);
+	free(nodes_heap_pos);
+
+	g_nodes_map = (g_nodes_list_s *)malloc(g_num_of_nodes * sizeof(g_nodes_list_s));
+	nodes_free_list = (uint16_t *)malloc(g_num_of_nodes * sizeof(uint16_t));
+	nodes_hash = (int16_t *)malloc(nodes_hash_size * sizeof(int16_t));
+	nodes_heap = (uint16_t *)malloc(g_num_of_nodes * sizeof(uint16_t));
+	nodes_heap_pos = (uint16_t *)malloc(g_num_of_nodes * sizeof(uint16_t));
+
+	if ((g_nodes_map == NULL) || (nodes_free_list == NULL) || (nodes_hash == NULL) || (nodes_heap == NULL) || (nodes_heap_pos == NULL))
+	{
+		nodes_hash_size = 0;
+		return false;
+	}
+
+	memset(g_nodes_map, 0, g_num_of_nodes * sizeof(g_nodes_list_s));
+	// Lowest entries are used first
+	for (int idx = 0; idx < g_num_of_nodes; idx++)
+	{
+		nodes_free_list[idx] = g_num_of_nodes - 1 - idx;
+	}
+	nodes_free_cnt = g_num_of_nodes;
+	nodes_mapindex = 0;
+	nodes_heap_cnt = 0;
+	nodes_unreachable = false;
+	rebuild_hash();
+
+	// Random start, neighbours should not mistake the map of a restarted node for the one they know
+	g_map_version = (uint16_t)random(0, 0x10000);
+	removed_log_floor = g_map_version;
+	removed_log_index = 0;
+	memset(removed_log, 0, sizeof(removed_log));
+
+	// Random start, neighbours should not drop the packets of a restarted node as duplicates
+	g_packet_seq = (uint8_t)random(0, 0x100);
+	memset(unknown_origins, 0, sizeof(unknown_origins));
+	return true;
+}
+
+/**
+ * @brief Delete a node route and put its entry back on the free stack.
+ *
+ * @param index The node to be deleted
+ * @param hold_down true if the node is gone, false if it only made room in a full map
+ */
+void delete_route(uint8_t index, bool hold_down = true)
+{
+	if (g_nodes_map[index].node_id == 0)
+	{
+		return;
+	}
+	nodes_mapindex--;
+	hash_remove(g_nodes_map[index].node_id);
+	heap_remove(index);
+
+	// Keep the removal for map deltas
+	g_map_version++;
+	if (removed_log[removed_log_index].node_id != 0)
+	{
+		removed_log_floor = removed_log[removed_log_index].version;
+	}
+	removed_log[removed_log_index].node_id = g_nodes_map[index].node_id;
+	removed_log[removed_log_index].version = g_map_version;
+	removed_log[removed_log_index].time = millis();
+	removed_log[removed_log_index].hold_down = hold_down;
+	removed_log_index = (removed_log_index + 1) % REMOVED_LOG_SIZE;
+
+	g_nodes_map[index].node_id = 0;
+	nodes_free_list[nodes_free_cnt++] = index;
+}
+
+/**
+ * @brief Find a route to a node
+ *
+ * @param id Node ID we need a route to
+ * @param route g_nodes_list_s struct that will be filled with the route
+ * @return true if route was found
+ * @return false if no route was found
+ */
+bool get_route(uint32_t id, g_nodes_list_s *route)
+{
+	int idx = find_entry(id);
+	if (idx < 0)
+	{
+		// Node not in map
+		return false;
+	}
+	route->first_hop = g_nodes_map[idx].first_hop;
+	route->node_id = g_nodes_map[idx].node_id;
+	route->metric = g_nodes_map[idx].metric;
+	// A direct node with a weak link is reached over another node if that route is clearly better
+	uint32_t alt_hop = g_nodes_map[idx].alt_hop;
+	if ((route->first_hop == 0) && (alt_hop != 0) && ((g_nodes_map[idx].alt_metric + ROUTE_METRIC_HYSTERESIS) <= g_nodes_map[idx].metric))
+	{
+		int hop_idx = find_entry(alt_hop);
+		if ((hop_idx >= 0) && (g_nodes_map[hop_idx].first_hop == 0))
+		{
+			route->first_hop = alt_hop;
+			route->metric = g_nodes_map[idx].alt_metric;
+		}
+		else
+		{
+			// Next hop is not a direct node anymore
+			g_nodes_map[idx].alt_hop = 0;
+		}
+	}
+	// Node found in map
+	return true;
+}
+
+/**
+ * @brief Check if a node was removed within the hold down time.
+ * 			A removed node is only added again as direct node in this time,
+ * 			otherwise two nodes can keep a node that is gone alive by announcing it to each other
+ *
+ * @param id node ID
+ * @return true if the node was removed within ROUTE_HOLD_DOWN
+ */
+static bool held_down(uint32_t id)
+{
+	for (int log = 0; log < REMOVED_LOG_SIZE; log++)
+	{
+		if ((removed_log[log].node_id == id) && removed_log[log].hold_down && ((long)(millis() - removed_log[log].time) < ROUTE_HOLD_DOWN))
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+/**
+ * @brief Select the entry that is removed to add a new node to a full map.
+ * 			The entry that was not refreshed for the longest time goes first if it timed out (least recently used).
+ * 			Otherwise the multi-hop entry with the highest path metric is removed, the oldest if several have it.
+ * 			Direct nodes are only removed for another direct node, they are the first hop of all other entries.
+ * 			A new multi-hop node does not replace an entry that is closer, a full map keeps its best routes.
+ *
+ * @param hop next hop of the new node, 0 for a direct node
+ * @param metric path metric to the new node
+ * @return int index of the entry to remove or -1 if the new node is not added
+ */
+static int eviction_candidate(uint32_t hop, uint8_t metric)
+{
+	// Oldest entry is the first in the timeout heap
+	if ((long)(millis() - g_nodes_map[nodes_heap[0]].time_stamp) > in_active_timeout)
+	{
+		return nodes_heap[0];
+	}
+	int far = -1;
+	int direct = -1;
+	for (int idx = 0; idx < g_num_of_nodes; idx++)
+	{
+		g_nodes_list_s *entry = &g_nodes_map[idx];
+		if (entry->first_hop != 0)
+		{
+			if ((far < 0) || (entry->metric > g_nodes_map[far].metric) ||
+				((entry->metric == g_nodes_map[far].metric) && (entry->time_stamp < g_nodes_map[far].time_stamp)))
+			{
+				far = idx;
+			}
+		}
+		else if ((direct < 0) || (entry->time_stamp < g_nodes_map[direct].time_stamp))
+		{
+			direct = idx;
+		}
+	}
+
+	if ((far >= 0) && ((hop == 0) || (metric < g_nodes_map[far].metric)))
+	{
+		return far;
+	}
+	if ((far < 0) && (hop == 0))
+	{
+		return direct;
+	}
+	return -1;
+}
+
+/**
+ * @brief Add a node into the list.
+ * 			Checks if the node already exists and
+ * 			replaces the route if the existing entry has a clearly higher path metric
+ *
+ * @param id node mesh address
+ * @param hop next hop node address, 0 for a direct node
+ * @param metric path metric to the node
+ * @return boolean true if node was added, otherwise false
+ */
+boolean add_node(uint32_t id, uint32_t hop, uint8_t metric)
+{
+	boolean list_changed = false;
+
+	int idx = find_entry(id);
+	if (idx >= 0)
+	{
+		if (g_nodes_map[idx].first_hop == 0)
+		{
+			if (hop == 0)
+			{ // Node entry exist already as direct, update timestamp
+				touch_entry(idx, millis());
+			}
+			else if ((g_nodes_map[idx].alt_hop == 0) || (g_nodes_map[idx].alt_hop == hop) || (metric < g_nodes_map[idx].alt_metric))
+			{
+				// Keep the best route over another node, it is used if the link to the direct node is weak
+				g_nodes_map[idx].alt_hop = hop;
+				g_nodes_map[idx].alt_metric = metric;
+			}
+			MYLOG("ROUT", "Node %08lX already exists as direct", id);
+			return list_changed;
+		}
+		if ((hop != 0) && (g_nodes_map[idx].first_hop == hop))
+		{
+			// Same route, update timestamp and take over a changed path metric
+			touch_entry(idx, millis());
+			if (g_nodes_map[idx].metric == metric)
+			{
+				return list_changed;
+			}
+			// Announced with the next map sync, the nodes list itself did not change
+			MYLOG("ROUT", "Node %08lX changed path metric", id);
+			g_nodes_map[idx].metric = metric;
+			map_changed(idx);
+			return list_changed;
+		}
+		if (hop == 0)
+		{
+			// Found the node, but not as direct neighbor
+			MYLOG("ROUT", "Node %08lX replaced because it was a sub", id);
+		}
+		else if (g_nodes_map[idx].metric < (metric + ROUTE_METRIC_HYSTERESIS))
+		{
+			// Node entry exist with a lower or similar path metric
+			MYLOG("ROUT", "Node %08lX exist with a lower path metric", id);
+			return list_changed;
+		}
+		else
+		{
+			// Found the node, but with higher path metric
+			MYLOG("ROUT", "Node %08lX exist with a higher path metric", id);
+		}
+		// Replace the route in place, the hash index stays valid
+		g_nodes_map[idx].first_hop = hop;
+		touch_entry(idx, millis());
+		g_nodes_map[idx].metric = metric;
+		g_nodes_map[idx].map_known = false;
+		g_nodes_map[idx].alt_hop = 0;
+		map_changed(idx);
+		return true;
+	}
+
+	if ((hop != 0) && held_down(id))
+	{
+		// Neighbours that did not get the removal yet announce the node with a route over this node
+		MYLOG("ROUT", "Node %08lX was removed, not added over %08lX", id, hop);
+		return list_changed;
+	}
+
+	if (nodes_free_cnt == 0)
+	{
+		// Map is full, make room only if the new node is more important than the least important entry
+		int victim = eviction_candidate(hop, metric);
+		if (victim < 0)
+		{
+			MYLOG("ROUT", "Map is full, node %08lX not added", id);
+			return list_changed;
+		}
+		MYLOG("ROUT", "Map is full, node %08lX with hop %08lX removed", g_nodes_map[victim].node_id, g_nodes_map[victim].first_hop);
+		delete_route(victim, false);
+	}
+
+	// New node entry
+	idx = nodes_free_list[--nodes_free_cnt];
+	g_nodes_map[idx].node_id = id;
+	g_nodes_map[idx].first_hop = hop;
+	g_nodes_map[idx].time_stamp = millis();
+	g_nodes_map[idx].metric = metric;
+	g_nodes_map[idx].map_known = false;
+	g_nodes_map[idx].link_prr = 0;
+	g_nodes_map[idx].alt_hop = 0;
+	g_nodes_map[idx].seq_window = 0;
+	// Take over the duplicate window if packets of the node were received before
+	for (int origin = 0; origin < NUM_OF_UNKNOWN_ORIGINS; origin++)
+	{
+		if (unknown_origins[origin].node_id == id)
+		{
+			g_nodes_map[idx].seq_last = unknown_origins[origin].seq_last;
+			g_nodes_map[idx].seq_window = unknown_origins[origin].seq_window;
+			unknown_origins[origin].node_id = 0;
+			break;
+		}
+	}
+	hash_insert(id, idx);
+	heap_insert(idx);
+	nodes_mapindex++;
+	map_changed(idx);
+
+	list_changed = true;
+	MYLOG("ROUT", "Added node %lX with hop %lX and metric %d", id, hop, metric);
+	return list_changed;
+}
+
+/**
+ * @brief Lowest SNR that can be demodulated with the current spreading factor
+ *
+ * @return int16_t SNR in 1/4 dB
+ */
+static int16_t link_snr_floor(void)
+{
+	return -30 - (10 * (api.lora.psf.get() - 7));
+}
+
+/**
+ * @brief Calculate the link metric of a direct node from its link estimate
+ *
+ * @param idx entry of the direct node in g_nodes_map
+ * @return uint8_t expected transmissions * ROUTE_METRIC_UNIT
+ */
+static uint8_t link_metric(int idx)
+{
+	// Delivery ratio that can be expected from the SNR margin
+	int32_t margin = g_nodes_map[idx].link_snr - link_snr_floor();
+	int32_t prr = 255;
+	if (margin < 0)
+	{
+		prr = LINK_PRR_MIN;
+	}
+	else if (margin < LINK_SNR_MARGIN)
+	{
+		prr = LINK_PRR_MIN + (((255 - LINK_PRR_MIN) * margin) / LINK_SNR_MARGIN);
+	}
+	// Observed delivery ratio of the map messages counts if it is worse
+	if (g_nodes_map[idx].link_prr < prr)
+	{
+		prr = g_nodes_map[idx].link_prr < LINK_PRR_MIN ? LINK_PRR_MIN : g_nodes_map[idx].link_prr;
+	}
+	// A transmission needs the link in both directions, links are assumed to be symmetric
+	return (uint8_t)((ROUTE_METRIC_UNIT * 255 * 255) / (prr * prr));
+}
+
+/**
+ * @brief Update the link estimate of a direct node with a received map message.
+ * 			Adds the node as direct node if it is new or if the direct link is better than its route.
+ * 			A change of the link metric changes the path metric of all nodes that use the node as first hop.
+ * 			Changed path metrics are announced with the next map sync, they do not count as change of the nodes list.
+ *
+ * @param id node ID of the direct node
+ * @param snr SNR of the received map message
+ * @param seq sequence number of the map message
+ * @return true if the nodes list changed
+ */
+bool update_link(uint32_t id, int8_t snr, uint8_t seq)
+{
+	bool list_changed = false;
+
+	int idx = find_entry(id);
+	if (idx < 0)
+	{
+		// New direct node, the path metric is set from the link estimate below
+		list_changed = add_node(id, 0, ROUTE_METRIC_MAX);
+		idx = find_entry(id);
+	}
+	if (g_nodes_map[idx].link_prr == 0)
+	{
+		// First map message of the node, start the link estimate
+		g_nodes_map[idx].link_snr = snr * 4;
+		g_nodes_map[idx].link_prr = 255;
+	}
+	else
+	{
+		// Map messages between the last one and this one were lost
+		uint8_t lost = seq - g_nodes_map[idx].link_seq - 1;
+		if (lost < LINK_MAX_GAP)
+		{
+			for (; lost > 0; lost--)
+			{
+				g_nodes_map[idx].link_prr -= g_nodes_map[idx].link_prr / LINK_PRR_WEIGHT;
+			}
+		}
+		g_nodes_map[idx].link_prr += (255 - g_nodes_map[idx].link_prr + LINK_PRR_WEIGHT - 1) / LINK_PRR_WEIGHT;
+		g_nodes_map[idx].link_snr += ((snr * 4) - g_nodes_map[idx].link_snr) / LINK_SNR_WEIGHT;
+	}
+	g_nodes_map[idx].link_seq = seq;
+
+	uint8_t metric = link_metric(idx);
+	if (g_nodes_map[idx].first_hop != 0)
+	{
+		// Node is known over another node, take the direct link if it is not worse
+		if (metric <= g_nodes_map[idx].metric)
+		{
+			list_changed |= add_node(id, 0, metric);
+		}
+		return list_changed;
+	}
+
+	touch_entry(idx, millis());
+	int16_t diff = (int16_t)metric - (int16_t)g_nodes_map[idx].metric;
+	if ((diff > -ROUTE_METRIC_HYSTERESIS) && (diff < ROUTE_METRIC_HYSTERESIS))
+	{
+		// Small changes are ignored to keep the map stable
+		return list_changed;
+	}
+	MYLOG("ROUT", "Node %08lX link metric %d -> %d", id, g_nodes_map[idx].metric, metric);
+	g_nodes_map[idx].metric = metric;
+	map_changed(idx);
+
+	// Path metric of the nodes behind the direct node change as well
+	for (int sub = 0; sub < g_num_of_nodes; sub++)
+	{
+		if ((g_nodes_map[sub].node_id == 0) || (g_nodes_map[sub].first_hop != id))
+		{
+			continue;
+		}
+		int16_t sub_metric = g_nodes_map[sub].metric + diff;
+		g_nodes_map[sub].metric = sub_metric < ROUTE_METRIC_MAX ? sub_metric : ROUTE_METRIC_MAX;
+		map_changed(sub);
+	}
+	return list_changed;
+}
+
+/**
+ * @brief Remove all nodes that are a non direct and have a given node as first hop.
+ * 			This is to clean up the nodes list from left overs of an unresponsive node
+ *
+ * @param id The node which is listed as first hop
+ */
+void clear_subs(uint32_t id)
+{
+	for (int idx = 0; idx < g_num_of_nodes; idx++)
+	{
+		if ((g_nodes_map[idx].node_id != 0) && (g_nodes_map[idx].first_hop == id))
+		{
+			MYLOG("ROUT", "Removed node %lX with hop %lX", g_nodes_map[idx].node_id, g_nodes_map[idx].first_hop);
+			delete_route(idx);
+		}
+		else if (g_nodes_map[idx].alt_hop == id)
+		{
+			g_nodes_map[idx].alt_hop = 0;
+		}
+	}
+}
+
+/**
+ * @brief Check the list for nodes that did not be refreshed within a given timeout
+ * 			Checks as well for nodes that are unreachable (path metric ROUTE_METRIC_MAX).
+ * 			Nodes time out in the order of the timeout heap, only nodes that are due are checked.
+ * 			The nodes list is only scanned if a node got unreachable or a direct node was removed
+ *
+ * @return true if no changes were done
+ * @return false if a node was removed
+ */
+bool clean_map(void)
+{
+	bool mapUpToDate = true;
+	bool direct_removed = false;
+
+	/// \todo discuss what is best node timeout
+	// Assume all nodes are on the same send interval
+	in_active_timeout = g_custom_parameters.send_interval * 100;
+	if (in_active_timeout == 0)
+	{
+		in_active_timeout = 3600000;
+	}
+
+	// Oldest nodes first, until a node is found that did not time out
+	time_t now = millis();
+	while (nodes_heap_cnt > 0)
+	{
+		int idx = nodes_heap[0];
+		if ((long)(now - g_nodes_map[idx].time_stamp) <= in_active_timeout)
+		{
+			break;
+		}
+		// Node was not refreshed for in_active_timeout milli seconds
+		MYLOG("ROUT", "Node %lX with hop %lX timed out", g_nodes_map[idx].node_id, g_nodes_map[idx].first_hop);
+		direct_removed |= g_nodes_map[idx].first_hop == 0;
+		delete_route(idx);
+		mapUpToDate = false;
+	}
+
+	if (nodes_unreachable)
+	{
+		nodes_unreachable = false;
+		for (int idx = 0; idx < g_num_of_nodes; idx++)
+		{
+			if ((g_nodes_map[idx].node_id != 0) && (g_nodes_map[idx].metric >= ROUTE_METRIC_MAX))
+			{
+				MYLOG("ROUT", "Node %lX with hop %lX is unreachable", g_nodes_map[idx].node_id, g_nodes_map[idx].first_hop);
+				direct_removed |= g_nodes_map[idx].first_hop == 0;
+				delete_route(idx);
+				mapUpToDate = false;
+			}
+		}
+	}
+
+	if (direct_removed)
+	{
+		// One pass for the nodes behind all removed direct nodes
+		for (int idx = 0; idx < g_num_of_nodes; idx++)
+		{
+			if (g_nodes_map[idx].node_id == 0)
+			{
+				continue;
+			}
+			if ((g_nodes_map[idx].first_hop != 0) && (find_entry(g_nodes_map[idx].first_hop) < 0))
+			{
+				MYLOG("ROUT", "Removed node %lX with hop %lX", g_nodes_map[idx].node_id, g_nodes_map[idx].first_hop);
+				delete_route(idx);
+			}
+			else if ((g_nodes_map[idx].alt_hop != 0) && (find_entry(g_nodes_map[idx].alt_hop) < 0))
+			{
+				g_nodes_map[idx].alt_hop = 0;
+			}
+		}
+	}
+
+	if (!mapUpToDate)
+	{
+		// Other neighbours might know a route to the removed nodes
+		invalidate_map_versions(0);
+	}
+	return mapUpToDate;
+}
 
 /**
- * @brief Delete a node route by copying following routes on top of it.
+ * @brief Get the time when the next node times out
  *
- * @param index The node to be deleted
+ * @param timeout time when the node that was not refreshed for the longest time times out
+ * @return true if there are nodes in the map
+ * @return false if the map is empty
  */
-void delete_route(uint8_t index)
+bool next_node_timeout(time_t &timeout)
 {
-	// Delete a route by copying following routes on top of it
-	memcpy(&g_nodes_map[index], &g_nodes_map[index + 1], sizeof(g_nodes_list_s) * (g_num_of_nodes - index - 1));
-	nodes_mapindex--;
-	g_nodes_map[nodes_mapindex].node_id = 0;
+	if (nodes_heap_cnt == 0)
+	{
+		return false;
+	}
+	timeout = g_nodes_map[nodes_heap[0]].time_stamp + in_active_timeout;
+	return true;
 }
 
 /**
- * @brief Find a route to a node
+ * @brief Refresh the timestamps of all nodes that have a given node as first hop.
+ * 			Used when a neighbour announces that its map did not change.
  *
- * @param id Node ID we need a route to
- * @param route g_nodes_list_s struct that will be filled with the route
- * @return true if route was found
- * @return false if no route was found
+ * @param id The node which is listed as first hop
  */
-bool get_route(uint32_t id, g_nodes_list_s *route)
+void touch_subs(uint32_t id)
 {
+	time_t now = millis();
 	for (int idx = 0; idx < g_num_of_nodes; idx++)
 	{
-		if (g_nodes_map[idx].node_id == id)
+		if ((g_nodes_map[idx].node_id != 0) && (g_nodes_map[idx].first_hop == id))
 		{
-			route->first_hop = g_nodes_map[idx].first_hop;
-			route->node_id = g_nodes_map[idx].node_id;
-			// Node found in map
-			return true;
+			touch_entry(idx, now);
 		}
 	}
-	// Node not in map
-	return false;
 }
 
 /**
- * @brief Add a node into the list.
- * 			Checks if the node already exists and
- * 			removes node if the existing entry has more hops
+ * @brief Get a node ID from a map message entry
  *
- * @param id node mesh address
- * @param hop next hop node address
- * @param num_hops number of hops to the ndoe
- * @return boolean true if node was added, otherwise false
+ * @param entry map message entry, 4 bytes node ID and 1 byte path metric
+ * @return uint32_t node ID
  */
-boolean add_node(uint32_t id, uint32_t hop, uint8_t num_hops)
+static uint32_t entry_id(uint8_t entry[5])
 {
-	boolean list_changed = false;
-	g_nodes_list_s _new_node;
-	_new_node.node_id = id;
-	_new_node.first_hop = hop;
-	_new_node.time_stamp = millis();
-	_new_node.num_hops = num_hops;
+	return (uint32_t)entry[0] | ((uint32_t)entry[1] << 8) | ((uint32_t)entry[2] << 16) | ((uint32_t)entry[3] << 24);
+}
+
+/**
+ * @brief Get the path metric of a node that a direct node announced in its map
+ *
+ * @param link_metric link metric of the direct node
+ * @param announced path metric from the direct node to the node
+ * @return uint8_t path metric from this node
+ */
+static uint8_t announced_metric(uint8_t link_metric, uint8_t announced)
+{
+	uint16_t metric = link_metric + announced;
+	return metric < ROUTE_METRIC_MAX ? metric : ROUTE_METRIC_MAX;
+}
+
+/**
+ * @brief Get the link metric of a direct node
+ *
+ * @param id node ID of the direct node
+ * @return uint8_t link metric, one transmission if the node has no link estimate
+ */
+static uint8_t direct_metric(uint32_t id)
+{
+	int idx = find_entry(id);
+	if ((idx < 0) || (g_nodes_map[idx].first_hop != 0))
+	{
+		return ROUTE_METRIC_UNIT;
+	}
+	return g_nodes_map[idx].metric;
+}
+
+/**
+ * @brief Take over the complete map of a neighbour.
+ * 			Nodes that have the neighbour as first hop but are not in its map anymore are removed.
+ *
+ * @param id node ID of the neighbour
+ * @param nodes map entries of the neighbour
+ * @param num_nodes number of map entries
+ * @return true if the nodes list changed
+ */
+bool sync_subs(uint32_t id, uint8_t nodes[][5], uint8_t num_nodes)
+{
+	bool list_changed = false;
+	bool removed = false;
 
+	// Remove the nodes the neighbour doesn't know anymore
 	for (int idx = 0; idx < g_num_of_nodes; idx++)
 	{
-		if (g_nodes_map[idx].node_id == id)
+		if ((g_nodes_map[idx].node_id == 0) || ((g_nodes_map[idx].first_hop != id) && (g_nodes_map[idx].alt_hop != id)))
+		{
+			continue;
+		}
+		bool found = false;
+		for (int sub = 0; sub < num_nodes; sub++)
 		{
-			if (g_nodes_map[idx].first_hop == 0)
+			if (entry_id(nodes[sub]) == g_nodes_map[idx].node_id)
 			{
-				if (hop == 0)
-				{ // Node entry exist already as direct, update timestamp
-					g_nodes_map[idx].time_stamp = millis();
-				}
-				MYLOG("ROUT", "Node %08lX already exists as direct", _new_node.node_id);
-				return list_changed;
+				found = true;
+				break;
 			}
-			else
+		}
+		if (!found && (g_nodes_map[idx].first_hop != id))
+		{
+			// Alternative route over the neighbour is gone
+			g_nodes_map[idx].alt_hop = 0;
+		}
+		else if (!found)
+		{
+			MYLOG("ROUT", "Removed node %lX with hop %lX", g_nodes_map[idx].node_id, id);
+			delete_route(idx);
+			removed = true;
+		}
+	}
+
+	uint8_t link_metric = direct_metric(id);
+	for (int sub = 0; sub < num_nodes; sub++)
+	{
+		uint32_t sub_id = entry_id(nodes[sub]);
+		if ((sub_id != g_this_device_addr) && (sub_id != 0))
+		{
+			list_changed |= add_node(sub_id, id, announced_metric(link_metric, nodes[sub][4]));
+		}
+	}
+
+	return list_changed | removed;
+}
+
+/**
+ * @brief Take over one page of the complete map of a neighbour that is sent in several map messages.
+ * 			The entries of each page are added. After the last page the nodes that have the neighbour
+ * 			as first hop but were in none of the pages are removed.
+ * 			If a page is missing, nothing is removed and the map is not complete.
+ *
+ * @param id node ID of the neighbour
+ * @param nodes map entries in this page
+ * @param num_nodes number of map entries in this page
+ * @param page page number, starts with 0
+ * @param pages number of pages
+ * @param version map version of the neighbour
+ * @param complete set to true if this was the last page and all pages were received
+ * @return true if the nodes list changed
+ */
+bool sync_subs_page(uint32_t id, uint8_t nodes[][5], uint8_t num_nodes, uint8_t page, uint8_t pages, uint16_t version, bool &complete)
+{
+	bool list_changed = false;
+	bool removed = false;
+	complete = false;
+
+	if (page == 0)
+	{
+		page_sync_id = id;
+		page_sync_next = 0;
+		page_sync_version = version;
+		page_sync_start = millis();
+		// Alternative routes over the neighbour are set again by the pages
+		for (int idx = 0; idx < g_num_of_nodes; idx++)
+		{
+			if ((g_nodes_map[idx].node_id != 0) && (g_nodes_map[idx].alt_hop == id))
 			{
-				if (hop == 0)
-				{
-					// Found the node, but not as direct neighbor
-					MYLOG("ROUT", "Node %08lX removed because it was a sub", _new_node.node_id);
-					delete_route(idx);
-					idx--;
-					break;
-				}
-				else
-				{
-					// Node entry exists, check number of hops
-					if (g_nodes_map[idx].num_hops <= num_hops)
-					{
-						// Node entry exist with smaller or equal # of hops
-						MYLOG("ROUT", "Node %08lX exist with a lower number of hops", _new_node.node_id);
-						return list_changed;
-					}
-					else
-					{
-						// Found the node, but with higher # of hops
-						MYLOG("ROUT", "Node %08lX exist with a higher number of hops", _new_node.node_id);
-						delete_route(idx);
-						idx--;
-						break;
-					}
-				}
+				g_nodes_map[idx].alt_hop = 0;
 			}
 		}
 	}
 
-	if (nodes_mapindex == g_num_of_nodes)
+	uint8_t link_metric = direct_metric(id);
+	for (int sub = 0; sub < num_nodes; sub++)
 	{
-		// Map is full, remove the oldest entry
-		delete_route(0);
-		list_changed = true;
+		uint32_t sub_id = entry_id(nodes[sub]);
+		if ((sub_id != g_this_device_addr) && (sub_id != 0))
+		{
+			list_changed |= add_node(sub_id, id, announced_metric(link_metric, nodes[sub][4]));
+		}
 	}
 
-	// New node entry
-	memcpy(&g_nodes_map[nodes_mapindex], &_new_node, sizeof(g_nodes_list_s));
-	nodes_mapindex++;
+	if ((page_sync_id != id) || (page_sync_next != page) || (page_sync_version != version))
+	{
+		// Page is missing or belongs to another map version, wait for the next full map
+		if (page_sync_id == id)
+		{
+			page_sync_id = 0;
+		}
+		return list_changed;
+	}
+	page_sync_next++;
+	if (page_sync_next < pages)
+	{
+		return list_changed;
+	}
 
-	list_changed = true;
-	MYLOG("ROUT", "Added node %lX with hop %lX and num hops %d", id, hop, num_hops);
-	return list_changed;
+	// Last page, refreshed entries have a newer time stamp
+	for (int idx = 0; idx < g_num_of_nodes; idx++)
+	{
+		if ((g_nodes_map[idx].node_id != 0) && (g_nodes_map[idx].first_hop == id) && (g_nodes_map[idx].time_stamp < page_sync_start))
+		{
+			MYLOG("ROUT", "Removed node %lX with hop %lX", g_nodes_map[idx].node_id, id);
+			delete_route(idx);
+			removed = true;
+		}
+	}
+	page_sync_id = 0;
+	complete = true;
+	return list_changed | removed;
 }
 
 /**
- * @brief Remove all nodes that are a non direct and have a given node as first hop.
- * 			This is to clean up the nodes list from left overs of an unresponsive node
+ * @brief Apply the changes a neighbour announced for its map.
+ * 			Entries with MAP_ENTRY_REMOVED as path metric are removed.
  *
- * @param id The node which is listed as first hop
+ * @param id node ID of the neighbour
+ * @param nodes changed map entries of the neighbour
+ * @param num_nodes number of changed map entries
+ * @return true if the nodes list changed
  */
-void clear_subs(uint32_t id)
+bool apply_delta(uint32_t id, uint8_t nodes[][5], uint8_t num_nodes)
 {
-	for (int idx = 0; idx < g_num_of_nodes; idx++)
+	bool list_changed = false;
+	bool removed = false;
+
+	uint8_t link_metric = direct_metric(id);
+	for (int sub = 0; sub < num_nodes; sub++)
 	{
-		if (g_nodes_map[idx].first_hop == id)
+		uint32_t sub_id = entry_id(nodes[sub]);
+		if ((sub_id == g_this_device_addr) || (sub_id == 0))
 		{
-			MYLOG("ROUT", "Removed node %lX with hop %lX", g_nodes_map[idx].node_id, g_nodes_map[idx].first_hop);
-			delete_route(idx);
-			idx--;
+			continue;
+		}
+		if (nodes[sub][4] == MAP_ENTRY_REMOVED)
+		{
+			int idx = find_entry(sub_id);
+			if ((idx >= 0) && (g_nodes_map[idx].first_hop == id))
+			{
+				MYLOG("ROUT", "Removed node %lX with hop %lX", sub_id, id);
+				delete_route(idx);
+				removed = true;
+			}
+			else if ((idx >= 0) && (g_nodes_map[idx].alt_hop == id))
+			{
+				// Alternative route over the neighbour is gone
+				g_nodes_map[idx].alt_hop = 0;
+			}
+		}
+		else
+		{
+			list_changed |= add_node(sub_id, id, announced_metric(link_metric, nodes[sub][4]));
 		}
 	}
+
+	return list_changed | removed;
 }
 
 /**
- * @brief Check the list for nodes that did not be refreshed within a given timeout
- * 			Checks as well for nodes that have "impossible" number of hops (> number of max nodes)
+ * @brief Get the map version of a neighbour that this node has applied
  *
- * @return true if no changes were done
- * @return false if a node was removed
+ * @param id node ID of the neighbour
+ * @param version map version of the neighbour
+ * @return true if the map of the neighbour is known
+ * @return false if the neighbour is not a direct node or its map is not known
  */
-bool clean_map(void)
+bool get_map_version(uint32_t id, uint16_t &version)
+{
+	int idx = find_entry(id);
+	if ((idx < 0) || (g_nodes_map[idx].first_hop != 0) || !g_nodes_map[idx].map_known)
+	{
+		return false;
+	}
+	version = g_nodes_map[idx].map_version;
+	return true;
+}
+
+/**
+ * @brief Save the map version of a neighbour after its map was applied
+ *
+ * @param id node ID of the neighbour
+ * @param version map version of the neighbour
+ */
+void set_map_version(uint32_t id, uint16_t version)
+{
+	int idx = find_entry(id);
+	if ((idx >= 0) && (g_nodes_map[idx].first_hop == 0))
+	{
+		g_nodes_map[idx].map_version = version;
+		g_nodes_map[idx].map_known = true;
+	}
+}
+
+/**
+ * @brief Forget the map versions of all neighbours, their next announcement requests their full map
+ *
+ * @param except neighbour that keeps its map version
+ */
+void invalidate_map_versions(uint32_t except)
 {
-	// Check active nodes list
-	bool mapUpToDate = true;
 	for (int idx = 0; idx < g_num_of_nodes; idx++)
 	{
-		if (g_nodes_map[idx].node_id == 0)
+		if ((g_nodes_map[idx].node_id != 0) && (g_nodes_map[idx].node_id != except))
 		{
-			// Last entry found
-			break;
+			g_nodes_map[idx].map_known = false;
 		}
+	}
+}
 
-		/// \todo discuss what is best node timeout
-		// Assume all nodes are on the same send interval
-		in_active_timeout = g_custom_parameters.send_interval * 100;
-		if (in_active_timeout == 0)
+/**
+ * @brief Create the list of map entries that changed since a given map version
+ *
+ * @param nodes Pointer to an two dimensional array to hold the node IDs and path metrics, NULL to only check the size
+ * @param base map version the receiver knows
+ * @param max_nodes max number of entries in the list
+ * @return uint8_t Number of nodes in the list or MAP_DELTA_INVALID if a full map is required
+ */
+uint8_t node_map_delta(uint8_t nodes[][5], uint16_t base, uint8_t max_nodes)
+{
+	// Versions wrap around, compare the distance to the current version
+	uint16_t distance = g_map_version - base;
+	if ((distance > (uint16_t)(g_map_version - removed_log_floor)) || (distance > 0x7FFF))
+	{
+		// Removals since base are not in the log anymore
+		return MAP_DELTA_INVALID;
+	}
+	uint8_t num_nodes = 0;
+	for (int idx = 0; idx < g_num_of_nodes; idx++)
+	{
+		if ((g_nodes_map[idx].node_id == 0) || ((uint16_t)(g_map_version - g_nodes_map[idx].changed_version) >= distance))
 		{
-			in_active_timeout = 3600000; 
+			continue;
 		}
-
-		if (((millis() > (g_nodes_map[idx].time_stamp + in_active_timeout))) || (g_nodes_map[idx].num_hops > 48))
+		if (num_nodes == max_nodes)
 		{
-			// Node was not refreshed for in_active_timeout milli seconds
-			MYLOG("ROUT", "Node %lX with hop %lX timed out or has too many hops", g_nodes_map[idx].node_id, g_nodes_map[idx].first_hop);
-			if (g_nodes_map[idx].first_hop == 0)
-			{
-				clear_subs(g_nodes_map[idx].node_id);
-			}
-			delete_route(idx);
-			idx--;
-			mapUpToDate = false;
+			return MAP_DELTA_INVALID;
+		}
+		if (nodes == NULL)
+		{
+			num_nodes++;
+			continue;
 		}
+		nodes[num_nodes][0] = g_nodes_map[idx].node_id & 0x000000FF;
+		nodes[num_nodes][1] = (g_nodes_map[idx].node_id >> 8) & 0x000000FF;
+		nodes[num_nodes][2] = (g_nodes_map[idx].node_id >> 16) & 0x000000FF;
+		nodes[num_nodes][3] = (g_nodes_map[idx].node_id >> 24) & 0x000000FF;
+		nodes[num_nodes][4] = g_nodes_map[idx].metric;
+		num_nodes++;
 	}
-	return mapUpToDate;
+	for (int log = 0; log < REMOVED_LOG_SIZE; log++)
+	{
+		uint32_t node_id = removed_log[log].node_id;
+		if ((node_id == 0) || ((uint16_t)(g_map_version - removed_log[log].version) >= distance) || (find_entry(node_id) >= 0))
+		{
+			// Empty, older than base or added again
+			continue;
+		}
+		if (num_nodes == max_nodes)
+		{
+			return MAP_DELTA_INVALID;
+		}
+		if (nodes == NULL)
+		{
+			num_nodes++;
+			continue;
+		}
+		nodes[num_nodes][0] = node_id & 0x000000FF;
+		nodes[num_nodes][1] = (node_id >> 8) & 0x000000FF;
+		nodes[num_nodes][2] = (node_id >> 16) & 0x000000FF;
+		nodes[num_nodes][3] = (node_id >> 24) & 0x000000FF;
+		nodes[num_nodes][4] = MAP_ENTRY_REMOVED;
+		num_nodes++;
+	}
+	return num_nodes;
 }
 
 /**
- * @brief Create a list of nodes and hops to be broadcasted as this nodes map
+ * @brief Create a list of nodes and path metrics to be broadcasted as this nodes map
  *
  * @param subs Pointer to an array to hold the node IDs
- * @param hops Pointer to an array to hold the hops for the node IDs
+ * @param metrics Pointer to an array to hold the path metrics for the node IDs
  * @return uint8_t Number of nodes in the list
  */
-uint8_t node_map(uint32_t subs[], uint8_t hops[])
+uint8_t node_map(uint32_t subs[], uint8_t metrics[])
 {
 	uint8_t subs_name_index = 0;
 
@@ -219,10 +1285,10 @@ uint8_t node_map(uint32_t subs[], uint8_t hops[])
 	{
 		if (g_nodes_map[idx].node_id == 0)
 		{
-			// Last node found
-			break;
+			// Free entry
+			continue;
 		}
-		hops[subs_name_index] = g_nodes_map[idx].num_hops;
+		metrics[subs_name_index] = g_nodes_map[idx].metric;
 
 		subs[subs_name_index] = g_nodes_map[idx].node_id;
 		subs_name_index++;
@@ -232,27 +1298,37 @@ uint8_t node_map(uint32_t subs[], uint8_t hops[])
 }
 
 /**
- * @brief Create a list of nodes and hops to be broadcasted as this nodes map
+ * @brief Create a list of nodes and path metrics to be broadcasted as this nodes map.
+ * 			Large maps are sent in pages, each page is a part of the list
  *
- * @param nodes Pointer to an two dimensional array to hold the node IDs and hops
+ * @param nodes Pointer to an two dimensional array to hold the node IDs and path metrics
+ * @param first number of the first node in the list, nodes before are skipped
+ * @param max_nodes max number of nodes in the list
  * @return uint8_t Number of nodes in the list
  */
-uint8_t node_map(uint8_t nodes[][5])
+uint8_t node_map(uint8_t nodes[][5], uint8_t first, uint8_t max_nodes)
 {
 	uint8_t subs_name_index = 0;
+	uint8_t skipped = 0;
 	MYLOG("ROUT", "Copy map");
-	for (int idx = 0; idx < g_num_of_nodes; idx++)
+	for (int idx = 0; (idx < g_num_of_nodes) && (subs_name_index < max_nodes); idx++)
 	{
 		if (g_nodes_map[idx].node_id == 0)
 		{
-			// Last node found
-			break;
+			// Free entry
+			continue;
+		}
+		if (skipped < first)
+		{
+			// Node is in an earlier page
+			skipped++;
+			continue;
 		}
 		nodes[subs_name_index][0] = g_nodes_map[idx].node_id & 0x000000FF;
 		nodes[subs_name_index][1] = (g_nodes_map[idx].node_id >> 8) & 0x000000FF;
 		nodes[subs_name_index][2] = (g_nodes_map[idx].node_id >> 16) & 0x000000FF;
 		nodes[subs_name_index][3] = (g_nodes_map[idx].node_id >> 24) & 0x000000FF;
-		nodes[subs_name_index][4] = g_nodes_map[idx].num_hops;
+		nodes[subs_name_index][4] = g_nodes_map[idx].metric;
 
 		subs_name_index++;
 	}
@@ -271,26 +1347,53 @@ uint8_t nodes_in_map(void)
 	return nodes_mapindex;
 }
 
+/**
+ * @brief Get the entry in the nodes list of the n'th node
+ *
+ * @param node_num Index of the node
+ * @return int index in g_nodes_map or -1 if out of range
+ */
+static int nth_entry(uint8_t node_num)
+{
+	if (node_num >= nodes_in_map())
+	{
+		return -1;
+	}
+	for (int idx = 0; idx < g_num_of_nodes; idx++)
+	{
+		if (g_nodes_map[idx].node_id != 0)
+		{
+			if (node_num == 0)
+			{
+				return idx;
+			}
+			node_num--;
+		}
+	}
+	return -1;
+}
+
 /**
  * @brief Get the information of a specific node
  *
  * @param node_num Index of the node we want to query
  * @param node_id Pointer to an uint32_t to save the node ID to
  * @param first_hop Pointer to an uint32_t to save the nodes first hop ID to
- * @param num_hops Pointer to an uint8_t to save the number of hops to
+ * @param metric Pointer to an uint8_t to save the path metric to, expected transmissions * ROUTE_METRIC_UNIT
  * @return true if the data could be found
  * @return false if the requested index is out of range
  */
-bool get_node(uint8_t node_num, uint32_t &node_id, uint32_t &first_hop, uint8_t &num_hops)
+bool get_node(uint8_t node_num, uint32_t &node_id, uint32_t &first_hop, uint8_t &metric)
 {
-	if (node_num >= nodes_in_map())
+	int idx = nth_entry(node_num);
+	if (idx < 0)
 	{
 		return false;
 	}
 
-	node_id = g_nodes_map[node_num].node_id;
-	first_hop = g_nodes_map[node_num].first_hop;
-	num_hops = g_nodes_map[node_num].num_hops;
+	node_id = g_nodes_map[idx].node_id;
+	first_hop = g_nodes_map[idx].first_hop;
+	metric = g_nodes_map[idx].metric;
 	return true;
 }
 
@@ -302,12 +1405,13 @@ bool get_node(uint8_t node_num, uint32_t &node_id, uint32_t &first_hop, uint8_t
  */
 uint32_t get_node_addr(uint8_t node_num)
 {
-	if (node_num > nodes_in_map())
+	int idx = nth_entry(node_num);
+	if (idx < 0)
 	{
 		return 0x00;
 	}
 
-	return g_nodes_map[node_num].node_id;
+	return g_nodes_map[idx].node_id;
 }
 
 /**
@@ -319,64 +1423,134 @@ uint32_t get_node_addr(uint8_t node_num)
  */
 bool check_node(uint32_t node_addr)
 {
-	for (int idx = 0; idx < g_num_of_nodes; idx++)
+	return find_entry(node_addr) >= 0;
+}
+
+/**
+ * @brief Get the sequence number for the next packet of this node
+ *
+ * @return uint8_t sequence number
+ */
+uint8_t get_next_packet_seq(void)
+{
+	g_packet_seq++;
+	return g_packet_seq;
+}
+
+/**
+ * @brief Get next broadcast ID, the lowest byte is the sequence number of the packet
+ *
+ * @return uint32_t next broadcast ID
+ */
+uint32_t get_next_broadcast_id(void)
+{
+	g_broadcast_id = (g_broadcast_id & 0xFFFFFF00) | get_next_packet_seq();
+	return g_broadcast_id;
+}
+
+/**
+ * @brief Check a sequence number against the duplicate window of an origin and add it to the window
+ *
+ * @param seq_last highest sequence number received from the origin
+ * @param seq_window received sequence numbers, bit n is set if seq_last - n was received
+ * @param seq sequence number of the received packet
+ * @return true if the packet was received before
+ * @return false if the packet is new
+ */
+static bool seq_window_check(uint8_t &seq_last, uint32_t &seq_window, uint8_t seq)
+{
+	uint8_t ahead = seq - seq_last;
+	uint8_t behind = seq_last - seq;
+	if ((seq_window == 0) || ((ahead != 0) && (ahead < 128)) || (behind >= SEQ_WINDOW_SIZE))
 	{
-		if (g_nodes_map[idx].node_id == 0)
+		// First packet, newer packet or far behind the window (restarted origin)
+		if ((seq_window != 0) && (ahead < SEQ_WINDOW_SIZE))
 		{
-			// Last node found
-			break;
+			seq_window = (seq_window << ahead) | 1;
 		}
-		if (g_nodes_map[idx].node_id== node_addr)
+		else
 		{
-			return true;
+			seq_window = 1;
 		}
+		seq_last = seq;
+		return false;
+	}
+	if ((seq_window & (1UL << behind)) != 0)
+	{
+		return true;
 	}
+	seq_window |= 1UL << behind;
 	return false;
 }
 
 /**
- * @brief Get next broadcast ID
+ * @brief Handle the sequence numbers of received packets
+ * 			to avoid circulating or delivering the same packet over and over.
+ * 			The window is kept in the nodes map, for origins that are not in the map in a small list
  *
- * @return uint32_t next broadcast ID
+ * @param origin address of the node that created the packet
+ * @param seq sequence number of the packet
+ * @return true if the packet is an old packet
+ * @return false if the packet is a new packet
  */
-uint32_t get_next_broadcast_id(void)
+bool is_old_packet(uint32_t origin, uint8_t seq)
 {
-	uint32_t broadcast_num = g_broadcast_id & 0x000000FF;
-	// Create new one by just counting up
-	broadcast_num++;
-	broadcast_num &= 0x000000FF;
-	g_broadcast_id = (g_broadcast_id & 0xFFFFFF00) | broadcast_num;
-	return g_broadcast_id;
+	int idx = find_entry(origin);
+	if (idx >= 0)
+	{
+		return seq_window_check(g_nodes_map[idx].seq_last, g_nodes_map[idx].seq_window, seq);
+	}
+	for (int entry = 0; entry < NUM_OF_UNKNOWN_ORIGINS; entry++)
+	{
+		if (unknown_origins[entry].node_id == origin)
+		{
+			return seq_window_check(unknown_origins[entry].seq_last, unknown_origins[entry].seq_window, seq);
+		}
+	}
+	// New origin, replace the oldest entry
+	origin_window_s &entry = unknown_origins[unknown_origins_index];
+	unknown_origins_index = (unknown_origins_index + 1) % NUM_OF_UNKNOWN_ORIGINS;
+	entry.node_id = origin;
+	entry.seq_window = 0;
+	return seq_window_check(entry.seq_last, entry.seq_window, seq);
 }
 
-byte broadcast_index = 0;
-#define NUM_OF_LAST_BROADCASTS 10
-uint32_t broadcastList[NUM_OF_LAST_BROADCASTS] = {0L};
 /**
- * @brief Handle broadcast message ID's
- * 			to avoid circulating same broadcast over and over
+ * @brief Remove a sequence number from the duplicate window of an origin.
+ * 			Used if a packet was not taken over after is_old_packet(), its retransmission is not a duplicate then
  *
- * @param g_broadcast_id The broadcast ID to be checked
- * @return true if the broadcast is an old broadcast
- * @return false if the broadcast is a new broadcast
+ * @param origin address of the node that created the packet
+ * @param seq sequence number of the packet
  */
-bool is_old_broadcast(uint32_t g_broadcast_id)
+void forget_packet(uint32_t origin, uint8_t seq)
 {
-	for (int idx = 0; idx < NUM_OF_LAST_BROADCASTS; idx++)
+	uint8_t *seq_last = NULL;
+	uint32_t *seq_window = NULL;
+	int idx = find_entry(origin);
+	if (idx >= 0)
 	{
-		if (g_broadcast_id == broadcastList[idx])
+		seq_last = &g_nodes_map[idx].seq_last;
+		seq_window = &g_nodes_map[idx].seq_window;
+	}
+	else
+	{
+		for (int entry = 0; entry < NUM_OF_UNKNOWN_ORIGINS; entry++)
 		{
-			// Broadcast ID is already in the list
-			return true;
+			if (unknown_origins[entry].node_id == origin)
+			{
+				seq_last = &unknown_origins[entry].seq_last;
+				seq_window = &unknown_origins[entry].seq_window;
+				break;
+			}
 		}
 	}
-	// This is a new broadcast ID
-	broadcastList[broadcast_index] = g_broadcast_id;
-	broadcast_index++;
-	if (broadcast_index == NUM_OF_LAST_BROADCASTS)
+	if (seq_window == NULL)
 	{
-		// Index overflow, reset to 0
-		broadcast_index = 0;
+		return;
+	}
+	uint8_t behind = *seq_last - seq;
+	if (behind < SEQ_WINDOW_SIZE)
+	{
+		*seq_window &= ~(1UL << behind);
 	}
-	return false;
 }
\ No newline at end of file
@@ -252,11 +252,11 @@ int mesh_map_handler(SERIAL_PORT port, char *cmd, stParam *param)
 	if (param->argc == 0)
 	{
 		/** Node ID of the selected receiver node */
-		uint32_t node_id[48];
+		uint32_t node_id;
 		/** First hop ID of the selected receiver node */
-		uint32_t first_hop[48];
-		/** Number of hops to the selected receiver node */
-		uint8_t num_hops[48];
+		uint32_t first_hop;
+		/** Path metric to the selected receiver node */
+		uint8_t metric;
 		/** Number of nodes in the map */
 		uint8_t num_elements;
 
@@ -264,22 +264,21 @@ int mesh_map_handler(SERIAL_PORT port, char *cmd, stParam *param)
 		/** Number of nodes in the map */
 		num_elements = nodes_in_map();
 
-		for (int idx = 0; idx < num_elements; idx++)
-		{
-			get_node(idx, node_id[idx], first_hop[idx], num_hops[idx]);
-		}
-		// Display the nodes
+		// Display the nodes, one by one, the map can be larger than a buffer on the stack
 		AT_PRINTF("%d nodes in the map", num_elements + 1);
 		AT_PRINTF("Node #01 id: %08lX this node", g_this_device_addr);
 		for (int idx = 0; idx < num_elements; idx++)
 		{
-			if (first_hop[idx] == 0)
+			get_node(idx, node_id, first_hop, metric);
+			if (first_hop == 0)
 			{
-				AT_PRINTF("Node #%02d id: %08lX direct", idx + 2, node_id[idx]);
+				AT_PRINTF("Node #%02d id: %08lX direct ETX %d.%02d", idx + 2, node_id,
+						  metric / ROUTE_METRIC_UNIT, (metric % ROUTE_METRIC_UNIT) * 100 / ROUTE_METRIC_UNIT);
 			}
 			else
 			{
-				AT_PRINTF("Node #%02d id: %08lX first hop %08lX #hops %d", idx + 2, node_id[idx], first_hop[idx], num_hops[idx]);
+				AT_PRINTF("Node #%02d id: %08lX first hop %08lX ETX %d.%02d", idx + 2, node_id, first_hop,
+						  metric / ROUTE_METRIC_UNIT, (metric % ROUTE_METRIC_UNIT) * 100 / ROUTE_METRIC_UNIT);
 			}
 		}
 		AT_PRINTF("---------------------------------------------");
@@ -353,6 +352,143 @@ int mesh_master_handler(SERIAL_PORT port, char *cmd, stParam *param)
 	return AT_OK;
 }
 
+/**
+ * @brief Add custom airtime AT command
+ *
+ * @return true AT commands were added
+ * @return false AT commands couldn't be added
+ */
+bool init_airtime_at(void)
+{
+	return api.system.atMode.add((char *)"AIRTIME",
+								 (char *)"Get the used and remaining airtime of the duty cycle window",
+								 (char *)"AIRTIME", airtime_handler,
+								 RAK_ATCMD_PERM_READ);
+}
+
+/**
+ * @brief Print the time on air of each TX class in the last hour and the airtime that is left
+ *
+ * @param port Serial port used
+ * @param cmd char array with the received AT command
+ * @param param char array with the received AT command parameters
+ * @return int result of command parsing
+ * 			AT_OK AT command & parameters valid
+ * 			AT_PARAM_ERROR command or parameters invalid
+ */
+int airtime_handler(SERIAL_PORT port, char *cmd, stParam *param)
+{
+	if ((param->argc == 1 && !strcmp(param->argv[0], "?")) || (param->argc == 0))
+	{
+		uint16_t duty_cycle = mesh_duty_cycle();
+		if (duty_cycle == 0)
+		{
+			AT_PRINTF("Duty cycle: no limit");
+		}
+		else
+		{
+			AT_PRINTF("Duty cycle: %d.%d %%", duty_cycle / 10, duty_cycle % 10);
+		}
+		for (int tx_class = 0; tx_class < MESH_TX_CLASSES; tx_class++)
+		{
+			uint32_t used = mesh_airtime_used((mesh_tx_class_t)tx_class);
+			if (duty_cycle == 0)
+			{
+				AT_PRINTF("%s: used %ld ms", mesh_tx_class_names[tx_class], used);
+			}
+			else
+			{
+				AT_PRINTF("%s: used %ld ms left %ld ms", mesh_tx_class_names[tx_class], used,
+						  mesh_airtime_left((mesh_tx_class_t)tx_class));
+			}
+		}
+		return AT_OK;
+	}
+	return AT_PARAM_ERROR;
+}
+
+/**
+ * @brief Add custom mesh statistics AT command
+ *
+ * @return true AT commands were added
+ * @return false AT commands couldn't be added
+ */
+bool init_meshstat_at(void)
+{
+	return api.system.atMode.add((char *)"MESHSTAT",
+								 (char *)"Get the mesh counters, 0 = reset the counters, 1 = send a report to the master node",
+								 (char *)"MESHSTAT", meshstat_handler,
+								 RAK_ATCMD_PERM_READ | RAK_ATCMD_PERM_WRITE);
+}
+
+/** Frame types as text array */
+const char *frame_type_names[MESH_STAT_TYPES] = {"invalid", "direct", "forward", "broadcast", "map", "map req",
+												 "map summary", "map delta", "map sync req", "aggregate", "ack"};
+
+/**
+ * @brief Print the mesh counters, reset them or send them as report to the master node
+ *
+ * @param port Serial port used
+ * @param cmd char array with the received AT command
+ * @param param char array with the received AT command parameters
+ * @return int result of command parsing
+ * 			AT_OK AT command & parameters valid
+ * 			AT_PARAM_ERROR command or parameters invalid
+ */
+int meshstat_handler(SERIAL_PORT port, char *cmd, stParam *param)
+{
+	if ((param->argc == 1 && !strcmp(param->argv[0], "?")) || (param->argc == 0))
+	{
+		AT_PRINTF("Counters of the last %ld s", (millis() - g_mesh_stats.start_time) / 1000);
+		for (int type = 1; type < MESH_STAT_TYPES; type++)
+		{
+			AT_PRINTF("%s: rx %ld tx %ld", frame_type_names[type], g_mesh_stats.rx[type], g_mesh_stats.tx[type]);
+		}
+		AT_PRINTF("Invalid %ld no route %ld duplicates %ld", g_mesh_stats.rx_invalid, g_mesh_stats.no_route, g_mesh_stats.duplicate);
+		for (int tx_class = 0; tx_class < MESH_TX_CLASSES; tx_class++)
+		{
+			AT_PRINTF("%s: queued %ld sent %ld dropped %ld failed %ld retried %ld retransmitted %ld aggregated %ld", mesh_tx_class_names[tx_class],
+					  g_mesh_tx_stats[tx_class].queued, g_mesh_tx_stats[tx_class].sent,
+					  g_mesh_tx_stats[tx_class].dropped, g_mesh_tx_stats[tx_class].failed,
+					  g_mesh_tx_stats[tx_class].retried, g_mesh_tx_stats[tx_class].retransmitted,
+					  g_mesh_tx_stats[tx_class].aggregated);
+			uint32_t *buckets = g_mesh_stats.queue_time[tx_class];
+			AT_PRINTF("%s queue ms: <10 %ld <50 %ld <100 %ld <500 %ld <1000 %ld <5000 %ld <10000 %ld more %ld", mesh_tx_class_names[tx_class],
+					  buckets[0], buckets[1], buckets[2], buckets[3], buckets[4], buckets[5], buckets[6], buckets[7]);
+		}
+		for (int idx = 0; idx < MESH_STAT_NEIGHBOURS; idx++)
+		{
+			mesh_neighbour_stats_s *entry = &g_mesh_stats.neighbours[idx];
+			if (entry->addr != 0)
+			{
+				AT_PRINTF("Neighbour %08lX: rx %ld tx %ld retransmitted %ld", entry->addr, entry->rx, entry->tx, entry->retransmitted);
+			}
+		}
+		return AT_OK;
+	}
+	else if ((param->argc == 1) && !strcmp(param->argv[0], "0"))
+	{
+		mesh_stats_reset();
+		return AT_OK;
+	}
+	else if ((param->argc == 1) && !strcmp(param->argv[0], "1"))
+	{
+		if ((g_custom_parameters.master_address == 0) || (g_custom_parameters.master_address == 0xFFFFFFFF))
+		{
+			// No master node
+			return AT_PARAM_ERROR;
+		}
+		uint8_t report[MESH_STAT_REPORT_SIZE];
+		uint8_t report_size = mesh_stats_report(report);
+		if (!send_to_mesh(false, g_custom_parameters.master_address, report, report_size))
+		{
+			return AT_BUSY_ERROR;
+		}
+		return AT_OK;
+	}
+	return AT_PARAM_ERROR;
+}
+
 /**
  * @brief Get setting from flash
  *